@@ -0,0 +1,131 @@
+/*
+ * Per-tensor sigmoid / box term tables against sigmoid(dequant()) per candidate.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include <infer_backend.h>
+#include <postprocess.h>
+
+#define BENCH_RUNS  50
+#define BENCH_TERMS 5 // score, x, y, w, h per candidate
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* what process() did for every candidate before the tables */
+static float sigmoid(float x) { return 1.0 / (1.0 + expf(-x)); }
+static float deqnt_affine_to_f32(int8_t qnt, int32_t zp, float scale) { return ((float)qnt - (float)zp) * scale; }
+
+/*
+ * The terms of every cell and anchor of a YOLOv5 head, as decode_yolov5()
+ * computes them for a candidate: expf per term, or table lookups.
+ */
+static void terms_expf(const int8_t *in, int grid_len, int prop, int32_t zp, float scale, float *out)
+{
+    for (int a = 0; a < 3; a++) {
+        const int8_t *p = in + prop * a * grid_len;
+
+        for (int cell = 0; cell < grid_len; cell++, out += BENCH_TERMS) {
+            float w = sigmoid(deqnt_affine_to_f32(p[2 * grid_len + cell], zp, scale)) * 2.0;
+            float h = sigmoid(deqnt_affine_to_f32(p[3 * grid_len + cell], zp, scale)) * 2.0;
+
+            out[0] = sigmoid(deqnt_affine_to_f32(p[5 * grid_len + cell], zp, scale)) *
+                     sigmoid(deqnt_affine_to_f32(p[4 * grid_len + cell], zp, scale));
+            out[1] = sigmoid(deqnt_affine_to_f32(p[cell], zp, scale)) * 2.0 - 0.5;
+            out[2] = sigmoid(deqnt_affine_to_f32(p[grid_len + cell], zp, scale)) * 2.0 - 0.5;
+            out[3] = w * w;
+            out[4] = h * h;
+        }
+    }
+}
+
+static void terms_lut(const int8_t *in, int grid_len, int prop, const qnt_lut_t *lut, float *out)
+{
+    for (int a = 0; a < 3; a++) {
+        const uint8_t *p = (const uint8_t *)in + prop * a * grid_len;
+
+        for (int cell = 0; cell < grid_len; cell++, out += BENCH_TERMS) {
+            out[0] = lut->sig[p[5 * grid_len + cell]] * lut->sig[p[4 * grid_len + cell]];
+            out[1] = lut->xy[p[cell]];
+            out[2] = lut->xy[p[grid_len + cell]];
+            out[3] = lut->wh[p[2 * grid_len + cell]];
+            out[4] = lut->wh[p[3 * grid_len + cell]];
+        }
+    }
+}
+
+int main()
+{
+    infer_tensor_attr_t inputs[INFER_MAX_TENSORS], attrs[INFER_MAX_TENSORS];
+    PostProcessWorkspace ws;
+    InferBackend *backend;
+    int n_inputs, n_outputs;
+
+    /* the YOLOv5 640x640 heads of the reference backend, with a real quantization */
+    backend = create_replay_backend(NULL, 0);
+    if (backend->init(NULL, 0, 1) < 0 || backend->query_attrs(&n_inputs, inputs, &n_outputs, attrs) < 0)
+        return 1;
+    delete backend;
+    for (int t = 0; t < n_outputs; t++) {
+        attrs[t].zp = -17;
+        attrs[t].scale = 0.0837f;
+    }
+    if (ws.init(n_outputs, attrs, 640, 640, NULL) < 0)
+        return 1;
+
+    fprintf(stderr, "%-16s  %10s  %10s  %10s  %8s  %s\n", "head", "candidates", "expf ms", "table ms", "speedup",
+            "max diff");
+    for (int t = 0; t < n_outputs; t++) {
+        int grid_len = attrs[t].dims[2] * attrs[t].dims[3];
+        int prop = attrs[t].dims[1] / 3;
+        std::vector<int8_t> in(attrs[t].n_elems);
+        std::vector<float> a(3 * grid_len * BENCH_TERMS), b(a.size());
+        uint64_t t_expf = 0, t_lut = 0, t0;
+        unsigned seed = 1 + t;
+        float diff = 0;
+
+        for (size_t i = 0; i < in.size(); i++) {
+            seed = seed * 1103515245 + 12345;
+            in[i] = (int8_t)(seed >> 24);
+        }
+        for (int r = 0; r < BENCH_RUNS; r++) {
+            t0 = now_us();
+            terms_expf(in.data(), grid_len, prop, attrs[t].zp, attrs[t].scale, a.data());
+            t_expf += now_us() - t0;
+            t0 = now_us();
+            terms_lut(in.data(), grid_len, prop, &ws.luts[t], b.data());
+            t_lut += now_us() - t0;
+        }
+        for (size_t i = 0; i < a.size(); i++)
+            diff = fmaxf(diff, fabsf(a[i] - b[i]));
+        fprintf(stderr, "%-8s %3dx%-3d   %10d  %10.3f  %10.3f  %7.1fx  %g\n", attrs[t].name, attrs[t].dims[3],
+                attrs[t].dims[2], 3 * grid_len, t_expf / 1000.0 / BENCH_RUNS, t_lut / 1000.0 / BENCH_RUNS,
+                t_lut ? (double)t_expf / t_lut : 0.0, diff);
+    }
+    deinitPostProcess();
+    return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * NmsEngine against the per-class O(n^2) NMS it replaced, 100 to 20000 candidates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include <nms.h>
+
+#define BENCH_CLASSES 80
+#define BENCH_IOU     0.45f
+#define BENCH_BUDGET  200000 // candidates per size, spread over as many runs
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* --- what post_process() ran before NmsEngine, as it was --- */
+
+static float CalculateOverlap(float xmin0, float ymin0, float xmax0, float ymax0, float xmin1, float ymin1, float xmax1,
+                              float ymax1)
+{
+    float w = fmax(0.f, fmin(xmax0, xmax1) - fmax(xmin0, xmin1) + 1.0);
+    float h = fmax(0.f, fmin(ymax0, ymax1) - fmax(ymin0, ymin1) + 1.0);
+    float i = w * h;
+    float u = (xmax0 - xmin0 + 1.0) * (ymax0 - ymin0 + 1.0) + (xmax1 - xmin1 + 1.0) * (ymax1 - ymin1 + 1.0) - i;
+    return u <= 0.f ? 0.f : (i / u);
+}
+
+static int nms(int validCount, std::vector<float> &outputLocations, std::vector<int> classIds, std::vector<int> &order,
+               int filterId, float threshold)
+{
+    for (int i = 0; i < validCount; ++i) {
+        if (order[i] == -1 || classIds[i] != filterId) {
+            continue;
+        }
+        int n = order[i];
+        for (int j = i + 1; j < validCount; ++j) {
+            int m = order[j];
+            if (m == -1 || classIds[i] != filterId) {
+                continue;
+            }
+            float xmin0 = outputLocations[n * 4 + 0];
+            float ymin0 = outputLocations[n * 4 + 1];
+            float xmax0 = outputLocations[n * 4 + 0] + outputLocations[n * 4 + 2];
+            float ymax0 = outputLocations[n * 4 + 1] + outputLocations[n * 4 + 3];
+
+            float xmin1 = outputLocations[m * 4 + 0];
+            float ymin1 = outputLocations[m * 4 + 1];
+            float xmax1 = outputLocations[m * 4 + 0] + outputLocations[m * 4 + 2];
+            float ymax1 = outputLocations[m * 4 + 1] + outputLocations[m * 4 + 3];
+
+            float iou = CalculateOverlap(xmin0, ymin0, xmax0, ymax0, xmin1, ymin1, xmax1, ymax1);
+
+            if (iou > threshold) {
+                order[j] = -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int quick_sort_indice_inverse(std::vector<float> &input, int left, int right, std::vector<int> &indices)
+{
+    float key;
+    int key_index;
+    int low = left;
+    int high = right;
+    if (left < right) {
+        key_index = indices[left];
+        key = input[left];
+        while (low < high) {
+            while (low < high && input[high] <= key) {
+                high--;
+            }
+            input[low] = input[high];
+            indices[low] = indices[high];
+            while (low < high && input[low] >= key) {
+                low++;
+            }
+            input[high] = input[low];
+            indices[high] = indices[low];
+        }
+        input[low] = key;
+        indices[low] = key_index;
+        quick_sort_indice_inverse(input, left, low - 1, indices);
+        quick_sort_indice_inverse(input, low + 1, right, indices);
+    }
+    return low;
+}
+
+static int old_nms(std::vector<float> &boxes, std::vector<float> scores, std::vector<int> &classes, int n)
+{
+    std::vector<int> indexArray;
+    int kept = 0;
+
+    for (int i = 0; i < n; ++i)
+        indexArray.push_back(i);
+    quick_sort_indice_inverse(scores, 0, n - 1, indexArray);
+    std::set<int> class_set(std::begin(classes), std::end(classes));
+    for (auto c : class_set)
+        nms(n, boxes, classes, indexArray, c, BENCH_IOU);
+    for (int i = 0; i < n; ++i)
+        kept += indexArray[i] != -1;
+    return kept;
+}
+
+/* greedy per-class NMS done the slow, obvious way: what NmsEngine has to give */
+static void reference_nms(const std::vector<float> &boxes, const std::vector<float> &scores,
+                          const std::vector<int> &classes, int n, std::vector<int> *keep)
+{
+    std::vector<int> order(n);
+
+    for (int i = 0; i < n; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return scores[a] > scores[b]; });
+    keep->clear();
+    for (int i = 0; i < n; i++) {
+        const float *b = &boxes[order[i] * 4];
+        int suppressed = 0;
+
+        for (size_t k = 0; k < keep->size() && !suppressed; k++) {
+            const float *o = &boxes[(*keep)[k] * 4];
+
+            suppressed = classes[(*keep)[k]] == classes[order[i]] &&
+                         nms_iou(o[0], o[1], o[0] + o[2], o[1] + o[3], b[0], b[1], b[0] + b[2], b[1] + b[3]) >
+                             BENCH_IOU;
+        }
+        if (!suppressed)
+            keep->push_back(order[i]);
+    }
+}
+
+/* candidates clustered around objects the way a detector reports them, in a 640x640 input */
+static void make_candidates(int n, unsigned seed, std::vector<float> *boxes, std::vector<float> *scores,
+                            std::vector<int> *classes)
+{
+    int objects = std::max(1, n / 20);
+
+    srand(seed);
+    boxes->resize(n * 4);
+    scores->resize(n);
+    classes->resize(n);
+    for (int i = 0; i < n; i++) {
+        int o = rand() % objects;
+        unsigned h = (unsigned)o * 2654435761u;
+        float w = 16 + h % 96, ht = 16 + (h >> 8) % 128;
+        float x = (h >> 4) % (int)(640 - w), y = (h >> 12) % (int)(640 - ht);
+
+        (*boxes)[i * 4 + 0] = x + (rand() % 17 - 8);
+        (*boxes)[i * 4 + 1] = y + (rand() % 17 - 8);
+        (*boxes)[i * 4 + 2] = w + (rand() % 9 - 4);
+        (*boxes)[i * 4 + 3] = ht + (rand() % 9 - 4);
+        (*scores)[i] = 0.25f + 0.75f * (rand() % 10000) / 10000.0f;
+        (*classes)[i] = (o * 7 + (rand() % 8 == 0)) % BENCH_CLASSES;
+    }
+}
+
+int main()
+{
+    static const int sizes[] = {100, 1000, 5000, 20000};
+    nms_params_t params = {NMS_HARD, BENCH_IOU, 0.0f, 0.0f, 0, 0};
+    NmsEngine engine;
+    int failures = 0;
+
+    fprintf(stderr, "%10s  %6s  %10s  %10s  %8s  %s\n", "candidates", "runs", "old ms", "engine ms", "speedup",
+            "kept (engine / exact)");
+    for (int size : sizes) {
+        std::vector<float> boxes, scores, work;
+        std::vector<int> classes, keep(size), expected;
+        int runs = std::max(1, BENCH_BUDGET / size), kept = 0;
+        uint64_t t_old = 0, t_new = 0, t0;
+
+        make_candidates(size, size, &boxes, &scores, &classes);
+        engine.reserve(size);
+        for (int r = 0; r < runs; r++) {
+            t0 = now_us();
+            old_nms(boxes, scores, classes, size);
+            t_old += now_us() - t0;
+            work = scores;
+            t0 = now_us();
+            kept = engine.run(boxes.data(), work.data(), classes.data(), NULL, size, &params, keep.data());
+            t_new += now_us() - t0;
+        }
+
+        reference_nms(boxes, scores, classes, size, &expected);
+        std::sort(keep.begin(), keep.begin() + kept);
+        std::sort(expected.begin(), expected.end());
+        if (kept != (int)expected.size() || !std::equal(expected.begin(), expected.end(), keep.begin())) {
+            fprintf(stderr, "nms_bench: %d candidates, the engine keeps other boxes than greedy NMS\n", size);
+            failures++;
+        }
+        fprintf(stderr, "%10d  %6d  %10.3f  %10.3f  %7.1fx  %d / %d\n", size, runs, t_old / 1000.0 / runs,
+                t_new / 1000.0 / runs, t_new ? (double)t_old / t_new : 0.0, kept, (int)expected.size());
+    }
+    return failures ? 1 : 0;
+}
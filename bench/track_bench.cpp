@@ -0,0 +1,168 @@
+/*
+ * Tracker::update() per frame, fed recorded detections (-w tensors) or a crowded synthetic scene.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <infer_backend.h>
+#include <postprocess.h>
+#include <tracker.h>
+
+#define BENCH_FRAMES  2000 // synthetic frames, or recorded frames replayed
+#define BENCH_OBJECTS 250  // synthetic objects in a 1920x1080 frame
+#define BENCH_CLASSES 5
+#define BENCH_MISS    10 // percent of the objects left undetected in a frame
+
+typedef std::vector<detect_result_t> frame_dets_t;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* what the player hands the tracker: post_process() over the tensors recorded with -w */
+static int load_recording(const char *path, int n_frames, std::vector<frame_dets_t> *frames)
+{
+    InferBackend *backend = create_replay_backend(path, 0);
+    infer_tensor_attr_t input, attrs[INFER_MAX_TENSORS];
+    detect_result_group_t group;
+    PostProcessWorkspace ws;
+    int n_inputs, n_outputs, w, h;
+
+    if (backend->init(NULL, 0, 1) < 0 || backend->query_attrs(&n_inputs, &input, &n_outputs, attrs) < 0) {
+        delete backend;
+        return -1;
+    }
+    w = input.nchw ? input.dims[2] : input.dims[1];
+    h = input.nchw ? input.dims[3] : input.dims[2];
+    if (ws.init(n_outputs, attrs, w, h, NULL) < 0 || backend->start() < 0) {
+        delete backend;
+        return -1;
+    }
+    /* seqs past the last recorded frame wrap around, like the replay in the player */
+    for (int f = 0; f < n_frames; f++) {
+        infer_job_t *job;
+
+        if (backend->submit(f, NULL, NULL) < 0 || !(job = backend->collect()))
+            break;
+        post_process(job->outputs, h, w, BOX_THRESH, NMS_THRESH, NULL, NULL, &ws, &group);
+        frames->push_back(frame_dets_t(group.results, group.results + group.count));
+        backend->release(job);
+    }
+    backend->stop();
+    delete backend;
+    deinitPostProcess();
+    return frames->empty() ? -1 : 0;
+}
+
+/*
+ * Boxes drifting and bouncing in 1920x1080, detected with some jitter and
+ * now and then missed: more objects than post_process() ever reports.
+ */
+static void make_scene(int n_objects, int n_frames, std::vector<frame_dets_t> *frames)
+{
+    std::vector<float> x(n_objects), y(n_objects), vx(n_objects), vy(n_objects);
+    std::vector<int> w(n_objects), h(n_objects);
+
+    srand(n_objects);
+    for (int o = 0; o < n_objects; o++) {
+        w[o] = 24 + rand() % 64;
+        h[o] = 24 + rand() % 96;
+        x[o] = rand() % (1920 - w[o]);
+        y[o] = rand() % (1080 - h[o]);
+        vx[o] = (rand() % 81 - 40) / 10.f;
+        vy[o] = (rand() % 81 - 40) / 10.f;
+    }
+    frames->resize(n_frames);
+    for (int f = 0; f < n_frames; f++) {
+        for (int o = 0; o < n_objects; o++) {
+            detect_result_t d;
+
+            x[o] += vx[o];
+            y[o] += vy[o];
+            if (x[o] < 0 || x[o] > 1920 - w[o])
+                vx[o] = -vx[o];
+            if (y[o] < 0 || y[o] > 1080 - h[o])
+                vy[o] = -vy[o];
+            if (rand() % 100 < BENCH_MISS)
+                continue;
+            d.class_id = o % BENCH_CLASSES;
+            d.box.left = (int)x[o] + rand() % 5 - 2;
+            d.box.top = (int)y[o] + rand() % 5 - 2;
+            d.box.right = d.box.left + w[o] + rand() % 5 - 2;
+            d.box.bottom = d.box.top + h[o] + rand() % 5 - 2;
+            d.prop = 0.3f + 0.7f * (rand() % 1000) / 1000.0f;
+            d.track_id = 0;
+            (*frames)[f].push_back(d);
+        }
+    }
+}
+
+static void run(const char *name, const std::vector<frame_dets_t> &frames)
+{
+    Tracker tracker;
+    detect_result_group_t group;
+    uint64_t total = 0, worst = 0, dets = 0, t0, us;
+    int most = 0;
+
+    for (size_t f = 0; f < frames.size(); f++) {
+        t0 = now_us();
+        tracker.update((int64_t)f, frames[f].data(), (int)frames[f].size());
+        tracker.output((int64_t)f, &group);
+        us = now_us() - t0;
+        total += us;
+        worst = std::max(worst, us);
+        dets += frames[f].size();
+        most = std::max(most, tracker.tracks());
+    }
+    fprintf(stderr, "%-10s  %6d  %10.1f  %8d  %10.3f  %10.3f\n", name, (int)frames.size(),
+            (double)dets / frames.size(), most, total / 1000.0 / frames.size(), worst / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<frame_dets_t> frames;
+    int n_frames = argc > 2 ? atoi(argv[2]) : BENCH_FRAMES;
+
+    if (argc < 2) {
+        fprintf(stderr, "(no recording given: track_bench <tensors recorded with -w> [frames])\n");
+    } else if (load_recording(argv[1], n_frames, &frames) < 0) {
+        fprintf(stderr, "track_bench: no detections from %s\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(stderr, "%-10s  %6s  %10s  %8s  %10s  %10s\n", "scene", "frames", "dets/frame", "tracks", "avg ms",
+            "max ms");
+    if (!frames.empty())
+        run("recorded", frames);
+    for (int objects : {OBJ_NUMB_MAX_SIZE, BENCH_OBJECTS}) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "synth %d", objects);
+        frames.clear();
+        make_scene(objects, BENCH_FRAMES, &frames);
+        run(name, frames);
+    }
+    return 0;
+}
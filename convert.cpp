@@ -0,0 +1,156 @@
+/*
+ * Decoder output -> display / RGA frame conversion.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "convert.h"
+
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+}
+
+int convert_displayable(int pix_fmt)
+{
+    switch (pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int convert_rga_layout(const AVFrame *f, int *wstride, int *hstride)
+{
+    ptrdiff_t luma = f->data[1] - f->data[0];
+    int ls = f->linesize[0];
+
+    if (!convert_displayable(f->format) || ls <= 0 || luma <= 0 || luma % ls)
+        return -1;
+    *wstride = ls;
+    *hstride = (int)(luma / ls);
+    if (*hstride < f->height)
+        return -1;
+    if (f->format == AV_PIX_FMT_NV12 || f->format == AV_PIX_FMT_NV21)
+        return f->linesize[1] == ls ? 0 : -1;
+    /* planar: U and V at half the luma stride, V right after U */
+    if (f->linesize[1] * 2 != ls || f->linesize[2] != f->linesize[1] ||
+        f->data[2] - f->data[1] != (ptrdiff_t)f->linesize[1] * (*hstride / 2))
+        return -1;
+    return 0;
+}
+
+FrameConverter::FrameConverter() : uses_(0)
+{
+    memset(cache_, 0, sizeof(cache_));
+    memset(frames_, 0, sizeof(frames_));
+}
+
+FrameConverter::~FrameConverter()
+{
+    for (int i = 0; i < CONVERT_CACHE; i++)
+        sws_freeContext(cache_[i].sws);
+}
+
+/* Cached context for the conversion, the least recently used one is replaced */
+SwsContext *FrameConverter::context(int src_fmt, int src_w, int src_h, int dst_fmt, int dst_w, int dst_h)
+{
+    cache_t *c, *lru = &cache_[0];
+    int flags;
+
+    for (int i = 0; i < CONVERT_CACHE; i++) {
+        c = &cache_[i];
+        if (c->sws && c->src_fmt == src_fmt && c->src_w == src_w && c->src_h == src_h && c->dst_fmt == dst_fmt &&
+            c->dst_w == dst_w && c->dst_h == dst_h) {
+            c->used = ++uses_;
+            return c->sws;
+        }
+        if (c->used < lru->used)
+            lru = c;
+    }
+
+    /* nothing to interpolate when only the format changes */
+    flags = (src_w == dst_w && src_h == dst_h) ? SWS_POINT : SWS_FAST_BILINEAR;
+    sws_freeContext(lru->sws);
+    lru->sws = sws_getContext(src_w, src_h, (enum AVPixelFormat)src_fmt, dst_w, dst_h, (enum AVPixelFormat)dst_fmt,
+                              flags, NULL, NULL, NULL);
+    if (!lru->sws) {
+        fprintf(stderr, "convert: no conversion from format %d %dx%d to %d %dx%d\n", src_fmt, src_w, src_h, dst_fmt,
+                dst_w, dst_h);
+        lru->used = 0;
+        return NULL;
+    }
+    lru->src_fmt = src_fmt;
+    lru->src_w = src_w;
+    lru->src_h = src_h;
+    lru->dst_fmt = dst_fmt;
+    lru->dst_w = dst_w;
+    lru->dst_h = dst_h;
+    lru->used = ++uses_;
+    return lru->sws;
+}
+
+int FrameConverter::convert(const AVFrame *src, int dst_w, int dst_h, frame_pool_t *pool, AVFrame *dst, AVFrame *ref,
+                            uint64_t *cpu_bytes)
+{
+    int same_size = src->width == dst_w && src->height == dst_h;
+    int dst_fmt = convert_displayable(src->format) ? src->format : AV_PIX_FMT_YUV420P;
+    int wstride, hstride;
+    int mode;
+
+    *cpu_bytes = 0;
+    av_frame_unref(ref);
+    av_frame_unref(dst);
+    if (same_size && convert_rga_layout(src, &wstride, &hstride) == 0) {
+        if (av_frame_ref(ref, src) < 0)
+            return -1;
+        frames_[CONVERT_PASSTHROUGH]++;
+        return CONVERT_PASSTHROUGH;
+    }
+
+    if (frame_pool_get(pool, dst, dst_fmt, dst_w, dst_h) < 0)
+        return -1;
+
+    if (same_size && dst_fmt == src->format) {
+        av_image_copy(dst->data, dst->linesize, (const uint8_t **)src->data, src->linesize,
+                      (enum AVPixelFormat)dst_fmt, dst_w, dst_h);
+        mode = CONVERT_COPY;
+    } else {
+        SwsContext *sws = context(src->format, src->width, src->height, dst_fmt, dst_w, dst_h);
+
+        if (!sws)
+            return -1;
+        sws_scale(sws, (const uint8_t *const *)src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+        mode = CONVERT_SCALE;
+    }
+    dst->pts = src->pts;
+    *cpu_bytes = av_image_get_buffer_size((enum AVPixelFormat)dst_fmt, dst_w, dst_h, 1);
+    frames_[mode]++;
+    return mode;
+}
+
+void FrameConverter::report() const
+{
+    fprintf(stderr, "convert   : %6llu passthrough  %6llu copied  %6llu scaled\n",
+            (unsigned long long)frames_[CONVERT_PASSTHROUGH], (unsigned long long)frames_[CONVERT_COPY],
+            (unsigned long long)frames_[CONVERT_SCALE]);
+}
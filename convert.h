@@ -0,0 +1,68 @@
+#ifndef _FFRKNN_CONVERT_H_
+#define _FFRKNN_CONVERT_H_
+
+#include <stdint.h>
+
+#include <pipeline.h>
+
+struct SwsContext;
+
+#define CONVERT_CACHE 4 // SwsContexts kept, one per (source format, size) seen recently
+
+typedef enum _convert_mode_t
+{
+    CONVERT_PASSTHROUGH = 0, // decoder frame shown and resized as-is, referenced, not copied
+    CONVERT_COPY,            // same format and size: planes copied into one contiguous buffer
+    CONVERT_SCALE,           // swscale: point sampling for a format change, fast bilinear for a resize
+    CONVERT_MODES,
+} convert_mode_t;
+
+/*
+ * Turns decoder output into a frame the display texture and RGA can take:
+ * YUV420P, YUVJ420P, NV12 or NV21 with the planes following each other
+ * in one buffer (RGA only takes a single address per surface).
+ *
+ * The cheapest mode that works is picked per frame from the source format,
+ * size and layout, so a stream changing resolution or format midway just
+ * switches to another cached SwsContext.
+ */
+class FrameConverter
+{
+public:
+    FrameConverter();
+    ~FrameConverter();
+
+    /*
+     * Writes the frame to show into ref (passthrough) or dst (converted
+     * into a buffer from pool) and unrefs the other one. Returns the mode,
+     * -1 on error or when the pool is exhausted; cpu_bytes is what the CPU
+     * wrote.
+     */
+    int convert(const struct AVFrame *src, int dst_w, int dst_h, frame_pool_t *pool, struct AVFrame *dst,
+                struct AVFrame *ref, uint64_t *cpu_bytes);
+
+    void report() const;
+
+private:
+    struct cache_t
+    {
+        struct SwsContext *sws;
+        int src_fmt, src_w, src_h;
+        int dst_fmt, dst_w, dst_h;
+        uint64_t used;
+    };
+
+    struct SwsContext *context(int src_fmt, int src_w, int src_h, int dst_fmt, int dst_w, int dst_h);
+
+    cache_t cache_[CONVERT_CACHE];
+    uint64_t uses_;
+    uint64_t frames_[CONVERT_MODES];
+};
+
+/* 1 for the formats the display uploads and RGA reads without conversion */
+int convert_displayable(int pix_fmt);
+
+/* Strides RGA needs to read f from data[0], -1 when the planes are not in one buffer */
+int convert_rga_layout(const struct AVFrame *f, int *wstride, int *hstride);
+
+#endif //_FFRKNN_CONVERT_H_
@@ -0,0 +1,126 @@
+/*
+ * Box extrapolation between inferred frames.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "extrapolate.h"
+
+#include <math.h>
+#include <string.h>
+
+void detect_history_init(detect_history_t *h)
+{
+    memset(h, 0, sizeof(detect_history_t));
+    h->seq[0] = -1;
+    h->seq[1] = -1;
+}
+
+static float box_iou(const BOX_RECT *a, const BOX_RECT *b)
+{
+    return nms_iou(a->left, a->top, a->right, a->bottom, b->left, b->top, b->right, b->bottom);
+}
+
+void detect_history_push(detect_history_t *h, int64_t seq, const detect_result_group_t *group)
+{
+    const detect_result_group_t *older;
+    char taken[OBJ_NUMB_MAX_SIZE];
+
+    h->seq[0] = h->seq[1];
+    h->group[0] = h->group[1];
+    h->seq[1] = seq;
+    h->group[1] = *group;
+
+    /* greedy by detection order, which is by decreasing score */
+    older = &h->group[0];
+    memset(taken, 0, sizeof(taken));
+    for (int i = 0; i < h->group[1].count; i++) {
+        const detect_result_t *det = &h->group[1].results[i];
+        float best = EXTRAPOLATE_IOU;
+
+        h->match[i] = -1;
+        if (h->seq[0] < 0)
+            continue;
+        for (int j = 0; j < older->count; j++) {
+            float iou;
+
+            if (taken[j] || det->class_id != older->results[j].class_id)
+                continue;
+            iou = box_iou(&det->box, &older->results[j].box);
+            if (iou > best) {
+                best = iou;
+                h->match[i] = j;
+            }
+        }
+        if (h->match[i] >= 0)
+            taken[h->match[i]] = 1;
+    }
+}
+
+static int lerp_edge(int last, int prev, float t)
+{
+    return (int)lroundf(last + (last - prev) * t);
+}
+
+void detect_history_predict(const detect_history_t *h, int64_t seq, detect_result_group_t *out)
+{
+    const detect_result_group_t *last = &h->group[1];
+    int64_t ahead;
+    float t = 0.0f;
+
+    if (h->seq[1] < 0) {
+        memset(out, 0, sizeof(detect_result_group_t));
+        return;
+    }
+    *out = *last;
+    if (h->seq[0] < 0 || h->seq[1] <= h->seq[0])
+        return;
+
+    /* in units of the gap between the last two sets */
+    ahead = seq - h->seq[1];
+    if (ahead > EXTRAPOLATE_MAX)
+        ahead = EXTRAPOLATE_MAX;
+    if (ahead > 0)
+        t = (float)ahead / (float)(h->seq[1] - h->seq[0]);
+
+    for (int i = 0; i < out->count; i++) {
+        const BOX_RECT *b1 = &last->results[i].box;
+        const BOX_RECT *b0;
+        BOX_RECT *b = &out->results[i].box;
+
+        if (h->match[i] < 0)
+            continue;
+        b0 = &h->group[0].results[h->match[i]].box;
+        b->left = lerp_edge(b1->left, b0->left, t);
+        b->top = lerp_edge(b1->top, b0->top, t);
+        b->right = lerp_edge(b1->right, b0->right, t);
+        b->bottom = lerp_edge(b1->bottom, b0->bottom, t);
+        if (b->left < 0)
+            b->left = 0;
+        if (b->top < 0)
+            b->top = 0;
+        if (b->right < b->left)
+            b->right = b->left;
+        if (b->bottom < b->top)
+            b->bottom = b->top;
+    }
+}
+
+void detect_history_hold(const detect_history_t *h, detect_result_group_t *out)
+{
+    if (h->seq[1] < 0)
+        memset(out, 0, sizeof(detect_result_group_t));
+    else
+        *out = h->group[1];
+}
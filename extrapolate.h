@@ -0,0 +1,31 @@
+#ifndef _FFRKNN_EXTRAPOLATE_H_
+#define _FFRKNN_EXTRAPOLATE_H_
+
+#include <stdint.h>
+
+#include <postprocess.h>
+
+#define EXTRAPOLATE_IOU 0.3f // overlap for a box of the newest set to be the same object as an older one
+#define EXTRAPOLATE_MAX 30   // frames a box keeps moving past its last detection, then it holds still
+
+/*
+ * Detections for frames that skip inference: the two latest detection sets
+ * are matched box to box (same class, best overlap) when they come in, and
+ * every matched box moves on linearly with the velocity between them.
+ * New boxes are shown where they were detected.
+ */
+typedef struct _detect_history_t
+{
+    int64_t seq[2]; // frame of each set, [1] is the newest, -1 when empty
+    detect_result_group_t group[2];
+    int match[OBJ_NUMB_MAX_SIZE]; // box of group[1] -> box of group[0], -1 when new
+} detect_history_t;
+
+void detect_history_init(detect_history_t *h);
+void detect_history_push(detect_history_t *h, int64_t seq, const detect_result_group_t *group);
+/* boxes for frame seq (after the newest set) */
+void detect_history_predict(const detect_history_t *h, int64_t seq, detect_result_group_t *out);
+/* the newest set where it was detected, for frames in which nothing moved (motion.h) */
+void detect_history_hold(const detect_history_t *h, detect_result_group_t *out);
+
+#endif //_FFRKNN_EXTRAPOLATE_H_
@@ -0,0 +1,182 @@
+/*
+ * Inference backend worker pool.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "infer_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pipeline.h>
+
+InferBackend::InferBackend()
+    : n_workers_(0), n_inputs_(0), n_outputs_(0), n_free_(0), next_submit_(0), next_collect_(0), started_(0)
+{
+    memset(in_attrs_, 0, sizeof(in_attrs_));
+    memset(out_attrs_, 0, sizeof(out_attrs_));
+    memset(pool_, 0, sizeof(pool_));
+    memset(jobs_, 0, sizeof(jobs_));
+}
+
+InferBackend::~InferBackend()
+{
+    stop();
+    for (int i = 0; i < INFER_MAX_WORKERS * INFER_JOBS_PER_WORKER; i++) {
+        for (int t = 0; t < INFER_MAX_TENSORS; t++)
+            free(jobs_[i].outputs[t]);
+    }
+}
+
+int InferBackend::query_attrs(int *n_inputs, infer_tensor_attr_t *inputs, int *n_outputs,
+                              infer_tensor_attr_t *outputs) const
+{
+    if (!n_workers_)
+        return -1;
+    if (n_inputs)
+        *n_inputs = n_inputs_;
+    if (inputs)
+        memcpy(inputs, in_attrs_, n_inputs_ * sizeof(infer_tensor_attr_t));
+    if (n_outputs)
+        *n_outputs = n_outputs_;
+    if (outputs)
+        memcpy(outputs, out_attrs_, n_outputs_ * sizeof(infer_tensor_attr_t));
+    return 0;
+}
+
+int InferBackend::start()
+{
+    if (started_ || n_workers_ <= 0)
+        return -1;
+
+    n_free_ = 0;
+    for (int i = 0; i < depth(); i++) {
+        for (int t = 0; t < n_outputs_; t++) {
+            jobs_[i].outputs[t] = (int8_t *)malloc(out_attrs_[t].n_elems);
+            if (!jobs_[i].outputs[t])
+                return -1;
+        }
+        free_jobs_[n_free_++] = &jobs_[i];
+    }
+
+    for (int w = 0; w < n_workers_; w++) {
+        worker_t *wk = &pool_[w];
+
+        wk->self = this;
+        wk->index = w;
+        wk->todo = new SpscRing<infer_job_t *>(INFER_JOBS_PER_WORKER);
+        wk->done = new SpscRing<infer_job_t *>(INFER_JOBS_PER_WORKER);
+        wk->thread = SDL_CreateThread(worker_main, "SDL_InferWorker", wk);
+        if (!wk->thread) {
+            fprintf(stderr, "%s: cannot start worker %d: %s\n", name(), w, SDL_GetError());
+            return -1;
+        }
+    }
+    started_ = 1;
+    return 0;
+}
+
+void InferBackend::stop()
+{
+    int status;
+
+    for (int w = 0; w < INFER_MAX_WORKERS; w++) {
+        worker_t *wk = &pool_[w];
+
+        if (wk->todo)
+            wk->todo->abort();
+        if (wk->done)
+            wk->done->abort();
+        if (wk->thread)
+            SDL_WaitThread(wk->thread, &status);
+        delete wk->todo;
+        delete wk->done;
+        wk->thread = NULL;
+        wk->todo = NULL;
+        wk->done = NULL;
+    }
+    started_ = 0;
+}
+
+int InferBackend::worker_main(void *data)
+{
+    worker_t *wk = (worker_t *)data;
+    infer_job_t *job;
+
+    while (wk->todo->pop(&job) == 0) {
+        uint64_t t0 = stage_now_us();
+
+        job->status = wk->self->run(wk->index, job);
+        job->run_us = stage_now_us() - t0;
+        wk->busy_us += job->run_us;
+        wk->jobs++;
+        if (wk->done->push(job) < 0)
+            break;
+    }
+    return 0;
+}
+
+/* Returns 0 once queued, -1 when every job is in flight (collect first) or on shutdown */
+int InferBackend::submit(int64_t seq, const void *input, void *user)
+{
+    infer_job_t *job;
+
+    if (!started_ || !n_free_)
+        return -1;
+    job = free_jobs_[--n_free_];
+    job->seq = seq;
+    job->input = input;
+    job->user = user;
+    job->worker = next_submit_ % n_workers_;
+    job->status = 0;
+    job->submit_us = stage_now_us();
+    if (pool_[job->worker].todo->push(job) < 0) {
+        free_jobs_[n_free_++] = job;
+        return -1;
+    }
+    next_submit_++;
+    return 0;
+}
+
+/* Next result in submission order, NULL on timeout, shutdown or when nothing is in flight */
+infer_job_t *InferBackend::collect(int timeout_ms)
+{
+    infer_job_t *job;
+
+    if (!started_ || next_collect_ == next_submit_)
+        return NULL;
+    if (pool_[next_collect_ % n_workers_].done->pop(&job, timeout_ms) != 0)
+        return NULL;
+    next_collect_++;
+    return job;
+}
+
+void InferBackend::release(infer_job_t *job)
+{
+    job->user = NULL;
+    job->input = NULL;
+    free_jobs_[n_free_++] = job;
+}
+
+void InferBackend::report() const
+{
+    for (int w = 0; w < n_workers_; w++) {
+        const worker_t *wk = &pool_[w];
+
+        fprintf(stderr, "%s worker %d: %6llu jobs  avg %6.2f ms\n", name(), w, (unsigned long long)wk->jobs,
+                wk->jobs ? wk->busy_us / 1000.0 / wk->jobs : 0.0);
+    }
+}
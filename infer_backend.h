@@ -0,0 +1,128 @@
+#ifndef _FFRKNN_INFER_BACKEND_H_
+#define _FFRKNN_INFER_BACKEND_H_
+
+#include <SDL2/SDL.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <spsc_ring.h>
+
+#define INFER_MAX_TENSORS     12 // YOLOv8 exports have 9 outputs
+#define INFER_MAX_WORKERS     8
+#define INFER_JOBS_PER_WORKER 2
+
+typedef struct _infer_tensor_attr_t
+{
+    char name[64];
+    int n_dims;
+    uint32_t dims[4];
+    uint32_t n_elems;
+    int nchw;      // 1: NCHW, 0: NHWC
+    int32_t zp;    // affine int8 quantization
+    float scale;
+} infer_tensor_attr_t;
+
+/* One frame in flight: owned by the backend between submit() and release() */
+typedef struct _infer_job_t
+{
+    int64_t seq;
+    const void *input;
+    void *user;
+    int8_t *outputs[INFER_MAX_TENSORS];
+    int worker;
+    int status;
+    uint64_t submit_us;
+    uint64_t run_us;
+} infer_job_t;
+
+/*
+ * Inference backend with a pool of workers (one NPU context / core each).
+ *
+ * submit() dispatches jobs round-robin and collect() hands them back in
+ * submission order: every worker runs its own jobs in FIFO order, so the
+ * next result in sequence is always at the head of worker (n % workers).
+ * submit(), collect() and release() must be called from the same thread.
+ *
+ * Subclasses only implement init() and run(); run() is synchronous, fills
+ * job->outputs from job->input and is called from the worker's own thread.
+ */
+class InferBackend
+{
+public:
+    InferBackend();
+    virtual ~InferBackend();
+
+    virtual const char *name() const = 0;
+    /* model is only read during init(), the caller releases it afterwards */
+    virtual int init(const void *model, size_t model_size, int n_workers) = 0;
+
+    int query_attrs(int *n_inputs, infer_tensor_attr_t *inputs, int *n_outputs, infer_tensor_attr_t *outputs) const;
+    int start();
+    void stop();
+
+    int submit(int64_t seq, const void *input, void *user);
+    infer_job_t *collect(int timeout_ms = -1);
+    void release(infer_job_t *job);
+
+    int workers() const { return n_workers_; }
+    int depth() const { return n_workers_ * INFER_JOBS_PER_WORKER; }
+    void report() const;
+
+protected:
+    virtual int run(int worker, infer_job_t *job) = 0;
+
+    int n_workers_;
+    int n_inputs_;
+    int n_outputs_;
+    infer_tensor_attr_t in_attrs_[INFER_MAX_TENSORS];
+    infer_tensor_attr_t out_attrs_[INFER_MAX_TENSORS];
+
+private:
+    struct worker_t
+    {
+        InferBackend *self;
+        int index;
+        SDL_Thread *thread;
+        SpscRing<infer_job_t *> *todo;
+        SpscRing<infer_job_t *> *done;
+        uint64_t jobs;
+        uint64_t busy_us;
+    };
+
+    static int worker_main(void *data);
+
+    worker_t pool_[INFER_MAX_WORKERS];
+    infer_job_t jobs_[INFER_MAX_WORKERS * INFER_JOBS_PER_WORKER];
+    infer_job_t *free_jobs_[INFER_MAX_WORKERS * INFER_JOBS_PER_WORKER];
+    int n_free_;
+    unsigned next_submit_;
+    unsigned next_collect_;
+    int started_;
+};
+
+/*
+ * Deterministic CPU reference backend with a fixed latency per frame
+ * (replay_backend.cpp). source selects the output tensors:
+ *   NULL     YOLOv5 640x640 heads with nothing detected
+ *   "synth"  same heads with a few synthetic objects moving with the frame number
+ *   <file>   tensors recorded by tensor_record_write(), looked up by frame seq
+ */
+InferBackend *create_replay_backend(const char *source, int latency_ms);
+
+/*
+ * Tensor recording, replayed by create_replay_backend(file):
+ *   "FFRT" | uint32 version | uint32 n_outputs | input attr | infer_tensor_attr_t[n_outputs]
+ *   then per inferred frame: int64 seq | output 0 .. n_outputs-1 raw int8 data
+ * One stream per recording: seqs are only unique within a stream.
+ */
+FILE *tensor_record_open(const char *path, const infer_tensor_attr_t *input, int n_outputs,
+                         const infer_tensor_attr_t *attrs);
+int tensor_record_write(FILE *fp, const infer_job_t *job, int n_outputs, const infer_tensor_attr_t *attrs);
+
+#ifdef HAVE_RKNN
+/* Rockchip NPU, one context per worker pinned to its own core (rknn_backend.cpp) */
+InferBackend *create_rknn_backend(void);
+#endif
+
+#endif //_FFRKNN_INFER_BACKEND_H_
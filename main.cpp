@@ -41,18 +41,32 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavdevice/avdevice.h>
 #include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
 #include <libavutil/hwcontext_drm.h>
 #include <libavutil/pixfmt.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 }
 
+#ifdef HAVE_RGA
 #include <rga/RgaApi.h>
 #include <rga/rga.h>
+#endif
 
 #include <SDL_FontCache.h>
+#include <convert.h>
+#include <extrapolate.h>
+#include <infer_backend.h>
+#include <motion.h>
+#include <output.h>
+#include <overlay.h>
+#include <pipeline.h>
 #include <postprocess.h>
-#include <rknn/rknn_api.h>
+#include <preprocess.h>
+#include <record.h>
+#include <roi.h>
+#include <stream.h>
+#include <tracker.h>
 
 #define ALIGN(x, a) ((x) + (a - 1)) & (~(a - 1))
 #define DRM_ALIGN(val, align) ((val + (align - 1)) & ~(align - 1))
@@ -67,23 +81,45 @@ extern "C" {
 
 #define MODEL_WIDTH 640
 #define MODEL_HEIGHT 640
+/* prefault the mapped model; build with -DMODEL_MAP_POPULATE=0 to fault it in as rknn_init() reads it */
+#if !defined(MODEL_MAP_POPULATE) && defined(MAP_POPULATE)
+#define MODEL_MAP_POPULATE MAP_POPULATE
+#elif !defined(MODEL_MAP_POPULATE)
+#define MODEL_MAP_POPULATE 0
+#endif
 
 #define argt_a 36430 // -a
 #define argt_b 36431 // -b
 #define argt_c 36432 // -c
 #define argt_i 36438 // -i
+#define argt_j 36439 // -j
+#define argt_k 36440 // -k
 #define argt_x 36453 // -x
 #define argt_y 36454 // -y
 #define argt_l 36441 // -l
 #define argt_m 36442 // -m
+#define argt_n 36443 // -n
 #define argt_o 36444 // -o
 #define argt_t 36449 // -t
+#define argt_u 36450 // -u
+#define argt_w 36452 // -w
 #define argt_e 36434 // -e
 #define argt_f 36435 // -f
+#define argt_g 36436 // -g
 #define argt_r 36447 // -r
 #define argt_d 36433 // -d
 #define argt_p 36445 // -p
+#define argt_q 36446 // -q
 #define argt_s 36448 // -s
+#define argt_z 36455 // -z
+#define argt_loop 1309704871 // -loop
+#define argt_headless 1044210198 // -headless
+#define argt_out 39691493 // -out
+#define argt_outfmt 464156460 // -outfmt
+#define argt_pp 1202797 // -pp
+#define argt_pt 1202801 // -pt
+#define argt_roi 39694551 // -roi
+#define argt_mg 1202689 // -mg
 
 static unsigned int hash_me(char *str);
 
@@ -92,62 +128,70 @@ int channel = 3;
 int width = MODEL_WIDTH;
 int height = MODEL_HEIGHT;
 unsigned char *model_data;
-int model_data_size = 0;
+size_t model_data_size = 0;
+int model_data_mapped; // model_data is the file mapped, not a heap copy
 char *model_name = NULL;
-float scale_w = 1.0f; // (float)width / img_width;
-float scale_h = 1.0f; // (float)height / img_height;
-detect_result_group_t detect_result_group;
-std::vector<float> out_scales;
-std::vector<int32_t> out_zps;
-rknn_context ctx;
-rknn_input_output_num io_num;
-rknn_input inputs[2];
-rknn_tensor_attr output_attrs[256];
-rknn_tensor_attr input_attrs[16];
+preprocess_mode_t preprocess_mode; // -pp: who letterboxes frames into the model input
+int preprocess_threads;            // -pt: CPU preprocessing threads per stream, 0: the cores shared out
+PostProcessWorkspace post_ws; // only used by the inference thread
+InferBackend *backend;
+int npu_cores = 3; // -n: contexts in the pool, one per RK3588 NPU core
+int n_inputs, n_outputs;
+infer_tensor_attr_t input_attrs[INFER_MAX_TENSORS];
+infer_tensor_attr_t output_attrs[INFER_MAX_TENSORS];
+char *record_name = NULL; // -w: dump raw output tensors for create_replay_backend()
+FILE *record_fp = NULL;
+int infer_every = 1;            // -j: inference on every Nth frame, 0: whenever an NPU context is idle
+int tracking;                   // -u 1: stable ids and smoothed boxes from the tracker, used for skipped frames too
+roi_spec_t roi_spec;            // -roi: regions inferred one by one instead of the whole frame, n = 0 without
+Preprocessor roi_preproc;       // cuts them out into roi_jobs, inference thread only
+roi_job_t *roi_jobs;            // one model input per job the backend takes
+roi_job_t **roi_free;
+int n_roi_jobs, n_roi_free;
+motion_params_t motion_params;  // -mg: inference only for frames / regions that moved, off (threshold 0) without
+int motion_gate;                // -mg given, -roi gates with the defaults otherwise
+uint64_t npu_run_us, npu_runs;  // NPU time of the results collected, for what the gating saved
 size_t actual_size = 0;
 const float nms_threshold = NMS_THRESH;
 const float box_conf_threshold = BOX_THRESH;
 char* labelsListFile = (char*)"/usr/share/model/coco_80_labels_list.txt";
 /* --- SDL --- */
 int alphablend;
-int accur;
-unsigned int obj2det;
+int accur;        // -a: confidence in percent for the classes -o gives none
+char *class_spec; // -o: classes kept by post_process(), see setClassFilter()
 int frameSize_rknn;
 void *resize_buf;
-Uint32 format;
-SDL_Texture *texture;
 SDL_Texture* captureTexture;
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 
-AVFormatContext *input_ctx = NULL;
-AVStream *video = NULL;
-int video_stream = 0;
-AVCodecParameters *codecpar;
-AVCodecContext *codec_ctx = NULL;
-AVFormatContext *pOutputFormatCtx = nullptr;
-AVStream* pOutStream = nullptr;
-AVPacket* outpkt = av_packet_alloc();
-AVCodecContext* pOutCodecCtx = nullptr;
-const AVCodec* pOutputCodec = nullptr;
-AVCodec *codec;
-AVFrame *frame;
-AVPacket pkt;
 AVFrame* pFrameSDL;
-AVFrame* pFrameYUV;
-SwsContext* swsCtx;
+/* cleared by the display thread, read by every decode thread */
+#ifdef HAVE_RGA
+SDL_atomic_t zero_copy = {1}; // -z 0: always convert on the CPU, cleared when RGA cannot take a dma-buf
+#else
+SDL_atomic_t zero_copy = {0}; // no RGA to read a dma-buf: always downloaded
+#endif
 
 int screen_width = 1024;
 int screen_height = 600;
 int screen_left = 0;
 int screen_top = 0;
-int frame_width = 1920;
+int frame_width = 1920;  // -s, or until the decoder tells
 int frame_height = 1080;
 int v4l2;  // v4l2 h264
 int rtsp;  // rtsp h264
 int rtmp;  // flv h264
 int http;  // flv h264
 int delay; // ms
+int synthetic_source; // -f synth: generated test pattern, no demux/decode
+int loop_input;       // -loop 1: files start over at the end
+int headless;         // -headless 1: no SDL video, no fonts, detections only go to -out
+char *out_dest;       // -out: file, FIFO, "-" (stdout) or unix:<socket>
+char *out_format;     // -outfmt: bin (default) or json
+DetectOutput detect_out; // display thread only
+char *record_dest;       // -e: annotated video to a file or rtsp:// / rtmp:// sink, %d for one per stream
+char *record_encoders;   // -c: encoders to try for -e, RECORD_ENCODERS if not given
 char *pixel_format;
 char *sensor_frame_size;
 char *sensor_frame_rate;
@@ -159,37 +203,42 @@ double avg_inference_time = 0.0, inference_time = 0.0;
 float frmrate = 0.0;      // Measured frame rate
 float avg_frmrate = 0.0;  // avg frame rate
 float prev_frmrate = 0.0; // avg frame rate
-Uint32 currtime;
-Uint32 lasttime;
-int loop_counter = 0;
 const int frmrate_update = 30;
 
-FC_Font *font_small;
-FC_Font *font_large;
 FC_Font *font_big;
-
-SDL_mutex *mutex;
-SDL_cond *cond_read_frame;
-SDL_cond *cond_decode_frame;
-SDL_cond *cond_inference_frame;
-SDL_cond *cond_display_frame;
+OverlayCompositor overlay; // boxes, labels and HUD, display thread only
+const char *font_file = "/usr/share/fonts/liberation/LiberationMono-Bold.ttf";
+
+/* --- Pipeline --- */
+stream_t *streams[STREAM_MAX]; // one per -i, each with its own read/decode threads and rings
+int n_streams;
+stream_sched_t sched;          // -q: which stream gets the NPU next, inference thread only
+char *sched_spec;
+int finished;
+stage_stats_t stats_infer;
+stage_stats_t stats_render;
 
 double __get_us(struct timeval t) { return (t.tv_sec * 1000000 + t.tv_usec); }
 
 enum AVPixelFormat get_format(AVCodecContext *Context, const enum AVPixelFormat *PixFmt)
 {
-    while (*PixFmt != AV_PIX_FMT_NONE) {
-        if (*PixFmt == AV_PIX_FMT_DRM_PRIME)
+    const enum AVPixelFormat *fmt;
+
+    for (fmt = PixFmt; SDL_AtomicGet(&zero_copy) && *fmt != AV_PIX_FMT_NONE; fmt++) {
+        if (*fmt == AV_PIX_FMT_DRM_PRIME)
             return AV_PIX_FMT_DRM_PRIME;
-        if (*PixFmt == AV_PIX_FMT_NV12)
+    }
+    for (fmt = PixFmt; *fmt != AV_PIX_FMT_NONE; fmt++) {
+        if (*fmt == AV_PIX_FMT_NV12)
             return AV_PIX_FMT_NV12;
-        PixFmt++;
     }
-    return AV_PIX_FMT_NONE;
+    /* software decoders: whatever they produce natively */
+    return PixFmt[0];
 }
 
+#ifdef HAVE_RGA
 static int drm_rga_buf(int src_Width, int src_Height, int wStride, int hStride, int src_fd, int src_format, int dst_Width,
-                       int dst_Height, int dst_format, int frameSize, char *buf)
+                       int dst_Height, int dst_wStride, int dst_format, char *buf)
 {
     rga_info_t src;
     rga_info_t dst;
@@ -209,31 +258,7 @@ static int drm_rga_buf(int src_Width, int src_Height, int wStride, int hStride,
     dst.mmuFlag = 1;
 
     rga_set_rect(&src.rect, 0, 0, src_Width, src_Height, wStride, hStride, src_format);
-    rga_set_rect(&dst.rect, 0, 0, dst_Width, dst_Height, dst_Width, dst_Height, dst_format);
-
-    ret = c_RkRgaBlit(&src, &dst, NULL);
-    return ret;
-}
-
-static int fast_rga_buf(int src_Width, int src_Height, int src_wStride, int src_hStride, int src_format, char *sbuf,
-                        int dst_Width, int dst_Height, int dst_wStride, int dst_hStride, int dst_format, char *dbuf)
-{
-    rga_info_t src;
-    rga_info_t dst;
-    int ret;
-
-    memset(&src, 0, sizeof(rga_info_t));
-    src.fd = -1;
-    src.mmuFlag = 1;
-    src.virAddr = sbuf;
-
-    memset(&dst, 0, sizeof(rga_info_t));
-    dst.fd = -1;
-    dst.virAddr = dbuf;
-    dst.mmuFlag = 1;
-
-    rga_set_rect(&src.rect, 0, 0, src_Width, src_Height, src_wStride, src_hStride, src_format);
-    rga_set_rect(&dst.rect, 0, 0, dst_Width, dst_Height, dst_wStride, dst_hStride, dst_format);
+    rga_set_rect(&dst.rect, 0, 0, dst_Width, dst_Height, dst_wStride, dst_Height, dst_format);
 
     ret = c_RkRgaBlit(&src, &dst, NULL);
     return ret;
@@ -281,148 +306,226 @@ static uint32_t drm_get_rgaformat(uint32_t drm_fmt)
     }
 }
 
-static void displayTextureNV12(unsigned char *imageData)
+/* dma-buf fd, RGA format and strides of a DRM_PRIME frame, -1 when RGA cannot read it in one blit */
+static int drm_frame_info(const AVFrame *drm, int *fd, int *rga_format, int *wStride, int *hStride)
+{
+    const AVDRMFrameDescriptor *desc = (const AVDRMFrameDescriptor *)drm->data[0];
+    const AVDRMLayerDescriptor *layer;
+    int pitch;
+
+    if (!desc || desc->nb_layers < 1 || desc->layers[0].nb_planes < 1)
+        return -1;
+    layer = &desc->layers[0];
+    if (!(*rga_format = drm_get_rgaformat(layer->format)))
+        return -1;
+    /* RGA takes a single buffer: the chroma plane has to follow the luma in the same object */
+    if (layer->planes[0].offset ||
+        (layer->nb_planes > 1 && layer->planes[1].object_index != layer->planes[0].object_index))
+        return -1;
+
+    pitch = layer->planes[0].pitch;
+    *fd = desc->objects[layer->planes[0].object_index].fd;
+    switch (layer->format) {
+    case DRM_FORMAT_NV12_10:
+    case DRM_FORMAT_NV15:
+        *wStride = pitch * 8 / 10;
+        break;
+    case DRM_FORMAT_YUYV:
+    case DRM_FORMAT_UYVY:
+        *wStride = pitch / 2;
+        break;
+    default:
+        *wStride = pitch;
+        break;
+    }
+    *hStride = layer->nb_planes > 1 ? layer->planes[1].offset / pitch : drm->height;
+    return 0;
+}
+#endif
+
+/* Frame the slot shows: the decoder's own when it could be kept, the converted copy otherwise */
+static AVFrame *slot_frame(frame_slot_t *slot)
+{
+    return slot->src->format != AV_PIX_FMT_NONE ? slot->src : slot->yuv;
+}
+
+/* The streaming texture follows the frames: created again when their layout or size changes */
+static int set_texture(stream_t *s, Uint32 fmt, int w, int h)
+{
+    if (s->texture && fmt == s->texture_format && w == s->texture_width && h == s->texture_height)
+        return 0;
+    if (s->texture)
+        SDL_DestroyTexture(s->texture);
+    s->texture = SDL_CreateTexture(renderer, fmt, SDL_TEXTUREACCESS_STREAMING, w, h);
+    if (!s->texture) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to create texture %dx%d: %s\n", w, h, SDL_GetError());
+        return -1;
+    }
+    s->texture_format = fmt;
+    s->texture_width = w;
+    s->texture_height = h;
+    return 0;
+}
+
+#ifdef HAVE_RGA
+/* RGA converts the decoder's buffer straight into the locked texture */
+static int drm_to_texture(stream_t *s, const AVFrame *drm)
 {
     unsigned char *texture_data = NULL;
     int texture_pitch = 0;
+    int fd, rga_format, wStride, hStride;
+    int ret;
 
-    if (loop_counter++ % frmrate_update == 0) {
-        currtime = SDL_GetTicks(); // [ms]
-        if (currtime - lasttime > 0) {
-            frmrate = frmrate_update * (1000.0 / (currtime - lasttime));
-        }
-        lasttime = currtime;
+    if (drm_frame_info(drm, &fd, &rga_format, &wStride, &hStride) < 0)
+        return -1;
+    if (set_texture(s, SDL_PIXELFORMAT_IYUV, drm->width, drm->height) < 0 ||
+        SDL_LockTexture(s->texture, NULL, (void **)&texture_data, &texture_pitch) < 0)
+        return -1;
+    ret = drm_rga_buf(drm->width, drm->height, wStride, hStride, fd, rga_format, drm->width, drm->height,
+                      texture_pitch, RK_FORMAT_YCbCr_420_P, (char *)texture_data);
+    SDL_UnlockTexture(s->texture);
+    return ret;
+}
+#else
+static int drm_to_texture(stream_t *s, const AVFrame *drm) { return -1; }
+#endif
+
+/* Uploads the planes where they are, SDL takes care of the U/V order of the texture. Returns the bytes copied */
+static int upload_texture(stream_t *s, const AVFrame *f)
+{
+    if (f->format == AV_PIX_FMT_NV12 || f->format == AV_PIX_FMT_NV21) {
+        if (set_texture(s, f->format == AV_PIX_FMT_NV12 ? SDL_PIXELFORMAT_NV12 : SDL_PIXELFORMAT_NV21, f->width,
+                        f->height) < 0 ||
+            SDL_UpdateNVTexture(s->texture, NULL, f->data[0], f->linesize[0], f->data[1], f->linesize[1]) < 0)
+            return -1;
+    } else {
+        if (set_texture(s, SDL_PIXELFORMAT_IYUV, f->width, f->height) < 0 ||
+            SDL_UpdateYUVTexture(s->texture, NULL, f->data[0], f->linesize[0], f->data[1], f->linesize[1],
+                                 f->data[2], f->linesize[2]) < 0)
+            return -1;
+    }
+    return av_image_get_buffer_size((enum AVPixelFormat)f->format, f->width, f->height, 1);
+}
+
+/* Puts the slot's picture into the stream's texture and keeps its detections, mapped to the tile, for the next render */
+static void showFrame(stream_t *s, frame_slot_t *slot)
+{
+    AVFrame *f = slot_frame(slot);
+    Uint32 now;
+    int copied;
+
+    s->to_tile = xform_rect(0, 0, f->width, f->height, 0, 0, s->tile.w, s->tile.h);
+
+    if (++s->frmrate_frames == frmrate_update) {
+        now = SDL_GetTicks(); // [ms]
+        if (now - s->frmrate_mark > 0)
+            s->frmrate = frmrate_update * (1000.0 / (now - s->frmrate_mark));
+        s->frmrate_mark = now;
+        s->frmrate_frames = 0;
+        /* the window shows what all streams together get through */
+        frmrate = 0;
+        for (int i = 0; i < n_streams; i++)
+            frmrate += streams[i]->frmrate;
         avg_frmrate = (prev_frmrate + frmrate) / 2.0;
         prev_frmrate = frmrate;
     }
 
-    int y_size = frame_width * frame_height;
-    int uv_size = (frame_width * frame_height) / 2;
-
-    int total_size = y_size + uv_size;
+    if (f->format == AV_PIX_FMT_DRM_PRIME) {
+        if (drm_to_texture(s, f) < 0) {
+            /* keeps the previous picture, the decoder switches to the CPU path */
+            fprintf(stderr, "RGA cannot read the decoder's dma-buf, falling back to the CPU path\n");
+            SDL_AtomicSet(&zero_copy, 0);
+        } else {
+            s->has_picture = 1;
+        }
+        path_account(&s->paths_display, FRAME_PATH_DMABUF, 0);
+    } else if ((copied = upload_texture(s, f)) >= 0) {
+        s->has_picture = 1;
+        path_account(&s->paths_display, FRAME_PATH_CPU, copied);
+    }
+    /* hand the buffers back to the decoder and the pool now rather than when the slot is reused */
+    av_frame_unref(slot->src);
+    av_frame_unref(slot->yuv);
 
-    SDL_LockTexture(texture, 0, (void **)&texture_data, &texture_pitch);
+    /* the detections are printed by -out only (-out - -outfmt json), never from here */
+    detect_map(&slot->detect, &s->to_tile, &s->shown);
+}
 
-    memcpy(texture_data, (unsigned char *)imageData, total_size);
+/* One tile of the mosaic, drawn in the stream's viewport: the boxes are in tile coordinates */
+static void drawStream(stream_t *s)
+{
+    detect_result_group_t *detect_result_group = &s->shown;
+    char hud[OVERLAY_HUD_LINES][64];
+    const char *hud_lines[OVERLAY_HUD_LINES] = {hud[0], hud[1], hud[2]};
+
+    SDL_RenderSetViewport(renderer, &s->tile);
+    SDL_RenderCopy(renderer, s->texture, NULL, NULL);
+
+    // Draw Objects, -o / -a already left out by post_process()
+    for (int i = 0; i < detect_result_group->count; i++)
+        overlay.add(&detect_result_group->results[i]);
+
+    /* the first tile also carries the total when there are several */
+    snprintf(hud[0], sizeof(hud[0]), "%.1f FPS", s->frmrate);
+    snprintf(hud[1], sizeof(hud[1]), "Inference Time: %.1f ms", avg_inference_time);
+    snprintf(hud[2], sizeof(hud[2]), "Total: %.1f FPS", frmrate);
+    overlay.hud(s->hud, hud_lines, n_streams > 1 && s->index == 0 ? 3 : 2, 310);
+    overlay.flush();
+}
 
-    SDL_UnlockTexture(texture);
+static void renderMosaic(void)
+{
+    SDL_RenderSetViewport(renderer, NULL);
     SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    for (int i = 0; i < n_streams; i++) {
+        if (streams[i]->has_picture)
+            drawStream(streams[i]);
+    }
+    SDL_RenderSetViewport(renderer, NULL);
+    SDL_RenderPresent(renderer);
+}
 
-    // Draw Objects
-    char text[256];
-    SDL_Rect rect;
-    SDL_Rect rect_bar;
-    unsigned int obj;
-    int accur_obj;
-    int clr;
-    for (int i = 0; i < detect_result_group.count; i++) {
-        detect_result_t *det_result = &(detect_result_group.results[i]);
-
-        sprintf(text, "%s %.1f%%", det_result->name, det_result->prop * 100);
-
-    printf("%s @ (%d %d %d %d) %f\n",
-           det_result->name,
-           det_result->box.left,
-           det_result->box.top,
-           det_result->box.right,
-           det_result->box.bottom,
-           det_result->prop);
-
-        if (obj2det) {
-            obj = hash_me(det_result->name);
-            if (obj != obj2det) {
-                continue;
-            }
-        }
-        if (accur) {
-            accur_obj = (int)(det_result->prop * 100.0);
-            if (accur_obj < accur) {
-                continue;
-            }
-        }
+/* Headless: the pictures are not needed past inference, their buffers go straight back */
+static void releaseFrame(frame_slot_t *slot)
+{
+    av_frame_unref(slot->src);
+    av_frame_unref(slot->yuv);
+}
 
-        rect.x = det_result->box.left;
-        rect.y = det_result->box.top;
-        rect.w = det_result->box.right - det_result->box.left + 1;
-        rect.h = det_result->box.bottom - det_result->box.top + 1;
-
-        if (det_result->name[0] == 'p' && det_result->name[1] == 'e')
-            clr = 1;
-        else if (det_result->name[0] == 'c' && det_result->name[1] == 'a')
-            clr = 2;
-        else if (det_result->name[0] == 'b' && det_result->name[1] == 'u')
-            clr = 3;
-        else if (det_result->name[0] == 'b' && det_result->name[1] == 'i')
-            clr = 4;
-        else if (det_result->name[0] == 'm' && det_result->name[1] == 'o')
-            clr = 5;
-        else if (det_result->name[0] == 'b' && det_result->name[3] == 'k')
-            clr = 6;
-        else if (det_result->name[0] == 'u' && det_result->name[1] == 'm')
-            clr = 7;
-        else
-            clr = 0;
-        if (alphablend) {
-            if (clr == 1)
-                SDL_SetRenderDrawColor(renderer, 255, 0, 0, alphablend);
-            else if (clr == 2)
-                SDL_SetRenderDrawColor(renderer, 0, 255, 0, alphablend);
-            else if (clr == 3)
-                SDL_SetRenderDrawColor(renderer, 255, 0, 255, alphablend);
-            else if (clr == 4)
-                SDL_SetRenderDrawColor(renderer, 255, 255, 0, alphablend);
-            else if (clr == 5)
-                SDL_SetRenderDrawColor(renderer, 128, 155, 255, alphablend);
-            else if (clr == 6)
-                SDL_SetRenderDrawColor(renderer, 128, 128, 128, alphablend);
-            else if (clr == 7)
-                SDL_SetRenderDrawColor(renderer, 255, 255, 255, alphablend);
-            else
-                SDL_SetRenderDrawColor(renderer, 0, 0, 255, alphablend);
-            SDL_RenderFillRect(renderer, &rect);
-        }
-        if (clr == 1)
-            SDL_SetRenderDrawColor(renderer, 255, 0, 0, SDL_ALPHA_OPAQUE);
-        else if (clr == 2)
-            SDL_SetRenderDrawColor(renderer, 0, 255, 0, SDL_ALPHA_OPAQUE);
-        else if (clr == 3)
-            SDL_SetRenderDrawColor(renderer, 255, 0, 255, SDL_ALPHA_OPAQUE);
-        else if (clr == 4)
-            SDL_SetRenderDrawColor(renderer, 255, 255, 0, SDL_ALPHA_OPAQUE);
-        else if (clr == 5)
-            SDL_SetRenderDrawColor(renderer, 128, 155, 255, SDL_ALPHA_OPAQUE);
-        else if (clr == 6)
-            SDL_SetRenderDrawColor(renderer, 128, 128, 128, SDL_ALPHA_OPAQUE);
-        else if (clr == 7)
-            SDL_SetRenderDrawColor(renderer, 255, 255, 255, SDL_ALPHA_OPAQUE);
-        else
-            SDL_SetRenderDrawColor(renderer, 0, 0, 255, SDL_ALPHA_OPAQUE);
-        SDL_RenderDrawRect(renderer, &rect);
-
-        rect_bar.x = rect.x;
-        rect_bar.h = 16;
-        rect_bar.w = rect.w;
-        if (rect.w < 80)
-            rect_bar.h += 16;
-        rect_bar.y = rect.y - rect_bar.h;
-        SDL_RenderFillRect(renderer, &rect_bar);
-        rect_bar.y -= 1;
-        FC_DrawBox(font_small, renderer, rect_bar, text);
-    }
-
-    SDL_SetRenderDrawColor(renderer, 120, 120, 120, 115);
-    rect.x = 0;
-    rect.y = 0;
-    rect.w = 310;
-    rect.h = 90;
-    SDL_RenderFillRect(renderer, &rect);
+/* The shown frame to the stream's recorder, boxes burnt in there in frame pixels */
+static void recordFrame(stream_t *s, frame_slot_t *slot)
+{
+    s->recorder->push(slot_frame(slot), slot->seq, &slot->detect);
+}
 
-    rect = FC_Draw(font_large, renderer, 0, 0, "%.1f FPS", frmrate);
-    rect.y += rect.h;
-    FC_Draw(font_large, renderer, rect.x, rect.y, "Inference Time: %.1f ms", avg_inference_time);
+/* -e out%d.mkv gives every stream its own recording, without %d only the first stream is recorded */
+static int open_recorder(stream_t *s)
+{
+    const char *pct = strstr(record_dest, "%d");
+    char dest[1024];
+    AVRational rate;
 
-    SDL_RenderPresent(renderer);
+    if (!pct && s->index > 0)
+        return 0;
+    if (pct)
+        snprintf(dest, sizeof(dest), "%.*s%d%s", (int)(pct - record_dest), record_dest, s->index, pct + 2);
+    else
+        snprintf(dest, sizeof(dest), "%s", record_dest);
+    rate = s->synthetic ? av_inv_q(s->time_base)
+                        : av_guess_frame_rate(s->input_ctx, s->input_ctx->streams[s->video_stream], NULL);
+    s->recorder = new FrameRecorder();
+    return s->recorder->open(dest, record_encoders, s->frame_width, s->frame_height, rate,
+                             post_ws.layout.n_classes);
+}
+
+/* The frame's detections to -out, boxes in frame pixels */
+static void emitFrame(stream_t *s, frame_slot_t *slot)
+{
+    int64_t pts_us = INT64_MIN;
+
+    if (slot->pts != AV_NOPTS_VALUE && s->time_base.den)
+        pts_us = av_rescale_q(slot->pts, s->time_base, AV_TIME_BASE_Q);
+    detect_out.write(s->index, slot->seq, pts_us, s->frame_width, s->frame_height, &slot->detect);
 }
 
 static unsigned int hash_me(char *str)
@@ -439,69 +542,122 @@ void print_help(void)
     fprintf(stderr, "ff-rknn parameters:\n"
                     "-x displayed width\n"
                     "-y displayed height\n"
-                    "-m rknn model\n"
-                    "-f protocol (v4l2 only)\n"
+                    "-m rknn model, or a CPU backend taking -d ms per frame:\n"
+                    "   stub (no detections), synth (synthetic objects), replay:<file> (recorded with -w)\n"
+                    "   <model>.cfg, if present, sets the decode head, classes, anchors and labels\n"
+                    "-n NPU contexts running in parallel (1 ~ 8, default 3)\n"
+                    "-j run inference on every Nth frame (default 1), 0 whenever an NPU context is idle;\n"
+                    "   the frames in between show the last boxes moved along their motion\n"
+                    "-u 1 to track objects: stable ids, smoothed boxes, short misses bridged\n"
+                    "-i input, up to 16 times: every stream gets a tile and shares the NPU contexts\n"
+                    "   (synth for a generated one, synth:idle for one that mostly holds still)\n"
+                    "-q NPU sharing between streams: fair (default), prio (-i order) or weights w0,w1,...\n"
+                    "-loop 1 to play files over and over\n"
+                    "-headless 1 to run without SDL video: no window, no fonts, no GPU\n"
+                    "-out write the detections of every frame to a file, a FIFO, - (stdout) or unix:<socket>;\n"
+                    "   nothing is printed without it (-out - -outfmt json to follow them), -headless 1 needs it\n"
+                    "-outfmt bin (default, records described in output.h) or json (one object per line)\n"
+                    "-e record the annotated video to a file or an rtsp:// / rtmp:// sink, %d in the name for\n"
+                    "   one recording per stream (only the first stream otherwise)\n"
+                    "-c encoders for -e, tried in order (default h264_rkmpp,libx264,mpeg4)\n"
+                    "-f protocol (v4l2, rtsp, rtmp, http or synth for a generated test pattern)\n"
                     "-p pixel format (h264) - camera\n"
                     "-s video frame size (WxH) - camera\n"
                     "-r video frame rate - camera\n"
-                    "-o unique object to detect\n"
+                    "-o classes to detect, by label or id: person,car (only these), -bird (all but these),\n"
+                    "   person:0.6 (own threshold), * (all); filtered before NMS\n"
                     "-b use alpha blend on detected objects (1 ~ 255)\n"
-                    "-a accuracy perc (1 ~ 100)\n");
+                    "-a accuracy perc (1 ~ 100), for the classes -o gives no threshold\n"
+                    "-k candidates kept before NMS (default 1000, 0 for all)\n"
+                    "-g NMS method: hard (default), linear or gauss[:sigma] (soft-NMS)\n"
+                    "-d delay in ms (CPU backend inference latency)\n"
+                    "-w record raw output tensors to file\n"
+                    "-z 0 to convert decoded frames on the CPU instead of passing dma-bufs to RGA\n"
+                    "-pp model input letterboxing: auto (RGA, the CPU for what it cannot take), rga, cpu, or\n"
+                    "   check (RGA, compared with the CPU on frames in memory, see -z 0)\n"
+                    "-pt CPU letterboxing threads per stream (1 ~ 8, default: the cores shared out)\n"
+                    "-roi infer regions of the frame one by one and merge their boxes, ; separated:\n"
+                    "   grid (model sized tiles, full resolution), CxR (tiles covering the frame), full,\n"
+                    "   x,y,w,h (frame pixels); regions that did not change since they were last inferred\n"
+                    "   keep their boxes, e.g. -roi \"grid;full\" for a 4K camera\n"
+                    "-mg motion gating threshold[:blocks[:refresh]] (default 5:1:30, 0 to turn off): frames\n"
+                    "   where fewer than blocks luma blocks differ from the background by threshold levels\n"
+                    "   keep the last detections, at most refresh frames in a row (-i synth:idle to try it)\n");
 }
 
 /*-------------------------------------------
   Functions
   -------------------------------------------*/
-static unsigned char *load_data(FILE *fp, size_t ofst, size_t sz)
+/*
+ * Maps the model file read-only instead of copying it to the heap: the pages
+ * are the page cache's, shared by every process running the same model, and
+ * go away with release_model() once the backend has its own copy. Sizes are
+ * 64 bit all the way. Read into memory when the file cannot be mapped.
+ */
+static unsigned char *load_model(const char *filename, size_t *model_size, int *mapped)
 {
+    struct stat st;
     unsigned char *data;
-    int ret;
+    size_t done = 0;
+    int fd;
 
-    data = NULL;
+    if (!filename)
+        return NULL;
 
-    if (NULL == fp) {
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Open file %s failed: %s\n", filename, strerror(errno));
         return NULL;
     }
-
-    ret = fseek(fp, ofst, SEEK_SET);
-    if (ret != 0) {
-        fprintf(stderr, "blob seek failure.\n");
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX) {
+        fprintf(stderr, "model: %s is not a file that fits in memory\n", filename);
+        close(fd);
         return NULL;
     }
+    *model_size = (size_t)st.st_size;
+
+    /* rknn_init() reads all of it anyway: fault it in at once */
+    data = (unsigned char *)mmap(NULL, *model_size, PROT_READ, MAP_SHARED | MODEL_MAP_POPULATE, fd, 0);
+    if (data != MAP_FAILED) {
+        close(fd);
+        *mapped = 1;
+        return data;
+    }
+    fprintf(stderr, "model: cannot map %s (%s), reading it\n", filename, strerror(errno));
 
-    data = (unsigned char *)malloc(sz);
-    if (data == NULL) {
+    *mapped = 0;
+    data = (unsigned char *)malloc(*model_size);
+    if (!data) {
         fprintf(stderr, "buffer malloc failure.\n");
+        close(fd);
         return NULL;
     }
-    ret = fread(data, 1, sz, fp);
+    while (done < *model_size) {
+        ssize_t n = read(fd, data + done, *model_size - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "model: short read of %s at %zu of %zu bytes\n", filename, done, *model_size);
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
     return data;
 }
 
-static unsigned char *load_model(char *filename, int *model_size)
+static void release_model(void)
 {
-
-    FILE *fp;
-    unsigned char *data;
-
-    if (!filename)
-        return NULL;
-
-    fp = fopen(filename, "rb");
-    if (NULL == fp) {
-        fprintf(stderr, "Open file %s failed.\n", filename);
-        return NULL;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    int size = ftell(fp);
-
-    data = load_data(fp, 0, size);
-
-    fclose(fp);
-
-    *model_size = size;
-    return data;
+    if (!model_data)
+        return;
+    if (model_data_mapped)
+        munmap(model_data, model_data_size);
+    else
+        free(model_data);
+    model_data = NULL;
 }
 
 static int saveFloat(const char *file_name, float *output, int element_size)
@@ -545,412 +701,639 @@ static int eventThread(void *data)
     return 0;
 }
 
-int create_mutex(void)
+/* Headless: there is no event loop to catch ^C */
+static void stop_signal(int sig)
 {
-    if (!(mutex = SDL_CreateMutex())) {
-        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
-        return 0;
+    finished = 1;
+}
+
+static int open_window(Uint32 wflags)
+{
+    SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
+    SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
+    SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
+    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+    SDL_GL_SetAttribute(SDL_GL_ACCELERATED_VISUAL, 1);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
+
+    window = SDL_CreateWindow("ff-rknn-v4l2-thread", screen_left, screen_top, screen_width, screen_height, wflags);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    if (window) {
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        if (!renderer) {
+            av_log(NULL, AV_LOG_WARNING, "Failed to initialize a hardware accelerated renderer: %s\n", SDL_GetError());
+            renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        }
     }
-    if (!(cond_read_frame = SDL_CreateCond())) {
-        av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(cond_read_frame): %s\n", SDL_GetError());
-        return 0;
+    if (!window || !renderer) {
+        SDL_Log("Unable to Create Window or the Renderer failed (%s)", SDL_GetError());
+        return -1;
     }
-    if (!(cond_decode_frame = SDL_CreateCond())) {
-        av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(cond_decode_frame): %s\n", SDL_GetError());
-        return 0;
+
+    if (alphablend) {
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
     }
-    if (!(cond_inference_frame = SDL_CreateCond())) {
-        av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(cond_inference_frame): %s\n", SDL_GetError());
-        return 0;
+    SDL_ShowWindow(window);
+    SDL_SetWindowPosition(window, screen_left, screen_top);
+    return 0;
+}
+
+void create_queues(void)
+{
+    /* a live source must never stall behind the NPU: drop the oldest pending frame instead */
+    for (int i = 0; i < n_streams; i++)
+        streams[i]->infer_ring.set_policy(streams[i]->live ? RING_DROP_OLDEST : RING_BLOCK);
+    stage_init(&stats_infer, "inference");
+    stage_init(&stats_render, "render");
+}
+
+void abort_queues(void)
+{
+    for (int i = 0; i < n_streams; i++) {
+        stream_t *s = streams[i];
+
+        s->pkt_free_ring.abort();
+        s->pkt_ring.abort();
+        s->slot_free_ring.abort();
+        s->infer_ring.abort();
+        s->display_ring.abort();
     }
-    if (!(cond_display_frame = SDL_CreateCond())) {
-        av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(cond_display_frame): %s\n", SDL_GetError());
-        return 0;
+}
+
+/* Next slot for the producer of infer_ring: a frame evicted by the drop policy is reused first */
+static frame_slot_t *get_free_slot(stream_t *s)
+{
+    frame_slot_t *slot = s->spare_slot;
+
+    if (slot) {
+        s->spare_slot = NULL;
+        return slot;
     }
-    return 1;
+    if (s->slot_free_ring.pop(&slot) != 0)
+        return NULL;
+    return slot;
 }
 
-void destroy_mutex(void)
+/* -loop: back to the first packet, the decoder just carries on */
+static int rewind_input(stream_t *s)
 {
-    SDL_DestroyMutex(mutex);
-    SDL_DestroyCond(cond_read_frame);
-    SDL_DestroyCond(cond_decode_frame);
-    SDL_DestroyCond(cond_inference_frame);
-    SDL_DestroyCond(cond_display_frame);
+    if (!loop_input || s->live)
+        return -1;
+    if (av_seek_frame(s->input_ctx, s->video_stream, 0, AVSEEK_FLAG_BACKWARD) < 0) {
+        SDL_Log("Cannot loop %s", s->url);
+        return -1;
+    }
+    return 0;
 }
 
 static int readpktThread(void *data)
 {
-    int *finished = (int *)data;
+    stream_t *s = (stream_t *)data;
+    AVPacket *pkt;
     int ret;
     int err = 3;
 
     ret = 0;
-    while (ret >= 0 && !*finished) {
-        SDL_LockMutex(mutex);
-        if ((ret = av_read_frame(input_ctx, &pkt)) < 0) {
-            if (ret == AVERROR(EAGAIN) && err > 0) {
-                ret = 0;
-                err--;
-                SDL_Log("Read Frame WAIT!");
-                SDL_Delay(5);
-                SDL_UnlockMutex(mutex);
+    while (ret >= 0 && !finished) {
+        if (s->pkt_free_ring.pop(&pkt) != 0)
+            break;
+        stage_begin(&s->stats_read);
+        while ((ret = av_read_frame(s->input_ctx, pkt)) >= 0 || (ret == AVERROR(EAGAIN) && err > 0) ||
+               (ret == AVERROR_EOF && rewind_input(s) == 0)) {
+            if (ret >= 0) {
+                err = 3;
+                if (pkt->stream_index == s->video_stream)
+                    break;
+                av_packet_unref(pkt);
                 continue;
             }
-            finished = 1;
+            if (ret == AVERROR_EOF)
+                continue;
+            err--;
+            SDL_Log("Read Frame WAIT!");
+            SDL_Delay(5);
+        }
+        if (ret < 0) {
             SDL_Log("Read Frame error!");
-            SDL_UnlockMutex(mutex);
+            s->pkt_free_ring.push(pkt);
             break; /* error */
         }
-        err = 3;
-        SDL_CondSignal(cond_decode_frame);
-        SDL_CondWait(cond_read_frame, mutex);
-        SDL_UnlockMutex(mutex);
+        stage_end(&s->stats_read);
+        if (s->pkt_ring.push(pkt) < 0)
+            break;
     }
     SDL_Log("Read Frame quit!");
-    SDL_CondSignal(cond_decode_frame);
-    SDL_CondSignal(cond_inference_frame);
-    SDL_CondSignal(cond_display_frame);
+    /* end of stream: let the decoder drain */
+    s->pkt_ring.push(NULL);
     return 0;
 }
 
-static int inferenceThread(void *data)
-{
-    int *finished = (int *)data;
-    RgaSURF_FORMAT src_format;
-    RgaSURF_FORMAT dst_format;
-    int hStride, wStride;
-    SDL_Rect rect;
-    int ret;
-    struct timeval start_time, stop_time;
-
-    ret = 0;
-    while (ret >= 0 && !*finished) {
-        SDL_LockMutex(mutex);
-        gettimeofday(&start_time, NULL);
+#define SYNTH_IDLE_PERIOD 150 // synth:idle moves for SYNTH_IDLE_BURST frames out of every SYNTH_IDLE_PERIOD
+#define SYNTH_IDLE_BURST  30
 
-        inputs[0].buf = resize_buf;
+static void synth_fill(AVFrame *yuv, int64_t n)
+{
+    int bar = (int)(n * 8 % yuv->width);
 
-        rknn_inputs_set(ctx, io_num.n_input, inputs);
-        rknn_output outputs[io_num.n_output];
+    for (int y = 0; y < yuv->height; y++) {
+        uint8_t *row = yuv->data[0] + y * yuv->linesize[0];
+        for (int x = 0; x < yuv->width; x++)
+            row[x] = (x >= bar && x < bar + 64) ? 235 : (uint8_t)(16 + ((x + y) & 0x7f));
+    }
+    memset(yuv->data[1], 128 + (int)(n & 0x3f), yuv->linesize[1] * (yuv->height / 2));
+    memset(yuv->data[2], 128 - (int)(n & 0x3f), yuv->linesize[2] * (yuv->height / 2));
+}
 
-        memset(outputs, 0, sizeof(outputs));
+/* Detections of the slot come out of post_process() in the pixels of the w x h frame it shows */
+static void map_to_source(frame_slot_t *slot, int w, int h)
+{
+    const letterbox_t *lb = &slot->letterbox;
 
-        for (int i = 0; i < io_num.n_output; i++) {
-            outputs[i].want_float = 0;
-        }
+    slot->to_source = xform_rect(lb->x, lb->y, lb->w, lb->h, 0, 0, w, h);
+}
 
-        ret = rknn_run(ctx, NULL);
-        ret = rknn_outputs_get(ctx, io_num.n_output, outputs, NULL);
+/* Letterboxed into the model input by RGA or the CPU kernel, see preprocess.h */
+static int resize_to_model(stream_t *s, frame_slot_t *slot)
+{
+    AVFrame *f = slot_frame(slot);
 
-        // post process
-        scale_w = (float)width / screen_width;
-        scale_h = (float)height / screen_height;
+    /* -roi: the inference thread cuts the regions out of the frame itself */
+    if (roi_spec.n)
+        return 0;
+    if (s->preproc.run(f, NULL, (uint8_t *)slot->resize_buf, &slot->letterbox) < 0)
+        return -1;
+    map_to_source(slot, f->width, f->height);
+    return 0;
+}
 
-        for (int i = 0; i < io_num.n_output; ++i) {
-            out_scales.push_back(output_attrs[i].scale);
-            out_zps.push_back(output_attrs[i].zp);
+/* Stands in for read + decode: feeds the pipeline with a moving test pattern */
+static int synthThread(void *data)
+{
+    stream_t *s = (stream_t *)data;
+    frame_slot_t *slot;
+    Uint32 period = 0;
+    Uint32 next;
+    int64_t n;
+
+    if (sensor_frame_rate && atoi(sensor_frame_rate) > 0)
+        period = 1000 / atoi(sensor_frame_rate);
+    next = SDL_GetTicks();
+    while (!finished) {
+        if (!(slot = get_free_slot(s)))
+            break;
+        stage_begin(&s->stats_decode);
+        if (frame_pool_get(&s->frame_pool, slot->yuv, AV_PIX_FMT_YUV420P, s->frame_width, s->frame_height) < 0) {
+            /* every buffer is still referenced downstream */
+            stage_end(&s->stats_decode);
+            s->spare_slot = slot;
+            SDL_Delay(1);
+            continue;
+        }
+        n = s->frame_seq;
+        if (s->synthetic_idle)
+            n = n / SYNTH_IDLE_PERIOD * SYNTH_IDLE_BURST + SDL_min(n % SYNTH_IDLE_PERIOD, SYNTH_IDLE_BURST);
+        synth_fill(slot->yuv, n + 97 * s->index);
+        slot->seq = s->frame_seq;
+        slot->pts = s->frame_seq++;
+        resize_to_model(s, slot);
+        stage_end(&s->stats_decode);
+        if (s->infer_ring.push(slot, &s->spare_slot) < 0)
+            break;
+        if (period) {
+            next += period;
+            if ((Sint32)(next - SDL_GetTicks()) > 0)
+                SDL_Delay(next - SDL_GetTicks());
         }
-
-        post_process((int8_t *)outputs[0].buf, (int8_t *)outputs[1].buf, (int8_t *)outputs[2].buf,
-                     height, width, box_conf_threshold, nms_threshold,
-                     scale_w, scale_h, out_zps, out_scales, &detect_result_group);
-
-        ret = rknn_outputs_release(ctx, io_num.n_output, outputs);
-
-        gettimeofday(&stop_time, NULL);
-        inference_time = ((__get_us(stop_time) - __get_us(start_time)) / 1000);
-        avg_inference_time = (avg_inference_time + inference_time) / 2.0;
-
-        SDL_CondSignal(cond_display_frame);
-        SDL_CondWait(cond_inference_frame, mutex);
-        SDL_UnlockMutex(mutex);
     }
-
-    SDL_Log("Inference Frame quit!");
-    SDL_CondSignal(cond_read_frame);
-    SDL_CondSignal(cond_display_frame);
+    SDL_Log("Synthetic source quit!");
+    s->infer_ring.push(NULL, &s->spare_slot);
     return 0;
 }
 
-static int decode(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt)
+/* Skipped frames reuse the latest detections, carried forward along the boxes' last motion */
+static int infer_this_frame(const stream_t *s, const frame_slot_t *slot, int in_flight)
 {
-    int ret;
+    if (infer_every <= 0)
+        return in_flight < backend->workers();
+    return s->last_inferred_seq < 0 || slot->seq - s->last_inferred_seq >= infer_every;
+}
 
-    ret = avcodec_send_packet(dec_ctx, pkt);
-    if (ret < 0) {
-        fprintf(stderr, "Error sending a packet for decoding\n");
-        return ret;
+/* Fresh detections of the slot into the tracker, or the history skipped frames are predicted from */
+static void track_detections(stream_t *s, frame_slot_t *slot, int valid)
+{
+    if (tracking) {
+        s->tracker.update(slot->seq, slot->detect.results, valid ? slot->detect.count : 0);
+        s->tracker.output(slot->seq, &slot->detect);
+    } else {
+        detect_history_push(&s->history, slot->seq, &slot->detect);
     }
-    ret = 0;
-    while (ret >= 0) {
+}
 
-        ret = avcodec_receive_frame(dec_ctx, frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            break;
-        } else if (ret < 0) {
-            fprintf(stderr, "Error during decoding!\n");
-            return ret;
-        }
+static void finish_inference(stream_t *s, frame_slot_t *slot, infer_job_t *job)
+{
+    stage_begin(&stats_infer);
 
-        sws_scale(swsCtx, (const uint8_t* const*)frame->data, frame->linesize, 0, codec_ctx->height,
-                  pFrameYUV->data, pFrameYUV->linesize);
+    if (job->status < 0) {
+        memset(&slot->detect, 0, sizeof(detect_result_group_t));
+    } else {
+        if (record_fp)
+            tensor_record_write(record_fp, job, n_outputs, output_attrs);
+        /* boxes in frame pixels from here on, whatever shows or consumes them */
+        post_process(job->outputs, height, width, box_conf_threshold, nms_threshold, &slot->letterbox,
+                     &slot->to_source, &post_ws, &slot->detect);
+    }
+    track_detections(s, slot, job->status >= 0);
+
+    npu_run_us += job->run_us;
+    npu_runs++;
+    inference_time = (stage_now_us() - job->submit_us) / 1000.0;
+    avg_inference_time = (avg_inference_time + inference_time) / 2.0;
+    backend->release(job);
+    stage_end(&stats_infer);
+}
 
-        // Configurar pFrameYUV antes de la codificación
-        pFrameYUV->pts = frame->pts;
-        // pFrameSDL->pts = pFrameYUV->pts;
+/* A region of the slot's frame into a model input: RGA crops the dma-buf or the picture in place */
+static int region_to_model(frame_slot_t *slot, const SDL_Rect *rect, roi_job_t *r)
+{
+    AVFrame *f = slot_frame(slot);
+    const letterbox_t *lb = &r->letterbox;
+    int ret;
 
-        // int ret = avcodec_send_frame(pOutCodecCtx, pFrameYUV);
-        // if (ret >= 0) {
-        //     ret = avcodec_receive_packet(pOutCodecCtx, outpkt);
-        //     if (ret >= 0) {
-        //         outpkt->stream_index = pOutStream->index;
-        //         av_interleaved_write_frame(pOutputFormatCtx, outpkt);
-        //         av_packet_unref(outpkt);
-        //     }
-        // }
+#ifdef HAVE_RGA
+    if (f->format == AV_PIX_FMT_DRM_PRIME) {
+        int fd, rga_format, wStride, hStride;
 
-        break;
-    }
+        if (drm_frame_info(f, &fd, &rga_format, &wStride, &hStride) < 0)
+            return -1;
+        ret = roi_preproc.run_dmabuf(fd, rga_format, f->width, f->height, wStride, hStride, rect, r->input,
+                                     &r->letterbox);
+    } else
+#endif
+        ret = roi_preproc.run(f, rect, r->input, &r->letterbox);
+    if (ret < 0)
+        return -1;
+    r->to_source = xform_rect(lb->x, lb->y, lb->w, lb->h, rect->x, rect->y, rect->w, rect->h);
     return 0;
 }
 
-static int decodeThread(void *data)
+/* -roi: the next regions of the stream's current frame onto the NPU, as far as it has room */
+static void submit_regions(stream_t *s, int *in_flight)
 {
-    int *finished = (int *)data;
-    RgaSURF_FORMAT src_format;
-    RgaSURF_FORMAT dst_format;
-    int hStride, wStride;
+    stream_pending_t *p = s->roi_frame;
 
-    int ret;
+    while (p && s->roi_next < s->roi.n_todo() && n_roi_free && *in_flight < backend->depth()) {
+        roi_job_t *r = roi_free[n_roi_free - 1];
+        int region = s->roi.todo(s->roi_next++);
 
-    ret = 0;
-    while (ret >= 0 && !*finished) {
-        SDL_LockMutex(mutex);
-        ret = decode(codec_ctx, frame, &pkt);
-        if (ret < 0) {
-            *finished = 1;
-            SDL_UnlockMutex(mutex);
-            break;
+        r->s = s;
+        r->region = region;
+        if (region_to_model(p->slot, s->roi.rect(region), r) < 0 || backend->submit(p->slot->seq, r->input, r) < 0) {
+            memset(s->roi.result(region), 0, sizeof(detect_result_group_t));
+            continue;
         }
-        av_packet_unref(&pkt);
-        /* ------------ RKNN ----------- */
-        src_format = RK_FORMAT_YCbCr_420_SP;
-        dst_format = RK_FORMAT_BGR_888;
-
-        fast_rga_buf(frame->width, frame->height, frame->width, frame->height, src_format, (char *)pFrameYUV->data[0], width, height,
-                     width, height, dst_format, (char *)resize_buf);
-
-        SDL_CondSignal(cond_inference_frame);
-        SDL_CondWait(cond_decode_frame, mutex);
-        SDL_UnlockMutex(mutex);
+        n_roi_free--;
+        s->roi_left++;
+        stream_sched_charge(&sched, s->index);
+        (*in_flight)++;
     }
-
-    SDL_Log("Decode Frame quit!");
-    SDL_CondSignal(cond_read_frame);
-    SDL_CondSignal(cond_inference_frame);
-    SDL_CondSignal(cond_display_frame);
-    return 0;
+    if (p && s->roi_next == s->roi.n_todo() && !s->roi_left)
+        s->roi_frame = NULL;
 }
 
-int main(int argc, char *argv[])
+/* A region back from the NPU: its detections, in frame pixels, replace the ones it had */
+static void finish_region(infer_job_t *job)
 {
-    SDL_Event event;
-    SDL_Thread *keybthread;
-    SDL_Thread *readthread;
-    SDL_Thread *inferencethread;
-    SDL_Thread *decodethread;
-    int status;
-    // SDL_SysWMinfo info;
-    SDL_version sdl_compiled;
-    SDL_version sdl_linked;
-    Uint32 wflags = 0 | SDL_WINDOW_OPENGL | SDL_WINDOW_ALWAYS_ON_TOP | SDL_WINDOW_FULLSCREEN;
+    roi_job_t *r = (roi_job_t *)job->user;
+    stream_t *s = r->s;
+    detect_result_group_t *group = s->roi.result(r->region);
 
-    /* -- encoding -- */
-    int ret, kmsgrab = 0;
-    int lindex, opt;
-    char *codec_name = NULL;
-    char *video_name = NULL;
-    char *pixel_format = NULL, *size_window = NULL;
-    AVDictionary *opts = NULL;
-    AVDictionaryEntry *dict = NULL;
-    const AVInputFormat *ifmt = NULL;
-    int nframe = 1;
-    int finished = 0;
-    int i = 1;
-    unsigned int a;
-    int fpts;
-    int raw_video, skip_some_frames;
-    SDL_Rect rect;
+    stage_begin(&stats_infer);
+    if (job->status < 0)
+        memset(group, 0, sizeof(detect_result_group_t));
+    else
+        post_process(job->outputs, height, width, box_conf_threshold, nms_threshold, &r->letterbox, &r->to_source,
+                     &post_ws, group);
+    npu_run_us += job->run_us;
+    npu_runs++;
+    inference_time = (stage_now_us() - job->submit_us) / 1000.0;
+    avg_inference_time = (avg_inference_time + inference_time) / 2.0;
+    backend->release(job);
+    roi_free[n_roi_free++] = r;
+    if (--s->roi_left == 0 && s->roi_next == s->roi.n_todo())
+        s->roi_frame = NULL;
+    stage_end(&stats_infer);
+}
 
-    a = 0;
+/* -roi: the regions of the frame merged into its detections, the still ones with what they had */
+static void finish_regions(stream_t *s, frame_slot_t *slot)
+{
+    stage_begin(&stats_infer);
+    s->roi.merge(nms_threshold, &slot->detect);
+    track_detections(s, slot, 1);
+    stage_end(&stats_infer);
+}
 
-    while (i < argc) {
-        a = hash_me(argv[i++]);
-        switch (a) {
-        case argt_c:
-            codec_name = argv[i];
-            break;
-        case argt_e:
-            // enc_file_name = argv[i];
-            break;
-        case argt_i:
-            video_name = argv[i];
-            break;
-        case argt_x:
-            screen_width = atoi(argv[i]);
-            break;
-        case argt_y:
-            screen_height = atoi(argv[i]);
-            break;
-        case argt_l:
-            screen_left = atoi(argv[i]);
-            break;
-        case argt_t:
-            screen_top = atoi(argv[i]);
-            break;
-        case argt_f:
-            // v4l2 = atoi(argv[i]);
-            v4l2 = !strncasecmp(argv[i], "v4l2", 4);
-            rtsp = !strncasecmp(argv[i], "rtsp", 4);
-            rtmp = !strncasecmp(argv[i], "rtmp", 4);
-            http = !strncasecmp(argv[i], "http", 4);
-            break;
-        case argt_r:
-            sensor_frame_rate = argv[i];
-            break;
-        case argt_d:
-            delay = atoi(argv[i]);
-            break;
-        case argt_p:
-            pixel_format = argv[i];
-            break;
-        case argt_s:
-            sensor_frame_size = argv[i];
-            sscanf(sensor_frame_size, "%dx%d", &frame_width, &frame_height);
-            break;
-        case argt_m:
-            model_name = argv[i];
-            break;
-        case argt_o:
-            obj2det = hash_me(argv[i]);
-            break;
-        case argt_b:
-            alphablend = atoi(argv[i]);
-            break;
-        case argt_a:
-            accur = atoi(argv[i]);
-            break;
-        default:
-            break;
+/* Hands the frames at the head of the stream to the display, up to the first one still on the NPU */
+static int flush_pending(stream_t *s)
+{
+    stream_pending_t *p;
+
+    while (s->n_pending) {
+        p = &s->pending[s->head];
+        if (p->inferred && roi_spec.n) {
+            if (p == s->roi_frame)
+                break;
+            finish_regions(s, p->slot);
+        } else if (p->inferred) {
+            if (!p->job)
+                break;
+            finish_inference(s, p->slot, p->job);
+        } else {
+            if (tracking)
+                s->tracker.output(p->slot->seq, &p->slot->detect);
+            else if (p->held)
+                detect_history_hold(&s->history, &p->slot->detect);
+            else
+                detect_history_predict(&s->history, p->slot->seq, &p->slot->detect);
+            s->frames_reused++;
         }
-        i++;
+        s->head = (s->head + 1) % PIPELINE_SLOTS;
+        s->n_pending--;
+        if (s->display_ring.push(p->slot) < 0)
+            return -1;
     }
+    return 0;
+}
 
-    if (!video_name) {
-        fprintf(stderr, "No stream to play! Please pass an input.\n");
-        print_help();
-        return -1;
+/* Queues the stream's next frame, on the NPU or behind the ones that are. Returns 1 when none is ready */
+static int take_frame(stream_t *s, int *in_flight)
+{
+    stream_pending_t *p;
+    frame_slot_t *slot;
+    AVFrame *f;
+    int ret;
+
+    /* -roi: one frame of the stream at a time, the regions of the next one would overwrite its results */
+    if (s->eos || s->n_pending == PIPELINE_SLOTS || s->roi_frame)
+        return 1;
+    if ((ret = s->infer_ring.try_pop(&slot)) > 0)
+        return 1;
+    if (ret < 0 || !slot) {
+        s->eos = 1;
+        return 0;
     }
-    if (!model_name) {
-        fprintf(stderr, "No model to load! Please pass a model.\n");
-        print_help();
-        return -1;
+
+    p = &s->pending[(s->head + s->n_pending) % PIPELINE_SLOTS];
+    p->slot = slot;
+    p->job = NULL;
+    p->held = 0;
+    f = slot_frame(slot);
+    /* every frame goes into the background, inferred or not */
+    if (s->motion.enabled())
+        s->motion.update(f);
+    if (roi_spec.n) {
+        /* every region still: inferred all the same, merged from what the regions had */
+        p->inferred = infer_this_frame(s, slot, *in_flight);
+        if (p->inferred && s->roi.begin(f->width, f->height, slot->seq, &s->motion)) {
+            s->roi_frame = p;
+            s->roi_next = 0;
+            s->roi_left = 0;
+            submit_regions(s, in_flight);
+        }
+    } else {
+        p->inferred = infer_this_frame(s, slot, *in_flight);
+        /* -mg: nothing moved, the last detections still stand */
+        if (p->inferred && s->motion.enabled() && !s->motion.wants(slot->seq)) {
+            p->inferred = 0;
+            p->held = 1;
+        }
+        if (p->inferred && backend->submit(slot->seq, slot->resize_buf, p) != 0)
+            p->inferred = 0;
+        if (p->inferred) {
+            stream_sched_charge(&sched, s->index);
+            (*in_flight)++;
+        }
     }
-    if (screen_width <= 0)
-        screen_width = 960;
-    if (screen_height <= 0)
-        screen_height = 540;
-    if (screen_left <= 0)
-        screen_left = 0;
-    if (screen_top <= 0)
-        screen_top = 0;
+    if (p->inferred)
+        s->last_inferred_seq = slot->seq;
+    s->n_pending++;
+    return 0;
+}
 
-    font_small = FC_CreateFont();
-    if (!font_small) {
-        fprintf(stderr, "No small ttf can be created.\n");
-        return -1;
+/*
+ * Keeps every NPU context busy with the frames of all streams: the next
+ * frame is taken from the stream the scheduler puts first, as long as the
+ * backend has room, and results come back in submission order. Frames
+ * picked to skip inference (-j) queue up behind the ones of their stream
+ * on the NPU, so every display still gets every frame in presentation
+ * order, at source rate.
+ *
+ * With -roi a frame is a set of regions, each its own job: they go out
+ * as the backend makes room, a stream's next frame only once they are
+ * all back and merged.
+ */
+static int inferenceThread(void *data)
+{
+    int *finished = (int *)data;
+    int order[STREAM_MAX];
+    infer_job_t *job;
+    int in_flight = 0;
+    int idle = 0;
+    int active;
+
+    while (!*finished) {
+        /* wait on the NPU only when there was nothing else to do */
+        while (in_flight && (job = backend->collect(idle ? 1 : 0))) {
+            if (roi_spec.n)
+                finish_region(job);
+            else
+                ((stream_pending_t *)job->user)->job = job;
+            in_flight--;
+            idle = 0;
+        }
+        /* -roi: a frame whose last regions go now is merged below, before its stream takes the next */
+        if (roi_spec.n) {
+            stream_sched_order(&sched, order);
+            for (int i = 0; i < n_streams; i++)
+                submit_regions(streams[order[i]], &in_flight);
+        }
+        active = 0;
+        for (int i = 0; i < n_streams; i++) {
+            if (flush_pending(streams[i]) < 0)
+                goto quit;
+            active += !streams[i]->eos || streams[i]->n_pending;
+        }
+        if (!active)
+            break;
+
+        /* one frame per round; with -j N a full NPU is waited for rather than skipped */
+        idle = 1;
+        if (infer_every <= 0 || in_flight < backend->depth()) {
+            stream_sched_order(&sched, order);
+            for (int i = 0; i < n_streams && idle; i++)
+                idle = take_frame(streams[order[i]], &in_flight);
+        }
+        if (idle && !in_flight)
+            SDL_Delay(1);
     }
-    font_large = FC_CreateFont();
-    if (!font_large) {
-        fprintf(stderr, "No large ttf can be created.\n");
+
+quit:
+    SDL_Log("Inference Frame quit!");
+    for (int i = 0; i < n_streams; i++)
+        streams[i]->display_ring.push(NULL);
+    return 0;
+}
+
+#ifdef HAVE_RGA
+/* Zero-copy: RGA letterboxes the decoder's dma-buf into the model input, the frame itself goes on to the display */
+static int frame_to_slot_drm(stream_t *s, AVFrame *frame, frame_slot_t *slot)
+{
+    int fd, rga_format, wStride, hStride;
+
+    if (drm_frame_info(frame, &fd, &rga_format, &wStride, &hStride) < 0)
         return -1;
-    }
-    font_big = FC_CreateFont();
-    if (!font_big) {
-        fprintf(stderr, "No big ttf can be created\n");
+    if (roi_spec.n) {
+        /* the regions are cut out of the dma-buf later, by the inference thread */
+        if (preprocess_mode == PREPROCESS_CPU)
+            return -1;
+    } else if (s->preproc.run_dmabuf(fd, rga_format, frame->width, frame->height, wStride, hStride, NULL,
+                                     (uint8_t *)slot->resize_buf, &slot->letterbox) < 0) {
         return -1;
     }
+    map_to_source(slot, frame->width, frame->height);
+    av_frame_move_ref(slot->src, frame);
+    return 0;
+}
+#else
+/* No RGA: dma-bufs are downloaded and go through the CPU path */
+static int frame_to_slot_drm(stream_t *s, AVFrame *frame, frame_slot_t *slot) { return -1; }
+#endif
 
-    create_mutex();
-
-    /* Create the neural network */
-    model_data_size = 0;
-    model_data = load_model(model_name, &model_data_size);
-    if (!model_data) {
-        fprintf(stderr, "Error locading model: `%s`\n", model_name);
-        return -1;
+/* CPU fallback: download if needed, keep or convert (convert.h) and resize that. Returns the bytes written */
+static int64_t frame_to_slot_cpu(stream_t *s, AVFrame *frame, frame_slot_t *slot)
+{
+    AVFrame *src = frame;
+    int64_t copied = 0;
+    uint64_t converted;
+
+    if (frame->format == AV_PIX_FMT_DRM_PRIME) {
+        av_frame_unref(s->sw_frame);
+        if (av_hwframe_transfer_data(s->sw_frame, frame, 0) < 0) {
+            fprintf(stderr, "Cannot download the decoded frame\n");
+            return -1;
+        }
+        src = s->sw_frame;
+        copied += av_image_get_buffer_size((enum AVPixelFormat)src->format, src->width, src->height, 1);
     }
-    fprintf(stderr, "Model: %s - size: %d.\n", model_name, model_data_size);
-    ret = rknn_init(&ctx, model_data, model_data_size, 0, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "rknn_init error ret=%d\n", ret);
+
+    /* a resolution change midway is scaled back to the size the pipeline was set up with */
+    if (s->converter.convert(src, s->frame_width, s->frame_height, &s->frame_pool, slot->yuv, slot->src,
+                             &converted) < 0)
         return -1;
-    }
+    copied += converted;
 
-    rknn_sdk_version version;
-    ret = rknn_query(ctx, RKNN_QUERY_SDK_VERSION, &version, sizeof(rknn_sdk_version));
-    if (ret < 0) {
-        fprintf(stderr, "rknn_init error ret=%d\n", ret);
+    /* ------------ RKNN ----------- */
+    if (resize_to_model(s, slot) < 0) {
+        fprintf(stderr, "Cannot resize the frame to the model input\n");
         return -1;
     }
-    fprintf(stderr, "sdk version: %s driver version: %s\n", version.api_version, version.drv_version);
+    return copied;
+}
 
-    ret = rknn_query(ctx, RKNN_QUERY_IN_OUT_NUM, &io_num, sizeof(io_num));
+static int decode(stream_t *s, AVPacket *pkt)
+{
+    AVFrame *frame = s->frame;
+    frame_slot_t *slot;
+    int64_t copied;
+    int ret;
+
+    ret = avcodec_send_packet(s->codec_ctx, pkt);
     if (ret < 0) {
-        fprintf(stderr, "rknn_init error ret=%d\n", ret);
-        return -1;
+        fprintf(stderr, "Error sending a packet for decoding\n");
+        return ret;
     }
-    fprintf(stderr, "model input num: %d, output num: %d\n", io_num.n_input, io_num.n_output);
+    ret = 0;
+    while (ret >= 0) {
 
-    rknn_tensor_attr input_attrs[io_num.n_input + 1];
-    memset(input_attrs, 0, sizeof(input_attrs));
-    for (int i = 0; i < io_num.n_input; i++) {
-        // fprintf(stderr, "RKNN_QUERY_OUTPUT_ATTR output_attrs[%d].index=%d\n", i, i);
-        input_attrs[i].index = i;
-        ret = rknn_query(ctx, RKNN_QUERY_INPUT_ATTR, &(input_attrs[i]), sizeof(rknn_tensor_attr));
-        if (ret < 0) {
-            fprintf(stderr, "rknn_init error ret=%d\n", ret);
+        ret = avcodec_receive_frame(s->codec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            break;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error during decoding!\n");
+            return ret;
+        }
+
+        if (!(slot = get_free_slot(s))) {
+            av_frame_unref(frame);
             return -1;
         }
-    }
+        stage_begin(&s->stats_decode);
+
+        slot->pts = frame->pts;
+        /* a slot evicted from infer_ring may still hold its buffers */
+        av_frame_unref(slot->src);
+        av_frame_unref(slot->yuv);
+        if (SDL_AtomicGet(&zero_copy) && frame->format == AV_PIX_FMT_DRM_PRIME &&
+            frame_to_slot_drm(s, frame, slot) == 0) {
+            path_account(&s->paths_decode, FRAME_PATH_DMABUF, 0);
+        } else if ((copied = frame_to_slot_cpu(s, frame, slot)) >= 0) {
+            path_account(&s->paths_decode, FRAME_PATH_CPU, copied);
+        } else {
+            av_frame_unref(frame);
+            stage_end(&s->stats_decode);
+            s->spare_slot = slot;
+            continue;
+        }
+        slot->seq = s->frame_seq++;
+        av_frame_unref(frame);
+        stage_end(&s->stats_decode);
 
-    memset(output_attrs, 0, sizeof(output_attrs));
-    for (int i = 0; i < io_num.n_output; i++) {
-        output_attrs[i].index = i;
-        ret = rknn_query(ctx, RKNN_QUERY_OUTPUT_ATTR, &(output_attrs[i]), sizeof(rknn_tensor_attr));
+        if (s->infer_ring.push(slot, &s->spare_slot) < 0)
+            return -1;
     }
+    return 0;
+}
 
-    if (input_attrs[0].fmt == RKNN_TENSOR_NCHW) {
-        channel = input_attrs[0].dims[1];
-        width = input_attrs[0].dims[2];
-        height = input_attrs[0].dims[3];
-    } else {
-        width = input_attrs[0].dims[1];
-        height = input_attrs[0].dims[2];
-        channel = input_attrs[0].dims[3];
+static int decodeThread(void *data)
+{
+    stream_t *s = (stream_t *)data;
+    AVPacket *pkt;
+    int ret;
+
+    ret = 0;
+    while (ret >= 0 && !finished) {
+        if (s->pkt_ring.pop(&pkt) != 0)
+            break;
+        ret = decode(s, pkt);
+        if (!pkt) {
+            /* end of stream, the decoder has been flushed */
+            break;
+        }
+        av_packet_unref(pkt);
+        s->pkt_free_ring.push(pkt);
+        if (ret < 0) {
+            /* this stream ends here, the others carry on */
+            break;
+        }
     }
 
-    fprintf(stderr, "model: %dx%dx%d\n", width, height, channel);
-    memset(inputs, 0, sizeof(inputs));
-    inputs[0].index = 0;
-    inputs[0].type = RKNN_TENSOR_UINT8;
-    inputs[0].size = width * height * channel;
-    inputs[0].fmt = RKNN_TENSOR_NHWC;
-    inputs[0].pass_through = 0;
-
-    input_ctx = avformat_alloc_context();
-    if (!input_ctx) {
+    SDL_Log("Decode Frame quit!");
+    s->infer_ring.push(NULL, &s->spare_slot);
+    return 0;
+}
+
+static int open_input(stream_t *s, char *pixel_format)
+{
+    AVDictionary *opts = NULL;
+    AVDictionaryEntry *dict = NULL;
+    const AVInputFormat *ifmt = NULL;
+    AVCodecParameters *codecpar;
+    int ret;
+
+    s->input_ctx = avformat_alloc_context();
+    if (!s->input_ctx) {
         av_log(0, AV_LOG_ERROR, "Cannot allocate input format (Out of memory?)\n");
         return -1;
     }
@@ -967,11 +1350,11 @@ int main(int argc, char *argv[])
             av_log(0, AV_LOG_ERROR, "Cannot find input format: v4l2\n");
             return -1;
         }
-           input_ctx->flags |= AVFMT_FLAG_NONBLOCK;
-        // input_ctx->flags |= AVFMT_FLAG_NOBUFFER;
-        // input_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
-        // input_ctx->flags |= AVFMT_FLAG_NOPARSE;
-        // input_ctx->flags |= AVFMT_FLAG_GENPTS;
+           s->input_ctx->flags |= AVFMT_FLAG_NONBLOCK;
+        // s->input_ctx->flags |= AVFMT_FLAG_NOBUFFER;
+        // s->input_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        // s->input_ctx->flags |= AVFMT_FLAG_NOPARSE;
+        // s->input_ctx->flags |= AVFMT_FLAG_GENPTS;
         if (pixel_format) {
             av_dict_set(&opts, "input_format", pixel_format, 0);
         }
@@ -1007,59 +1390,59 @@ int main(int argc, char *argv[])
         av_dict_set(&opts, "fflags", "nobuffer", 0);
     }
 
-    if (avformat_open_input(&input_ctx, video_name, ifmt, &opts) != 0) {
-        av_log(0, AV_LOG_ERROR, "Cannot open input file '%s'\n", video_name);
-        avformat_close_input(&input_ctx);
+    if (avformat_open_input(&s->input_ctx, s->url, ifmt, &opts) != 0) {
+        av_log(0, AV_LOG_ERROR, "Cannot open input file '%s'\n", s->url);
+        avformat_close_input(&s->input_ctx);
         return -1;
     }
 
-    if (avformat_find_stream_info(input_ctx, NULL) < 0) {
+    if (avformat_find_stream_info(s->input_ctx, NULL) < 0) {
         av_log(0, AV_LOG_ERROR, "Cannot find input stream information.\n");
-        avformat_close_input(&input_ctx);
+        avformat_close_input(&s->input_ctx);
         return -1;
     }
 
     /* find the video stream information */
-    ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    ret = av_find_best_stream(s->input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &s->codec, 0);
     if (ret < 0) {
         av_log(0, AV_LOG_ERROR, "Cannot find a video stream in the input file\n");
-        avformat_close_input(&input_ctx);
+        avformat_close_input(&s->input_ctx);
         return -1;
     }
-    video_stream = ret;
+    s->video_stream = ret;
 
     /* find the video decoder: ie: h264_rkmpp / h264_rkmpp_decoder */
-    codecpar = input_ctx->streams[video_stream]->codecpar;
+    codecpar = s->input_ctx->streams[s->video_stream]->codecpar;
     if (!codecpar) {
         av_log(0, AV_LOG_ERROR, "Unable to find stream!\n");
-        avformat_close_input(&input_ctx);
+        avformat_close_input(&s->input_ctx);
         return -1;
     }
 
 #if 0
     if (codecpar->codec_id != AV_CODEC_ID_H264) {
         av_log(0, AV_LOG_ERROR, "H264 support only!\n");
-        avformat_close_input(&input_ctx);
+        avformat_close_input(&s->input_ctx);
         return -1;
     }
 #endif
 
-    codec_ctx = avcodec_alloc_context3(codec);
-    if (!codec_ctx) {
+    s->codec_ctx = avcodec_alloc_context3(s->codec);
+    if (!s->codec_ctx) {
         av_log(0, AV_LOG_ERROR, "Could not allocate video codec context!\n");
-        avformat_close_input(&input_ctx);
+        avformat_close_input(&s->input_ctx);
         return -1;
     }
 
-    video = input_ctx->streams[video_stream];
-    if (avcodec_parameters_to_context(codec_ctx, video->codecpar) < 0) {
+    if (avcodec_parameters_to_context(s->codec_ctx, codecpar) < 0) {
         av_log(0, AV_LOG_ERROR, "Error with the codec!\n");
-        avformat_close_input(&input_ctx);
-        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&s->input_ctx);
+        avcodec_free_context(&s->codec_ctx);
         return -1;
     }
 
     av_dict_set(&opts, "threads", "auto", 0);
+    s->codec_ctx->get_format = get_format;
 
 #if 0
     while (dict = av_dict_get(opts, "", dict, AV_DICT_IGNORE_SUFFIX)) {
@@ -1068,108 +1451,458 @@ int main(int argc, char *argv[])
 #endif
 
     /* open it */
-    if (avcodec_open2(codec_ctx, codec, &opts) < 0) {
+    if (avcodec_open2(s->codec_ctx, s->codec, &opts) < 0) {
         av_log(0, AV_LOG_ERROR, "Could not open codec!\n");
-        avformat_close_input(&input_ctx);
-        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&s->input_ctx);
+        avcodec_free_context(&s->codec_ctx);
         return -1;
     }
+    av_dict_free(&opts);
 
-    pFrameYUV = av_frame_alloc();
-    int numBytes = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, codec_ctx->width, codec_ctx->height, 1);
-    uint8_t* buffer = (uint8_t*)av_malloc(numBytes * sizeof(uint8_t));
-
-    pFrameYUV->format = AV_PIX_FMT_YUV420P;
-    pFrameYUV->width = codec_ctx->width;
-    pFrameYUV->height = codec_ctx->height;
+    s->frame = av_frame_alloc();
+    s->sw_frame = av_frame_alloc();
+    if (!s->frame || !s->sw_frame) {
+        fprintf(stderr, "Could not allocate video frame\n");
+        avformat_close_input(&s->input_ctx);
+        avcodec_free_context(&s->codec_ctx);
+        return -1;
+    }
 
-    // Inicializa los campos de datos de imagen y las líneas de paso (stride) en pFrameYUV
-    av_image_fill_arrays(pFrameYUV->data, pFrameYUV->linesize, buffer, AV_PIX_FMT_YUV420P, codec_ctx->width, codec_ctx->height, 1);
+    s->frame_width = s->codec_ctx->width;
+    s->frame_height = s->codec_ctx->height;
+    s->time_base = s->input_ctx->streams[s->video_stream]->time_base;
+    return 0;
+}
 
-    // Configuración de swsContext para la conversión de formatos de imagen
-    swsCtx = sws_getContext(codec_ctx->width, codec_ctx->height, codec_ctx->pix_fmt,
-                                        codec_ctx->width, codec_ctx->height, AV_PIX_FMT_YUV420P, SWS_BICUBIC,
-                                        nullptr, nullptr, nullptr);
+static int alloc_pipeline(stream_t *s)
+{
+    for (int i = 0; i < PIPELINE_PKTS; i++) {
+        if (!(s->pkts[i] = av_packet_alloc()))
+            return -1;
+        s->pkt_free_ring.push(s->pkts[i]);
+    }
+    /* pictures are referenced by the slots, not owned: buffers come from the pool frame by frame */
+    if (frame_pool_init(&s->frame_pool, PIPELINE_FRAMES + (s->recorder ? RECORD_FRAMES : 0)) < 0)
+        return -1;
+    /* by default the cores are shared out between the streams' decode threads */
+    if (s->preproc.init(width, height, 0, preprocess_mode,
+                        preprocess_threads ? preprocess_threads : SDL_max(1, SDL_GetCPUCount() / n_streams)) < 0)
+        return -1;
+    for (int i = 0; i < PIPELINE_SLOTS; i++) {
+        frame_slot_t *slot = &s->slots[i];
 
-    av_dict_free(&opts);
+        if (!(slot->yuv = av_frame_alloc()))
+            return -1;
+        if (!(slot->src = av_frame_alloc()))
+            return -1;
+        /* -roi: regions go into roi_jobs, the slots need no model input of their own */
+        if (!roi_spec.n && !(slot->resize_buf = calloc(1, frameSize_rknn)))
+            return -1;
+        s->slot_free_ring.push(slot);
+    }
+    if (roi_spec.n)
+        s->roi.init(&roi_spec, width, height);
+    s->motion.init(&motion_params);
+    return 0;
+}
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate video frame\n");
-        avformat_close_input(&input_ctx);
-        avcodec_free_context(&codec_ctx);
+/* -roi: a model input for every job the backend can hold, shared by the streams */
+static int alloc_regions(void)
+{
+    n_roi_jobs = backend->depth();
+    roi_jobs = (roi_job_t *)calloc(n_roi_jobs, sizeof(roi_job_t));
+    roi_free = (roi_job_t **)calloc(n_roi_jobs, sizeof(roi_job_t *));
+    if (!roi_jobs || !roi_free)
         return -1;
+    for (int i = 0; i < n_roi_jobs; i++) {
+        if (!(roi_jobs[i].input = (uint8_t *)calloc(1, frameSize_rknn)))
+            return -1;
+        roi_free[n_roi_free++] = &roi_jobs[i];
     }
+    return roi_preproc.init(width, height, 0, preprocess_mode,
+                            preprocess_threads ? preprocess_threads : SDL_GetCPUCount());
+}
 
-    frame->format = AV_PIX_FMT_YUV420P;
-    frame->width = codec_ctx->width;
-    frame->height = codec_ctx->height;
+static void free_regions(void)
+{
+    for (int i = 0; roi_jobs && i < n_roi_jobs; i++)
+        free(roi_jobs[i].input);
+    free(roi_jobs);
+    free(roi_free);
+    roi_jobs = NULL;
+    roi_free = NULL;
+    roi_preproc.uninit();
+}
 
-    SDL_VERSION(&sdl_compiled);
-    SDL_GetVersion(&sdl_linked);
-    SDL_Log("SDL: compiled with=%d.%d.%d linked against=%d.%d.%d", sdl_compiled.major, sdl_compiled.minor, sdl_compiled.patch,
-            sdl_linked.major, sdl_linked.minor, sdl_linked.patch);
+static void free_stream(stream_t *s)
+{
+    if (s->input_ctx)
+        avformat_close_input(&s->input_ctx);
+    if (s->codec_ctx)
+        avcodec_free_context(&s->codec_ctx);
+    if (s->frame)
+        av_frame_free(&s->frame);
+    if (s->sw_frame)
+        av_frame_free(&s->sw_frame);
+    for (int i = 0; i < PIPELINE_PKTS; i++) {
+        if (s->pkts[i])
+            av_packet_free(&s->pkts[i]);
+    }
+    for (int i = 0; i < PIPELINE_SLOTS; i++) {
+        if (s->slots[i].yuv)
+            av_frame_free(&s->slots[i].yuv);
+        if (s->slots[i].src)
+            av_frame_free(&s->slots[i].src);
+        if (s->slots[i].resize_buf) {
+            free(s->slots[i].resize_buf);
+            s->slots[i].resize_buf = NULL;
+        }
+    }
+    /* gives back the pictures it still references before their pool goes */
+    delete s->recorder;
+    frame_pool_uninit(&s->frame_pool);
+    for (int i = 0; i < OVERLAY_HUD_LINES; i++)
+        overlay_text_free(&s->hud[i]);
+    if (s->texture)
+        SDL_DestroyTexture(s->texture);
+    delete s;
+}
 
-    // SDL_SetHint(SDL_HINT_RENDER_DRIVER, "opengles2");
-    // SDL_SetHint(SDL_HINT_VIDEO_WAYLAND_ALLOW_LIBDECOR, "0");
-    if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-        SDL_Log("SDL_Init failed (%s)", SDL_GetError());
-        avformat_close_input(&input_ctx);
-        avcodec_free_context(&codec_ctx);
-        return -1;
+int main(int argc, char *argv[])
+{
+    SDL_Event event;
+    SDL_Thread *keybthread;
+    SDL_Thread *readthreads[STREAM_MAX];
+    SDL_Thread *inferencethread;
+    SDL_Thread *decodethreads[STREAM_MAX];
+    int status;
+    // SDL_SysWMinfo info;
+    SDL_version sdl_compiled;
+    SDL_version sdl_linked;
+    Uint32 wflags = 0 | SDL_WINDOW_OPENGL | SDL_WINDOW_ALWAYS_ON_TOP | SDL_WINDOW_FULLSCREEN;
+
+    /* -- encoding -- */
+    int ret, kmsgrab = 0;
+    int lindex, opt;
+    char *urls[STREAM_MAX];
+    int n_urls = 0;
+    char *pixel_format = NULL, *size_window = NULL;
+    int nframe = 1;
+    int i = 1;
+    unsigned int a;
+    int fpts;
+    int raw_video, skip_some_frames;
+    char head_cfg_name[1024];
+    head_config_t head_cfg;
+    SDL_Rect rect;
+    SDL_Rect tiles[STREAM_MAX];
+    uint64_t rss_base, rss_run, pipeline_bytes;
+    uint64_t t_start, t_loaded, rss_model;
+    double total_fps;
+
+    a = 0;
+
+    while (i < argc) {
+        a = hash_me(argv[i++]);
+        switch (a) {
+        case argt_c:
+            record_encoders = argv[i];
+            break;
+        case argt_e:
+            record_dest = argv[i];
+            break;
+        case argt_i:
+            if (n_urls < STREAM_MAX)
+                urls[n_urls++] = argv[i];
+            else
+                fprintf(stderr, "At most %d inputs, ignoring %s\n", STREAM_MAX, argv[i]);
+            break;
+        case argt_x:
+            screen_width = atoi(argv[i]);
+            break;
+        case argt_y:
+            screen_height = atoi(argv[i]);
+            break;
+        case argt_l:
+            screen_left = atoi(argv[i]);
+            break;
+        case argt_t:
+            screen_top = atoi(argv[i]);
+            break;
+        case argt_f:
+            // v4l2 = atoi(argv[i]);
+            v4l2 = !strncasecmp(argv[i], "v4l2", 4);
+            rtsp = !strncasecmp(argv[i], "rtsp", 4);
+            rtmp = !strncasecmp(argv[i], "rtmp", 4);
+            http = !strncasecmp(argv[i], "http", 4);
+            synthetic_source = !strncasecmp(argv[i], "synth", 5);
+            break;
+        case argt_r:
+            sensor_frame_rate = argv[i];
+            break;
+        case argt_d:
+            delay = atoi(argv[i]);
+            break;
+        case argt_p:
+            pixel_format = argv[i];
+            break;
+        case argt_s:
+            sensor_frame_size = argv[i];
+            sscanf(sensor_frame_size, "%dx%d", &frame_width, &frame_height);
+            break;
+        case argt_m:
+            model_name = argv[i];
+            break;
+        case argt_n:
+            npu_cores = atoi(argv[i]);
+            break;
+        case argt_j:
+            infer_every = atoi(argv[i]);
+            break;
+        case argt_q:
+            sched_spec = argv[i];
+            break;
+        case argt_loop:
+            loop_input = atoi(argv[i]);
+            break;
+        case argt_headless:
+            headless = atoi(argv[i]);
+            break;
+        case argt_out:
+            out_dest = argv[i];
+            break;
+        case argt_outfmt:
+            out_format = argv[i];
+            break;
+        case argt_u:
+            tracking = atoi(argv[i]);
+            break;
+        case argt_w:
+            record_name = argv[i];
+            break;
+        case argt_o:
+            class_spec = argv[i];
+            break;
+        case argt_g:
+            if (!strncmp(argv[i], "linear", 6))
+                setNmsMethod(NMS_LINEAR, 0);
+            else if (!strncmp(argv[i], "gauss", 5))
+                setNmsMethod(NMS_GAUSSIAN, argv[i][5] == ':' ? atof(argv[i] + 6) : 0);
+            else
+                setNmsMethod(NMS_HARD, 0);
+            break;
+        case argt_k:
+            setPreNmsTopK(atoi(argv[i]));
+            break;
+        case argt_b:
+            alphablend = atoi(argv[i]);
+            break;
+        case argt_a:
+            accur = atoi(argv[i]);
+            break;
+        case argt_z:
+            SDL_AtomicSet(&zero_copy, atoi(argv[i]));
+            break;
+        case argt_pp:
+            if ((ret = preprocess_parse_mode(argv[i])) < 0) {
+                fprintf(stderr, "-pp takes auto, rga, cpu or check, not %s\n", argv[i]);
+                return -1;
+            }
+            preprocess_mode = (preprocess_mode_t)ret;
+            break;
+        case argt_pt:
+            preprocess_threads = atoi(argv[i]);
+            break;
+        case argt_roi:
+            if (roi_parse(argv[i], &roi_spec) < 0)
+                return -1;
+            break;
+        case argt_mg:
+            if (motion_parse(argv[i], &motion_params) < 0)
+                return -1;
+            motion_gate = 1;
+            break;
+        default:
+            break;
+        }
+        i++;
     }
 
-    SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
-    SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
-    SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
-    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
-    SDL_GL_SetAttribute(SDL_GL_ACCELERATED_VISUAL, 1);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
+    /* -roi skips the regions that did not move unless -mg 0 */
+    if (roi_spec.n && !motion_gate)
+        motion_params_init(&motion_params);
 
-    window = SDL_CreateWindow("ff-rknn-v4l2-thread", screen_left, screen_top, screen_width, screen_height, wflags);
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-    if (window) {
-        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-        if (!renderer) {
-            av_log(NULL, AV_LOG_WARNING, "Failed to initialize a hardware accelerated renderer: %s\n", SDL_GetError());
-            renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    if (!n_urls && !synthetic_source) {
+        fprintf(stderr, "No stream to play! Please pass an input.\n");
+        print_help();
+        return -1;
+    }
+    if (!model_name) {
+        fprintf(stderr, "No model to load! Please pass a model.\n");
+        print_help();
+        return -1;
+    }
+    /* no window and no -out: every detection would be thrown away */
+    if (headless && !out_dest) {
+        fprintf(stderr, "-headless 1 shows nothing, the detections need -out (- for stdout)\n");
+        print_help();
+        return -1;
+    }
+    if (screen_width <= 0)
+        screen_width = 960;
+    if (screen_height <= 0)
+        screen_height = 540;
+    if (screen_left <= 0)
+        screen_left = 0;
+    if (screen_top <= 0)
+        screen_top = 0;
+
+    /* headless runs draw nothing */
+    if (!headless) {
+        font_big = FC_CreateFont();
+        if (!font_big) {
+            fprintf(stderr, "No big ttf can be created\n");
+            return -1;
         }
     }
-    if (!window || !renderer) {
-        SDL_Log("Unable to Create Window or the Renderer failed (%s)", SDL_GetError());
-        goto error_exit;
+
+    /* -f synth on its own is one generated stream, -i synth mixes generated streams with real ones */
+    if (!n_urls)
+        urls[n_urls++] = (char *)"synth";
+    for (i = 0; i < n_urls; i++) {
+        stream_t *s = new stream_t();
+
+        stream_init(s, i, urls[i], frame_width, frame_height);
+        s->synthetic = synthetic_source || !strncmp(urls[i], "synth", 5);
+        s->synthetic_idle = s->synthetic && !strcmp(urls[i], "synth:idle");
+        /* synthetic frames are numbered at -r */
+        s->time_base = (AVRational){1, sensor_frame_rate && atoi(sensor_frame_rate) > 0 ? atoi(sensor_frame_rate) : 30};
+        s->live = !s->synthetic && (v4l2 || rtsp || rtmp || http);
+        streams[n_streams++] = s;
     }
+    if (stream_sched_init(&sched, n_streams, sched_spec) < 0)
+        return -1;
+    create_queues();
 
-    if (alphablend) {
-        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    /* Create the neural network */
+    t_start = stage_now_us();
+    if (!strcmp(model_name, "stub")) {
+        backend = create_replay_backend(NULL, delay);
+    } else if (!strcmp(model_name, "synth")) {
+        backend = create_replay_backend("synth", delay);
+    } else if (!strncmp(model_name, "replay:", 7)) {
+        backend = create_replay_backend(model_name + 7, delay);
+    } else {
+#ifdef HAVE_RKNN
+        model_data_size = 0;
+        model_data = load_model(model_name, &model_data_size, &model_data_mapped);
+        if (!model_data) {
+            fprintf(stderr, "Error locading model: `%s`\n", model_name);
+            return -1;
+        }
+        fprintf(stderr, "Model: %s - size: %zu%s.\n", model_name, model_data_size, model_data_mapped ? ", mapped" : "");
+        backend = create_rknn_backend();
+#else
+        fprintf(stderr, "Built without RKNN, use a CPU backend: stub, synth or replay:<file>\n");
+        return -1;
+#endif
     }
-    SDL_ShowWindow(window);
-    SDL_SetWindowPosition(window, screen_left, screen_top);
+    t_loaded = stage_now_us();
+    if (backend->init(model_data, model_data_size, npu_cores) < 0 ||
+        backend->query_attrs(&n_inputs, input_attrs, &n_outputs, output_attrs) < 0) {
+        fprintf(stderr, "%s backend init failed\n", backend->name());
+        release_model();
+        return -1;
+    }
+    /* the contexts hold their own copy of the model: the file is not needed any more */
+    rss_model = process_rss_kb(0);
+    release_model();
+    fprintf(stderr, "startup   : %s  load %.1f ms  init %.1f ms  rss %llu kB with the model file, %llu kB without\n",
+            backend->name(), (t_loaded - t_start) / 1000.0, (stage_now_us() - t_loaded) / 1000.0,
+            (unsigned long long)rss_model, (unsigned long long)process_rss_kb(0));
 
-    format = SDL_PIXELFORMAT_YV12;
+    if (input_attrs[0].nchw) {
+        channel = input_attrs[0].dims[1];
+        width = input_attrs[0].dims[2];
+        height = input_attrs[0].dims[3];
+    } else {
+        width = input_attrs[0].dims[1];
+        height = input_attrs[0].dims[2];
+        channel = input_attrs[0].dims[3];
+    }
+    fprintf(stderr, "model: %dx%dx%d\n", width, height, channel);
 
-    if (rtsp) {
-        format = SDL_PIXELFORMAT_IYUV;
+    /* optional sidecar next to the model (or the recording) picks the head, classes and labels */
+    snprintf(head_cfg_name, sizeof(head_cfg_name), "%s.cfg",
+             strncmp(model_name, "replay:", 7) ? model_name : model_name + 7);
+    ret = load_head_config(head_cfg_name, &head_cfg);
+    if (ret < 0)
+        return -1;
+    if (post_ws.init(n_outputs, output_attrs, width, height, ret == 0 ? &head_cfg : NULL) < 0)
+        return -1;
+    if ((class_spec || accur) && setClassFilter(class_spec, accur / 100.0f) < 0)
+        return -1;
+    if (record_name && roi_spec.n) {
+        fprintf(stderr, "-w records the tensors of whole frames, not of -roi regions: not recording\n");
+        record_name = NULL;
     }
-    texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, screen_width, screen_height);
-    if (!texture) {
-        av_log(NULL, AV_LOG_FATAL, "Failed to create texturer %dx%d: %s", screen_width, screen_height, SDL_GetError());
+    if (record_name && n_streams > 1) {
+        fprintf(stderr, "-w records the tensors of one stream, %d given: not recording\n", n_streams);
+        record_name = NULL;
+    }
+    if (record_name && !(record_fp = tensor_record_open(record_name, &input_attrs[0], n_outputs, output_attrs)))
+        return -1;
+
+    SDL_VERSION(&sdl_compiled);
+    SDL_GetVersion(&sdl_linked);
+    SDL_Log("SDL: compiled with=%d.%d.%d linked against=%d.%d.%d", sdl_compiled.major, sdl_compiled.minor, sdl_compiled.patch,
+            sdl_linked.major, sdl_linked.minor, sdl_linked.patch);
+
+    // SDL_SetHint(SDL_HINT_RENDER_DRIVER, "opengles2");
+    // SDL_SetHint(SDL_HINT_VIDEO_WAYLAND_ALLOW_LIBDECOR, "0");
+    /* headless: threads and timers only */
+    if (SDL_Init(headless ? SDL_INIT_TIMER : SDL_INIT_EVERYTHING) < 0) {
+        SDL_Log("SDL_Init failed (%s)", SDL_GetError());
         goto error_exit;
     }
+    if (!headless && open_window(wflags) < 0)
+        goto error_exit;
 
+    /*
+     * One tile per stream. Textures are frame sized, the renderer scales them
+     * to the tile; recreated by showFrame() when the stream changes.
+     * Everything from here on is paid again by every stream.
+     */
+    rss_base = process_rss_kb(0);
+    stream_mosaic(n_streams, screen_width, screen_height, tiles);
     frameSize_rknn = width * height * channel;
-    resize_buf = calloc(1, frameSize_rknn);
-
-    if (!resize_buf) {
-        av_log(NULL, AV_LOG_FATAL, "Failed to create rknn buf: %dx%d", width, height);
+    if (roi_spec.n && alloc_regions() < 0) {
+        fprintf(stderr, "Cannot allocate the -roi model inputs\n");
         goto error_exit;
     }
+    for (i = 0; i < n_streams; i++) {
+        if (!streams[i]->synthetic && open_input(streams[i], pixel_format) < 0)
+            goto error_exit;
+        if (!headless) {
+            streams[i]->tile = tiles[i];
+            if (set_texture(streams[i], SDL_PIXELFORMAT_IYUV, streams[i]->frame_width, streams[i]->frame_height) < 0)
+                goto error_exit;
+        }
+        if (record_dest && open_recorder(streams[i]) < 0)
+            goto error_exit;
+        if (alloc_pipeline(streams[i]) < 0) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to create pipeline buffers: %dx%d", width, height);
+            goto error_exit;
+        }
+    }
 
-    FC_LoadFont(font_small, renderer, "/usr/share/fonts/liberation/LiberationMono-Bold.ttf", 16, FC_MakeColor(255, 255, 255, 255), TTF_STYLE_NORMAL);
-    FC_LoadFont(font_large, renderer, "/usr/share/fonts/liberation/LiberationMono-Bold.ttf", 26, FC_MakeColor(255, 255, 255, 155), TTF_STYLE_NORMAL);
-    FC_LoadFont(font_big, renderer, "/usr/share/fonts/liberation/LiberationMono-Bold.ttf", 72, FC_MakeColor(255, 55, 5, 255), TTF_STYLE_NORMAL);
+    if (!headless) {
+        FC_LoadFont(font_big, renderer, font_file, 72, FC_MakeColor(255, 55, 5, 255), TTF_STYLE_NORMAL);
+        if (overlay.init(renderer, font_file, post_ws.layout.n_classes, alphablend) < 0)
+            goto error_exit;
+    }
+    if (out_dest && detect_out.open(out_dest, out_format) < 0)
+        goto error_exit;
 
     rect.x = 0;
     rect.y = 0;
@@ -1180,107 +1913,186 @@ int main(int argc, char *argv[])
         skip_some_frames = i * atoi(sensor_frame_rate);
     else
         skip_some_frames = i * 30;
-    ret = 0;
-    while (ret >= 0 && skip_some_frames) {
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 55);
-        SDL_RenderFillRect(renderer, &rect);
-        SDL_SetRenderDrawColor(renderer, 255, 50, 50, SDL_ALPHA_OPAQUE);
-        FC_Draw(font_big, renderer, screen_width / 2 - 220, screen_height / 2 - 100, "Buffering... %d", skip_some_frames);
-        SDL_RenderPresent(renderer);
-        if ((ret = av_read_frame(input_ctx, &pkt)) < 0) {
-            if (ret == AVERROR(EAGAIN)) {
-                ret = 0;
-                continue;
+    for (int n = 0; n < n_streams; n++) {
+        stream_t *s = streams[n];
+        int skip = s->synthetic ? 0 : skip_some_frames;
+
+        ret = 0;
+        while (ret >= 0 && skip) {
+            if (!headless) {
+                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 55);
+                SDL_RenderFillRect(renderer, &rect);
+                SDL_SetRenderDrawColor(renderer, 255, 50, 50, SDL_ALPHA_OPAQUE);
+                FC_Draw(font_big, renderer, screen_width / 2 - 220, screen_height / 2 - 100, "Buffering... %d", skip);
+                SDL_RenderPresent(renderer);
             }
-            break;
+            if ((ret = av_read_frame(s->input_ctx, s->pkts[0])) < 0) {
+                if (ret == AVERROR(EAGAIN)) {
+                    ret = 0;
+                    continue;
+                }
+                break;
+            }
+            av_packet_unref(s->pkts[0]);
+            skip--;
+        }
+    }
+
+    if (backend->start() < 0) {
+        fprintf(stderr, "Cannot start %s backend\n", backend->name());
+        goto error_exit;
+    }
+
+    for (i = 0; i < n_streams; i++) {
+        if (streams[i]->recorder && streams[i]->recorder->is_open() && streams[i]->recorder->start() < 0) {
+            fprintf(stderr, "Cannot start the recorder of stream %d\n", i);
+            goto error_exit;
         }
-        skip_some_frames--;
     }
 
     finished = 0;
-    keybthread = SDL_CreateThread(eventThread, "SDL_EventThread", (void *)&finished);
-    readthread = SDL_CreateThread(readpktThread, "SDL_ReadThread", (void *)&finished);
-    decodethread = SDL_CreateThread(decodeThread, "SDL_DecodeThread", (void *)&finished);
+    if (headless) {
+        keybthread = NULL;
+        signal(SIGINT, stop_signal);
+        signal(SIGTERM, stop_signal);
+    } else {
+        keybthread = SDL_CreateThread(eventThread, "SDL_EventThread", (void *)&finished);
+    }
+    /* a reader going away must not kill the process, write() reports it */
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < n_streams; i++) {
+        if (streams[i]->synthetic) {
+            readthreads[i] = NULL;
+            decodethreads[i] = SDL_CreateThread(synthThread, "SDL_SynthThread", streams[i]);
+        } else {
+            readthreads[i] = SDL_CreateThread(readpktThread, "SDL_ReadThread", streams[i]);
+            decodethreads[i] = SDL_CreateThread(decodeThread, "SDL_DecodeThread", streams[i]);
+        }
+    }
     inferencethread = SDL_CreateThread(inferenceThread, "SDL_InferenceThread", (void *)&finished);
 
+    /* takes at most one frame per stream and renders them together, until every stream has ended */
     while (!finished) {
-        SDL_LockMutex(mutex);
-        displayTextureNV12((unsigned char *)pFrameYUV->data[0]);
-        SDL_CondSignal(cond_read_frame);
-        SDL_CondWait(cond_display_frame, mutex);
-        SDL_UnlockMutex(mutex);
-        SDL_Delay(1);
-        if (finished) {
-            SDL_Log("Quit!");
-            SDL_CondSignal(cond_read_frame);
+        frame_slot_t *slot;
+        int shown = 0, ended = 0;
+
+        for (i = 0; i < n_streams; i++) {
+            stream_t *s = streams[i];
+
+            if (!s->ended) {
+                ret = s->display_ring.try_pop(&slot);
+                if (ret > 0)
+                    continue;
+                if (ret < 0 || !slot) {
+                    s->ended = 1;
+                } else {
+                    stage_begin(&s->stats_display);
+                    if (s->recorder)
+                        recordFrame(s, slot);
+                    if (headless)
+                        releaseFrame(slot);
+                    else
+                        showFrame(s, slot);
+                    if (detect_out.is_open())
+                        emitFrame(s, slot);
+                    stage_end(&s->stats_display);
+                    s->slot_free_ring.push(slot);
+                    shown++;
+                }
+            }
+            ended += s->ended;
+        }
+        if (ended == n_streams) {
+            /* end of stream */
+            finished = 1;
             break;
         }
+        if (!shown || headless) {
+            if (!shown)
+                SDL_Delay(1);
+            continue;
+        }
+        stage_begin(&stats_render);
+        renderMosaic();
+        stage_end(&stats_render);
     }
-    SDL_Delay(40);
-    /* flush the codec */
-    decode(codec_ctx, frame, NULL);
+    SDL_Log("Quit!");
+    abort_queues();
 
     SDL_Log("Program wait for the threads...");
-    SDL_WaitThread(keybthread, &status);
-    SDL_WaitThread(readthread, &status);
-    SDL_WaitThread(decodethread, &status);
+    if (keybthread)
+        SDL_WaitThread(keybthread, &status);
+    for (i = 0; i < n_streams; i++) {
+        if (readthreads[i])
+            SDL_WaitThread(readthreads[i], &status);
+        SDL_WaitThread(decodethreads[i], &status);
+    }
     SDL_WaitThread(inferencethread, &status);
+    /* encodes what is still queued and finishes the files */
+    for (i = 0; i < n_streams; i++) {
+        if (streams[i]->recorder)
+            streams[i]->recorder->close();
+    }
     SDL_Log("Program exit!");
 
-    destroy_mutex();
+    rss_run = process_rss_kb(0);
+    pipeline_bytes = 0;
+    total_fps = 0;
+    for (i = 0; i < n_streams; i++) {
+        stream_report(streams[i], &sched, npu_runs ? npu_run_us / 1000.0 / npu_runs : 0.0);
+        if (tracking)
+            streams[i]->tracker.report();
+        if (streams[i]->recorder)
+            streams[i]->recorder->report();
+        pipeline_bytes += stream_memory(streams[i], roi_spec.n ? 0 : frameSize_rknn);
+        total_fps += stage_fps(&streams[i]->stats_display);
+    }
+    stage_report(&stats_infer);
+    if (roi_spec.n)
+        roi_preproc.report();
+    stage_report(&stats_render);
+    overlay.report();
+    backend->report();
+    detect_out.report();
+    fprintf(stderr, "streams   : %d  %.1f fps together\n", n_streams, total_fps);
+    fprintf(stderr, "memory    : %llu kB before the streams, %llu kB more per stream (%llu kB of it pipeline buffers), "
+                    "peak %llu kB\n",
+            (unsigned long long)rss_base, (unsigned long long)(rss_run > rss_base ? rss_run - rss_base : 0) / n_streams,
+            (unsigned long long)pipeline_bytes / 1024 / n_streams, (unsigned long long)process_rss_kb(1));
 
 error_exit:
 
-    if (input_ctx)
-        avformat_close_input(&input_ctx);
-    if (codec_ctx)
-        avcodec_free_context(&codec_ctx);
-    if (frame) {
-        av_frame_free(&frame);
-    }
+    for (i = 0; i < n_streams; i++)
+        free_stream(streams[i]);
+    free_regions();
 
-    if (pFrameYUV)
-        av_frame_free(&pFrameYUV);
     if (pFrameSDL)
         av_frame_free(&pFrameSDL);
-    if (outpkt)
-        av_packet_free(&outpkt);
-    if (pOutputFormatCtx)
-        avformat_free_context(pOutputFormatCtx);
-    if (pOutCodecCtx)
-        avcodec_free_context(&pOutCodecCtx);
 
-    av_free(buffer);
-    sws_freeContext(swsCtx);
 
-    if (resize_buf) {
-        free(resize_buf);
+    /* the font cache before the overlay's TTF_Quit() and both before the renderer they have textures on */
+    if (font_big) {
+        FC_FreeFont(font_big);
+        font_big = NULL;
     }
+    overlay.uninit();
     if (renderer) {
         SDL_DestroyRenderer(renderer);
     }
     if (window) {
         SDL_DestroyWindow(window);
     }
-    if (font_small) {
-        FC_FreeFont(font_small);
-    }
-    if (font_large) {
-        FC_FreeFont(font_large);
-    }
-    if (font_big) {
-        FC_FreeFont(font_big);
-    }
     SDL_Quit();
 
     // release
-    if (ctx) {
-        ret = rknn_destroy(ctx);
+    if (backend) {
+        backend->stop();
+        delete backend;
     }
 
-    if (model_data) {
-        free(model_data);
-    }
+    release_model();
+    if (record_fp)
+        fclose(record_fp);
 
     deinitPostProcess();
 
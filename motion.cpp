@@ -0,0 +1,292 @@
+/*
+ * Block motion detector gating inference on static scenes.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "motion.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -DFFRKNN_NO_SIMD leaves the plain C loops alone, tests/ hold them against the vector ones */
+#if defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+#include <arm_neon.h>
+#elif defined(__SSE2__) && !defined(FFRKNN_NO_SIMD)
+#include <emmintrin.h>
+#endif
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/hwcontext.h>
+}
+
+#include <pipeline.h>
+
+void motion_params_init(motion_params_t *p)
+{
+    p->threshold = MOTION_THRESHOLD;
+    p->min_blocks = MOTION_BLOCKS;
+    p->refresh = MOTION_REFRESH;
+}
+
+int motion_parse(const char *spec, motion_params_t *p)
+{
+    const char *s = spec;
+    int used = 0;
+
+    motion_params_init(p);
+    if (sscanf(s, "%f%n", &p->threshold, &used) != 1)
+        goto bad;
+    s += used;
+    if (*s == ':' && sscanf(s + 1, "%d%n", &p->min_blocks, &used) == 1)
+        s += used + 1;
+    if (*s == ':' && sscanf(s + 1, "%d%n", &p->refresh, &used) == 1)
+        s += used + 1;
+    if (*s || p->min_blocks < 1 || p->refresh < 1)
+        goto bad;
+    return 0;
+
+bad:
+    fprintf(stderr, "motion: cannot take \"%s\", threshold[:blocks[:refresh]]\n", spec);
+    return -1;
+}
+
+/* background = (background * 3 + thumb) / 4 as two rounded halvings, so every version rounds the same */
+void motion_block_sad(const uint8_t *thumb, uint8_t *background, int w, int h, uint32_t *sad)
+{
+    int bw = w / MOTION_BLOCK;
+
+    for (int by = 0; by < h / MOTION_BLOCK; by++) {
+        for (int bx = 0; bx < bw; bx += 2) {
+            size_t o = (size_t)by * MOTION_BLOCK * w + bx * MOTION_BLOCK;
+            uint32_t *out = sad + by * bw + bx;
+#if defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+            uint16x8_t acc = vdupq_n_u16(0);
+            uint64x2_t sum;
+
+            for (int r = 0; r < MOTION_BLOCK; r++, o += w) {
+                uint8x16_t c = vld1q_u8(thumb + o), b = vld1q_u8(background + o);
+
+                acc = vpadalq_u8(acc, vabdq_u8(c, b));
+                vst1q_u8(background + o, vrhaddq_u8(b, vrhaddq_u8(b, c)));
+            }
+            /* lanes 0-3 are the left block, 4-7 the right one */
+            sum = vpaddlq_u32(vpaddlq_u16(acc));
+            out[0] = (uint32_t)vgetq_lane_u64(sum, 0);
+            out[1] = (uint32_t)vgetq_lane_u64(sum, 1);
+#elif defined(__SSE2__) && !defined(FFRKNN_NO_SIMD)
+            __m128i acc = _mm_setzero_si128();
+
+            for (int r = 0; r < MOTION_BLOCK; r++, o += w) {
+                __m128i c = _mm_loadu_si128((const __m128i *)(thumb + o));
+                __m128i b = _mm_loadu_si128((const __m128i *)(background + o));
+
+                /* one sum per 8 bytes: the two blocks side by side */
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(c, b));
+                _mm_storeu_si128((__m128i *)(background + o), _mm_avg_epu8(b, _mm_avg_epu8(b, c)));
+            }
+            out[0] = (uint32_t)_mm_cvtsi128_si32(acc);
+            out[1] = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#else
+            out[0] = out[1] = 0;
+            for (int r = 0; r < MOTION_BLOCK; r++, o += w) {
+                for (int i = 0; i < 2 * MOTION_BLOCK; i++) {
+                    int c = thumb[o + i], b = background[o + i];
+                    int half = (b + c + 1) >> 1;
+
+                    out[i / MOTION_BLOCK] += abs(c - b);
+                    background[o + i] = (uint8_t)((b + half + 1) >> 1);
+                }
+            }
+#endif
+        }
+    }
+}
+
+MotionGate::MotionGate()
+    : frame_w_(0), frame_h_(0), thumb_w_(0), thumb_h_(0), blocks_x_(0), blocks_y_(0), thumb_(nullptr),
+      background_(nullptr), sad_(nullptr), moved_(nullptr), n_moved_(-1), primed_(0), passed_seq_(-1), frames_(0),
+      moving_(0), skipped_(0), refreshes_(0), unreadable_(0), busy_us_(0)
+{
+    params_.threshold = 0;
+    params_.min_blocks = MOTION_BLOCKS;
+    params_.refresh = MOTION_REFRESH;
+    mapped_ = av_frame_alloc();
+}
+
+MotionGate::~MotionGate()
+{
+    free(thumb_);
+    free(background_);
+    free(sad_);
+    free(moved_);
+    av_frame_free(&mapped_);
+}
+
+void MotionGate::init(const motion_params_t *p)
+{
+    params_ = *p;
+    frame_w_ = frame_h_ = 0;
+    primed_ = 0;
+    passed_seq_ = -1;
+}
+
+/* Thumbnail as wide as MOTION_THUMB_W, as high as the frame's aspect ratio makes it, in whole blocks */
+void MotionGate::resize(int w, int h)
+{
+    int th = (MOTION_THUMB_W * h / w + MOTION_BLOCK / 2) / MOTION_BLOCK * MOTION_BLOCK;
+
+    th = SDL_max(MOTION_BLOCK, SDL_min(th, MOTION_THUMB_MAX));
+    frame_w_ = w;
+    frame_h_ = h;
+    thumb_w_ = MOTION_THUMB_W;
+    thumb_h_ = th;
+    blocks_x_ = thumb_w_ / MOTION_BLOCK;
+    blocks_y_ = thumb_h_ / MOTION_BLOCK;
+    /* the 2 x 2 samples stay inside the frame */
+    for (int i = 0; i < thumb_w_; i++)
+        xs_[i] = SDL_min((2 * i + 1) * w / (2 * thumb_w_), w - 2);
+    for (int j = 0; j < thumb_h_; j++)
+        ys_[j] = SDL_min((2 * j + 1) * h / (2 * thumb_h_), h - 2);
+    free(thumb_);
+    free(background_);
+    free(sad_);
+    free(moved_);
+    thumb_ = (uint8_t *)malloc((size_t)thumb_w_ * thumb_h_);
+    background_ = (uint8_t *)malloc((size_t)thumb_w_ * thumb_h_);
+    sad_ = (uint32_t *)malloc(sizeof(uint32_t) * blocks_x_ * blocks_y_);
+    moved_ = (uint8_t *)malloc(blocks_x_ * blocks_y_);
+    primed_ = 0;
+}
+
+void MotionGate::sample(const AVFrame *f)
+{
+    for (int j = 0; j < thumb_h_; j++) {
+        const uint8_t *r0 = f->data[0] + (size_t)ys_[j] * f->linesize[0];
+        const uint8_t *r1 = r0 + f->linesize[0];
+        uint8_t *out = thumb_ + j * thumb_w_;
+
+        for (int i = 0; i < thumb_w_; i++) {
+            int x = xs_[i];
+
+            out[i] = (uint8_t)((r0[x] + r0[x + 1] + r1[x] + r1[x + 1] + 2) >> 2);
+        }
+    }
+}
+
+int MotionGate::update(const AVFrame *f)
+{
+    const AVFrame *luma = f;
+    uint64_t t0 = stage_now_us();
+    uint32_t limit = (uint32_t)(params_.threshold * MOTION_BLOCK * MOTION_BLOCK);
+
+    frames_++;
+    if (f->width < 2 || f->height < 2) {
+        unreadable_++;
+        return n_moved_ = -1;
+    }
+    if (f->width != frame_w_ || f->height != frame_h_)
+        resize(f->width, f->height);
+    if (!thumb_ || !background_ || !sad_ || !moved_) {
+        frame_w_ = frame_h_ = 0;
+        unreadable_++;
+        return n_moved_ = -1;
+    }
+
+    /* a dma-buf is mapped for the few rows sampled, nothing is downloaded */
+    if (f->format == AV_PIX_FMT_DRM_PRIME) {
+        luma = NULL;
+        av_frame_unref(mapped_);
+        if (f->hw_frames_ctx) {
+            mapped_->format = ((AVHWFramesContext *)f->hw_frames_ctx->data)->sw_format;
+            if (av_hwframe_map(mapped_, f, AV_HWFRAME_MAP_READ) == 0)
+                luma = mapped_;
+        }
+    }
+    if (!luma || (luma->format != AV_PIX_FMT_YUV420P && luma->format != AV_PIX_FMT_YUVJ420P &&
+                  luma->format != AV_PIX_FMT_NV12 && luma->format != AV_PIX_FMT_NV21)) {
+        av_frame_unref(mapped_);
+        unreadable_++;
+        return n_moved_ = -1;
+    }
+    sample(luma);
+    av_frame_unref(mapped_);
+
+    /* the first frame is the background, and all of it counts as new */
+    if (!primed_) {
+        memcpy(background_, thumb_, (size_t)thumb_w_ * thumb_h_);
+        memset(moved_, 1, blocks_x_ * blocks_y_);
+        primed_ = 1;
+        n_moved_ = blocks_x_ * blocks_y_;
+    } else {
+        motion_block_sad(thumb_, background_, thumb_w_, thumb_h_, sad_);
+        n_moved_ = 0;
+        for (int i = 0; i < blocks_x_ * blocks_y_; i++) {
+            moved_[i] = sad_[i] > limit;
+            n_moved_ += moved_[i];
+        }
+    }
+    moving_ += n_moved_ > 0;
+    busy_us_ += stage_now_us() - t0;
+    return n_moved_;
+}
+
+int MotionGate::wants(int64_t seq)
+{
+    if (n_moved_ < 0 || n_moved_ >= params_.min_blocks) {
+        passed_seq_ = seq;
+        return 1;
+    }
+    if (passed_seq_ < 0 || seq - passed_seq_ >= params_.refresh) {
+        passed_seq_ = seq;
+        refreshes_++;
+        return 1;
+    }
+    skipped_++;
+    return 0;
+}
+
+int MotionGate::moved(const SDL_Rect *r) const
+{
+    int bx0, by0, bx1, by1;
+
+    if (n_moved_ < 0)
+        return 1;
+    if (!n_moved_)
+        return 0;
+    /* blocks cover frame_w_ / blocks_x_ x frame_h_ / blocks_y_ pixels */
+    bx0 = (int)((int64_t)r->x * blocks_x_ / frame_w_);
+    by0 = (int)((int64_t)r->y * blocks_y_ / frame_h_);
+    bx1 = SDL_min((int)(((int64_t)(r->x + r->w) * blocks_x_ + frame_w_ - 1) / frame_w_), blocks_x_);
+    by1 = SDL_min((int)(((int64_t)(r->y + r->h) * blocks_y_ + frame_h_ - 1) / frame_h_), blocks_y_);
+    for (int by = by0; by < by1; by++)
+        for (int bx = bx0; bx < bx1; bx++)
+            if (moved_[by * blocks_x_ + bx])
+                return 1;
+    return 0;
+}
+
+void MotionGate::report(double ms_per_run) const
+{
+    if (!frames_)
+        return;
+    fprintf(stderr, "%-10s: %6llu frames  %llu moving  %llu skipped (%.1f%%)  %llu refreshes  %llu unreadable  "
+                    "avg %.3f ms  ~%.1f s of NPU time saved at %.1f ms per run\n",
+            "motion", (unsigned long long)frames_, (unsigned long long)moving_, (unsigned long long)skipped_,
+            100.0 * skipped_ / frames_,
+            (unsigned long long)refreshes_, (unsigned long long)unreadable_, busy_us_ / 1000.0 / frames_,
+            skipped_ * ms_per_run / 1000.0, ms_per_run);
+}
@@ -0,0 +1,105 @@
+#ifndef _FFRKNN_MOTION_H_
+#define _FFRKNN_MOTION_H_
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+
+struct AVFrame;
+
+#define MOTION_THUMB_W   160  // luma thumbnail width, whatever the frame size; a multiple of 2 blocks
+#define MOTION_THUMB_MAX 160  // and height at most
+#define MOTION_BLOCK     8    // blocks of MOTION_BLOCK x MOTION_BLOCK thumbnail pixels
+#define MOTION_THRESHOLD 5.0f // mean |luma - background| over a block from which it has moved
+#define MOTION_BLOCKS    1    // moved blocks for a whole frame to go to the NPU
+#define MOTION_REFRESH   30   // frames the NPU is skipped at most, moving or not
+
+typedef struct _motion_params_t
+{
+    float threshold; // <= 0: no gating, every frame and region is inferred
+    int min_blocks;
+    int refresh;
+} motion_params_t;
+
+/* defaults above */
+void motion_params_init(motion_params_t *p);
+/* "threshold[:blocks[:refresh]]", e.g. "8:2:60"; "0" turns the gate off. -1 if malformed */
+int motion_parse(const char *spec, motion_params_t *p);
+
+/*
+ * SAD of every MOTION_BLOCK square of thumb (w x h, w a multiple of two
+ * blocks) against background, row by row into sad; background moves a
+ * quarter of the way to thumb on the way.
+ */
+void motion_block_sad(const uint8_t *thumb, uint8_t *background, int w, int h, uint32_t *sad);
+
+/*
+ * Motion detector gating inference, one per stream (-mg, and the -roi
+ * regions).
+ *
+ * Every frame is reduced to a MOTION_THUMB_W wide luma thumbnail (2 x 2
+ * averages at evenly spaced points, a dma-buf is mapped rather than
+ * downloaded) and compared block by block with a running background: the
+ * sum of absolute differences of each block (NEON / SSE2), then the
+ * background moves a quarter of the way to the frame. Blocks over
+ * threshold have moved. The SIMD and the plain C versions give the same
+ * result.
+ *
+ * Used by the inference thread only.
+ */
+class MotionGate
+{
+public:
+    MotionGate();
+    ~MotionGate();
+
+    void init(const motion_params_t *p);
+    int enabled() const { return params_.threshold > 0; }
+    int refresh() const { return params_.refresh; }
+
+    /*
+     * Folds frame f into the background. Returns the blocks that moved, -1
+     * when f cannot be read (then everything counts as moved).
+     */
+    int update(const struct AVFrame *f);
+
+    /*
+     * Whole frames: frame seq goes to the NPU when enough blocks moved or
+     * nothing went for refresh frames. Counts what it skips.
+     */
+    int wants(int64_t seq);
+
+    /* whether a block over r (frame pixels) moved in the last update() */
+    int moved(const SDL_Rect *r) const;
+
+    /* ms_per_run: NPU time per inference, for the time saved */
+    void report(double ms_per_run) const;
+
+private:
+    void resize(int w, int h);
+    void sample(const struct AVFrame *f);
+
+    motion_params_t params_;
+    int frame_w_, frame_h_;
+    int thumb_w_, thumb_h_;
+    int blocks_x_, blocks_y_;
+    int xs_[MOTION_THUMB_W];   // frame column of each thumbnail column
+    int ys_[MOTION_THUMB_MAX]; // frame row of each thumbnail row
+    uint8_t *thumb_;
+    uint8_t *background_;
+    uint32_t *sad_;
+    uint8_t *moved_;
+    int n_moved_; // -1: unreadable, everything moved
+    int primed_;  // the background holds a frame
+    int64_t passed_seq_;
+
+    struct AVFrame *mapped_; // a DRM_PRIME frame mapped for sampling
+
+    uint64_t frames_;
+    uint64_t moving_; // frames with a block that moved
+    uint64_t skipped_;
+    uint64_t refreshes_;
+    uint64_t unreadable_;
+    uint64_t busy_us_;
+};
+
+#endif //_FFRKNN_MOTION_H_
@@ -0,0 +1,357 @@
+/*
+ * Class-aware non-maximum suppression with a grid spatial index.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "nms.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#define NMS_GRID_MAX 32 // cells per axis
+
+enum {
+    BOX_DROPPED = 0,
+    BOX_LIVE,
+    BOX_KEPT,
+};
+
+float nms_iou(float xmin0, float ymin0, float xmax0, float ymax0, float xmin1, float ymin1, float xmax1, float ymax1)
+{
+    float w = fmax(0.f, fmin(xmax0, xmax1) - fmax(xmin0, xmin1) + 1.0);
+    float h = fmax(0.f, fmin(ymax0, ymax1) - fmax(ymin0, ymin1) + 1.0);
+    float i = w * h;
+    float u = (xmax0 - xmin0 + 1.0) * (ymax0 - ymin0 + 1.0) + (xmax1 - xmin1 + 1.0) * (ymax1 - ymin1 + 1.0) - i;
+    return u <= 0.f ? 0.f : (i / u);
+}
+
+static inline float rect_iou(const float *a, const float *b)
+{
+    return nms_iou(a[0], a[1], a[2], a[3], b[0], b[1], b[2], b[3]);
+}
+
+/*
+ * The grid covers the bounding box of all candidates with cells about the
+ * size of an average box, so a typical box lands in at most four cells.
+ * Two boxes overlap only if [x1, x2 + 1) x [y1, y2 + 1) intersect, and
+ * then they share at least one cell, which makes the pruning exact.
+ */
+void NmsEngine::build_grid(int n)
+{
+    float x0 = rects_[0].x1, y0 = rects_[0].y1;
+    float x1 = rects_[0].x2 + 1, y1 = rects_[0].y2 + 1;
+    double dim = 0;
+    float cell;
+    int cells;
+
+    for (int i = 0; i < n; i++) {
+        const rect_t *r = &rects_[i];
+
+        x0 = std::min(x0, r->x1);
+        y0 = std::min(y0, r->y1);
+        x1 = std::max(x1, r->x2 + 1);
+        y1 = std::max(y1, r->y2 + 1);
+        dim += std::max(r->x2 - r->x1, r->y2 - r->y1) + 1;
+    }
+    cell = dim / n;
+    cell = std::max(cell, std::max(x1 - x0, y1 - y0) / NMS_GRID_MAX);
+    if (!(cell >= 1.0f))
+        cell = 1.0f; // also catches NaN
+    grid_x0_ = x0;
+    grid_y0_ = y0;
+    inv_cell_ = 1.0f / cell;
+    grid_w_ = std::min(NMS_GRID_MAX, std::max(1, (int)((x1 - x0) * inv_cell_) + 1));
+    grid_h_ = std::min(NMS_GRID_MAX, std::max(1, (int)((y1 - y0) * inv_cell_) + 1));
+
+    cells = grid_w_ * grid_h_;
+    if ((int)cell_gen_.size() < cells) {
+        cell_gen_.resize(cells, 0);
+        cell_head_.resize(cells, -1);
+    }
+    if ((int)seen_.size() < n)
+        seen_.resize(n, 0);
+}
+
+void NmsEngine::cell_range(const rect_t *r, int *cx0, int *cy0, int *cx1, int *cy1) const
+{
+    float fx0 = (r->x1 - grid_x0_) * inv_cell_;
+    float fy0 = (r->y1 - grid_y0_) * inv_cell_;
+    float fx1 = (r->x2 + 1 - grid_x0_) * inv_cell_;
+    float fy1 = (r->y2 + 1 - grid_y0_) * inv_cell_;
+
+    *cx0 = fx0 > 0 ? std::min((int)fx0, grid_w_ - 1) : 0;
+    *cy0 = fy0 > 0 ? std::min((int)fy0, grid_h_ - 1) : 0;
+    *cx1 = fx1 > 0 ? std::min((int)fx1, grid_w_ - 1) : 0;
+    *cy1 = fy1 > 0 ? std::min((int)fy1, grid_h_ - 1) : 0;
+}
+
+void NmsEngine::grid_insert(int box)
+{
+    int cx0, cy0, cx1, cy1;
+
+    cell_range(&rects_[box], &cx0, &cy0, &cx1, &cy1);
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            int c = cy * grid_w_ + cx;
+
+            if (cell_gen_[c] != gen_) {
+                cell_gen_[c] = gen_;
+                cell_head_[c] = -1;
+            }
+            node_box_.push_back(box);
+            node_next_.push_back(cell_head_[c]);
+            cell_head_[c] = (int)node_box_.size() - 1;
+        }
+    }
+}
+
+/* new generation: every cell reads as empty again */
+void NmsEngine::grid_reset()
+{
+    if (++gen_ == 0) {
+        std::fill(cell_gen_.begin(), cell_gen_.end(), 0);
+        gen_ = 1;
+    }
+    node_box_.clear();
+    node_next_.clear();
+}
+
+/* new query: no box seen yet */
+void NmsEngine::next_stamp()
+{
+    if (++stamp_ == 0) {
+        std::fill(seen_.begin(), seen_.end(), 0);
+        stamp_ = 1;
+    }
+}
+
+/* greedy NMS of one group, order[] by decreasing score */
+int NmsEngine::hard_group(const int *order, int count, float threshold, int *keep)
+{
+    int kept = 0;
+
+    grid_reset();
+    for (int k = 0; k < count; k++) {
+        int b = order[k];
+        const rect_t *r = &rects_[b];
+        int cx0, cy0, cx1, cy1;
+        int suppressed = 0;
+
+        cell_range(r, &cx0, &cy0, &cx1, &cy1);
+        next_stamp();
+        for (int cy = cy0; cy <= cy1 && !suppressed; cy++) {
+            for (int cx = cx0; cx <= cx1 && !suppressed; cx++) {
+                int c = cy * grid_w_ + cx;
+
+                if (cell_gen_[c] != gen_)
+                    continue;
+                for (int node = cell_head_[c]; node >= 0; node = node_next_[node]) {
+                    int o = node_box_[node];
+
+                    if (seen_[o] == stamp_)
+                        continue;
+                    seen_[o] = stamp_;
+                    if (rect_iou(&r->x1, &rects_[o].x1) > threshold) {
+                        suppressed = 1;
+                        break;
+                    }
+                }
+            }
+        }
+        if (!suppressed) {
+            keep[kept++] = b;
+            grid_insert(b);
+        }
+    }
+    return kept;
+}
+
+static inline bool heap_less(const std::pair<float, int> &a, const std::pair<float, int> &b)
+{
+    /* max-heap on score, lowest index first on ties */
+    return a.first < b.first || (a.first == b.first && a.second > b.second);
+}
+
+/*
+ * Soft-NMS of one group: all boxes sit in the grid, the best live one is
+ * taken from a lazy heap and only the boxes sharing a cell with it decay.
+ */
+int NmsEngine::soft_group(const int *order, int count, float *scores, const nms_params_t *params, int *keep)
+{
+    int kept = 0;
+
+    grid_reset();
+    heap_.clear();
+    for (int k = 0; k < count; k++) {
+        int b = order[k];
+
+        state_[b] = BOX_LIVE;
+        grid_insert(b);
+        heap_.push_back(std::make_pair(scores[b], b));
+    }
+    std::make_heap(heap_.begin(), heap_.end(), heap_less);
+
+    while (!heap_.empty()) {
+        std::pair<float, int> top = heap_.front();
+        int b = top.second;
+        const rect_t *r = &rects_[b];
+        int cx0, cy0, cx1, cy1;
+
+        std::pop_heap(heap_.begin(), heap_.end(), heap_less);
+        heap_.pop_back();
+        /* stale entry: kept, dropped or decayed since it was pushed */
+        if (state_[b] != BOX_LIVE || top.first != scores[b])
+            continue;
+        state_[b] = BOX_KEPT;
+        keep[kept++] = b;
+
+        cell_range(r, &cx0, &cy0, &cx1, &cy1);
+        next_stamp();
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                int c = cy * grid_w_ + cx;
+
+                if (cell_gen_[c] != gen_)
+                    continue;
+                for (int node = cell_head_[c]; node >= 0; node = node_next_[node]) {
+                    int o = node_box_[node];
+                    float iou, w;
+
+                    if (seen_[o] == stamp_ || state_[o] != BOX_LIVE)
+                        continue;
+                    seen_[o] = stamp_;
+                    iou = rect_iou(&r->x1, &rects_[o].x1);
+                    if (params->method == NMS_LINEAR)
+                        w = iou > params->iou_threshold ? 1.0f - iou : 1.0f;
+                    else
+                        w = expf(-(iou * iou) / params->sigma);
+                    if (w == 1.0f)
+                        continue;
+                    scores[o] *= w;
+                    if (scores[o] < params->score_threshold) {
+                        state_[o] = BOX_DROPPED;
+                        continue;
+                    }
+                    heap_.push_back(std::make_pair(scores[o], o));
+                    std::push_heap(heap_.begin(), heap_.end(), heap_less);
+                }
+            }
+        }
+    }
+    return kept;
+}
+
+void NmsEngine::reserve(int n)
+{
+    rects_.reserve(n);
+    state_.reserve(n);
+    order_.reserve(n);
+    grouped_.reserve(n);
+    keys_.reserve(n);
+    if ((int)seen_.size() < n)
+        seen_.resize(n, 0);
+    cell_gen_.resize(NMS_GRID_MAX * NMS_GRID_MAX, 0);
+    cell_head_.resize(NMS_GRID_MAX * NMS_GRID_MAX, -1);
+    /* a typical box spans up to 4 cells, the node lists only grow past that once */
+    node_box_.reserve(n * 4);
+    node_next_.reserve(n * 4);
+    heap_.reserve(n * 2);
+}
+
+int NmsEngine::run(const float *boxes, float *scores, const int *classes, const int *batch, int n,
+                   const nms_params_t *params, int *keep)
+{
+    int n_classes = 1, n_keys = 1;
+    int out = 0;
+    int m = n;
+    auto by_score = [scores](int a, int b) { return scores[a] > scores[b] || (scores[a] == scores[b] && a < b); };
+
+    if (n <= 0)
+        return 0;
+
+    rects_.resize(n);
+    state_.resize(n);
+    order_.resize(n);
+    grouped_.resize(n);
+    keys_.resize(n);
+    for (int i = 0; i < n; i++) {
+        const float *b = boxes + i * 4;
+
+        rects_[i].x1 = b[0];
+        rects_[i].y1 = b[1];
+        rects_[i].x2 = b[0] + b[2];
+        rects_[i].y2 = b[1] + b[3];
+        order_[i] = i;
+    }
+
+    /*
+     * Pre-NMS cap: only the top_k best candidates go on, picked in linear
+     * time, so a frame with thousands of boxes over the threshold costs a
+     * bounded sort and NMS. Then the only sort: by decreasing score, index
+     * breaks ties.
+     */
+    if (params->top_k > 0 && n > params->top_k) {
+        m = params->top_k;
+        std::nth_element(order_.begin(), order_.begin() + m, order_.end(), by_score);
+    }
+    std::sort(order_.begin(), order_.begin() + m, by_score);
+
+    /* one counting pass groups by (batch, class), keeping the score order */
+    for (int i = 0; i < n; i++) {
+        if (classes && classes[i] >= n_classes)
+            n_classes = classes[i] + 1;
+    }
+    for (int i = 0; i < n; i++) {
+        int key = classes ? std::max(classes[i], 0) : 0;
+
+        if (batch)
+            key += std::max(batch[i], 0) * n_classes;
+        keys_[i] = key;
+        n_keys = std::max(n_keys, key + 1);
+    }
+    group_start_.assign(n_keys + 1, 0);
+    for (int i = 0; i < m; i++)
+        group_start_[keys_[order_[i]] + 1]++;
+    for (int g = 0; g < n_keys; g++)
+        group_start_[g + 1] += group_start_[g];
+    for (int i = 0; i < m; i++) {
+        int b = order_[i];
+        grouped_[group_start_[keys_[b]]++] = b;
+    }
+    /* the scatter advanced every start to the next group's, shift back */
+    for (int g = n_keys; g > 0; g--)
+        group_start_[g] = group_start_[g - 1];
+    group_start_[0] = 0;
+
+    build_grid(n);
+    for (int g = 0; g < n_keys; g++) {
+        int first = group_start_[g];
+        int count = group_start_[g + 1] - first;
+
+        if (!count)
+            continue;
+        if (params->method == NMS_HARD)
+            out += hard_group(&grouped_[first], count, params->iou_threshold, keep + out);
+        else
+            out += soft_group(&grouped_[first], count, scores, params, keep + out);
+    }
+
+    std::sort(keep, keep + out, by_score);
+    if (params->max_out > 0 && out > params->max_out)
+        out = params->max_out;
+    return out;
+}
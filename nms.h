@@ -0,0 +1,95 @@
+#ifndef _FFRKNN_NMS_H_
+#define _FFRKNN_NMS_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+typedef enum _nms_method_t
+{
+    NMS_HARD = 0, // greedy: drop every box overlapping a kept one by more than iou_threshold
+    NMS_LINEAR,   // soft-NMS: score *= 1 - iou above iou_threshold
+    NMS_GAUSSIAN, // soft-NMS: score *= exp(-iou^2 / sigma) for every overlap
+} nms_method_t;
+
+typedef struct _nms_params_t
+{
+    nms_method_t method;
+    float iou_threshold;
+    float sigma;           // NMS_GAUSSIAN only
+    float score_threshold; // soft-NMS: boxes decayed below it are dropped
+    int top_k;             // candidates kept before NMS, <= 0: all
+    int max_out;           // <= 0: no limit
+} nms_params_t;
+
+/*
+ * Class-aware non-maximum suppression.
+ *
+ * The best top_k candidates are selected in linear time, sorted by score
+ * once and scattered into per-group runs
+ * with a counting pass (group = class, or batch x class for batched runs),
+ * then every group is pruned against a uniform grid over the boxes, so a
+ * box is only compared with the boxes sharing one of its cells instead of
+ * with every other candidate. Overlap uses the same +1 pixel convention as
+ * the Rockchip demo code.
+ *
+ * The engine keeps its scratch buffers between calls, reuse one instance
+ * per thread.
+ */
+class NmsEngine
+{
+public:
+    NmsEngine() : grid_x0_(0), grid_y0_(0), inv_cell_(1), grid_w_(1), grid_h_(1), gen_(0), stamp_(0) {}
+
+    /* preallocates the scratch buffers for up to n candidates */
+    void reserve(int n);
+
+    /*
+     * boxes: n x (x, y, w, h). classes may be NULL (class agnostic); batch
+     * may be NULL, otherwise boxes of different batch entries (images,
+     * streams) never suppress each other. Soft-NMS decays scores in place.
+     * Writes the surviving indices to keep[] by decreasing score and
+     * returns how many there are.
+     */
+    int run(const float *boxes, float *scores, const int *classes, const int *batch, int n,
+            const nms_params_t *params, int *keep);
+
+private:
+    struct rect_t
+    {
+        float x1, y1, x2, y2;
+    };
+
+    void build_grid(int n);
+    void cell_range(const rect_t *r, int *cx0, int *cy0, int *cx1, int *cy1) const;
+    void grid_insert(int box);
+    void grid_reset();
+    void next_stamp();
+    int hard_group(const int *order, int count, float threshold, int *keep);
+    int soft_group(const int *order, int count, float *scores, const nms_params_t *params, int *keep);
+
+    std::vector<rect_t> rects_;
+    std::vector<int> order_;
+    std::vector<int> grouped_;
+    std::vector<int> group_start_;
+    std::vector<int> keys_;
+
+    /* grid: per-cell singly linked lists, emptied by bumping the generation */
+    float grid_x0_, grid_y0_, inv_cell_;
+    int grid_w_, grid_h_;
+    unsigned gen_;
+    std::vector<unsigned> cell_gen_;
+    std::vector<int> cell_head_;
+    std::vector<int> node_next_;
+    std::vector<int> node_box_;
+    std::vector<unsigned> seen_;
+    unsigned stamp_;
+
+    /* soft-NMS lazy max-heap of (score, box) */
+    std::vector<std::pair<float, int>> heap_;
+    std::vector<uint8_t> state_;
+};
+
+float nms_iou(float xmin0, float ymin0, float xmax0, float ymax0, float xmin1, float ymin1, float xmax1, float ymax1);
+
+#endif //_FFRKNN_NMS_H_
@@ -0,0 +1,283 @@
+/*
+ * Detections streamed to a file, pipe or Unix socket, binary or JSON lines.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static_assert(sizeof(output_header_t) == 28, "binary header layout");
+static_assert(sizeof(output_detection_t) == 20, "binary detection layout");
+
+DetectOutput::DetectOutput() : fd_(-1), json_(0), owned_(0), sent_(0), len_(0), frames_(0), bytes_(0), dropped_(0)
+{
+}
+
+DetectOutput::~DetectOutput()
+{
+    close();
+}
+
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "output: socket path too long: %s\n", path);
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int DetectOutput::open(const char *dest, const char *format)
+{
+    struct stat st;
+
+    close();
+    json_ = format && !strcmp(format, "json");
+    owned_ = 1;
+    if (!strcmp(dest, "-")) {
+        fd_ = STDOUT_FILENO;
+        owned_ = 0;
+    } else if (!strncmp(dest, "unix:", 5)) {
+        fd_ = connect_unix(dest + 5);
+    } else {
+        /* a FIFO blocks here until its reader shows up */
+        fd_ = ::open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd_ < 0) {
+        fprintf(stderr, "output: cannot open %s: %s\n", dest, strerror(errno));
+        return -1;
+    }
+    /* only pipes and sockets can fill up: never wait on their reader */
+    if (fstat(fd_, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    sent_ = len_ = 0;
+    return 0;
+}
+
+void DetectOutput::close()
+{
+    if (fd_ >= 0 && owned_)
+        ::close(fd_);
+    fd_ = -1;
+}
+
+/* Writes what is left of the record, 1 while some of it is still waiting for room, -1 on error */
+int DetectOutput::send()
+{
+    while (sent_ < len_) {
+        ssize_t n = ::write(fd_, buf_ + sent_, len_ - sent_);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            fprintf(stderr, "output: %s, no more detections written\n", strerror(errno));
+            close();
+            return -1;
+        }
+        sent_ += n;
+        bytes_ += n;
+    }
+    return 0;
+}
+
+static int16_t clamp16(float v)
+{
+    return (int16_t)(v < -32768.f ? -32768.f : v > 32767.f ? 32767.f : v);
+}
+
+int DetectOutput::encode_binary(int stream, int64_t seq, int64_t pts_us, int width, int height,
+                                const detect_result_group_t *group)
+{
+    output_header_t *h = (output_header_t *)buf_;
+    output_detection_t *d = (output_detection_t *)(buf_ + sizeof(output_header_t));
+
+    h->magic = OUTPUT_MAGIC;
+    h->stream = (uint16_t)stream;
+    h->count = (uint16_t)group->count;
+    h->seq = seq;
+    h->pts_us = pts_us;
+    h->width = (uint16_t)width;
+    h->height = (uint16_t)height;
+    for (int i = 0; i < group->count; i++, d++) {
+        const detect_result_t *r = &group->results[i];
+
+        d->left = clamp16(r->box.left);
+        d->top = clamp16(r->box.top);
+        d->right = clamp16(r->box.right);
+        d->bottom = clamp16(r->box.bottom);
+        d->class_id = (uint16_t)r->class_id;
+        d->reserved = 0;
+        d->track_id = r->track_id;
+        d->score = r->prop;
+    }
+    return (int)((char *)d - buf_);
+}
+
+/* Plain appenders: no locale, no format parsing, nothing allocated */
+static char *put_str(char *p, const char *s)
+{
+    while (*s)
+        *p++ = *s++;
+    return p;
+}
+
+static char *put_int(char *p, int64_t v)
+{
+    char tmp[24];
+    int n = 0;
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+    if (v < 0)
+        *p++ = '-';
+    do {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+/* scores are in [0, 1], three decimals */
+static char *put_score(char *p, float v)
+{
+    int m = (int)(v * 1000.f + 0.5f);
+
+    if (m < 0)
+        m = 0;
+    p = put_int(p, m / 1000);
+    *p++ = '.';
+    *p++ = (char)('0' + m / 100 % 10);
+    *p++ = (char)('0' + m / 10 % 10);
+    *p++ = (char)('0' + m % 10);
+    return p;
+}
+
+static char *put_json_str(char *p, const char *s, int max)
+{
+    *p++ = '"';
+    for (int i = 0; i < max && s[i]; i++) {
+        unsigned char c = (unsigned char)s[i];
+
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+        } else if (c < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            p = put_str(p, "\\u00");
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        } else {
+            *p++ = (char)c;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+int DetectOutput::encode_json(int stream, int64_t seq, int64_t pts_us, int width, int height,
+                              const detect_result_group_t *group)
+{
+    char *p = buf_;
+
+    p = put_str(p, "{\"stream\":");
+    p = put_int(p, stream);
+    p = put_str(p, ",\"seq\":");
+    p = put_int(p, seq);
+    p = put_str(p, ",\"pts\":");
+    p = pts_us == INT64_MIN ? put_str(p, "null") : put_int(p, pts_us);
+    p = put_str(p, ",\"w\":");
+    p = put_int(p, width);
+    p = put_str(p, ",\"h\":");
+    p = put_int(p, height);
+    p = put_str(p, ",\"det\":[");
+    for (int i = 0; i < group->count; i++) {
+        const detect_result_t *r = &group->results[i];
+
+        p = put_str(p, i ? ",{\"cls\":" : "{\"cls\":");
+        p = put_int(p, r->class_id);
+        p = put_str(p, ",\"name\":");
+        p = put_json_str(p, getLabelName(r->class_id) ? getLabelName(r->class_id) : "", OUTPUT_LABEL_MAX);
+        p = put_str(p, ",\"score\":");
+        p = put_score(p, r->prop);
+        p = put_str(p, ",\"box\":[");
+        p = put_int(p, clamp16(r->box.left));
+        *p++ = ',';
+        p = put_int(p, clamp16(r->box.top));
+        *p++ = ',';
+        p = put_int(p, clamp16(r->box.right));
+        *p++ = ',';
+        p = put_int(p, clamp16(r->box.bottom));
+        *p++ = ']';
+        if (r->track_id) {
+            p = put_str(p, ",\"id\":");
+            p = put_int(p, r->track_id);
+        }
+        *p++ = '}';
+    }
+    p = put_str(p, "]}\n");
+    return (int)(p - buf_);
+}
+
+int DetectOutput::write(int stream, int64_t seq, int64_t pts_us, int width, int height,
+                        const detect_result_group_t *group)
+{
+    int ret;
+
+    if (fd_ < 0)
+        return -1;
+    /* the previous record goes out whole first, this frame is lost if it cannot */
+    if ((ret = send()) != 0) {
+        if (ret > 0)
+            dropped_++;
+        return ret < 0 ? -1 : 0;
+    }
+
+    len_ = json_ ? encode_json(stream, seq, pts_us, width, height, group)
+                 : encode_binary(stream, seq, pts_us, width, height, group);
+    sent_ = 0;
+    frames_++;
+    return send() < 0 ? -1 : 0;
+}
+
+void DetectOutput::report() const
+{
+    if (!frames_ && !dropped_)
+        return;
+    fprintf(stderr, "output    : %6llu frames  %8.1f bytes/frame  %llu dropped by a slow reader\n",
+            (unsigned long long)frames_, frames_ ? (double)bytes_ / frames_ : 0.0, (unsigned long long)dropped_);
+}
@@ -0,0 +1,86 @@
+#ifndef _FFRKNN_OUTPUT_H_
+#define _FFRKNN_OUTPUT_H_
+
+#include <stdint.h>
+
+#include <postprocess.h>
+
+#define OUTPUT_MAGIC      0x44524646u // "FFRD", little-endian
+#define OUTPUT_RECORD_MAX 24576       // one frame of OBJ_NUMB_MAX_SIZE detections, JSON worst case
+#define OUTPUT_LABEL_MAX  16          // label characters written per detection, fits OUTPUT_RECORD_MAX
+
+/*
+ * Binary framing, little-endian, packed, one record per frame:
+ *   header    u32 magic "FFRD" | u16 stream | u16 count | i64 seq | i64 pts_us (INT64_MIN if unknown)
+ *             | u16 frame width | u16 frame height                                        28 bytes
+ *   count x   i16 left, top, right, bottom (frame pixels) | u16 class_id | u16 0
+ *             | i32 track_id (0: not tracked) | f32 score                                  20 bytes
+ */
+typedef struct __attribute__((packed)) _output_header_t
+{
+    uint32_t magic;
+    uint16_t stream;
+    uint16_t count;
+    int64_t seq;
+    int64_t pts_us;
+    uint16_t width;
+    uint16_t height;
+} output_header_t;
+
+typedef struct __attribute__((packed)) _output_detection_t
+{
+    int16_t left, top, right, bottom;
+    uint16_t class_id;
+    uint16_t reserved;
+    int32_t track_id;
+    float score;
+} output_detection_t;
+
+/*
+ * Per-frame detections to a file, a FIFO, stdout ("-") or a Unix stream
+ * socket ("unix:<path>", connected to a listener), as binary records or
+ * one JSON object per line:
+ *   {"stream":0,"seq":12,"pts":400000,"w":1920,"h":1080,
+ *    "det":[{"cls":0,"name":"person","score":0.873,"box":[10,20,110,220],"id":3}]}
+ *
+ * Records are built in a fixed buffer and written with one write() per
+ * frame. Pipes and sockets are non-blocking: a consumer falling behind
+ * loses whole frames (counted) instead of stalling the pipeline, a record
+ * cut short by a full pipe is finished before the next one is sent.
+ */
+class DetectOutput
+{
+public:
+    DetectOutput();
+    ~DetectOutput();
+
+    /* format: "bin" (default) or "json" */
+    int open(const char *dest, const char *format);
+    void close();
+    bool is_open() const { return fd_ >= 0; }
+
+    /* boxes in frame pixels, as post_process() maps them; returns -1 once the consumer is gone */
+    int write(int stream, int64_t seq, int64_t pts_us, int width, int height, const detect_result_group_t *group);
+
+    void report() const;
+
+private:
+    int encode_binary(int stream, int64_t seq, int64_t pts_us, int width, int height,
+                      const detect_result_group_t *group);
+    int encode_json(int stream, int64_t seq, int64_t pts_us, int width, int height,
+                    const detect_result_group_t *group);
+    int send();
+
+    int fd_;
+    int json_;
+    int owned_; // closed by close(), stdout is not
+    int sent_;  // bytes of buf_ already written
+    int len_;
+    char buf_[OUTPUT_RECORD_MAX];
+
+    uint64_t frames_;
+    uint64_t bytes_;
+    uint64_t dropped_;
+};
+
+#endif //_FFRKNN_OUTPUT_H_
@@ -0,0 +1,286 @@
+/*
+ * Batched box, label and HUD drawing for the display.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "overlay.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define OVERLAY_WAYS 4
+#define OVERLAY_SETS (OVERLAY_LABELS / OVERLAY_WAYS)
+
+/* label prefix -> colour, '?' matches any character; the first match wins */
+static const struct
+{
+    const char *pattern;
+    SDL_Color color;
+} class_colors[] = {
+    {"pe", {255, 0, 0, 255}},       // person
+    {"ca", {0, 255, 0, 255}},       // car
+    {"bu", {255, 0, 255, 255}},     // bus
+    {"bi", {255, 255, 0, 255}},     // bicycle
+    {"mo", {128, 155, 255, 255}},   // motorcycle
+    {"b??k", {128, 128, 128, 255}}, // backpack, book
+    {"um", {255, 255, 255, 255}},   // umbrella
+};
+
+SDL_Color overlay_class_color(const char *label)
+{
+    for (size_t i = 0; label && i < sizeof(class_colors) / sizeof(class_colors[0]); i++) {
+        const char *p = class_colors[i].pattern;
+        int n = 0;
+
+        while (p[n] && label[n] && (p[n] == '?' || p[n] == label[n]))
+            n++;
+        if (!p[n])
+            return class_colors[i].color;
+    }
+    return (SDL_Color){0, 0, 255, 255};
+}
+
+void overlay_text_free(overlay_text_t *t)
+{
+    if (t->texture)
+        SDL_DestroyTexture(t->texture);
+    memset(t, 0, sizeof(overlay_text_t));
+}
+
+OverlayCompositor::OverlayCompositor()
+    : renderer_(nullptr), ttf_(0), label_font_(nullptr), hud_font_(nullptr), alpha_(0), n_classes_(0), n_quads_(0),
+      n_blits_(0), n_retired_(0), uses_(0), frames_(0), draw_calls_(0), label_hits_(0), label_misses_(0),
+      hud_rasterized_(0)
+{
+    memset(labels_, 0, sizeof(labels_));
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    /* two triangles per quad, corners in the order quad() writes them */
+    for (int q = 0; q < OVERLAY_QUADS; q++) {
+        static const int corners[6] = {0, 1, 2, 2, 1, 3};
+
+        for (int k = 0; k < 6; k++)
+            indices_[q * 6 + k] = q * 4 + corners[k];
+    }
+#endif
+}
+
+OverlayCompositor::~OverlayCompositor()
+{
+    uninit();
+}
+
+void OverlayCompositor::uninit()
+{
+    for (int i = 0; i < OVERLAY_LABELS; i++) {
+        if (labels_[i].texture)
+            SDL_DestroyTexture(labels_[i].texture);
+    }
+    memset(labels_, 0, sizeof(labels_));
+    if (label_font_)
+        TTF_CloseFont(label_font_);
+    if (hud_font_)
+        TTF_CloseFont(hud_font_);
+    label_font_ = hud_font_ = nullptr;
+    if (ttf_)
+        TTF_Quit();
+    ttf_ = 0;
+    renderer_ = nullptr;
+}
+
+int OverlayCompositor::init(SDL_Renderer *renderer, const char *ttf, int n_classes, int alpha)
+{
+    /* also when the font cache started SDL_ttf already: our TTF_Quit() must not end it under that */
+    if (TTF_Init() < 0) {
+        fprintf(stderr, "overlay: %s\n", TTF_GetError());
+        return -1;
+    }
+    ttf_ = 1;
+    renderer_ = renderer;
+    label_font_ = TTF_OpenFont(ttf, OVERLAY_LABEL_SIZE);
+    hud_font_ = TTF_OpenFont(ttf, OVERLAY_HUD_SIZE);
+    if (!label_font_ || !hud_font_) {
+        fprintf(stderr, "overlay: cannot open %s: %s\n", ttf, TTF_GetError());
+        return -1;
+    }
+    alpha_ = alpha;
+    n_classes_ = n_classes < OBJ_CLASS_MAX ? n_classes : OBJ_CLASS_MAX;
+    for (int i = 0; i < OBJ_CLASS_MAX; i++)
+        colors_[i] = overlay_class_color(i < n_classes_ ? getLabelName(i) : NULL);
+    return 0;
+}
+
+void OverlayCompositor::quad(int x, int y, int w, int h, SDL_Color c)
+{
+    if (n_quads_ == OVERLAY_QUADS || w <= 0 || h <= 0)
+        return;
+    rects_[n_quads_] = (SDL_Rect){x, y, w, h};
+    rect_colors_[n_quads_] = c;
+    n_quads_++;
+}
+
+int OverlayCompositor::rasterize(TTF_Font *font, const char *text, SDL_Texture **texture, int *w, int *h)
+{
+    static const SDL_Color white = {255, 255, 255, 255};
+    SDL_Surface *surface = TTF_RenderUTF8_Blended(font, text, white);
+
+    if (*texture)
+        SDL_DestroyTexture(*texture);
+    *texture = NULL;
+    if (!surface)
+        return -1;
+    *texture = SDL_CreateTextureFromSurface(renderer_, surface);
+    *w = surface->w;
+    *h = surface->h;
+    SDL_FreeSurface(surface);
+    return *texture ? 0 : -1;
+}
+
+const OverlayCompositor::label_t *OverlayCompositor::label(const detect_result_t *det)
+{
+    int pct = (int)(det->prop * 100.0f + 0.5f);
+    uint64_t key = ((uint64_t)(uint32_t)det->track_id << 32 | (uint64_t)(det->class_id & 0xffff) << 8 | pct) + 1;
+    label_t *set = &labels_[(key * 0x9E3779B97F4A7C15ull >> 32) % OVERLAY_SETS * OVERLAY_WAYS];
+    label_t *l = &set[0];
+    const char *name = getLabelName(det->class_id);
+    char text[64];
+
+    for (int i = 0; i < OVERLAY_WAYS; i++) {
+        if (set[i].key == key) {
+            set[i].used = ++uses_;
+            label_hits_++;
+            return &set[i];
+        }
+        if (set[i].used < l->used)
+            l = &set[i];
+    }
+
+    if (det->track_id)
+        snprintf(text, sizeof(text), "%s #%d %d%%", name ? name : "?", det->track_id, pct);
+    else
+        snprintf(text, sizeof(text), "%s %d%%", name ? name : "?", pct);
+    label_misses_++;
+    /* the texture may already be queued for this frame, it goes after the flush */
+    if (l->texture && n_retired_ < OBJ_NUMB_MAX_SIZE) {
+        retired_[n_retired_++] = l->texture;
+        l->texture = NULL;
+    }
+    l->key = 0;
+    if (rasterize(label_font_, text, &l->texture, &l->w, &l->h) < 0)
+        return NULL;
+    l->key = key;
+    l->used = ++uses_;
+    return l;
+}
+
+void OverlayCompositor::add(const detect_result_t *det)
+{
+    SDL_Color c = colors_[(unsigned)det->class_id < OBJ_CLASS_MAX ? det->class_id : 0];
+    int x = det->box.left, y = det->box.top;
+    int w = det->box.right - det->box.left + 1;
+    int h = det->box.bottom - det->box.top + 1;
+    const label_t *l;
+    int bar_h;
+
+    if (alpha_) {
+        SDL_Color fill = c;
+
+        fill.a = (Uint8)alpha_;
+        quad(x, y, w, h, fill);
+    }
+    quad(x, y, w, 1, c);
+    quad(x, y + h - 1, w, 1, c);
+    quad(x, y + 1, 1, h - 2, c);
+    quad(x + w - 1, y + 1, 1, h - 2, c);
+
+    /* label on a bar in the class colour above the box, wide enough for the text */
+    if (!(l = label(det)))
+        return;
+    bar_h = l->h > OVERLAY_LABEL_SIZE ? l->h : OVERLAY_LABEL_SIZE;
+    quad(x, y - bar_h, w > l->w ? w : l->w, bar_h, c);
+    if (n_blits_ < OBJ_NUMB_MAX_SIZE + OVERLAY_HUD_LINES)
+        blits_[n_blits_++] = (blit_t){l->texture, {x, y - bar_h - 1, l->w, l->h}};
+}
+
+void OverlayCompositor::hud(overlay_text_t *lines, const char *const *texts, int n, int width)
+{
+    int y = 0;
+
+    quad(0, 0, width, n * 45, (SDL_Color){120, 120, 120, 115});
+    for (int i = 0; i < n && i < OVERLAY_HUD_LINES; i++) {
+        overlay_text_t *t = &lines[i];
+
+        if (!t->texture || strcmp(t->text, texts[i])) {
+            snprintf(t->text, sizeof(t->text), "%s", texts[i]);
+            if (rasterize(hud_font_, t->text, &t->texture, &t->w, &t->h) < 0)
+                continue;
+            SDL_SetTextureAlphaMod(t->texture, 155);
+            hud_rasterized_++;
+        }
+        if (n_blits_ < OBJ_NUMB_MAX_SIZE + OVERLAY_HUD_LINES)
+            blits_[n_blits_++] = (blit_t){t->texture, {0, y, t->w, t->h}};
+        y += t->h;
+    }
+}
+
+void OverlayCompositor::flush()
+{
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    for (int q = 0; q < n_quads_; q++) {
+        const SDL_Rect *r = &rects_[q];
+        SDL_Vertex *v = &vertices_[q * 4];
+
+        for (int k = 0; k < 4; k++) {
+            v[k].position.x = (float)(r->x + (k & 1 ? r->w : 0));
+            v[k].position.y = (float)(r->y + (k & 2 ? r->h : 0));
+            v[k].color = rect_colors_[q];
+            v[k].tex_coord.x = v[k].tex_coord.y = 0.0f;
+        }
+    }
+    if (n_quads_) {
+        SDL_RenderGeometry(renderer_, NULL, vertices_, n_quads_ * 4, indices_, n_quads_ * 6);
+        draw_calls_++;
+    }
+#else
+    /* one colour switch per run of quads of the same colour */
+    for (int q = 0, run; q < n_quads_; q += run) {
+        SDL_Color c = rect_colors_[q];
+
+        for (run = 1; q + run < n_quads_ && !memcmp(&rect_colors_[q + run], &c, sizeof(c)); run++)
+            ;
+        SDL_SetRenderDrawColor(renderer_, c.r, c.g, c.b, c.a);
+        SDL_RenderFillRects(renderer_, &rects_[q], run);
+        draw_calls_++;
+    }
+#endif
+    for (int i = 0; i < n_blits_; i++)
+        SDL_RenderCopy(renderer_, blits_[i].texture, NULL, &blits_[i].dst);
+    draw_calls_ += n_blits_;
+    for (int i = 0; i < n_retired_; i++)
+        SDL_DestroyTexture(retired_[i]);
+    n_retired_ = 0;
+    n_quads_ = 0;
+    n_blits_ = 0;
+    frames_++;
+}
+
+void OverlayCompositor::report() const
+{
+    if (!frames_)
+        return;
+    fprintf(stderr, "overlay   : %6llu tiles  %5.1f draw calls/tile  labels %llu cached %llu rasterized  "
+                    "HUD %llu rasterized\n",
+            (unsigned long long)frames_, (double)draw_calls_ / frames_, (unsigned long long)label_hits_,
+            (unsigned long long)label_misses_, (unsigned long long)hud_rasterized_);
+}
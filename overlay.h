@@ -0,0 +1,108 @@
+#ifndef _FFRKNN_OVERLAY_H_
+#define _FFRKNN_OVERLAY_H_
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include <stdint.h>
+
+#include <postprocess.h>
+
+#define OVERLAY_LABELS     256 // cached label textures, 4-way set associative, LRU within a set
+#define OVERLAY_LABEL_SIZE 16  // label font size
+#define OVERLAY_HUD_SIZE   26  // FPS / inference time font size
+#define OVERLAY_HUD_LINES  3
+#define OVERLAY_QUADS      (OBJ_NUMB_MAX_SIZE * 6 + 1) // per box: fill, 4 edges, label bar; the HUD background
+
+/* Colour of a class, from its label by the rules the display has always used */
+SDL_Color overlay_class_color(const char *label);
+
+/* A line of text rasterized once, redrawn from its texture until the text changes */
+typedef struct _overlay_text_t
+{
+    char text[64];
+    SDL_Texture *texture;
+    int w, h;
+} overlay_text_t;
+
+void overlay_text_free(overlay_text_t *t);
+
+/*
+ * Box and label compositor for one renderer.
+ *
+ * Class colours are looked up once per model. Boxes added for a frame are
+ * collected as coloured quads and drawn by flush() with a single
+ * SDL_RenderGeometry call (runs of SDL_RenderFillRects on SDL older than
+ * 2.0.18), so the draw colour is never switched per box. Labels are
+ * textures cached by (class, track id, score in whole percent): a steady
+ * scene rasterizes nothing after its first frames.
+ */
+class OverlayCompositor
+{
+public:
+    OverlayCompositor();
+    ~OverlayCompositor();
+
+    /* alpha: fill of the boxes (-b), 0 for outlines only */
+    int init(SDL_Renderer *renderer, const char *ttf, int n_classes, int alpha);
+    /* textures and fonts go before the renderer does */
+    void uninit();
+
+    /* queues a box, in the coordinates of the current viewport */
+    void add(const detect_result_t *det);
+    /* queues the HUD: a background and one cached line per text, re-rasterized only when it changes */
+    void hud(overlay_text_t *lines, const char *const *texts, int n, int width);
+    /* draws everything queued since the last flush */
+    void flush();
+
+    void report() const;
+
+private:
+    struct label_t
+    {
+        uint64_t key; // 0: empty
+        SDL_Texture *texture;
+        int w, h;
+        uint64_t used;
+    };
+
+    struct blit_t
+    {
+        SDL_Texture *texture;
+        SDL_Rect dst;
+    };
+
+    void quad(int x, int y, int w, int h, SDL_Color c);
+    const label_t *label(const detect_result_t *det);
+    int rasterize(TTF_Font *font, const char *text, SDL_Texture **texture, int *w, int *h);
+
+    SDL_Renderer *renderer_;
+    int ttf_; // our TTF_Init() succeeded: SDL_ttf counts them, one TTF_Quit() each
+    TTF_Font *label_font_;
+    TTF_Font *hud_font_;
+    int alpha_;
+    int n_classes_;
+    SDL_Color colors_[OBJ_CLASS_MAX];
+
+    SDL_Rect rects_[OVERLAY_QUADS];
+    SDL_Color rect_colors_[OVERLAY_QUADS];
+    int n_quads_;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    SDL_Vertex vertices_[OVERLAY_QUADS * 4];
+    int indices_[OVERLAY_QUADS * 6];
+#endif
+    blit_t blits_[OBJ_NUMB_MAX_SIZE + OVERLAY_HUD_LINES];
+    int n_blits_;
+
+    label_t labels_[OVERLAY_LABELS];
+    SDL_Texture *retired_[OBJ_NUMB_MAX_SIZE]; // evicted labels, destroyed once drawn
+    int n_retired_;
+    uint64_t uses_;
+
+    uint64_t frames_;
+    uint64_t draw_calls_;
+    uint64_t label_hits_;
+    uint64_t label_misses_;
+    uint64_t hud_rasterized_;
+};
+
+#endif //_FFRKNN_OVERLAY_H_
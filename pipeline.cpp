@@ -0,0 +1,197 @@
+/*
+ * Per-stage statistics for the read -> decode -> inference -> display
+ * pipeline.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+}
+
+#define FRAME_POOL_HEADER 64 // owner pointer in front of the picture, keeps it aligned
+#define FRAME_POOL_ALIGN  16 // linesize alignment, RGA wants 16 pixel strides
+
+uint64_t stage_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stage_init(stage_stats_t *s, const char *name)
+{
+    memset(s, 0, sizeof(stage_stats_t));
+    s->name = name;
+}
+
+void stage_begin(stage_stats_t *s)
+{
+    s->mark_us = stage_now_us();
+    if (!s->first_us)
+        s->first_us = s->mark_us;
+}
+
+void stage_end(stage_stats_t *s)
+{
+    s->last_us = stage_now_us();
+    s->busy_us += s->last_us - s->mark_us;
+    s->frames++;
+}
+
+void stage_report(const stage_stats_t *s)
+{
+    double wall_ms = (s->last_us - s->first_us) / 1000.0;
+    double busy_ms = s->busy_us / 1000.0;
+
+    if (!s->frames || wall_ms <= 0.0) {
+        fprintf(stderr, "%-10s: no frames\n", s->name);
+        return;
+    }
+    fprintf(stderr, "%-10s: %6llu frames %6.1f fps  avg %6.2f ms  busy %5.1f%%\n", s->name,
+            (unsigned long long)s->frames, s->frames * 1000.0 / wall_ms, busy_ms / s->frames,
+            100.0 * busy_ms / wall_ms);
+}
+
+double stage_fps(const stage_stats_t *s)
+{
+    return s->last_us > s->first_us ? s->frames * 1000000.0 / (s->last_us - s->first_us) : 0.0;
+}
+
+int frame_pool_init(frame_pool_t *p, int capacity)
+{
+    memset(p, 0, sizeof(frame_pool_t));
+    p->format = -1;
+    p->capacity = capacity;
+    return capacity > 0 ? 0 : -1;
+}
+
+/* Last reference to a frame gone: the underlying pool buffer goes back for reuse */
+static void frame_pool_release(void *opaque, uint8_t *data)
+{
+    AVBufferRef *buf = (AVBufferRef *)opaque;
+    frame_pool_t *p = *(frame_pool_t **)buf->data;
+
+    SDL_AtomicAdd(&p->in_use, -1);
+    av_buffer_unref(&buf);
+}
+
+/* Backs frame with a pooled buffer of that layout, -1 when capacity buffers are already out */
+int frame_pool_get(frame_pool_t *p, AVFrame *frame, int format, int width, int height)
+{
+    AVBufferRef *buf;
+    int in_use;
+
+    av_frame_unref(frame);
+    if (!p->pool || format != p->format || width != p->width || height != p->height) {
+        av_buffer_pool_uninit(&p->pool);
+        p->size = av_image_get_buffer_size((enum AVPixelFormat)format, width, height, FRAME_POOL_ALIGN);
+        if (p->size <= 0)
+            return -1;
+        p->pool = av_buffer_pool_init(FRAME_POOL_HEADER + p->size, NULL);
+        if (!p->pool)
+            return -1;
+        p->format = format;
+        p->width = width;
+        p->height = height;
+    }
+
+    p->requests++;
+    if (SDL_AtomicGet(&p->in_use) >= p->capacity) {
+        p->exhausted++;
+        return -1;
+    }
+    if (!(buf = av_buffer_pool_get(p->pool)))
+        return -1;
+    *(frame_pool_t **)buf->data = p;
+    frame->buf[0] = av_buffer_create(buf->data + FRAME_POOL_HEADER, p->size, frame_pool_release, buf, 0);
+    if (!frame->buf[0]) {
+        av_buffer_unref(&buf);
+        return -1;
+    }
+    in_use = SDL_AtomicAdd(&p->in_use, 1) + 1;
+    if (in_use > p->high_water)
+        p->high_water = in_use;
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, (enum AVPixelFormat)format, width,
+                         height, FRAME_POOL_ALIGN);
+    return 0;
+}
+
+/* Buffers still referenced stay valid, the pool goes away with the last of them */
+void frame_pool_uninit(frame_pool_t *p)
+{
+    av_buffer_pool_uninit(&p->pool);
+}
+
+void frame_pool_report(const frame_pool_t *p)
+{
+    fprintf(stderr, "%-10s: %d of %d buffers at most in use, %llu of %llu requests found the pool exhausted\n",
+            "frames", p->high_water, p->capacity, (unsigned long long)p->exhausted,
+            (unsigned long long)p->requests);
+}
+
+void path_init(path_stats_t *s, const char *name)
+{
+    memset(s, 0, sizeof(path_stats_t));
+    s->name = name;
+}
+
+void path_account(path_stats_t *s, frame_path_t path, uint64_t cpu_bytes)
+{
+    s->frames[path]++;
+    s->cpu_bytes[path] += cpu_bytes;
+}
+
+void path_report(const path_stats_t *s)
+{
+    static const char *path_names[FRAME_PATHS] = {"dma-buf", "cpu"};
+
+    for (int p = 0; p < FRAME_PATHS; p++) {
+        if (!s->frames[p])
+            continue;
+        fprintf(stderr, "%-10s: %6llu frames via %-7s  %9.0f bytes/frame copied by the CPU\n", s->name,
+                (unsigned long long)s->frames[p], path_names[p], (double)s->cpu_bytes[p] / s->frames[p]);
+    }
+}
+
+uint64_t process_rss_kb(int peak)
+{
+    const char *key = peak ? "VmHWM:" : "VmRSS:";
+    unsigned long long kb = 0;
+    char line[128];
+    FILE *fp;
+
+    if (!(fp = fopen("/proc/self/status", "r")))
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, key, strlen(key))) {
+            sscanf(line + strlen(key), "%llu", &kb);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
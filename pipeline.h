@@ -0,0 +1,100 @@
+#ifndef _FFRKNN_PIPELINE_H_
+#define _FFRKNN_PIPELINE_H_
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+
+#include <postprocess.h>
+#include <spsc_ring.h>
+
+struct AVBufferPool;
+struct AVFrame;
+struct AVPacket;
+
+#define PIPELINE_SLOTS 8 // frame slots shared by decode, inference and display
+#define PIPELINE_DEPTH 2 // frames queued between two stages
+#define PIPELINE_PKTS  8 // demuxed packets queued ahead of the decoder
+#define PIPELINE_FRAMES (PIPELINE_SLOTS + PIPELINE_DEPTH) // pooled frame buffers, a few for consumers keeping refs
+
+/* One frame travelling through decode -> inference -> display */
+typedef struct _frame_slot_t
+{
+    int64_t seq;
+    int64_t pts;
+    struct AVFrame *yuv;  // decoder output converted for the display (convert.h), when src is empty; pooled
+    struct AVFrame *src;  // decoder frame shown as-is: DRM_PRIME dma-buf or a passthrough reference
+    void *resize_buf;     // model input (width x height x channel)
+    letterbox_t letterbox; // where the picture is in resize_buf, the bars around it already painted
+    xform_t to_source;     // model input -> pixels of the frame shown, where detect lives
+    detect_result_group_t detect;
+} frame_slot_t;
+
+typedef SpscRing<struct AVPacket *> packet_ring_t;
+typedef SpscRing<frame_slot_t *> slot_ring_t;
+
+/* Per-stage throughput counters, only touched by the owning thread */
+typedef struct _stage_stats_t
+{
+    const char *name;
+    uint64_t frames;
+    uint64_t busy_us;
+    uint64_t first_us;
+    uint64_t last_us;
+    uint64_t mark_us;
+} stage_stats_t;
+
+/*
+ * Refcounted frame buffers of one layout (AVBufferPool). Every reference
+ * handed out is counted: a buffer goes back to the pool when the last
+ * stage holding it unrefs its frame, so a producer never writes into a
+ * picture still being shown. A layout change starts a new pool, the old
+ * one lives on until its buffers come back.
+ */
+typedef struct _frame_pool_t
+{
+    struct AVBufferPool *pool;
+    int format;
+    int width;
+    int height;
+    int size;
+    int capacity;      // buffers out at the same time
+    SDL_atomic_t in_use;
+    int high_water;    // owned by the producer, like the counters below
+    uint64_t requests;
+    uint64_t exhausted;
+} frame_pool_t;
+
+/* How frames got from the decoder into the model input and the display texture */
+typedef enum _frame_path_t
+{
+    FRAME_PATH_DMABUF = 0, // RGA reads the decoder's dma-buf, the CPU never touches the pixels
+    FRAME_PATH_CPU,        // hw download and/or sws_scale, RGA from virtual addresses
+    FRAME_PATHS,
+} frame_path_t;
+
+/* Frames and bytes written by the CPU per path, only touched by the owning thread */
+typedef struct _path_stats_t
+{
+    const char *name;
+    uint64_t frames[FRAME_PATHS];
+    uint64_t cpu_bytes[FRAME_PATHS];
+} path_stats_t;
+
+uint64_t stage_now_us(void);
+void stage_init(stage_stats_t *s, const char *name);
+void stage_begin(stage_stats_t *s);
+void stage_end(stage_stats_t *s);
+void stage_report(const stage_stats_t *s);
+/* frames per second between the first and the last frame */
+double stage_fps(const stage_stats_t *s);
+int frame_pool_init(frame_pool_t *p, int capacity);
+int frame_pool_get(frame_pool_t *p, struct AVFrame *frame, int format, int width, int height);
+void frame_pool_uninit(frame_pool_t *p);
+void frame_pool_report(const frame_pool_t *p);
+void path_init(path_stats_t *s, const char *name);
+void path_account(path_stats_t *s, frame_path_t path, uint64_t cpu_bytes);
+void path_report(const path_stats_t *s);
+/* resident set of the process (peak: high water mark) from /proc, 0 if unknown */
+uint64_t process_rss_kb(int peak);
+
+#endif //_FFRKNN_PIPELINE_H_
@@ -21,15 +21,34 @@
 #include <string.h>
 #include <sys/time.h>
 
-#include <set>
 #include <vector>
+
+/* -DFFRKNN_NO_SIMD leaves the plain C loops alone, tests/ hold them against the vector ones */
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+#include <arm_neon.h>
+#elif defined(__AVX2__) && !defined(FFRKNN_NO_SIMD)
+#include <immintrin.h>
+#elif defined(__SSE2__) && !defined(FFRKNN_NO_SIMD)
+#include <emmintrin.h>
+#endif
+
 #define LABEL_NALE_TXT_PATH "/usr/share/model/coco_80_labels_list.txt"
 
-static char* labels[OBJ_CLASS_NUM];
+static char* labels[OBJ_CLASS_MAX];
+
+/* one bit per class kept, set by setClassFilter() */
+static uint64_t class_allow[OBJ_CLASS_MAX / 64] = {~0ull, ~0ull, ~0ull, ~0ull};
+static float    class_min_score[OBJ_CLASS_MAX];
+static_assert(OBJ_CLASS_MAX == 256, "class_allow initializer");
+
+static nms_method_t nms_method = NMS_HARD;
+static float        nms_sigma  = 0.5;
+static int          nms_top_k  = NMS_TOP_K;
 
-const int anchor0[6] = {10, 13, 16, 30, 33, 23};
-const int anchor1[6] = {30, 61, 62, 45, 59, 119};
-const int anchor2[6] = {116, 90, 156, 198, 373, 326};
+static const int yolov5_anchors[HEAD_LEVELS * 6] = {10, 13, 16,  30,  33,  23,  30,  61,  62,
+                                                    45, 59, 119, 116, 90, 156, 198, 373, 326};
+static const int yolov7_anchors[HEAD_LEVELS * 6] = {12, 16, 19,  36,  40,  28,  36,  75,  76,
+                                                    55, 72, 146, 142, 110, 192, 243, 459, 401};
 
 inline static int clamp(float val, int min, int max) { return val > min ? (val < max ? val : max) : min; }
 
@@ -88,225 +107,724 @@ int readLines(const char* fileName, char* lines[], int max_line)
   return i;
 }
 
-int loadLabelName(const char* locationFilename, char* label[])
+int loadLabelName(const char* locationFilename, char* label[], int n_labels)
 {
   fprintf(stderr,"loadLabelName %s\n", locationFilename);
-  readLines(locationFilename, label, OBJ_CLASS_NUM);
+  readLines(locationFilename, label, n_labels);
   return 0;
 }
 
-static float CalculateOverlap(float xmin0, float ymin0, float xmax0, float ymax0, float xmin1, float ymin1, float xmax1,
-                              float ymax1)
+static float sigmoid(float x) { return 1.0 / (1.0 + expf(-x)); }
+
+static float unsigmoid(float y) { return -1.0 * logf((1.0 / y) - 1.0); }
+
+inline static int32_t __clip(float val, float min, float max)
+{
+  float f = val <= min ? min : (val >= max ? max : val);
+  return f;
+}
+
+static int8_t qnt_f32_to_affine(float f32, int32_t zp, float scale)
+{
+  float  dst_val = (f32 / scale) + zp;
+  int8_t res     = (int8_t)__clip(dst_val, -128, 127);
+  return res;
+}
+
+static float deqnt_affine_to_f32(int8_t qnt, int32_t zp, float scale) { return ((float)qnt - (float)zp) * scale; }
+
+static inline int class_kept(int id, float score)
+{
+  return (class_allow[id >> 6] >> (id & 63) & 1) && score >= class_min_score[id];
+}
+
+/* same expressions as the per-candidate decode used, so results do not change */
+static void build_qnt_lut(qnt_lut_t* lut, int32_t zp, float scale)
+{
+  lut->zp    = zp;
+  lut->scale = scale;
+  for (int q = -128; q <= 127; q++) {
+    float sig            = sigmoid(deqnt_affine_to_f32(q, zp, scale));
+    float wh             = sig * 2.0;
+    lut->sig[(uint8_t)q] = sig;
+    lut->xy[(uint8_t)q]  = sig * 2.0 - 0.5;
+    lut->wh[(uint8_t)q]  = wh * wh;
+  }
+  for (int d = 0; d < 256; d++) {
+    lut->dfl[d] = expf(-d * scale);
+  }
+}
+
+/*
+ * Vectorized candidate scan. The objectness and class planes of one anchor
+ * are contiguous over the grid cells, so DECODE_BLOCK cells are thresholded
+ * at once and, only for blocks holding a candidate, the class argmax runs
+ * over the whole block plane by plane (one contiguous load per class instead
+ * of one strided byte per class and candidate). Ties keep the lowest class
+ * id, exactly like the scalar loop.
+ */
+#define DECODE_BLOCK 32
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+static inline uint32_t neon_movemask(uint8x16_t m)
+{
+  static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t           b        = vandq_u8(m, vld1q_u8(bits));
+  return vaddv_u8(vget_low_u8(b)) | ((uint32_t)vaddv_u8(vget_high_u8(b)) << 8);
+}
+#endif
+
+/* bit n set when conf[n] >= thres */
+static inline uint32_t candidate_mask(const int8_t* conf, int8_t thres)
+{
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+  int8x16_t  t  = vdupq_n_s8(thres);
+  uint8x16_t m0 = vcgeq_s8(vld1q_s8(conf), t);
+  uint8x16_t m1 = vcgeq_s8(vld1q_s8(conf + 16), t);
+  if (vmaxvq_u8(vorrq_u8(m0, m1)) == 0) {
+    return 0;
+  }
+  return neon_movemask(m0) | (neon_movemask(m1) << 16);
+#elif defined(__AVX2__) && !defined(FFRKNN_NO_SIMD)
+  __m256i gt = _mm256_cmpgt_epi8(_mm256_set1_epi8(thres), _mm256_loadu_si256((const __m256i*)conf));
+  return ~(uint32_t)_mm256_movemask_epi8(gt);
+#elif defined(__SSE2__) && !defined(FFRKNN_NO_SIMD)
+  __m128i  t  = _mm_set1_epi8(thres);
+  uint32_t lo = _mm_movemask_epi8(_mm_cmpgt_epi8(t, _mm_loadu_si128((const __m128i*)conf)));
+  uint32_t hi = _mm_movemask_epi8(_mm_cmpgt_epi8(t, _mm_loadu_si128((const __m128i*)(conf + 16))));
+  return ~(lo | (hi << 16));
+#else
+  uint32_t mask = 0;
+  for (int n = 0; n < DECODE_BLOCK; n++) {
+    if (conf[n] >= thres) {
+      mask |= 1u << n;
+    }
+  }
+  return mask;
+#endif
+}
+
+/*
+ * Per cell max class score and its id, planes are grid_len apart. The
+ * vector paths do the whole block, the scalar one only the cells in mask.
+ */
+template <int NC>
+static inline void class_argmax(const int8_t* cls, int grid_len, int n_classes, uint32_t mask, int8_t* max_prob,
+                                uint8_t* max_id)
 {
-  float w = fmax(0.f, fmin(xmax0, xmax1) - fmax(xmin0, xmin1) + 1.0);
-  float h = fmax(0.f, fmin(ymax0, ymax1) - fmax(ymin0, ymin1) + 1.0);
-  float i = w * h;
-  float u = (xmax0 - xmin0 + 1.0) * (ymax0 - ymin0 + 1.0) + (xmax1 - xmin1 + 1.0) * (ymax1 - ymin1 + 1.0) - i;
-  return u <= 0.f ? 0.f : (i / u);
+  const int nc = NC ? NC : n_classes;
+  (void)mask; // the vector paths do every cell
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+  int8x16_t  max0 = vld1q_s8(cls);
+  int8x16_t  max1 = vld1q_s8(cls + 16);
+  uint8x16_t id0  = vdupq_n_u8(0);
+  uint8x16_t id1  = vdupq_n_u8(0);
+  for (int k = 1; k < nc; ++k) {
+    const int8_t* p  = cls + k * grid_len;
+    int8x16_t     v0 = vld1q_s8(p);
+    int8x16_t     v1 = vld1q_s8(p + 16);
+    uint8x16_t    k8 = vdupq_n_u8(k);
+    id0              = vbslq_u8(vcgtq_s8(v0, max0), k8, id0);
+    id1              = vbslq_u8(vcgtq_s8(v1, max1), k8, id1);
+    max0             = vmaxq_s8(v0, max0);
+    max1             = vmaxq_s8(v1, max1);
+  }
+  vst1q_s8(max_prob, max0);
+  vst1q_s8(max_prob + 16, max1);
+  vst1q_u8(max_id, id0);
+  vst1q_u8(max_id + 16, id1);
+#elif defined(__AVX2__) && !defined(FFRKNN_NO_SIMD)
+  __m256i max = _mm256_loadu_si256((const __m256i*)cls);
+  __m256i id  = _mm256_setzero_si256();
+  for (int k = 1; k < nc; ++k) {
+    __m256i v  = _mm256_loadu_si256((const __m256i*)(cls + k * grid_len));
+    __m256i gt = _mm256_cmpgt_epi8(v, max);
+    id         = _mm256_blendv_epi8(id, _mm256_set1_epi8(k), gt);
+    max        = _mm256_max_epi8(v, max);
+  }
+  _mm256_storeu_si256((__m256i*)max_prob, max);
+  _mm256_storeu_si256((__m256i*)max_id, id);
+#elif defined(__SSE2__) && !defined(FFRKNN_NO_SIMD)
+  __m128i max0 = _mm_loadu_si128((const __m128i*)cls);
+  __m128i max1 = _mm_loadu_si128((const __m128i*)(cls + 16));
+  __m128i id0  = _mm_setzero_si128();
+  __m128i id1  = _mm_setzero_si128();
+  for (int k = 1; k < nc; ++k) {
+    const int8_t* p   = cls + k * grid_len;
+    __m128i       v0  = _mm_loadu_si128((const __m128i*)p);
+    __m128i       v1  = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i       k8  = _mm_set1_epi8(k);
+    __m128i       gt0 = _mm_cmpgt_epi8(v0, max0);
+    __m128i       gt1 = _mm_cmpgt_epi8(v1, max1);
+    /* SSE2 has no signed byte max/blend: select with and/andnot */
+    max0 = _mm_or_si128(_mm_and_si128(gt0, v0), _mm_andnot_si128(gt0, max0));
+    max1 = _mm_or_si128(_mm_and_si128(gt1, v1), _mm_andnot_si128(gt1, max1));
+    id0  = _mm_or_si128(_mm_and_si128(gt0, k8), _mm_andnot_si128(gt0, id0));
+    id1  = _mm_or_si128(_mm_and_si128(gt1, k8), _mm_andnot_si128(gt1, id1));
+  }
+  _mm_storeu_si128((__m128i*)max_prob, max0);
+  _mm_storeu_si128((__m128i*)(max_prob + 16), max1);
+  _mm_storeu_si128((__m128i*)max_id, id0);
+  _mm_storeu_si128((__m128i*)(max_id + 16), id1);
+#else
+  while (mask) {
+    int n = __builtin_ctz(mask);
+    mask &= mask - 1;
+    max_prob[n] = cls[n];
+    max_id[n]   = 0;
+    for (int k = 1; k < nc; ++k) {
+      int8_t prob = cls[k * grid_len + n];
+      if (prob > max_prob[n]) {
+        max_prob[n] = prob;
+        max_id[n]   = k;
+      }
+    }
+  }
+#endif
 }
 
-static int nms(int validCount, std::vector<float>& outputLocations, std::vector<int> classIds, std::vector<int>& order,
-               int filterId, float threshold)
+/* scalar argmax of the cells of a partial block whose gate value passes thres */
+static inline uint32_t tail_argmax(const int8_t* gate, const int8_t* cls, int grid_len, int n_cells, int n_classes,
+                                   int8_t thres, int8_t* max_prob, uint8_t* max_id)
 {
-  for (int i = 0; i < validCount; ++i) {
-    if (order[i] == -1 || classIds[i] != filterId) {
+  uint32_t mask = 0;
+  for (int n = 0; n < n_cells; n++) {
+    if (gate && gate[n] < thres) {
       continue;
     }
-    int n = order[i];
-    for (int j = i + 1; j < validCount; ++j) {
-      int m = order[j];
-      if (m == -1 || classIds[i] != filterId) {
-        continue;
+    mask |= 1u << n;
+    max_prob[n] = cls[n];
+    max_id[n]   = 0;
+    for (int k = 1; k < n_classes; ++k) {
+      int8_t prob = cls[k * grid_len + n];
+      if (prob > max_prob[n]) {
+        max_id[n]   = k;
+        max_prob[n] = prob;
       }
-      float xmin0 = outputLocations[n * 4 + 0];
-      float ymin0 = outputLocations[n * 4 + 1];
-      float xmax0 = outputLocations[n * 4 + 0] + outputLocations[n * 4 + 2];
-      float ymax0 = outputLocations[n * 4 + 1] + outputLocations[n * 4 + 3];
+    }
+  }
+  return mask;
+}
+
+/*
+ * YOLOv5 / YOLOv7: per level one tensor of 3 anchors x (x, y, w, h, obj,
+ * classes) planes, all logits. NC is the class count the kernel is
+ * specialized for, 0 takes it from the layout.
+ */
+template <int NC>
+static int decode_yolov5(PostProcessWorkspace* ws, int level, int8_t** outputs, float threshold)
+{
+  const head_layout_t* layout = &ws->layout;
+  const int            nc     = NC ? NC : layout->n_classes;
+  const int            prop   = 5 + nc;
+  int                  t      = layout->tensor[level][0];
+  int8_t*              input  = outputs[t];
+  const qnt_lut_t*     lut    = &ws->luts[t];
+  const int*           anchor = layout->anchors[level];
+  int                  grid_w = layout->grid_w[level];
+  int                  stride = layout->stride[level];
+
+  int     validCount = 0;
+  int     grid_len   = layout->grid_h[level] * grid_w;
+  float   thres      = unsigmoid(threshold);
+  int8_t  thres_i8   = qnt_f32_to_affine(thres, lut->zp, lut->scale);
+  int8_t  blk_prob[DECODE_BLOCK];
+  uint8_t blk_id[DECODE_BLOCK];
 
-      float xmin1 = outputLocations[m * 4 + 0];
-      float ymin1 = outputLocations[m * 4 + 1];
-      float xmax1 = outputLocations[m * 4 + 0] + outputLocations[m * 4 + 2];
-      float ymax1 = outputLocations[m * 4 + 1] + outputLocations[m * 4 + 3];
+  for (int a = 0; a < 3; a++) {
+    const int8_t* conf_plane = input + (prop * a + 4) * grid_len;
+    const int8_t* cls_plane  = input + (prop * a + 5) * grid_len;
+
+    for (int base = 0; base < grid_len; base += DECODE_BLOCK) {
+      uint32_t mask;
+      if (base + DECODE_BLOCK <= grid_len) {
+        mask = candidate_mask(conf_plane + base, thres_i8);
+        if (!mask) {
+          continue;
+        }
+        class_argmax<NC>(cls_plane + base, grid_len, nc, mask, blk_prob, blk_id);
+      } else {
+        /* partial block at the end of the plane */
+        mask = tail_argmax(conf_plane + base, cls_plane + base, grid_len, grid_len - base, nc, thres_i8, blk_prob,
+                           blk_id);
+      }
 
-      float iou = CalculateOverlap(xmin0, ymin0, xmax0, ymax0, xmin1, ymin1, xmax1, ymax1);
+      while (mask) {
+        int     n              = __builtin_ctz(mask);
+        int     cell           = base + n;
+        int     i              = cell / grid_w;
+        int     j              = cell % grid_w;
+        int8_t  box_confidence = conf_plane[cell];
+        int8_t  maxClassProbs  = blk_prob[n];
+        mask &= mask - 1;
+
+        if (maxClassProbs > thres_i8) {
+          float score = lut->sig[(uint8_t)maxClassProbs] * lut->sig[(uint8_t)box_confidence];
+          if (!class_kept(blk_id[n], score)) {
+            continue;
+          }
+          uint8_t* in_ptr = (uint8_t*)input + (prop * a) * grid_len + cell;
+          float    box_x  = lut->xy[*in_ptr];
+          float    box_y  = lut->xy[in_ptr[grid_len]];
+          float    box_w  = lut->wh[in_ptr[2 * grid_len]];
+          float    box_h  = lut->wh[in_ptr[3 * grid_len]];
+          box_x           = (box_x + j) * (float)stride;
+          box_y           = (box_y + i) * (float)stride;
+          box_w           = box_w * (float)anchor[a * 2];
+          box_h           = box_h * (float)anchor[a * 2 + 1];
+          box_x -= (box_w / 2.0);
+          box_y -= (box_h / 2.0);
 
-      if (iou > threshold) {
-        order[j] = -1;
+          ws->objProbs.push_back(score);
+          ws->classId.push_back(blk_id[n]);
+          validCount++;
+          ws->filterBoxes.push_back(box_x);
+          ws->filterBoxes.push_back(box_y);
+          ws->filterBoxes.push_back(box_w);
+          ws->filterBoxes.push_back(box_h);
+        }
       }
     }
   }
-  return 0;
+  return validCount;
+}
+
+/* expected distance of one box side: softmax over the DFL bins, planes grid_len apart */
+static inline float dfl_side(const int8_t* bins, int grid_len, int dfl_len, const qnt_lut_t* lut)
+{
+  int8_t qmax = bins[0];
+  for (int k = 1; k < dfl_len; k++) {
+    qmax = bins[k * grid_len] > qmax ? bins[k * grid_len] : qmax;
+  }
+  float sum = 0, acc = 0;
+  for (int k = 0; k < dfl_len; k++) {
+    float e = lut->dfl[qmax - bins[k * grid_len]];
+    sum += e;
+    acc += e * k;
+  }
+  return acc / sum;
 }
 
-static int quick_sort_indice_inverse(std::vector<float>& input, int left, int right, std::vector<int>& indices)
+/*
+ * YOLOv8 (anchor-free, RKNN export): per level a DFL box tensor of
+ * 4 x dfl_len planes, a class tensor with already activated scores and
+ * optionally their clipped sum, used to skip cells cheaply.
+ */
+template <int NC>
+static int decode_yolov8(PostProcessWorkspace* ws, int level, int8_t** outputs, float threshold)
 {
-  float key;
-  int   key_index;
-  int   low  = left;
-  int   high = right;
-  if (left < right) {
-    key_index = indices[left];
-    key       = input[left];
-    while (low < high) {
-      while (low < high && input[high] <= key) {
-        high--;
+  const head_layout_t* layout    = &ws->layout;
+  const int            nc        = NC ? NC : layout->n_classes;
+  const int*           tensor    = layout->tensor[level];
+  const int8_t*        box_plane = outputs[tensor[0]];
+  const int8_t*        cls_plane = outputs[tensor[1]];
+  const int8_t*        sum_plane = tensor[2] >= 0 ? outputs[tensor[2]] : NULL;
+  const qnt_lut_t*     box_lut   = &ws->luts[tensor[0]];
+  const qnt_lut_t*     cls_lut   = &ws->luts[tensor[1]];
+  int                  grid_w    = layout->grid_w[level];
+  int                  grid_len  = layout->grid_h[level] * grid_w;
+  float                stride    = layout->stride[level];
+  int                  dfl_len   = layout->dfl_len;
+
+  int     validCount = 0;
+  int8_t  cls_thres  = qnt_f32_to_affine(threshold, cls_lut->zp, cls_lut->scale);
+  int8_t  sum_thres  = 0;
+  int8_t  blk_prob[DECODE_BLOCK];
+  uint8_t blk_id[DECODE_BLOCK];
+
+  if (sum_plane) {
+    const qnt_lut_t* sum_lut = &ws->luts[tensor[2]];
+    sum_thres                = qnt_f32_to_affine(threshold, sum_lut->zp, sum_lut->scale);
+  }
+
+  for (int base = 0; base < grid_len; base += DECODE_BLOCK) {
+    uint32_t mask;
+    if (base + DECODE_BLOCK <= grid_len) {
+      mask = sum_plane ? candidate_mask(sum_plane + base, sum_thres) : ~0u;
+      if (!mask) {
+        continue;
       }
-      input[low]   = input[high];
-      indices[low] = indices[high];
-      while (low < high && input[low] >= key) {
-        low++;
+      class_argmax<NC>(cls_plane + base, grid_len, nc, mask, blk_prob, blk_id);
+      if (!sum_plane) {
+        mask = candidate_mask(blk_prob, cls_thres);
+      }
+    } else {
+      mask = tail_argmax(sum_plane ? sum_plane + base : NULL, cls_plane + base, grid_len, grid_len - base, nc,
+                         sum_thres, blk_prob, blk_id);
+    }
+
+    while (mask) {
+      int n    = __builtin_ctz(mask);
+      int cell = base + n;
+      mask &= mask - 1;
+
+      if (blk_prob[n] > cls_thres) {
+        float score = deqnt_affine_to_f32(blk_prob[n], cls_lut->zp, cls_lut->scale);
+        if (!class_kept(blk_id[n], score)) {
+          continue;
+        }
+        const int8_t* bins = box_plane + cell;
+        float         cx   = cell % grid_w + 0.5f;
+        float         cy   = cell / grid_w + 0.5f;
+        float         x1   = (cx - dfl_side(bins, grid_len, dfl_len, box_lut)) * stride;
+        float         y1   = (cy - dfl_side(bins + dfl_len * grid_len, grid_len, dfl_len, box_lut)) * stride;
+        float         x2   = (cx + dfl_side(bins + 2 * dfl_len * grid_len, grid_len, dfl_len, box_lut)) * stride;
+        float         y2   = (cy + dfl_side(bins + 3 * dfl_len * grid_len, grid_len, dfl_len, box_lut)) * stride;
+
+        ws->objProbs.push_back(score);
+        ws->classId.push_back(blk_id[n]);
+        validCount++;
+        ws->filterBoxes.push_back(x1);
+        ws->filterBoxes.push_back(y1);
+        ws->filterBoxes.push_back(x2 - x1);
+        ws->filterBoxes.push_back(y2 - y1);
       }
-      input[high]   = input[low];
-      indices[high] = indices[low];
     }
-    input[low]   = key;
-    indices[low] = key_index;
-    quick_sort_indice_inverse(input, left, low - 1, indices);
-    quick_sort_indice_inverse(input, low + 1, right, indices);
   }
-  return low;
+  return validCount;
 }
 
-static float sigmoid(float x) { return 1.0 / (1.0 + expf(-x)); }
+/*
+ * Class counts with their own kernel, so the argmax loops have constant
+ * trip counts; anything else runs the generic <0> instance.
+ */
+#define HEAD_KERNELS(decode)                                                                                          \
+  {                                                                                                                   \
+    {1, decode<1>}, {2, decode<2>}, {3, decode<3>}, {4, decode<4>}, {5, decode<5>}, {6, decode<6>}, {7, decode<7>},   \
+      {8, decode<8>}, {9, decode<9>}, {10, decode<10>}, {11, decode<11>}, {12, decode<12>}, {13, decode<13>},        \
+      {14, decode<14>}, {15, decode<15>}, {16, decode<16>}, {17, decode<17>}, {18, decode<18>}, {19, decode<19>},    \
+      {20, decode<20>}, {80, decode<80>}, {0, decode<0>},                                                             \
+  }
 
-static float unsigmoid(float y) { return -1.0 * logf((1.0 / y) - 1.0); }
+typedef struct _head_kernel_t
+{
+  int             n_classes;
+  decode_level_fn decode;
+} head_kernel_t;
 
-inline static int32_t __clip(float val, float min, float max)
+static const head_kernel_t yolov5_kernels[] = HEAD_KERNELS(decode_yolov5);
+static const head_kernel_t yolov8_kernels[] = HEAD_KERNELS(decode_yolov8);
+
+static decode_level_fn pick_kernel(const head_kernel_t* kernels, int n_classes)
 {
-  float f = val <= min ? min : (val >= max ? max : val);
-  return f;
+  while (kernels->n_classes && kernels->n_classes != n_classes) {
+    kernels++;
+  }
+  return kernels->decode;
 }
 
-static int8_t qnt_f32_to_affine(float f32, int32_t zp, float scale)
+static decode_level_fn yolov5_kernel(int n_classes) { return pick_kernel(yolov5_kernels, n_classes); }
+
+static decode_level_fn yolov8_kernel(int n_classes) { return pick_kernel(yolov8_kernels, n_classes); }
+
+/* 4-d NCHW output, channels and grid */
+static int nchw_dims(const infer_tensor_attr_t* attr, int* c, int* h, int* w)
 {
-  float  dst_val = (f32 / scale) + zp;
-  int8_t res     = (int8_t)__clip(dst_val, -128, 127);
-  return res;
+  if (attr->n_dims != 4 || !attr->nchw) {
+    return -1;
+  }
+  *c = attr->dims[1];
+  *h = attr->dims[2];
+  *w = attr->dims[3];
+  return 0;
 }
 
-static float deqnt_affine_to_f32(int8_t qnt, int32_t zp, float scale) { return ((float)qnt - (float)zp) * scale; }
+/* one tensor per level, 3 x (5 + classes) channels */
+static int probe_yolov5(int n_outputs, const infer_tensor_attr_t* attrs, head_layout_t* layout)
+{
+  int c, h, w;
+
+  if (n_outputs != HEAD_LEVELS) {
+    return -1;
+  }
+  for (int l = 0; l < HEAD_LEVELS; l++) {
+    if (nchw_dims(&attrs[l], &c, &h, &w) < 0 || c % 3 || c / 3 <= 5) {
+      return -1;
+    }
+    if (l && c / 3 - 5 != layout->n_classes) {
+      return -1;
+    }
+    layout->n_classes    = c / 3 - 5;
+    layout->grid_h[l]    = h;
+    layout->grid_w[l]    = w;
+    layout->tensor[l][0] = l;
+    layout->tensor[l][1] = -1;
+    layout->tensor[l][2] = -1;
+  }
+  return 0;
+}
 
-static int process(int8_t* input, int* anchor, int grid_h, int grid_w, int height, int width, int stride,
-                   std::vector<float>& boxes, std::vector<float>& objProbs, std::vector<int>& classId, float threshold,
-                   int32_t zp, float scale)
+/* box (4 x dfl_len channels), classes and optionally score sum (1 channel) per level */
+static int probe_yolov8(int n_outputs, const infer_tensor_attr_t* attrs, head_layout_t* layout)
 {
-  int    validCount = 0;
-  int    grid_len   = grid_h * grid_w;
-  float  thres      = unsigmoid(threshold);
-  int8_t thres_i8   = qnt_f32_to_affine(thres, zp, scale);
-  for (int a = 0; a < 3; a++) {
-    for (int i = 0; i < grid_h; i++) {
-      for (int j = 0; j < grid_w; j++) {
-        int8_t box_confidence = input[(PROP_BOX_SIZE * a + 4) * grid_len + i * grid_w + j];
-        if (box_confidence >= thres_i8) {
-          int     offset = (PROP_BOX_SIZE * a) * grid_len + i * grid_w + j;
-          int8_t* in_ptr = input + offset;
-          float   box_x  = sigmoid(deqnt_affine_to_f32(*in_ptr, zp, scale)) * 2.0 - 0.5;
-          float   box_y  = sigmoid(deqnt_affine_to_f32(in_ptr[grid_len], zp, scale)) * 2.0 - 0.5;
-          float   box_w  = sigmoid(deqnt_affine_to_f32(in_ptr[2 * grid_len], zp, scale)) * 2.0;
-          float   box_h  = sigmoid(deqnt_affine_to_f32(in_ptr[3 * grid_len], zp, scale)) * 2.0;
-          box_x          = (box_x + j) * (float)stride;
-          box_y          = (box_y + i) * (float)stride;
-          box_w          = box_w * box_w * (float)anchor[a * 2];
-          box_h          = box_h * box_h * (float)anchor[a * 2 + 1];
-          box_x -= (box_w / 2.0);
-          box_y -= (box_h / 2.0);
+  int per_level = n_outputs / HEAD_LEVELS;
+  int c, h, w, cc, ch, cw;
 
-          int8_t maxClassProbs = in_ptr[5 * grid_len];
-          int    maxClassId    = 0;
-          for (int k = 1; k < OBJ_CLASS_NUM; ++k) {
-            int8_t prob = in_ptr[(5 + k) * grid_len];
-            if (prob > maxClassProbs) {
-              maxClassId    = k;
-              maxClassProbs = prob;
-            }
-          }
-          if (maxClassProbs>thres_i8){
-            objProbs.push_back(sigmoid(deqnt_affine_to_f32(maxClassProbs, zp, scale))* sigmoid(deqnt_affine_to_f32(box_confidence, zp, scale)));
-            classId.push_back(maxClassId);
-            validCount++;
-            boxes.push_back(box_x);
-            boxes.push_back(box_y);
-            boxes.push_back(box_w);
-            boxes.push_back(box_h);
-          }
+  if (n_outputs % HEAD_LEVELS || per_level < 2 || per_level > 3) {
+    return -1;
+  }
+  for (int l = 0; l < HEAD_LEVELS; l++) {
+    const infer_tensor_attr_t* a = &attrs[l * per_level];
+    if (nchw_dims(&a[0], &c, &h, &w) < 0 || c % 4 || c / 4 < 2 || nchw_dims(&a[1], &cc, &ch, &cw) < 0 ||
+        ch != h || cw != w) {
+      return -1;
+    }
+    if (l && (cc != layout->n_classes || c / 4 != layout->dfl_len)) {
+      return -1;
+    }
+    layout->tensor[l][2] = -1;
+    if (per_level == 3) {
+      if (nchw_dims(&a[2], &c, &ch, &cw) < 0 || c != 1 || ch != h || cw != w) {
+        return -1;
+      }
+      layout->tensor[l][2] = l * per_level + 2;
+    }
+    layout->dfl_len      = attrs[l * per_level].dims[1] / 4;
+    layout->n_classes    = cc;
+    layout->grid_h[l]    = h;
+    layout->grid_w[l]    = w;
+    layout->tensor[l][0] = l * per_level;
+    layout->tensor[l][1] = l * per_level + 1;
+  }
+  return 0;
+}
+
+static const decode_head_t head_yolov5 = {"yolov5", probe_yolov5, yolov5_kernel, yolov5_anchors};
+static const decode_head_t head_yolov7 = {"yolov7", probe_yolov5, yolov5_kernel, yolov7_anchors};
+static const decode_head_t head_yolov8 = {"yolov8", probe_yolov8, yolov8_kernel, NULL};
+
+/* probed in order: YOLOv7 has the YOLOv5 layout, so it is only picked by name */
+static const decode_head_t* const decode_heads[] = {&head_yolov5, &head_yolov7, &head_yolov8, NULL};
+
+static char* trim(char* str)
+{
+  char* end;
+  while (*str == ' ' || *str == '\t') {
+    str++;
+  }
+  end = str + strlen(str);
+  while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) {
+    *--end = '\0';
+  }
+  return str;
+}
+
+int load_head_config(const char* path, head_config_t* cfg)
+{
+  char  line[512];
+  int   lineno = 0;
+  FILE* fp;
+
+  memset(cfg, 0, sizeof(head_config_t));
+  fp = fopen(path, "r");
+  if (!fp) {
+    return 1;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    char* hash = strchr(line, '#');
+    char* eq;
+    char* key;
+    char* value;
+
+    lineno++;
+    if (hash) {
+      *hash = '\0';
+    }
+    eq = strchr(line, '=');
+    if (!eq) {
+      if (*trim(line)) {
+        goto fail;
+      }
+      continue;
+    }
+    *eq   = '\0';
+    key   = trim(line);
+    value = trim(eq + 1);
+    if (!strcmp(key, "head")) {
+      snprintf(cfg->head, sizeof(cfg->head), "%s", value);
+    } else if (!strcmp(key, "classes")) {
+      cfg->n_classes = atoi(value);
+      if (cfg->n_classes <= 0 || cfg->n_classes > OBJ_CLASS_MAX) {
+        goto fail;
+      }
+    } else if (!strcmp(key, "anchors")) {
+      char* p = value;
+      char* next;
+      for (cfg->n_anchors = 0; *p; p = next) {
+        long v = strtol(p, &next, 10);
+        if (next == p || cfg->n_anchors == HEAD_LEVELS * 6) {
+          goto fail;
+        }
+        cfg->anchors[cfg->n_anchors++] = v;
+        while (*next == ',' || *next == ' ' || *next == '\t') {
+          next++;
         }
       }
+    } else if (!strcmp(key, "labels")) {
+      snprintf(cfg->labels, sizeof(cfg->labels), "%s", value);
+    } else {
+      goto fail;
+    }
+  }
+  fclose(fp);
+  fprintf(stderr, "head config %s\n", path);
+  return 0;
+
+fail:
+  fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+  fclose(fp);
+  return -1;
+}
+
+static void free_labels()
+{
+  for (int i = 0; i < OBJ_CLASS_MAX; i++) {
+    if (labels[i] != nullptr) {
+      free(labels[i]);
+      labels[i] = nullptr;
+    }
+  }
+}
+
+/* the model's labels, "class<N>" for every line the list is missing */
+static void load_labels(const char* path, int n_classes)
+{
+  free_labels();
+  if (path) {
+    loadLabelName(path, labels, n_classes);
+  }
+  for (int i = 0; i < n_classes; i++) {
+    if (!labels[i]) {
+      labels[i] = (char*)malloc(OBJ_NAME_MAX_SIZE);
+      snprintf(labels[i], OBJ_NAME_MAX_SIZE, "class%d", i);
     }
   }
-  return validCount;
 }
 
-void post_process(int8_t* input0, int8_t* input1, int8_t* input2, int model_in_h, int model_in_w, float conf_threshold,
-                 float nms_threshold, float scale_w, float scale_h, std::vector<int32_t>& qnt_zps,
-                 std::vector<float>& qnt_scales, detect_result_group_t* group)
+int PostProcessWorkspace::init(int n_outputs, const infer_tensor_attr_t* attrs, int model_in_w, int model_in_h,
+                               const head_config_t* cfg)
 {
-  static int init = -1;
-  if (init == -1) {
-    int ret = 0;
-    ret     = loadLabelName(LABEL_NALE_TXT_PATH, labels);
-    if (ret < 0) {
+  const decode_head_t* head  = NULL;
+  const char*          name  = cfg && cfg->head[0] ? cfg->head : NULL;
+  int                  total = 0;
+
+  max_candidates = 0;
+  if (n_outputs > INFER_MAX_TENSORS) {
+    return -1;
+  }
+  for (int i = 0; decode_heads[i]; i++) {
+    if (name && strcasecmp(name, decode_heads[i]->name)) {
+      continue;
+    }
+    memset(&layout, 0, sizeof(layout));
+    if (decode_heads[i]->probe(n_outputs, attrs, &layout) == 0) {
+      head = decode_heads[i];
+      break;
+    }
+  }
+  if (!head) {
+    fprintf(stderr, "no %s decode head matches the %d model outputs\n", name ? name : "known", n_outputs);
+    return -1;
+  }
+  if (cfg && cfg->n_classes && cfg->n_classes != layout.n_classes) {
+    fprintf(stderr, "%s: config says %d classes, the outputs hold %d\n", head->name, cfg->n_classes,
+            layout.n_classes);
+    return -1;
+  }
+  if (layout.n_classes > OBJ_CLASS_MAX) {
+    fprintf(stderr, "%s: %d classes, at most %d supported\n", head->name, layout.n_classes, OBJ_CLASS_MAX);
+    return -1;
+  }
+  if (head->anchors) {
+    if (cfg && cfg->n_anchors && cfg->n_anchors != HEAD_LEVELS * 6) {
+      fprintf(stderr, "%s: %d anchor values, %d expected\n", head->name, cfg->n_anchors, HEAD_LEVELS * 6);
       return -1;
     }
+    memcpy(layout.anchors, cfg && cfg->n_anchors ? cfg->anchors : head->anchors, sizeof(layout.anchors));
+  }
 
-    init = 0;
+  for (int l = 0; l < HEAD_LEVELS; l++) {
+    layout.stride[l] = model_in_w / layout.grid_w[l];
+    if (layout.stride[l] <= 0 || layout.stride[l] * layout.grid_h[l] != model_in_h) {
+      fprintf(stderr, "%s: %dx%d grid does not fit a %dx%d input\n", head->name, layout.grid_w[l],
+              layout.grid_h[l], model_in_w, model_in_h);
+      return -1;
+    }
+    /* anchor-based heads predict 3 boxes per cell */
+    total += layout.grid_h[l] * layout.grid_w[l] * (head->anchors ? 3 : 1);
   }
-  memset(group, 0, sizeof(detect_result_group_t));
+  for (int t = 0; t < n_outputs; t++) {
+    build_qnt_lut(&luts[t], attrs[t].zp, attrs[t].scale);
+  }
+  layout.head   = head;
+  layout.decode = head->kernel(layout.n_classes);
 
-  std::vector<float> filterBoxes;
-  std::vector<float> objProbs;
-  std::vector<int>   classId;
-
-  // stride 8
-  int stride0     = 8;
-  int grid_h0     = model_in_h / stride0;
-  int grid_w0     = model_in_w / stride0;
-  int validCount0 = 0;
-  validCount0 = process(input0, (int*)anchor0, grid_h0, grid_w0, model_in_h, model_in_w, stride0, filterBoxes, objProbs,
-                        classId, conf_threshold, qnt_zps[0], qnt_scales[0]);
-
-  // stride 16
-  int stride1     = 16;
-  int grid_h1     = model_in_h / stride1;
-  int grid_w1     = model_in_w / stride1;
-  int validCount1 = 0;
-  validCount1 = process(input1, (int*)anchor1, grid_h1, grid_w1, model_in_h, model_in_w, stride1, filterBoxes, objProbs,
-                        classId, conf_threshold, qnt_zps[1], qnt_scales[1]);
-
-  // stride 32
-  int stride2     = 32;
-  int grid_h2     = model_in_h / stride2;
-  int grid_w2     = model_in_w / stride2;
-  int validCount2 = 0;
-  validCount2 = process(input2, (int*)anchor2, grid_h2, grid_w2, model_in_h, model_in_w, stride2, filterBoxes, objProbs,
-                        classId, conf_threshold, qnt_zps[2], qnt_scales[2]);
-
-  int validCount = validCount0 + validCount1 + validCount2;
-  // no object detect
-  if (validCount <= 0) {
-    return 0;
+  if (cfg && cfg->labels[0]) {
+    load_labels(cfg->labels, layout.n_classes);
+  } else {
+    load_labels(layout.n_classes == 80 ? LABEL_NALE_TXT_PATH : NULL, layout.n_classes);
   }
 
-  std::vector<int> indexArray;
-  for (int i = 0; i < validCount; ++i) {
-    indexArray.push_back(i);
+  filterBoxes.reserve(total * 4);
+  objProbs.reserve(total);
+  classId.reserve(total);
+  indexArray.resize(total);
+  nms.reserve(total);
+  max_candidates = total;
+  fprintf(stderr, "decode head: %s, %d classes, %d candidates max\n", head->name, layout.n_classes, total);
+  return 0;
+}
+
+void post_process(int8_t** outputs, int model_in_h, int model_in_w, float conf_threshold, float nms_threshold,
+                 const letterbox_t* lb, const xform_t* to_src, PostProcessWorkspace* ws,
+                 detect_result_group_t* group)
+{
+  letterbox_t full = {0, 0, model_in_w, model_in_h};
+  xform_t     none = xform_identity();
+  if (!lb) {
+    lb = &full;
+  }
+  if (!to_src) {
+    to_src = &none;
   }
 
-  quick_sort_indice_inverse(objProbs, 0, validCount - 1, indexArray);
+  memset(group, 0, sizeof(detect_result_group_t));
+  if (!ws->max_candidates) {
+    return;
+  }
 
-  std::set<int> class_set(std::begin(classId), std::end(classId));
+  std::vector<float>& filterBoxes = ws->filterBoxes;
+  std::vector<float>& objProbs    = ws->objProbs;
+  std::vector<int>&   classId     = ws->classId;
+  filterBoxes.clear();
+  objProbs.clear();
+  classId.clear();
 
-  for (auto c : class_set) {
-    nms(validCount, filterBoxes, classId, indexArray, c, nms_threshold);
+  int validCount = 0;
+  for (int l = 0; l < HEAD_LEVELS; l++) {
+    validCount += ws->layout.decode(ws, l, outputs, conf_threshold);
   }
+  // no object detect
+  if (validCount <= 0) {
+    return;
+  }
+
+  nms_params_t params;
+  params.method          = nms_method;
+  params.iou_threshold   = nms_threshold;
+  params.sigma           = nms_sigma;
+  params.score_threshold = conf_threshold;
+  params.top_k           = nms_top_k;
+  params.max_out         = OBJ_NUMB_MAX_SIZE;
+
+  std::vector<int>& indexArray = ws->indexArray;
+  int               keptCount  = ws->nms.run(filterBoxes.data(), objProbs.data(), classId.data(), NULL, validCount,
+                                             &params, indexArray.data());
 
   int last_count = 0;
   group->count   = 0;
-  /* box valid detect target */
-  for (int i = 0; i < validCount; ++i) {
-    if (indexArray[i] == -1 || last_count >= OBJ_NUMB_MAX_SIZE) {
-      continue;
-    }
+  /* box valid detect target, by decreasing score */
+  for (int i = 0; i < keptCount; ++i) {
     int n = indexArray[i];
 
     float x1       = filterBoxes[n * 4 + 0];
@@ -314,32 +832,126 @@ void post_process(int8_t* input0, int8_t* input1, int8_t* input2, int model_in_h
     float x2       = x1 + filterBoxes[n * 4 + 2];
     float y2       = y1 + filterBoxes[n * 4 + 3];
     int   id       = classId[n];
-    float obj_conf = objProbs[i];
+    float obj_conf = objProbs[n];
 
-    group->results[last_count].box.left   = (int)(clamp(x1, 0, model_in_w) / scale_w);
-    group->results[last_count].box.top    = (int)(clamp(y1, 0, model_in_h) / scale_h);
-    group->results[last_count].box.right  = (int)(clamp(x2, 0, model_in_w) / scale_w);
-    group->results[last_count].box.bottom = (int)(clamp(y2, 0, model_in_h) / scale_h);
+    /* the letterbox bars are not part of the picture */
+    group->results[last_count].box.left   = (int)xform_x(to_src, clamp(x1, lb->x, lb->x + lb->w));
+    group->results[last_count].box.top    = (int)xform_y(to_src, clamp(y1, lb->y, lb->y + lb->h));
+    group->results[last_count].box.right  = (int)xform_x(to_src, clamp(x2, lb->x, lb->x + lb->w));
+    group->results[last_count].box.bottom = (int)xform_y(to_src, clamp(y2, lb->y, lb->y + lb->h));
     group->results[last_count].prop       = obj_conf;
-    char* label                           = labels[id];
-    strncpy(group->results[last_count].name, label, OBJ_NAME_MAX_SIZE);
+    group->results[last_count].class_id   = id;
 
     // fprintf(stderr,"result %2d: (%4d, %4d, %4d, %4d), %s\n", i, group->results[last_count].box.left,
     // group->results[last_count].box.top,
-    //        group->results[last_count].box.right, group->results[last_count].box.bottom, label);
+    //        group->results[last_count].box.right, group->results[last_count].box.bottom, labels[id]);
     last_count++;
   }
   group->count = last_count;
+}
 
-  return 0;
+void detect_map(const detect_result_group_t* src, const xform_t* t, detect_result_group_t* dst)
+{
+  if (dst != src) {
+    dst->id    = src->id;
+    dst->count = src->count;
+  }
+  for (int i = 0; i < src->count; i++) {
+    const BOX_RECT* s = &src->results[i].box;
+    BOX_RECT*       d = &dst->results[i].box;
+
+    dst->results[i] = src->results[i];
+    d->left         = (int)xform_x(t, s->left);
+    d->top          = (int)xform_y(t, s->top);
+    d->right        = (int)xform_x(t, s->right);
+    d->bottom       = (int)xform_y(t, s->bottom);
+  }
 }
 
-void deinitPostProcess()
+void setNmsMethod(nms_method_t method, float sigma)
 {
-  for (int i = 0; i < OBJ_CLASS_NUM; i++) {
-    if (labels[i] != nullptr) {
-      free(labels[i]);
-      labels[i] = nullptr;
+  nms_method = method;
+  if (sigma > 0) {
+    nms_sigma = sigma;
+  }
+}
+
+void setPreNmsTopK(int top_k) { nms_top_k = top_k; }
+
+const char* getLabelName(int class_id)
+{
+  return class_id >= 0 && class_id < OBJ_CLASS_MAX ? labels[class_id] : nullptr;
+}
+
+/* class id from a label or a number, -1 if the model has no such class */
+static int find_class(const char* name, int len)
+{
+  char* end;
+  long  id = strtol(name, &end, 10);
+
+  if (len > 0 && end == name + len) {
+    return id >= 0 && id < OBJ_CLASS_MAX && labels[id] ? (int)id : -1;
+  }
+  for (int i = 0; i < OBJ_CLASS_MAX; i++) {
+    if (labels[i] && !strncmp(labels[i], name, len) && !labels[i][len]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int setClassFilter(const char* spec, float min_score)
+{
+  uint64_t allow[OBJ_CLASS_MAX / 64] = {0};
+  uint64_t deny[OBJ_CLASS_MAX / 64]  = {0};
+  float    scores[OBJ_CLASS_MAX];
+  int      listed = 0;
+  int      kept   = 0;
+
+  for (int i = 0; i < OBJ_CLASS_MAX; i++) {
+    scores[i] = min_score;
+  }
+  for (const char* p = spec; p && *p;) {
+    int         n      = strcspn(p, ",");
+    const char* colon  = (const char*)memchr(p, ':', n);
+    int         denied = *p == '-';
+    const char* name   = p + denied;
+    int         len    = (colon ? colon : p + n) - name;
+
+    if (len == 1 && *name == '*') {
+      memset(allow, 0xff, sizeof(allow));
+      listed = 1;
+      for (int i = 0; colon && i < OBJ_CLASS_MAX; i++) {
+        scores[i] = strtof(colon + 1, NULL);
+      }
+    } else {
+      int id = find_class(name, len);
+      if (id < 0) {
+        fprintf(stderr, "class filter: no class '%.*s' in the model\n", len, name);
+        return -1;
+      }
+      if (denied) {
+        deny[id >> 6] |= 1ull << (id & 63);
+      } else {
+        allow[id >> 6] |= 1ull << (id & 63);
+        listed = 1;
+      }
+      if (colon) {
+        scores[id] = strtof(colon + 1, NULL);
+      }
     }
+    p += n + (p[n] == ',');
+  }
+
+  for (int w = 0; w < OBJ_CLASS_MAX / 64; w++) {
+    class_allow[w] = (listed ? allow[w] : ~0ull) & ~deny[w];
   }
+  memcpy(class_min_score, scores, sizeof(class_min_score));
+  for (int i = 0; i < OBJ_CLASS_MAX; i++) {
+    kept += labels[i] && (class_allow[i >> 6] >> (i & 63) & 1);
+  }
+  fprintf(stderr, "class filter: %d classes kept\n", kept);
+  return 0;
 }
+
+void deinitPostProcess() { free_labels(); }
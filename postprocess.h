@@ -4,12 +4,17 @@
 #include <stdint.h>
 #include <vector>
 
+#include <infer_backend.h>
+#include <nms.h>
+#include <xform.h>
+
 #define OBJ_NAME_MAX_SIZE 16
 #define OBJ_NUMB_MAX_SIZE 64
-#define OBJ_CLASS_NUM     80
+#define OBJ_CLASS_MAX     256
 #define NMS_THRESH        0.45
 #define BOX_THRESH        0.25
-#define PROP_BOX_SIZE     (5+OBJ_CLASS_NUM)
+#define NMS_TOP_K         1000 // candidates kept before NMS
+#define HEAD_LEVELS       3 // strides 8, 16, 32
 
 typedef struct _BOX_RECT
 {
@@ -19,11 +24,19 @@ typedef struct _BOX_RECT
     int bottom;
 } BOX_RECT;
 
+/* Where the picture sits in the model input: one scale both ways, centred, the rest padded */
+typedef struct _letterbox_t
+{
+    int x, y; // top left of the picture in the model input
+    int w, h; // its size there
+} letterbox_t;
+
 typedef struct __detect_result_t
 {
-    char name[OBJ_NAME_MAX_SIZE];
+    int class_id; // index into the model's labels, getLabelName() when it has to be shown
     BOX_RECT box;
     float prop;
+    int track_id; // stable across frames when tracking (tracker.h), 0 otherwise
 } detect_result_t;
 
 typedef struct _detect_result_group_t
@@ -33,10 +46,132 @@ typedef struct _detect_result_group_t
     detect_result_t results[OBJ_NUMB_MAX_SIZE];
 } detect_result_group_t;
 
-void post_process(int8_t *input0, int8_t *input1, int8_t *input2, int model_in_h, int model_in_w,
-                 float conf_threshold, float nms_threshold, float scale_w, float scale_h,
-                 std::vector<int32_t> &qnt_zps, std::vector<float> &qnt_scales,
-                 detect_result_group_t *group);
+/*
+ * An int8 output only takes 256 values and zp/scale are fixed per tensor,
+ * so sigmoid(dequant(q)) and the box terms derived from it are tabulated
+ * once per model and indexed by (uint8_t)q.
+ */
+typedef struct _qnt_lut_t
+{
+    int32_t zp;
+    float scale;
+    float sig[256]; // sigmoid(dequant(q))
+    float xy[256];  // sigmoid * 2 - 0.5, box centre offset in cells
+    float wh[256];  // (sigmoid * 2)^2, box size in anchors
+    float dfl[256]; // exp(-d * scale), softmax term of a DFL bin d steps below the max
+} qnt_lut_t;
+
+class PostProcessWorkspace;
+
+/* decodes the candidates of one pyramid level into the workspace, returns how many */
+typedef int (*decode_level_fn)(PostProcessWorkspace *ws, int level, int8_t **outputs, float threshold);
+
+/*
+ * A detection head family. probe() checks the output tensors against the
+ * layout it expects and fills in what it can derive from them (levels,
+ * class count, tensor indices); kernel() returns the decoder specialized
+ * for that class count.
+ */
+typedef struct _head_layout_t head_layout_t;
+typedef struct _decode_head_t
+{
+    const char *name;
+    int (*probe)(int n_outputs, const infer_tensor_attr_t *attrs, head_layout_t *layout);
+    decode_level_fn (*kernel)(int n_classes);
+    const int *anchors; // [HEAD_LEVELS][6], NULL for anchor-free heads
+} decode_head_t;
+
+struct _head_layout_t
+{
+    const decode_head_t *head;
+    decode_level_fn decode;
+    int n_classes;
+    int grid_h[HEAD_LEVELS];
+    int grid_w[HEAD_LEVELS];
+    int stride[HEAD_LEVELS];
+    int tensor[HEAD_LEVELS][3]; // yolov5/v7: heads; yolov8: box, class, score sum (-1 if absent)
+    int anchors[HEAD_LEVELS][6];
+    int dfl_len;                // yolov8: bins per box side
+};
+
+/*
+ * Optional sidecar config, "<model>.cfg", one "key = value" per line:
+ *   head = yolov5 | yolov7 | yolov8   (default: probed from the output shapes)
+ *   classes = 3                       (checked against the output shapes)
+ *   anchors = 10,13, 16,30, ...       (18 values, anchor-based heads)
+ *   labels = /path/to/labels.txt      (default: the COCO list, or "class<N>")
+ */
+typedef struct _head_config_t
+{
+    char head[16];
+    int n_classes;
+    int n_anchors;
+    int anchors[HEAD_LEVELS * 6];
+    char labels[256];
+} head_config_t;
+
+int load_head_config(const char *path, head_config_t *cfg);
+
+/*
+ * Everything post_process() needs besides its inputs, sized once from the
+ * model's output tensors and reused for every frame, so steady-state post
+ * processing does not touch the heap. One workspace per calling thread.
+ */
+class PostProcessWorkspace
+{
+public:
+    PostProcessWorkspace() : max_candidates(0) {}
+
+    /*
+     * Picks the decode head for the model's int8 outputs (cfg may be NULL)
+     * and loads its labels. Returns -1 if no registered head fits.
+     */
+    int init(int n_outputs, const infer_tensor_attr_t *attrs, int model_in_w, int model_in_h,
+             const head_config_t *cfg);
+
+    int max_candidates;
+    head_layout_t layout;
+    qnt_lut_t luts[INFER_MAX_TENSORS];
+    std::vector<float> filterBoxes;
+    std::vector<float> objProbs;
+    std::vector<int> classId;
+    std::vector<int> indexArray;
+    NmsEngine nms;
+};
+
+/*
+ * Boxes come out clamped to the picture (lb, NULL when it fills the whole
+ * input) and mapped by to_src, normally into the pixels of the source
+ * frame; NULL leaves them in model input pixels.
+ */
+void post_process(int8_t **outputs, int model_in_h, int model_in_w,
+                 float conf_threshold, float nms_threshold, const letterbox_t *lb, const xform_t *to_src,
+                 PostProcessWorkspace *ws, detect_result_group_t *group);
+
+/* group with every box mapped by t, e.g. from source pixels into a display tile; dst may be src */
+void detect_map(const detect_result_group_t *src, const xform_t *t, detect_result_group_t *dst);
+
+/* NMS_HARD by default; sigma only matters for NMS_GAUSSIAN (<= 0 keeps 0.5) */
+void setNmsMethod(nms_method_t method, float sigma);
+
+/* best candidates kept before NMS, NMS_TOP_K by default, <= 0 keeps all */
+void setPreNmsTopK(int top_k);
+
+/* label of a class of the loaded model, NULL past its classes */
+const char* getLabelName(int class_id);
+
+/*
+ * Classes post_process() keeps, checked on every candidate before NMS so
+ * filtered classes cost neither NMS, tracking nor drawing. spec is a comma
+ * separated list of labels or class ids, NULL keeps every class:
+ *   person,car       only these
+ *   -bird,-cat       all but these
+ *   person:0.6       with its own confidence threshold
+ *   *,person:0.6     all, person from 0.6 on
+ * min_score is the threshold of the classes not given one. Needs the
+ * labels (PostProcessWorkspace::init()), returns -1 on an unknown class.
+ */
+int setClassFilter(const char* spec, float min_score);
 
 void deinitPostProcess();
 #endif //_RKNN_ZERO_COPY_DEMO_POSTPROCESS_H_
@@ -0,0 +1,614 @@
+/*
+ * Decoded frame -> letterboxed model input, by RGA or the CPU.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "preprocess.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -DFFRKNN_NO_SIMD leaves the plain C loops alone, tests/ hold them against the vector ones */
+#if defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+#include <arm_neon.h>
+#elif defined(__SSE2__) && !defined(FFRKNN_NO_SIMD)
+#include <emmintrin.h>
+#endif
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#ifdef HAVE_RGA
+#include <rga/RgaApi.h>
+#include <rga/rga.h>
+#endif
+
+#include <convert.h>
+
+/* BT.601 in 1/64: R = Y' + rv V, G = Y' - gu U - gv V, B = Y' + bu U, with Y' = (Y - y_off) * y_mul */
+typedef struct _yuv_coefs_t
+{
+    int16_t y_off, y_mul;
+    int16_t rv, gu, gv, bu;
+} yuv_coefs_t;
+
+static const yuv_coefs_t bt601_limited = {16, 74, 102, 25, 52, 129};
+static const yuv_coefs_t bt601_full = {0, 64, 90, 22, 46, 113};
+
+void letterbox_fit(int src_w, int src_h, int dst_w, int dst_h, letterbox_t *lb)
+{
+    /* the side that fills its dimension first sets the scale; even sizes and offsets for RGA */
+    if ((int64_t)src_w * dst_h >= (int64_t)src_h * dst_w) {
+        lb->w = dst_w;
+        lb->h = (int)((int64_t)src_h * dst_w / src_w) & ~1;
+    } else {
+        lb->w = (int)((int64_t)src_w * dst_h / src_h) & ~1;
+        lb->h = dst_h;
+    }
+    if (lb->w < 2)
+        lb->w = 2;
+    if (lb->h < 2)
+        lb->h = 2;
+    lb->x = (dst_w - lb->w) / 2 & ~1;
+    lb->y = (dst_h - lb->h) / 2 & ~1;
+}
+
+int preprocess_parse_mode(const char *name)
+{
+    static const char *const names[] = {"auto", "rga", "cpu", "check"};
+
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (!strcmp(name, names[i]))
+            return i;
+    }
+    return -1;
+}
+
+/* Output sample i of dst -> the two source samples around its centre and the weight of the second */
+static inline void axis_tap(int dst, int src, int i, int *i0, int *i1, int *f)
+{
+    int64_t p = (int64_t)(2 * i + 1) * src * 128 / (2 * dst) - 64;
+
+    if (p < 0)
+        p = 0;
+    *i0 = (int)(p >> 7);
+    *f = (int)(p & 127);
+    if (*i0 >= src - 1) {
+        *i0 = src - 1;
+        *f = 0;
+    }
+    *i1 = *f ? *i0 + 1 : *i0;
+}
+
+/* (a * (128 - f) + b * f) / 128, rounded; a itself when there is nothing to blend */
+static const uint8_t *blend_rows(const uint8_t *a, const uint8_t *b, int f, uint8_t *out, int n)
+{
+    int i = 0;
+
+    if (!f || a == b)
+        return a;
+#if defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+    uint8x8_t w0 = vdup_n_u8((uint8_t)(128 - f)), w1 = vdup_n_u8((uint8_t)f);
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t va = vld1q_u8(a + i), vb = vld1q_u8(b + i);
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), w0), vget_low_u8(vb), w1);
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), w0), vget_high_u8(vb), w1);
+
+        vst1q_u8(out + i, vcombine_u8(vrshrn_n_u16(lo, 7), vrshrn_n_u16(hi, 7)));
+    }
+#elif defined(__SSE2__) && !defined(FFRKNN_NO_SIMD)
+    const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(64);
+    const __m128i w0 = _mm_set1_epi16((short)(128 - f)), w1 = _mm_set1_epi16((short)f);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i)), vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), w1));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), w1));
+
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, half), 7);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, half), 7);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = (uint8_t)((a[i] * (128 - f) + b[i] * f + 64) >> 7);
+    return out;
+}
+
+static inline uint8_t px_u8(int v)
+{
+    v = (v + 32) >> 6;
+    return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+/* One output row: Y, U, V at output resolution -> packed B G R (R G B) */
+static void yuv_to_rgb_row(const uint8_t *py, const uint8_t *pu, const uint8_t *pv, uint8_t *dst, int n,
+                           const yuv_coefs_t *c, int rgb)
+{
+    int i = 0;
+
+#if defined(__ARM_NEON) && !defined(FFRKNN_NO_SIMD)
+    const int16x8_t y_off = vdupq_n_s16(c->y_off), c128 = vdupq_n_s16(128);
+
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t y = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(py + i)));
+        int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pu + i))), c128);
+        int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pv + i))), c128);
+        int16x8_t r, g, b;
+        uint8x8x3_t px;
+
+        y = vmulq_n_s16(vsubq_s16(y, y_off), c->y_mul);
+        r = vqaddq_s16(y, vmulq_n_s16(v, c->rv));
+        g = vqsubq_s16(vqsubq_s16(y, vmulq_n_s16(u, c->gu)), vmulq_n_s16(v, c->gv));
+        b = vqaddq_s16(y, vmulq_n_s16(u, c->bu));
+        px.val[rgb ? 0 : 2] = vqrshrun_n_s16(r, 6);
+        px.val[1] = vqrshrun_n_s16(g, 6);
+        px.val[rgb ? 2 : 0] = vqrshrun_n_s16(b, 6);
+        vst3_u8(dst + 3 * i, px);
+    }
+#elif defined(__SSE2__) && !defined(FFRKNN_NO_SIMD)
+    const __m128i zero = _mm_setzero_si128(), c128 = _mm_set1_epi16(128), round = _mm_set1_epi16(32);
+    const __m128i y_off = _mm_set1_epi16(c->y_off), y_mul = _mm_set1_epi16(c->y_mul);
+    const __m128i rv = _mm_set1_epi16(c->rv), gu = _mm_set1_epi16(c->gu);
+    const __m128i gv = _mm_set1_epi16(c->gv), bu = _mm_set1_epi16(c->bu);
+    uint8_t out[3][16];
+
+    /* SSE2 has no interleaving store: converted 16 at a time, packed by hand */
+    for (; i + 16 <= n; i += 16) {
+        __m128i vy = _mm_loadu_si128((const __m128i *)(py + i));
+        __m128i vu = _mm_loadu_si128((const __m128i *)(pu + i));
+        __m128i vv = _mm_loadu_si128((const __m128i *)(pv + i));
+        __m128i r[2], g[2], b[2];
+
+        for (int h = 0; h < 2; h++) {
+            __m128i y = h ? _mm_unpackhi_epi8(vy, zero) : _mm_unpacklo_epi8(vy, zero);
+            __m128i u = _mm_sub_epi16(h ? _mm_unpackhi_epi8(vu, zero) : _mm_unpacklo_epi8(vu, zero), c128);
+            __m128i v = _mm_sub_epi16(h ? _mm_unpackhi_epi8(vv, zero) : _mm_unpacklo_epi8(vv, zero), c128);
+
+            y = _mm_mullo_epi16(_mm_sub_epi16(y, y_off), y_mul);
+            r[h] = _mm_adds_epi16(y, _mm_mullo_epi16(v, rv));
+            g[h] = _mm_subs_epi16(_mm_subs_epi16(y, _mm_mullo_epi16(u, gu)), _mm_mullo_epi16(v, gv));
+            b[h] = _mm_adds_epi16(y, _mm_mullo_epi16(u, bu));
+            r[h] = _mm_srai_epi16(_mm_adds_epi16(r[h], round), 6);
+            g[h] = _mm_srai_epi16(_mm_adds_epi16(g[h], round), 6);
+            b[h] = _mm_srai_epi16(_mm_adds_epi16(b[h], round), 6);
+        }
+        _mm_storeu_si128((__m128i *)out[rgb ? 0 : 2], _mm_packus_epi16(r[0], r[1]));
+        _mm_storeu_si128((__m128i *)out[1], _mm_packus_epi16(g[0], g[1]));
+        _mm_storeu_si128((__m128i *)out[rgb ? 2 : 0], _mm_packus_epi16(b[0], b[1]));
+        for (int k = 0; k < 16; k++) {
+            dst[3 * (i + k) + 0] = out[0][k];
+            dst[3 * (i + k) + 1] = out[1][k];
+            dst[3 * (i + k) + 2] = out[2][k];
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        int y = (py[i] - c->y_off) * c->y_mul;
+        int u = pu[i] - 128, v = pv[i] - 128;
+        uint8_t *px = dst + 3 * i;
+
+        px[rgb ? 0 : 2] = px_u8(y + c->rv * v);
+        px[1] = px_u8(y - c->gu * u - c->gv * v);
+        px[rgb ? 2 : 0] = px_u8(y + c->bu * u);
+    }
+}
+
+#ifdef HAVE_RGA
+static uint32_t av_get_rgaformat(int pix_fmt)
+{
+    switch (pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        return RK_FORMAT_YCbCr_420_P;
+    case AV_PIX_FMT_NV12:
+        return RK_FORMAT_YCbCr_420_SP;
+    case AV_PIX_FMT_NV21:
+        return RK_FORMAT_YCrCb_420_SP;
+    default:
+        return 0;
+    }
+}
+
+/* src into the letterbox rectangle of the model input */
+static int rga_letterbox(rga_info_t *src, uint8_t *dst, int width, int height, int rgb, const letterbox_t *lb)
+{
+    rga_info_t out;
+
+    memset(&out, 0, sizeof(rga_info_t));
+    out.fd = -1;
+    out.virAddr = dst;
+    out.mmuFlag = 1;
+    rga_set_rect(&out.rect, lb->x, lb->y, lb->w, lb->h, width, height, rgb ? RK_FORMAT_RGB_888 : RK_FORMAT_BGR_888);
+    return c_RkRgaBlit(src, &out, NULL);
+}
+#endif
+
+Preprocessor::Preprocessor()
+    : width_(0), height_(0), rgb_(0), mode_(PREPROCESS_AUTO), threads_(1), n_bands_(1), started_(1), quit_(0),
+      done_(nullptr), x_luma_(nullptr), x_chroma_(nullptr), taps_src_w_(0), taps_src_h_(0), scratch_(nullptr),
+      banded_(0), rga_failed_(0), checked_(0), check_bytes_(0), check_sum_(0), check_over_(0), check_max_(0)
+{
+    memset(&job_, 0, sizeof(job_));
+    memset(bands_, 0, sizeof(bands_));
+    memset(&taps_lb_, 0, sizeof(taps_lb_));
+    memset(frames_, 0, sizeof(frames_));
+}
+
+Preprocessor::~Preprocessor()
+{
+    uninit();
+}
+
+int Preprocessor::init(int width, int height, int rgb, preprocess_mode_t mode, int threads)
+{
+#ifndef HAVE_RGA
+    if (mode == PREPROCESS_RGA || mode == PREPROCESS_CHECK) {
+        fprintf(stderr, "preprocess: built without RGA, only -pp cpu\n");
+        return -1;
+    }
+#endif
+    width_ = width;
+    height_ = height;
+    rgb_ = rgb;
+    mode_ = mode;
+    if (threads <= 0)
+        threads = SDL_GetCPUCount();
+    threads_ = threads < 1 ? 1 : threads > PREPROCESS_BANDS ? PREPROCESS_BANDS : threads;
+    for (int i = 0; i < PREPROCESS_BANDS; i++) {
+        bands_[i].pp = this;
+        bands_[i].index = i;
+    }
+    x_luma_ = (tap_t *)calloc(width, sizeof(tap_t));
+    x_chroma_ = (tap_t *)calloc(width, sizeof(tap_t));
+    if (mode == PREPROCESS_CHECK)
+        scratch_ = (uint8_t *)malloc((size_t)width * height * 3);
+    if (!x_luma_ || !x_chroma_ || (mode == PREPROCESS_CHECK && !scratch_)) {
+        fprintf(stderr, "preprocess: out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+void Preprocessor::uninit()
+{
+    quit_ = 1;
+    for (int i = 1; i < started_; i++) {
+        SDL_SemPost(bands_[i].go);
+        SDL_WaitThread(bands_[i].thread, NULL);
+        SDL_DestroySemaphore(bands_[i].go);
+    }
+    started_ = 1;
+    for (int i = 0; i < PREPROCESS_BANDS; i++) {
+        free(bands_[i].line);
+        bands_[i].line = NULL;
+        bands_[i].line_size = 0;
+    }
+    if (done_)
+        SDL_DestroySemaphore(done_);
+    done_ = nullptr;
+    free(x_luma_);
+    free(x_chroma_);
+    free(scratch_);
+    x_luma_ = x_chroma_ = nullptr;
+    scratch_ = nullptr;
+}
+
+int Preprocessor::band_main(void *data)
+{
+    band_t *band = (band_t *)data;
+    Preprocessor *pp = band->pp;
+
+    for (;;) {
+        SDL_SemWait(band->go);
+        if (pp->quit_)
+            break;
+        pp->rows(band, pp->job_.lb.h * band->index / pp->n_bands_, pp->job_.lb.h * (band->index + 1) / pp->n_bands_);
+        SDL_SemPost(pp->done_);
+    }
+    return 0;
+}
+
+/* Threads for bands 1 .. n-1 (the caller runs band 0), returns how many bands can run */
+int Preprocessor::start_bands(int n)
+{
+    if (n <= started_)
+        return n;
+    if (!done_ && !(done_ = SDL_CreateSemaphore(0)))
+        return started_;
+    for (; started_ < n; started_++) {
+        band_t *band = &bands_[started_];
+
+        if (!(band->go = SDL_CreateSemaphore(0)))
+            break;
+        if (!(band->thread = SDL_CreateThread(band_main, "SDL_PreprocessThread", band))) {
+            fprintf(stderr, "preprocess: %s, %d bands only\n", SDL_GetError(), started_);
+            SDL_DestroySemaphore(band->go);
+            break;
+        }
+    }
+    return started_;
+}
+
+/* Output rows r0 .. r1-1 of the letterboxed picture */
+void Preprocessor::rows(band_t *band, int r0, int r1)
+{
+    const job_t *j = &job_;
+    const yuv_coefs_t *c = j->full_range ? &bt601_full : &bt601_limited;
+    int cw = (j->src_w + 1) / 2, ch = (j->src_h + 1) / 2;
+    int n = j->lb.w;
+    uint8_t *by = band->line;    // blended luma row, src_w
+    uint8_t *bc = by + j->src_w; // blended chroma rows, 2 * cw
+    uint8_t *oy = bc + 2 * cw;   // output row planes, n each
+    uint8_t *ou = oy + n;
+    uint8_t *ov = ou + n;
+
+    for (int r = r0; r < r1; r++) {
+        const uint8_t *ry, *ru, *rv;
+        int i0, i1, f;
+
+        axis_tap(j->lb.h, j->src_h, r, &i0, &i1, &f);
+        ry = blend_rows(j->y + (ptrdiff_t)i0 * j->y_stride, j->y + (ptrdiff_t)i1 * j->y_stride, f, by, j->src_w);
+        axis_tap(j->lb.h, ch, r, &i0, &i1, &f);
+        if (j->c_step == 2) {
+            /* NV12 / NV21: both planes blended in one go */
+            const uint8_t *base = j->u < j->v ? j->u : j->v;
+            const uint8_t *rc = blend_rows(base + (ptrdiff_t)i0 * j->u_stride, base + (ptrdiff_t)i1 * j->u_stride,
+                                           f, bc, 2 * cw);
+
+            ru = rc + (j->u - base);
+            rv = rc + (j->v - base);
+        } else {
+            ru = blend_rows(j->u + (ptrdiff_t)i0 * j->u_stride, j->u + (ptrdiff_t)i1 * j->u_stride, f, bc, cw);
+            rv = blend_rows(j->v + (ptrdiff_t)i0 * j->v_stride, j->v + (ptrdiff_t)i1 * j->v_stride, f, bc + cw, cw);
+        }
+
+        for (int x = 0; x < n; x++) {
+            const tap_t *t = &x_luma_[x];
+
+            oy[x] = (uint8_t)((ry[t->i0] * (128 - t->f) + ry[t->i1] * t->f + 64) >> 7);
+        }
+        for (int x = 0, step = j->c_step; x < n; x++) {
+            const tap_t *t = &x_chroma_[x];
+            int a = t->i0 * step, b = t->i1 * step;
+
+            ou[x] = (uint8_t)((ru[a] * (128 - t->f) + ru[b] * t->f + 64) >> 7);
+            ov[x] = (uint8_t)((rv[a] * (128 - t->f) + rv[b] * t->f + 64) >> 7);
+        }
+        yuv_to_rgb_row(oy, ou, ov, j->dst + ((size_t)(j->lb.y + r) * width_ + j->lb.x) * 3, n, c, rgb_);
+    }
+}
+
+int Preprocessor::cpu(const AVFrame *f, uint8_t *dst, const letterbox_t *lb)
+{
+    job_t *j = &job_;
+    int cw = (f->width + 1) / 2;
+    int n = 1, line;
+
+    j->y = f->data[0];
+    j->y_stride = f->linesize[0];
+    j->full_range = f->format == AV_PIX_FMT_YUVJ420P || f->color_range == AVCOL_RANGE_JPEG;
+    switch (f->format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        j->u = f->data[1];
+        j->v = f->data[2];
+        j->u_stride = f->linesize[1];
+        j->v_stride = f->linesize[2];
+        j->c_step = 1;
+        break;
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21:
+        j->u = f->data[1] + (f->format == AV_PIX_FMT_NV21);
+        j->v = f->data[1] + (f->format == AV_PIX_FMT_NV12);
+        j->u_stride = j->v_stride = f->linesize[1];
+        j->c_step = 2;
+        break;
+    default:
+        return -1;
+    }
+    j->src_w = f->width;
+    j->src_h = f->height;
+    j->dst = dst;
+    j->lb = *lb;
+
+    if (f->width != taps_src_w_ || f->height != taps_src_h_ || memcmp(lb, &taps_lb_, sizeof(letterbox_t))) {
+        for (int x = 0; x < lb->w; x++) {
+            axis_tap(lb->w, f->width, x, &x_luma_[x].i0, &x_luma_[x].i1, &x_luma_[x].f);
+            axis_tap(lb->w, cw, x, &x_chroma_[x].i0, &x_chroma_[x].i1, &x_chroma_[x].f);
+        }
+        taps_src_w_ = f->width;
+        taps_src_h_ = f->height;
+        taps_lb_ = *lb;
+    }
+
+    if ((int64_t)f->width * f->height >= PREPROCESS_BAND_MIN)
+        n = start_bands(threads_ < lb->h ? threads_ : lb->h);
+    line = f->width + 2 * cw + 3 * lb->w;
+    for (int i = 0; i < n; i++) {
+        band_t *band = &bands_[i];
+
+        if (band->line_size < line) {
+            uint8_t *p = (uint8_t *)realloc(band->line, line);
+
+            if (!p)
+                return -1;
+            band->line = p;
+            band->line_size = line;
+        }
+    }
+
+    n_bands_ = n;
+    for (int i = 1; i < n; i++)
+        SDL_SemPost(bands_[i].go);
+    rows(&bands_[0], 0, lb->h / n);
+    for (int i = 1; i < n; i++)
+        SDL_SemWait(done_);
+    banded_ += n > 1;
+    return 0;
+}
+
+int Preprocessor::rga(const AVFrame *f, const SDL_Rect *crop, uint8_t *dst, const letterbox_t *lb)
+{
+#ifdef HAVE_RGA
+    rga_info_t src;
+    uint32_t format = av_get_rgaformat(f->format);
+    int wstride, hstride;
+
+    if (!format || convert_rga_layout(f, &wstride, &hstride) < 0)
+        return -1;
+    memset(&src, 0, sizeof(rga_info_t));
+    src.fd = -1;
+    src.virAddr = f->data[0];
+    src.mmuFlag = 1;
+    rga_set_rect(&src.rect, crop->x, crop->y, crop->w, crop->h, wstride, hstride, format);
+    if (rga_letterbox(&src, dst, width_, height_, rgb_, lb) < 0) {
+        rga_failed_++;
+        return -1;
+    }
+    return 0;
+#else
+    (void)f;
+    (void)crop;
+    (void)dst;
+    (void)lb;
+    return -1;
+#endif
+}
+
+/* A view of crop inside f: the same buffers, the plane pointers moved to its corner */
+static void crop_view(const AVFrame *f, const SDL_Rect *crop, AVFrame *view)
+{
+    int c_step = f->format == AV_PIX_FMT_NV12 || f->format == AV_PIX_FMT_NV21 ? 2 : 1;
+
+    *view = *f;
+    view->width = crop->w;
+    view->height = crop->h;
+    view->data[0] = f->data[0] + (size_t)crop->y * f->linesize[0] + crop->x;
+    for (int i = 1; i <= 3 - c_step; i++)
+        view->data[i] = f->data[i] + (size_t)(crop->y / 2) * f->linesize[i] + (crop->x / 2) * c_step;
+}
+
+/* The bars, once per buffer and letterbox: the picture never draws over them */
+void Preprocessor::paint(uint8_t *dst, const letterbox_t *fit, letterbox_t *lb)
+{
+    if (!memcmp(fit, lb, sizeof(letterbox_t)))
+        return;
+    memset(dst, PREPROCESS_PAD, (size_t)width_ * height_ * 3);
+    *lb = *fit;
+}
+
+int Preprocessor::run(const AVFrame *f, const SDL_Rect *crop, uint8_t *dst, letterbox_t *lb)
+{
+    SDL_Rect all = {0, 0, f->width, f->height};
+    const AVFrame *in = f;
+    AVFrame view;
+    letterbox_t fit;
+    int path = -1;
+
+    if (!crop)
+        crop = &all;
+    else if (crop->x || crop->y || crop->w != f->width || crop->h != f->height) {
+        crop_view(f, crop, &view);
+        in = &view;
+    }
+    letterbox_fit(crop->w, crop->h, width_, height_, &fit);
+    paint(dst, &fit, lb);
+    if (mode_ != PREPROCESS_CPU && rga(f, crop, dst, &fit) == 0)
+        path = PREPROCESS_PATH_RGA;
+    else if (mode_ != PREPROCESS_RGA && cpu(in, dst, &fit) == 0)
+        path = PREPROCESS_PATH_CPU;
+    if (path < 0)
+        return -1;
+    if (mode_ == PREPROCESS_CHECK && path == PREPROCESS_PATH_RGA)
+        compare(in, dst, &fit);
+    frames_[path]++;
+    return path;
+}
+
+int Preprocessor::run_dmabuf(int fd, int rga_format, int w, int h, int wstride, int hstride, const SDL_Rect *crop,
+                             uint8_t *dst, letterbox_t *lb)
+{
+#ifdef HAVE_RGA
+    SDL_Rect all = {0, 0, w, h};
+    letterbox_t fit;
+    rga_info_t src;
+
+    if (mode_ == PREPROCESS_CPU)
+        return -1;
+    if (!crop)
+        crop = &all;
+    letterbox_fit(crop->w, crop->h, width_, height_, &fit);
+    paint(dst, &fit, lb);
+    memset(&src, 0, sizeof(rga_info_t));
+    src.fd = fd;
+    src.mmuFlag = 1;
+    rga_set_rect(&src.rect, crop->x, crop->y, crop->w, crop->h, wstride, hstride, rga_format);
+    if (rga_letterbox(&src, dst, width_, height_, rgb_, &fit) < 0) {
+        rga_failed_++;
+        return -1;
+    }
+    frames_[PREPROCESS_PATH_RGA]++;
+    return PREPROCESS_PATH_RGA;
+#else
+    (void)fd;
+    (void)rga_format;
+    (void)w;
+    (void)h;
+    (void)wstride;
+    (void)hstride;
+    (void)crop;
+    (void)dst;
+    (void)lb;
+    return -1;
+#endif
+}
+
+/* -pp check: the CPU kernel on the same frame, byte by byte against what RGA wrote */
+void Preprocessor::compare(const AVFrame *f, const uint8_t *dst, const letterbox_t *lb)
+{
+    if (cpu(f, scratch_, lb) < 0)
+        return;
+    for (int r = lb->y; r < lb->y + lb->h; r++) {
+        size_t offset = ((size_t)r * width_ + lb->x) * 3;
+
+        for (int i = 0; i < lb->w * 3; i++) {
+            int d = abs(dst[offset + i] - scratch_[offset + i]);
+
+            check_sum_ += d;
+            check_over_ += d > PREPROCESS_TOLERANCE;
+            if (d > check_max_)
+                check_max_ = d;
+        }
+    }
+    check_bytes_ += (uint64_t)lb->w * lb->h * 3;
+    checked_++;
+}
+
+void Preprocessor::report() const
+{
+    fprintf(stderr, "preproc   : %6llu RGA  %6llu CPU (%llu split over %d threads)  %llu RGA failures\n",
+            (unsigned long long)frames_[PREPROCESS_PATH_RGA], (unsigned long long)frames_[PREPROCESS_PATH_CPU],
+            (unsigned long long)banded_, started_, (unsigned long long)rga_failed_);
+    if (checked_)
+        fprintf(stderr, "%-10s: %6llu frames  |RGA - CPU| max %d mean %.2f  %.3f%% over %d\n", "check",
+                (unsigned long long)checked_, check_max_, (double)check_sum_ / check_bytes_,
+                100.0 * check_over_ / check_bytes_, PREPROCESS_TOLERANCE);
+}
@@ -0,0 +1,141 @@
+#ifndef _FFRKNN_PREPROCESS_H_
+#define _FFRKNN_PREPROCESS_H_
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+
+#include <postprocess.h>
+
+struct AVFrame;
+
+#define PREPROCESS_PAD       114          // grey of the letterbox bars, what the yolo models are trained with
+#define PREPROCESS_BANDS     8            // threads the CPU kernel splits a picture across, the caller included
+#define PREPROCESS_BAND_MIN  (1280 * 720) // source pixels from which a picture is worth splitting
+#define PREPROCESS_TOLERANCE 8            // -pp check: bytes further apart than this count as a mismatch
+
+typedef enum _preprocess_mode_t
+{
+    PREPROCESS_AUTO = 0, // RGA when built with it, the CPU kernel for what RGA cannot take
+    PREPROCESS_RGA,      // RGA only
+    PREPROCESS_CPU,      // the CPU kernel only, dma-bufs are downloaded first
+    PREPROCESS_CHECK,    // RGA into the model input, the CPU kernel alongside, differences counted
+} preprocess_mode_t;
+
+typedef enum _preprocess_path_t
+{
+    PREPROCESS_PATH_RGA = 0,
+    PREPROCESS_PATH_CPU,
+    PREPROCESS_PATHS,
+} preprocess_path_t;
+
+/* src_w x src_h scaled into dst_w x dst_h as large as it fits without changing its aspect ratio, centred */
+void letterbox_fit(int src_w, int src_h, int dst_w, int dst_h, letterbox_t *lb);
+
+/* "auto", "rga", "cpu" or "check", -1 for anything else */
+int preprocess_parse_mode(const char *name);
+
+/*
+ * Decoded frame -> model input: letterboxed, YUV -> packed B G R (or
+ * R G B), by RGA or by the CPU kernel.
+ *
+ * The CPU kernel resizes bilinearly and converts BT.601 in one pass per
+ * output row: the two source rows are blended (NEON / SSE2), the row is
+ * resampled horizontally into line buffers, then converted and interleaved
+ * (NEON / SSE2), so the intermediate picture never exists. Large pictures
+ * are cut into row bands run on PREPROCESS_BANDS threads at most, started
+ * the first time one is needed. The SIMD and the plain C versions give the
+ * same bytes.
+ *
+ * One per thread that uses it: each stream's decode thread has its own,
+ * the inference thread one for the -roi crops.
+ */
+class Preprocessor
+{
+public:
+    Preprocessor();
+    ~Preprocessor();
+
+    /* width x height x 3 model input; threads: CPU kernel bands, 0 for one per core */
+    int init(int width, int height, int rgb, preprocess_mode_t mode, int threads);
+    void uninit();
+
+    /*
+     * f (YUV420P, YUVJ420P, NV12 or NV21 in memory) into dst. crop is the
+     * part of f to take, even coordinates, NULL for all of it; nothing is
+     * copied to cut it out. lb is where the previous picture went in that
+     * buffer, the bars are only painted again when it moves. Returns the
+     * path taken, -1 on error.
+     */
+    int run(const struct AVFrame *f, const SDL_Rect *crop, uint8_t *dst, letterbox_t *lb);
+    /* A dma-buf RGA reads directly, -1 without RGA or with -pp cpu */
+    int run_dmabuf(int fd, int rga_format, int w, int h, int wstride, int hstride, const SDL_Rect *crop, uint8_t *dst,
+                   letterbox_t *lb);
+
+    void report() const;
+
+private:
+    struct tap_t
+    {
+        int i0, i1; // source samples
+        int f;      // weight of i1 in 1/128
+    };
+
+    struct job_t
+    {
+        const uint8_t *y, *u, *v;
+        int y_stride, u_stride, v_stride;
+        int c_step; // 1 planar, 2 interleaved chroma
+        int src_w, src_h;
+        int full_range;
+        uint8_t *dst;
+        letterbox_t lb;
+    };
+
+    struct band_t
+    {
+        Preprocessor *pp;
+        int index;
+        SDL_Thread *thread;
+        SDL_sem *go;
+        uint8_t *line; // blended source rows and resampled output rows
+        int line_size;
+    };
+
+    static int band_main(void *data);
+    int start_bands(int n);
+    void rows(band_t *band, int r0, int r1);
+    int cpu(const struct AVFrame *f, uint8_t *dst, const letterbox_t *lb);
+    int rga(const struct AVFrame *f, const SDL_Rect *crop, uint8_t *dst, const letterbox_t *lb);
+    void paint(uint8_t *dst, const letterbox_t *fit, letterbox_t *lb);
+    void compare(const struct AVFrame *f, const uint8_t *dst, const letterbox_t *lb);
+
+    int width_, height_;
+    int rgb_;
+    preprocess_mode_t mode_;
+    int threads_;
+
+    job_t job_;
+    int n_bands_; // bands of the current job
+    band_t bands_[PREPROCESS_BANDS];
+    int started_;
+    int quit_;
+    SDL_sem *done_;
+
+    /* resampling taps, rebuilt when the source or the letterbox changes */
+    tap_t *x_luma_, *x_chroma_;
+    int taps_src_w_, taps_src_h_;
+    letterbox_t taps_lb_;
+
+    uint8_t *scratch_; // -pp check: what the CPU kernel makes of the frame RGA took
+
+    uint64_t frames_[PREPROCESS_PATHS];
+    uint64_t banded_;
+    uint64_t rga_failed_;
+    uint64_t checked_;
+    uint64_t check_bytes_;
+    uint64_t check_sum_;
+    uint64_t check_over_;
+    int check_max_;
+};
+
+#endif //_FFRKNN_PREPROCESS_H_
@@ -0,0 +1,397 @@
+/*
+ * Annotated output: boxes burnt into the shown frames, encoded and muxed.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "record.h"
+
+#include <overlay.h>
+
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+#include <libavutil/hwcontext.h>
+#include <libswscale/swscale.h>
+}
+
+FrameRecorder::FrameRecorder()
+    : encoder_(nullptr), fmt_ctx_(nullptr), enc_ctx_(nullptr), out_stream_(nullptr), sw_frame_(nullptr),
+      enc_frame_(nullptr), pkt_(nullptr), sws_(nullptr), thread_(nullptr), header_written_(0), failed_(0),
+      first_seq_(-1), spare_(nullptr), offered_(0), no_item_(0), depth_sum_(0), depth_max_(0), packets_(0),
+      bytes_(0), errors_(0)
+{
+    dest_[0] = 0;
+    memset(items_, 0, sizeof(items_));
+    stage_init(&stats_, "record");
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    close();
+}
+
+/* The first one that opens wins: h264_rkmpp is built in but needs the MPP device */
+int FrameRecorder::open_encoder(const char *name, int width, int height, AVRational frame_rate)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name(name);
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+    AVDictionary *opts = NULL;
+    int ret;
+
+    if (!codec)
+        return -1;
+    /* boxes are drawn in NV12 or YUV420P, NV12 first: what the decoder and MPP work in */
+    for (const enum AVPixelFormat *f = codec->pix_fmts; f && *f != AV_PIX_FMT_NONE; f++) {
+        if (*f == AV_PIX_FMT_NV12) {
+            pix_fmt = *f;
+            break;
+        }
+        if (*f == AV_PIX_FMT_YUV420P)
+            pix_fmt = *f;
+    }
+    if (pix_fmt == AV_PIX_FMT_NONE) {
+        fprintf(stderr, "record: %s takes neither NV12 nor YUV420P\n", name);
+        return -1;
+    }
+
+    if (!(enc_ctx_ = avcodec_alloc_context3(codec)))
+        return -1;
+    enc_ctx_->width = width & ~1;
+    enc_ctx_->height = height & ~1;
+    enc_ctx_->pix_fmt = pix_fmt;
+    enc_ctx_->time_base = av_inv_q(frame_rate);
+    enc_ctx_->framerate = frame_rate;
+    enc_ctx_->gop_size = (int)(av_q2d(frame_rate) * 2 + 0.5);
+    enc_ctx_->max_b_frames = 0; // restreams are watched live
+    enc_ctx_->bit_rate = (int64_t)(width * height * av_q2d(frame_rate) / 10); // ~6 Mbit/s at 1080p30
+    if (fmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
+        enc_ctx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (!strcmp(name, "libx264")) {
+        av_dict_set(&opts, "preset", "veryfast", 0);
+        av_dict_set(&opts, "tune", "zerolatency", 0);
+    }
+    ret = avcodec_open2(enc_ctx_, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "record: cannot open encoder %s\n", name);
+        avcodec_free_context(&enc_ctx_);
+        return -1;
+    }
+    encoder_ = codec->name;
+    return 0;
+}
+
+int FrameRecorder::open(const char *dest, const char *encoders, int width, int height, AVRational frame_rate,
+                        int n_classes)
+{
+    const char *format = NULL;
+    const char *p = encoders ? encoders : RECORD_ENCODERS;
+    AVDictionary *opts = NULL;
+    char name[64];
+    int ret;
+
+    snprintf(dest_, sizeof(dest_), "%s", dest);
+    if (frame_rate.num <= 0 || frame_rate.den <= 0)
+        frame_rate = (AVRational){30, 1};
+    /* network sinks have no file name to guess the muxer from */
+    if (!strncmp(dest, "rtsp://", 7))
+        format = "rtsp";
+    else if (!strncmp(dest, "rtmp://", 7))
+        format = "flv";
+    if (avformat_alloc_output_context2(&fmt_ctx_, NULL, format, dest) < 0 || !fmt_ctx_) {
+        fprintf(stderr, "record: no muxer for %s\n", dest);
+        fmt_ctx_ = nullptr;
+        return -1;
+    }
+
+    while (*p && !enc_ctx_) {
+        size_t n = strcspn(p, ",");
+
+        snprintf(name, sizeof(name), "%.*s", (int)n, p);
+        p += n + (p[n] == ',');
+        open_encoder(name, width, height, frame_rate);
+    }
+    if (!enc_ctx_) {
+        fprintf(stderr, "record: none of %s could be opened\n", encoders ? encoders : RECORD_ENCODERS);
+        close();
+        return -1;
+    }
+
+    if (!(out_stream_ = avformat_new_stream(fmt_ctx_, NULL)) ||
+        avcodec_parameters_from_context(out_stream_->codecpar, enc_ctx_) < 0) {
+        close();
+        return -1;
+    }
+    out_stream_->time_base = enc_ctx_->time_base;
+    if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE) && avio_open(&fmt_ctx_->pb, dest, AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "record: cannot open %s\n", dest);
+        close();
+        return -1;
+    }
+    if (format && !strcmp(format, "rtsp"))
+        av_dict_set(&opts, "rtsp_transport", "tcp", 0);
+    ret = avformat_write_header(fmt_ctx_, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "record: cannot start %s\n", dest);
+        close();
+        return -1;
+    }
+    header_written_ = 1;
+
+    sw_frame_ = av_frame_alloc();
+    enc_frame_ = av_frame_alloc();
+    pkt_ = av_packet_alloc();
+    if (!sw_frame_ || !enc_frame_ || !pkt_) {
+        close();
+        return -1;
+    }
+    enc_frame_->format = enc_ctx_->pix_fmt;
+    enc_frame_->width = enc_ctx_->width;
+    enc_frame_->height = enc_ctx_->height;
+    if (av_frame_get_buffer(enc_frame_, 0) < 0) {
+        close();
+        return -1;
+    }
+    for (int i = 0; i < RECORD_FRAMES; i++) {
+        if (!(items_[i].frame = av_frame_alloc())) {
+            close();
+            return -1;
+        }
+        free_.push(&items_[i]);
+    }
+
+    /* BT.601 limited range, what the encoders assume by default */
+    for (int i = 0; i < OBJ_CLASS_MAX; i++) {
+        SDL_Color c = overlay_class_color(i < n_classes ? getLabelName(i) : NULL);
+        int r = c.r, g = c.g, b = c.b;
+
+        colors_[i][0] = (uint8_t)(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+        colors_[i][1] = (uint8_t)(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+        colors_[i][2] = (uint8_t)(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+    }
+    fprintf(stderr, "record: %s %dx%d %.2f fps -> %s\n", encoder_, enc_ctx_->width, enc_ctx_->height,
+            av_q2d(frame_rate), dest);
+    return 0;
+}
+
+int FrameRecorder::start()
+{
+    thread_ = SDL_CreateThread(thread_main, "SDL_RecordThread", this);
+    return thread_ ? 0 : -1;
+}
+
+void FrameRecorder::close()
+{
+    record_item_t *evicted = nullptr;
+
+    if (thread_) {
+        /* the end marker may push the oldest frame out, it is not worth waiting for */
+        queue_.push(nullptr, &evicted);
+        SDL_WaitThread(thread_, NULL);
+        thread_ = nullptr;
+    }
+    if (fmt_ctx_) {
+        if (header_written_)
+            av_write_trailer(fmt_ctx_);
+        if (!(fmt_ctx_->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&fmt_ctx_->pb);
+        avformat_free_context(fmt_ctx_);
+        fmt_ctx_ = nullptr;
+    }
+    header_written_ = 0;
+    avcodec_free_context(&enc_ctx_);
+    av_frame_free(&sw_frame_);
+    av_frame_free(&enc_frame_);
+    av_packet_free(&pkt_);
+    sws_freeContext(sws_);
+    sws_ = nullptr;
+    /* queued pictures go back to the decoder and the pools with their items */
+    for (int i = 0; i < RECORD_FRAMES; i++)
+        av_frame_free(&items_[i].frame);
+}
+
+void FrameRecorder::push(const AVFrame *frame, int64_t seq, const detect_result_group_t *detect)
+{
+    record_item_t *item = spare_;
+    record_item_t *evicted = nullptr;
+    unsigned depth;
+
+    offered_++;
+    if (item)
+        spare_ = nullptr;
+    else if (free_.try_pop(&item) != 0) {
+        no_item_++;
+        return;
+    }
+    /* an evicted item still holds its picture */
+    av_frame_unref(item->frame);
+    if (av_frame_ref(item->frame, frame) < 0) {
+        no_item_++;
+        spare_ = item;
+        return;
+    }
+    item->seq = seq;
+    item->detect = *detect;
+
+    depth = queue_.size();
+    depth_sum_ += depth;
+    if (depth > depth_max_)
+        depth_max_ = depth;
+    if (queue_.push(item, &evicted) < 0) {
+        av_frame_unref(item->frame);
+        spare_ = item;
+        return;
+    }
+    if (evicted) {
+        av_frame_unref(evicted->frame);
+        spare_ = evicted;
+    }
+}
+
+int FrameRecorder::thread_main(void *data)
+{
+    FrameRecorder *r = (FrameRecorder *)data;
+    record_item_t *item;
+
+    while (r->queue_.pop(&item) == 0 && item) {
+        stage_begin(&r->stats_);
+        /* once the sink is gone frames are only taken off the queue */
+        if (!r->failed_ && r->encode(item) < 0)
+            r->errors_++;
+        stage_end(&r->stats_);
+        av_frame_unref(item->frame);
+        r->free_.push(item);
+    }
+    if (!r->failed_ && avcodec_send_frame(r->enc_ctx_, NULL) >= 0)
+        r->write_packets();
+    return 0;
+}
+
+int FrameRecorder::encode(record_item_t *item)
+{
+    AVFrame *src = item->frame;
+
+    if (src->format == AV_PIX_FMT_DRM_PRIME) {
+        av_frame_unref(sw_frame_);
+        if (av_hwframe_transfer_data(sw_frame_, src, 0) < 0)
+            return -1;
+        src = sw_frame_;
+    }
+    sws_ = sws_getCachedContext(sws_, src->width, src->height, (enum AVPixelFormat)src->format, enc_ctx_->width,
+                                enc_ctx_->height, enc_ctx_->pix_fmt, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    if (!sws_)
+        return -1;
+    /* the encoder may still hold the previous picture */
+    if (av_frame_make_writable(enc_frame_) < 0)
+        return -1;
+    sws_scale(sws_, (const uint8_t *const *)src->data, src->linesize, 0, src->height, enc_frame_->data,
+              enc_frame_->linesize);
+    draw_boxes(item);
+
+    if (first_seq_ < 0)
+        first_seq_ = item->seq;
+    enc_frame_->pts = item->seq - first_seq_;
+    if (avcodec_send_frame(enc_ctx_, enc_frame_) < 0)
+        return -1;
+    return write_packets();
+}
+
+int FrameRecorder::write_packets()
+{
+    int ret;
+
+    while ((ret = avcodec_receive_packet(enc_ctx_, pkt_)) >= 0) {
+        av_packet_rescale_ts(pkt_, enc_ctx_->time_base, out_stream_->time_base);
+        pkt_->stream_index = out_stream_->index;
+        packets_++;
+        bytes_ += pkt_->size;
+        /* a slow sink blocks here, only this thread waits on it */
+        if (av_interleaved_write_frame(fmt_ctx_, pkt_) < 0) {
+            fprintf(stderr, "record: writing to %s failed, recording stopped\n", dest_);
+            failed_ = 1;
+            return -1;
+        }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : -1;
+}
+
+/* Solid rectangle [x0, x1) x [y0, y1), widened to whole chroma samples */
+void FrameRecorder::fill(int x0, int y0, int x1, int y1, const uint8_t *yuv)
+{
+    AVFrame *f = enc_frame_;
+
+    x0 = x0 < 0 ? 0 : x0 & ~1;
+    y0 = y0 < 0 ? 0 : y0 & ~1;
+    x1 = x1 > f->width ? f->width : (x1 + 1) & ~1;
+    y1 = y1 > f->height ? f->height : (y1 + 1) & ~1;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    for (int y = y0; y < y1; y++)
+        memset(f->data[0] + y * f->linesize[0] + x0, yuv[0], x1 - x0);
+    for (int y = y0 / 2; y < y1 / 2; y++) {
+        if (f->format == AV_PIX_FMT_NV12) {
+            uint8_t *uv = f->data[1] + y * f->linesize[1] + x0;
+
+            for (int x = x0; x < x1; x += 2, uv += 2) {
+                uv[0] = yuv[1];
+                uv[1] = yuv[2];
+            }
+        } else {
+            memset(f->data[1] + y * f->linesize[1] + x0 / 2, yuv[1], (x1 - x0) / 2);
+            memset(f->data[2] + y * f->linesize[2] + x0 / 2, yuv[2], (x1 - x0) / 2);
+        }
+    }
+}
+
+void FrameRecorder::draw_boxes(const record_item_t *item)
+{
+    const detect_result_group_t *g = &item->detect;
+
+    for (int i = 0; i < g->count; i++) {
+        const detect_result_t *r = &g->results[i];
+        const uint8_t *c = colors_[(unsigned)r->class_id < OBJ_CLASS_MAX ? r->class_id : 0];
+        int l = r->box.left;
+        int t = r->box.top;
+        int rt = r->box.right + 1;
+        int b = r->box.bottom + 1;
+
+        fill(l, t, rt, t + RECORD_LINE, c);
+        fill(l, b - RECORD_LINE, rt, b, c);
+        fill(l, t, l + RECORD_LINE, b, c);
+        fill(rt - RECORD_LINE, t, rt, b, c);
+    }
+}
+
+void FrameRecorder::report() const
+{
+    double secs = (stats_.last_us - stats_.first_us) / 1000000.0;
+    uint64_t dropped = queue_.dropped() + no_item_;
+
+    if (!offered_)
+        return;
+    stage_report(&stats_);
+    fprintf(stderr, "%-10s: %s -> %s  %llu packets  %.0f kbit/s  %llu frames failed\n", "record",
+            encoder_ ? encoder_ : "-", dest_, (unsigned long long)packets_, secs > 0 ? bytes_ * 8 / 1000.0 / secs : 0.0,
+            (unsigned long long)errors_);
+    fprintf(stderr, "%-10s: queue %.2f avg %u max of %u  %llu of %llu frames dropped by a slow encoder or sink\n",
+            "record", (double)depth_sum_ / offered_, depth_max_, queue_.capacity(), (unsigned long long)dropped,
+            (unsigned long long)offered_);
+}
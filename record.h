@@ -0,0 +1,106 @@
+#ifndef _FFRKNN_RECORD_H_
+#define _FFRKNN_RECORD_H_
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+
+#include <pipeline.h>
+#include <postprocess.h>
+#include <spsc_ring.h>
+
+extern "C" {
+#include <libavutil/rational.h>
+}
+
+struct AVCodecContext;
+struct AVFormatContext;
+struct AVFrame;
+struct AVPacket;
+struct AVStream;
+struct SwsContext;
+
+#define RECORD_QUEUE  2                  // frames waiting for the encoder, the oldest goes when a new one comes
+#define RECORD_FRAMES (RECORD_QUEUE + 2) // pictures the recorder may hold: queued, encoding, evicted spare
+#define RECORD_LINE   3                  // box outline width in pixels
+#define RECORD_ENCODERS "h264_rkmpp,libx264,mpeg4" // tried in order when -c does not name one
+
+/* A shown frame on its way to the encoder */
+typedef struct _record_item_t
+{
+    struct AVFrame *frame; // reference to the decoder's or the pool's picture, nothing copied
+    int64_t seq;
+    detect_result_group_t detect; // in frame pixels
+} record_item_t;
+
+/*
+ * Annotated output: the frames the display shows, boxes burnt in, encoded
+ * and muxed to a file or an rtsp:// / rtmp:// sink.
+ *
+ * The display thread only queues a reference to the picture with its
+ * detections. Download, conversion, drawing, encoding and muxing run on the
+ * recorder's own thread, behind a RECORD_QUEUE deep ring that drops the
+ * oldest frame when full, so a slow encoder or a stalled network sink loses
+ * frames in the recording instead of holding up inference or display.
+ * Timestamps follow the frame sequence, dropped frames leave gaps rather
+ * than speeding the video up.
+ */
+class FrameRecorder
+{
+public:
+    FrameRecorder();
+    ~FrameRecorder();
+
+    /* once per recorder; encoders: comma separated names tried in order, NULL for RECORD_ENCODERS */
+    int open(const char *dest, const char *encoders, int width, int height, AVRational frame_rate, int n_classes);
+    int start();
+    /* stops taking frames, encodes what is queued, flushes the encoder and closes the output */
+    void close();
+    bool is_open() const { return fmt_ctx_ != nullptr; }
+
+    /* display thread: never waits, the frame is only referenced */
+    void push(const struct AVFrame *frame, int64_t seq, const detect_result_group_t *detect);
+
+    void report() const;
+
+private:
+    static int thread_main(void *data);
+    int open_encoder(const char *name, int width, int height, AVRational frame_rate);
+    int encode(record_item_t *item);
+    int write_packets();
+    void draw_boxes(const record_item_t *item);
+    void fill(int x0, int y0, int x1, int y1, const uint8_t *yuv);
+
+    char dest_[1024];
+    const char *encoder_;
+    struct AVFormatContext *fmt_ctx_;
+    struct AVCodecContext *enc_ctx_;
+    struct AVStream *out_stream_;
+    struct AVFrame *sw_frame_;  // DRM_PRIME picture downloaded to memory
+    struct AVFrame *enc_frame_; // what the encoder gets, in its own format and size
+    struct AVPacket *pkt_;
+    struct SwsContext *sws_;
+    SDL_Thread *thread_;
+    int header_written_;
+    int failed_;
+    int64_t first_seq_;
+    uint8_t colors_[OBJ_CLASS_MAX][3]; // class colours of the display, in the encoder's YUV
+
+    SpscRing<record_item_t *> queue_{RECORD_QUEUE, RING_DROP_OLDEST}; // display -> recorder
+    SpscRing<record_item_t *> free_{RECORD_FRAMES};                    // recorder -> display
+    record_item_t items_[RECORD_FRAMES];
+    record_item_t *spare_; // evicted from queue_, reused by the display first
+
+    /* display thread */
+    uint64_t offered_;
+    uint64_t no_item_;
+    uint64_t depth_sum_;
+    unsigned depth_max_;
+
+    /* recorder thread */
+    stage_stats_t stats_;
+    uint64_t packets_;
+    uint64_t bytes_;
+    uint64_t errors_;
+};
+
+#endif //_FFRKNN_RECORD_H_
@@ -0,0 +1,289 @@
+/*
+ * Deterministic CPU reference backend: empty, synthetic or recorded
+ * int8 output tensors with a configurable latency.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "infer_backend.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#define RECORD_MAGIC   "FFRT"
+#define RECORD_VERSION 1
+
+#define SYNTH_OBJECTS 4
+
+enum replay_mode_t {
+    REPLAY_EMPTY = 0,
+    REPLAY_SYNTH,
+    REPLAY_FILE,
+};
+
+class ReplayBackend : public InferBackend
+{
+public:
+    ReplayBackend(const char *source, int latency_ms)
+        : mode_(REPLAY_EMPTY), path_(source), latency_ms_(latency_ms), fd_(-1), header_size_(0), frame_size_(0),
+          n_frames_(0)
+    {
+        if (source)
+            mode_ = strcmp(source, "synth") ? REPLAY_FILE : REPLAY_SYNTH;
+    }
+
+    ~ReplayBackend()
+    {
+        stop();
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    const char *name() const { return mode_ == REPLAY_FILE ? "replay" : (mode_ == REPLAY_SYNTH ? "synth" : "stub"); }
+
+    int init(const void *model, size_t model_size, int n_workers);
+
+protected:
+    int run(int worker, infer_job_t *job);
+
+private:
+    void init_yolov5_attrs();
+    int open_recording();
+    off_t frame_offset(int64_t seq) const;
+    void synth_objects(int64_t seq, int8_t **outputs);
+
+    replay_mode_t mode_;
+    const char *path_;
+    int latency_ms_;
+    int fd_;
+    off_t header_size_;
+    off_t frame_size_;
+    int64_t n_frames_;
+    std::vector<std::pair<int64_t, int64_t>> index_; // (recorded seq, frame in the file), by seq
+};
+
+/* YOLOv5 640x640 heads, quantized so that -128 dequantizes far below any threshold */
+void ReplayBackend::init_yolov5_attrs()
+{
+    static const int grids[3] = {80, 40, 20};
+
+    n_inputs_ = 1;
+    strcpy(in_attrs_[0].name, "images");
+    in_attrs_[0].n_dims = 4;
+    in_attrs_[0].dims[0] = 1;
+    in_attrs_[0].dims[1] = 640;
+    in_attrs_[0].dims[2] = 640;
+    in_attrs_[0].dims[3] = 3;
+    in_attrs_[0].n_elems = 640 * 640 * 3;
+    in_attrs_[0].nchw = 0;
+
+    n_outputs_ = 3;
+    for (int i = 0; i < n_outputs_; i++) {
+        infer_tensor_attr_t *attr = &out_attrs_[i];
+
+        snprintf(attr->name, sizeof(attr->name), "output%d", i);
+        attr->n_dims = 4;
+        attr->dims[0] = 1;
+        attr->dims[1] = 255;
+        attr->dims[2] = grids[i];
+        attr->dims[3] = grids[i];
+        attr->n_elems = 255 * grids[i] * grids[i];
+        attr->nchw = 1;
+        attr->zp = 0;
+        attr->scale = 0.1f;
+    }
+}
+
+int ReplayBackend::open_recording()
+{
+    char magic[4];
+    uint32_t version, n_outputs;
+    struct stat st;
+    FILE *fp;
+
+    fp = fopen(path_, "rb");
+    if (!fp) {
+        fprintf(stderr, "Open file %s failed.\n", path_);
+        return -1;
+    }
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, RECORD_MAGIC, 4) || fread(&version, 4, 1, fp) != 1 ||
+        version != RECORD_VERSION || fread(&n_outputs, 4, 1, fp) != 1 || n_outputs > INFER_MAX_TENSORS ||
+        fread(&in_attrs_[0], sizeof(infer_tensor_attr_t), 1, fp) != 1 ||
+        fread(out_attrs_, sizeof(infer_tensor_attr_t), n_outputs, fp) != n_outputs) {
+        fprintf(stderr, "%s: not a tensor recording\n", path_);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    n_inputs_ = 1;
+    n_outputs_ = n_outputs;
+    header_size_ = 12 + (off_t)sizeof(infer_tensor_attr_t) * (1 + n_outputs);
+    frame_size_ = sizeof(int64_t);
+    for (int i = 0; i < n_outputs_; i++)
+        frame_size_ += out_attrs_[i].n_elems;
+
+    /* workers read their frame with pread(), no shared file position */
+    fd_ = open(path_, O_RDONLY);
+    if (fd_ < 0 || fstat(fd_, &st) < 0)
+        return -1;
+    n_frames_ = (st.st_size - header_size_) / frame_size_;
+    if (n_frames_ <= 0) {
+        fprintf(stderr, "%s: no frames recorded\n", path_);
+        return -1;
+    }
+
+    /* only inferred frames are recorded (-j, -mg): frames are found by their seq, not their position */
+    index_.resize(n_frames_);
+    for (int64_t i = 0; i < n_frames_; i++) {
+        if (pread(fd_, &index_[i].first, sizeof(int64_t), header_size_ + i * frame_size_) != sizeof(int64_t)) {
+            fprintf(stderr, "%s: cannot read frame %lld\n", path_, (long long)i);
+            return -1;
+        }
+        index_[i].second = i;
+    }
+    std::stable_sort(index_.begin(), index_.end(),
+                     [](const std::pair<int64_t, int64_t> &a, const std::pair<int64_t, int64_t> &b) {
+                         return a.first < b.first;
+                     });
+    fprintf(stderr, "replay: %s, %lld frames (seq %lld to %lld), %d outputs\n", path_, (long long)n_frames_,
+            (long long)index_.front().first, (long long)index_.back().first, n_outputs_);
+    return 0;
+}
+
+/*
+ * The recorded frame of seq. A frame that was not inferred while recording
+ * gets the latest one recorded before it, as the detections shown then
+ * were; past the end the recording starts over.
+ */
+off_t ReplayBackend::frame_offset(int64_t seq) const
+{
+    int64_t last = index_.back().first;
+    auto it = std::upper_bound(index_.begin(), index_.end(), std::make_pair(seq % (last + 1), INT64_MAX));
+
+    if (it != index_.begin())
+        --it;
+    return header_size_ + it->second * frame_size_;
+}
+
+int ReplayBackend::init(const void *model, size_t model_size, int n_workers)
+{
+    /* no model, the outputs come from source */
+    (void)model;
+    (void)model_size;
+
+    if (n_workers <= 0 || n_workers > INFER_MAX_WORKERS)
+        n_workers = 1;
+
+    if (mode_ == REPLAY_FILE) {
+        if (open_recording() < 0)
+            return -1;
+    } else {
+        init_yolov5_attrs();
+    }
+    n_workers_ = n_workers;
+    return 0;
+}
+
+/* A few boxes of anchor size on the stride 32 head, drifting with the frame number */
+void ReplayBackend::synth_objects(int64_t seq, int8_t **outputs)
+{
+    static const int classes[SYNTH_OBJECTS] = {0, 2, 5, 7}; // person, car, bus, truck
+    const int grid = out_attrs_[2].dims[2];
+    const int grid_len = grid * grid;
+    const int prop = 255 / 3;
+
+    for (int o = 0; o < SYNTH_OBJECTS; o++) {
+        int a = o % 3;
+        int i = (int)((o * 5 + seq / 2) % grid);
+        int j = (int)((o * 7 + 3 + seq / 3) % grid);
+        int8_t *cell = outputs[2] + (prop * a) * grid_len + i * grid + j;
+
+        cell[0] = 0;                               // x: sigmoid(0) * 2 - 0.5 = cell centre
+        cell[grid_len] = 0;                        // y
+        cell[2 * grid_len] = 0;                    // w: (sigmoid(0) * 2)^2 = anchor width
+        cell[3 * grid_len] = 0;                    // h
+        cell[4 * grid_len] = 50;                   // objectness: sigmoid(5.0)
+        cell[(5 + classes[o]) * grid_len] = 50;    // class score
+    }
+}
+
+int ReplayBackend::run(int worker, infer_job_t *job)
+{
+    (void)worker;
+
+    if (latency_ms_ > 0)
+        SDL_Delay(latency_ms_);
+
+    if (mode_ == REPLAY_FILE) {
+        off_t offset = frame_offset(job->seq) + sizeof(int64_t);
+
+        for (int i = 0; i < n_outputs_; i++) {
+            if (pread(fd_, job->outputs[i], out_attrs_[i].n_elems, offset) != (ssize_t)out_attrs_[i].n_elems)
+                return -1;
+            offset += out_attrs_[i].n_elems;
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < n_outputs_; i++)
+        memset(job->outputs[i], -128, out_attrs_[i].n_elems);
+    if (mode_ == REPLAY_SYNTH)
+        synth_objects(job->seq, job->outputs);
+    return 0;
+}
+
+InferBackend *create_replay_backend(const char *source, int latency_ms)
+{
+    return new ReplayBackend(source, latency_ms);
+}
+
+FILE *tensor_record_open(const char *path, const infer_tensor_attr_t *input, int n_outputs,
+                         const infer_tensor_attr_t *attrs)
+{
+    uint32_t version = RECORD_VERSION;
+    uint32_t n = n_outputs;
+    FILE *fp;
+
+    fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Open file %s failed.\n", path);
+        return NULL;
+    }
+    fwrite(RECORD_MAGIC, 1, 4, fp);
+    fwrite(&version, 4, 1, fp);
+    fwrite(&n, 4, 1, fp);
+    fwrite(input, sizeof(infer_tensor_attr_t), 1, fp);
+    fwrite(attrs, sizeof(infer_tensor_attr_t), n_outputs, fp);
+    return fp;
+}
+
+int tensor_record_write(FILE *fp, const infer_job_t *job, int n_outputs, const infer_tensor_attr_t *attrs)
+{
+    if (fwrite(&job->seq, sizeof(int64_t), 1, fp) != 1)
+        return -1;
+    for (int i = 0; i < n_outputs; i++) {
+        if (fwrite(job->outputs[i], 1, attrs[i].n_elems, fp) != attrs[i].n_elems)
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Rockchip NPU inference backend: one rknn context per worker.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "infer_backend.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rknn/rknn_api.h>
+
+class RknnBackend : public InferBackend
+{
+public:
+    RknnBackend() { memset(ctx_, 0, sizeof(ctx_)); }
+
+    ~RknnBackend()
+    {
+        /* workers must be gone before their contexts */
+        stop();
+        for (int i = INFER_MAX_WORKERS - 1; i >= 0; i--) {
+            if (ctx_[i])
+                rknn_destroy(ctx_[i]);
+        }
+    }
+
+    const char *name() const { return "rknn"; }
+
+    int init(const void *model, size_t model_size, int n_workers);
+
+protected:
+    int run(int worker, infer_job_t *job);
+
+private:
+    static void to_attr(const rknn_tensor_attr *src, infer_tensor_attr_t *dst);
+
+    rknn_context ctx_[INFER_MAX_WORKERS];
+    rknn_input_output_num io_num_;
+};
+
+void RknnBackend::to_attr(const rknn_tensor_attr *src, infer_tensor_attr_t *dst)
+{
+    memset(dst, 0, sizeof(infer_tensor_attr_t));
+    strncpy(dst->name, src->name, sizeof(dst->name) - 1);
+    dst->n_dims = src->n_dims < 4 ? src->n_dims : 4;
+    for (int i = 0; i < dst->n_dims; i++)
+        dst->dims[i] = src->dims[i];
+    dst->n_elems = src->n_elems;
+    dst->nchw = src->fmt == RKNN_TENSOR_NCHW;
+    dst->zp = src->zp;
+    dst->scale = src->scale;
+}
+
+int RknnBackend::init(const void *model, size_t model_size, int n_workers)
+{
+    /* RK3588: one context per NPU core, beyond that contexts share the cores */
+    static const rknn_core_mask core_masks[3] = {RKNN_NPU_CORE_0, RKNN_NPU_CORE_1, RKNN_NPU_CORE_2};
+    rknn_tensor_attr attr;
+    rknn_sdk_version version;
+    int ret;
+
+    if (n_workers <= 0 || n_workers > INFER_MAX_WORKERS)
+        n_workers = 1;
+
+    /* rknn_init() takes the size as a uint32_t */
+    if (model_size > UINT32_MAX) {
+        fprintf(stderr, "rknn: model of %zu bytes, rknn_init() takes 4 GB at most\n", model_size);
+        return -1;
+    }
+
+    /* only read, the runtime copies the model into its own memory: the read-only mapping is safe to pass */
+    ret = rknn_init(&ctx_[0], (void *)model, (uint32_t)model_size, 0, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "rknn_init error ret=%d\n", ret);
+        return -1;
+    }
+
+    ret = rknn_query(ctx_[0], RKNN_QUERY_SDK_VERSION, &version, sizeof(rknn_sdk_version));
+    if (ret < 0) {
+        fprintf(stderr, "rknn_query error ret=%d\n", ret);
+        return -1;
+    }
+    fprintf(stderr, "sdk version: %s driver version: %s\n", version.api_version, version.drv_version);
+
+    ret = rknn_query(ctx_[0], RKNN_QUERY_IN_OUT_NUM, &io_num_, sizeof(io_num_));
+    if (ret < 0) {
+        fprintf(stderr, "rknn_query error ret=%d\n", ret);
+        return -1;
+    }
+    fprintf(stderr, "model input num: %d, output num: %d\n", io_num_.n_input, io_num_.n_output);
+    if (io_num_.n_input > INFER_MAX_TENSORS || io_num_.n_output > INFER_MAX_TENSORS) {
+        fprintf(stderr, "rknn: too many tensors\n");
+        return -1;
+    }
+
+    n_inputs_ = io_num_.n_input;
+    for (int i = 0; i < n_inputs_; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.index = i;
+        ret = rknn_query(ctx_[0], RKNN_QUERY_INPUT_ATTR, &attr, sizeof(rknn_tensor_attr));
+        if (ret < 0) {
+            fprintf(stderr, "rknn_query error ret=%d\n", ret);
+            return -1;
+        }
+        to_attr(&attr, &in_attrs_[i]);
+    }
+
+    n_outputs_ = io_num_.n_output;
+    for (int i = 0; i < n_outputs_; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.index = i;
+        ret = rknn_query(ctx_[0], RKNN_QUERY_OUTPUT_ATTR, &attr, sizeof(rknn_tensor_attr));
+        if (ret < 0) {
+            fprintf(stderr, "rknn_query error ret=%d\n", ret);
+            return -1;
+        }
+        to_attr(&attr, &out_attrs_[i]);
+    }
+
+    for (int i = 1; i < n_workers; i++) {
+        ret = rknn_dup_context(&ctx_[0], &ctx_[i]);
+        if (ret < 0) {
+            fprintf(stderr, "rknn_dup_context error ret=%d, using %d context(s)\n", ret, i);
+            n_workers = i;
+            break;
+        }
+    }
+    if (n_workers > 1) {
+        for (int i = 0; i < n_workers; i++) {
+            ret = rknn_set_core_mask(ctx_[i], core_masks[i % 3]);
+            if (ret < 0)
+                fprintf(stderr, "rknn_set_core_mask(%d) error ret=%d\n", i, ret);
+        }
+    }
+    n_workers_ = n_workers;
+    fprintf(stderr, "rknn: %d context(s)\n", n_workers_);
+    return 0;
+}
+
+int RknnBackend::run(int worker, infer_job_t *job)
+{
+    rknn_context ctx = ctx_[worker];
+    rknn_input inputs[1];
+    rknn_output out[INFER_MAX_TENSORS];
+    int ret;
+
+    memset(inputs, 0, sizeof(inputs));
+    inputs[0].index = 0;
+    inputs[0].type = RKNN_TENSOR_UINT8;
+    inputs[0].size = in_attrs_[0].n_elems;
+    inputs[0].fmt = RKNN_TENSOR_NHWC;
+    inputs[0].pass_through = 0;
+    inputs[0].buf = (void *)job->input;
+
+    ret = rknn_inputs_set(ctx, 1, inputs);
+    if (ret < 0)
+        return ret;
+
+    ret = rknn_run(ctx, NULL);
+    if (ret < 0)
+        return ret;
+
+    /* write straight into the job's buffers so the context is free for the next frame */
+    memset(out, 0, sizeof(out));
+    for (int i = 0; i < n_outputs_; i++) {
+        out[i].index = i;
+        out[i].want_float = 0;
+        out[i].is_prealloc = 1;
+        out[i].buf = job->outputs[i];
+        out[i].size = out_attrs_[i].n_elems;
+    }
+    ret = rknn_outputs_get(ctx, n_outputs_, out, NULL);
+    if (ret < 0)
+        return ret;
+    rknn_outputs_release(ctx, n_outputs_, out);
+    return 0;
+}
+
+InferBackend *create_rknn_backend(void)
+{
+    return new RknnBackend();
+}
@@ -0,0 +1,220 @@
+/*
+ * Tiled / region of interest inference: layout, motion test, cross-region NMS.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "roi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROI_MIN_SIZE 32 // regions clamped to the frame below this are dropped
+
+int roi_parse(const char *spec, roi_spec_t *out)
+{
+    const char *p = spec;
+
+    memset(out, 0, sizeof(roi_spec_t));
+    while (*p) {
+        roi_item_t *item = &out->items[out->n];
+        int len = (int)strcspn(p, ";");
+        int used = 0, ok = 0;
+
+        if (out->n == ROI_MAX) {
+            fprintf(stderr, "roi: at most %d regions in %s\n", ROI_MAX, spec);
+            return -1;
+        }
+        if (len == 4 && !strncmp(p, "full", 4)) {
+            item->kind = ROI_FULL;
+            ok = 1;
+        } else if (len == 4 && !strncmp(p, "grid", 4)) {
+            item->kind = ROI_GRID;
+            ok = 1;
+        } else if (sscanf(p, "%d,%d,%d,%d%n", &item->x, &item->y, &item->w, &item->h, &used) == 4 && used == len) {
+            item->kind = ROI_RECT;
+            ok = item->x >= 0 && item->y >= 0 && item->w >= ROI_MIN_SIZE && item->h >= ROI_MIN_SIZE;
+        } else if (sscanf(p, "%dx%d%n", &item->w, &item->h, &used) == 2 && used == len) {
+            item->kind = ROI_TILES;
+            ok = item->w >= 1 && item->h >= 1 && item->w * item->h <= ROI_MAX;
+        }
+        if (!ok) {
+            fprintf(stderr, "roi: cannot take \"%.*s\" in %s\n", len, p, spec);
+            return -1;
+        }
+        out->n++;
+        p += len;
+        if (*p == ';')
+            p++;
+    }
+    if (!out->n) {
+        fprintf(stderr, "roi: no region in \"%s\"\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+/* Tiles of size tile along frame, at least ROI_OVERLAP of it shared with the next one, spread evenly */
+static int tiles_along(int frame, int tile)
+{
+    int step = (int)(tile * (1.0f - ROI_OVERLAP));
+
+    if (tile >= frame || step < 1)
+        return 1;
+    return 1 + (frame - tile + step - 1) / step;
+}
+
+static int tile_at(int frame, int tile, int n, int i)
+{
+    return n > 1 ? (int)((int64_t)(frame - tile) * i / (n - 1)) : 0;
+}
+
+RoiScheduler::RoiScheduler()
+    : model_w_(0), model_h_(0), frame_w_(0), frame_h_(0), n_(0), n_todo_(0), frames_(0), inferred_(0), still_(0),
+      refreshed_(0), merged_in_(0), merged_out_(0)
+{
+    memset(&spec_, 0, sizeof(spec_));
+}
+
+void RoiScheduler::init(const roi_spec_t *spec, int model_w, int model_h)
+{
+    spec_ = *spec;
+    model_w_ = model_w;
+    model_h_ = model_h;
+    frame_w_ = frame_h_ = 0;
+    n_ = 0;
+    nms_.reserve(ROI_CANDIDATES);
+}
+
+/* Clamped to the frame, even coordinates for RGA and the chroma planes */
+void RoiScheduler::add(int x, int y, int w, int h)
+{
+    SDL_Rect *r = &rects_[n_];
+
+    if (n_ == ROI_MAX)
+        return;
+    r->x = SDL_min(x, frame_w_) & ~1;
+    r->y = SDL_min(y, frame_h_) & ~1;
+    r->w = SDL_min(w, frame_w_ - r->x) & ~1;
+    r->h = SDL_min(h, frame_h_ - r->y) & ~1;
+    if (r->w < ROI_MIN_SIZE || r->h < ROI_MIN_SIZE)
+        return;
+    memset(&results_[n_], 0, sizeof(detect_result_group_t));
+    inferred_seq_[n_] = -1;
+    n_++;
+}
+
+void RoiScheduler::layout(int w, int h)
+{
+    frame_w_ = w;
+    frame_h_ = h;
+    n_ = 0;
+    for (int i = 0; i < spec_.n; i++) {
+        const roi_item_t *item = &spec_.items[i];
+        int tw, th, nx, ny;
+
+        switch (item->kind) {
+        case ROI_FULL:
+            add(0, 0, w, h);
+            continue;
+        case ROI_RECT:
+            add(item->x, item->y, item->w, item->h);
+            continue;
+        case ROI_GRID:
+            tw = SDL_min(model_w_, w);
+            th = SDL_min(model_h_, h);
+            nx = tiles_along(w, tw);
+            ny = tiles_along(h, th);
+            break;
+        case ROI_TILES:
+        default:
+            nx = item->w;
+            ny = item->h;
+            /* n tiles overlapping by ROI_OVERLAP of their size span n - (n - 1) * ROI_OVERLAP of them */
+            tw = ((int)(w / (nx - (nx - 1) * ROI_OVERLAP) + 0.999f) + 1) & ~1;
+            th = ((int)(h / (ny - (ny - 1) * ROI_OVERLAP) + 0.999f) + 1) & ~1;
+            break;
+        }
+        for (int ty = 0; ty < ny; ty++)
+            for (int tx = 0; tx < nx; tx++)
+                add(tile_at(w, tw, nx, tx), tile_at(h, th, ny, ty), tw, th);
+    }
+    if (n_ == ROI_MAX)
+        fprintf(stderr, "roi: %dx%d cut into more than %d regions, the rest is left out\n", w, h, ROI_MAX);
+}
+
+int RoiScheduler::begin(int w, int h, int64_t seq, const MotionGate *motion)
+{
+    if (w != frame_w_ || h != frame_h_)
+        layout(w, h);
+    frames_++;
+
+    n_todo_ = 0;
+    for (int r = 0; r < n_; r++) {
+        int moved = !motion || !motion->enabled() || motion->moved(&rects_[r]);
+
+        if (!moved && inferred_seq_[r] >= 0 && seq - inferred_seq_[r] < motion->refresh()) {
+            still_++;
+            continue;
+        }
+        refreshed_ += !moved;
+        inferred_seq_[r] = seq;
+        todo_[n_todo_++] = r;
+    }
+    inferred_ += n_todo_;
+    return n_todo_;
+}
+
+void RoiScheduler::merge(float nms_threshold, detect_result_group_t *out)
+{
+    nms_params_t params = {NMS_HARD, nms_threshold, 0.0f, 0.0f, 0, OBJ_NUMB_MAX_SIZE};
+    int n = 0, kept;
+
+    for (int r = 0; r < n_; r++) {
+        for (int i = 0; i < results_[r].count; i++) {
+            const detect_result_t *d = &results_[r].results[i];
+
+            boxes_[n * 4 + 0] = d->box.left;
+            boxes_[n * 4 + 1] = d->box.top;
+            boxes_[n * 4 + 2] = d->box.right - d->box.left;
+            boxes_[n * 4 + 3] = d->box.bottom - d->box.top;
+            scores_[n] = d->prop;
+            classes_[n] = d->class_id;
+            cands_[n++] = d;
+        }
+    }
+
+    /* same class boxes overlapping across regions are one object seen twice */
+    kept = n ? nms_.run(boxes_, scores_, classes_, NULL, n, &params, keep_) : 0;
+    memset(out, 0, sizeof(detect_result_group_t));
+    for (int i = 0; i < kept; i++)
+        out->results[i] = *cands_[keep_[i]];
+    out->count = kept;
+    merged_in_ += n;
+    merged_out_ += kept;
+}
+
+void RoiScheduler::report(double ms_per_run) const
+{
+    fprintf(stderr, "%-10s: %d regions of %dx%d  %6llu frames  %llu regions inferred (%llu refreshes)  "
+                    "%llu still (%.1f%%, ~%.1f s of NPU time saved)\n",
+            "roi", n_, frame_w_, frame_h_, (unsigned long long)frames_, (unsigned long long)inferred_,
+            (unsigned long long)refreshed_, (unsigned long long)still_,
+            inferred_ + still_ ? 100.0 * still_ / (inferred_ + still_) : 0.0, still_ * ms_per_run / 1000.0);
+    if (merged_in_)
+        fprintf(stderr, "%-10s: %llu boxes from the regions, %llu after NMS across them (%.1f%% duplicates)\n",
+                "roi merge", (unsigned long long)merged_in_, (unsigned long long)merged_out_,
+                100.0 * (merged_in_ - merged_out_) / merged_in_);
+}
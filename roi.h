@@ -0,0 +1,120 @@
+#ifndef _FFRKNN_ROI_H_
+#define _FFRKNN_ROI_H_
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+
+#include <motion.h>
+#include <nms.h>
+#include <postprocess.h>
+
+#define ROI_MAX        48   // regions of a frame inferred separately
+#define ROI_CANDIDATES (ROI_MAX * OBJ_NUMB_MAX_SIZE)
+#define ROI_OVERLAP    0.2f // grid tiles share at least this much of their size with the next one
+
+typedef enum _roi_kind_t
+{
+    ROI_FULL = 0, // the whole frame
+    ROI_GRID,     // tiles of the model input size, not scaled
+    ROI_TILES,    // cols x rows tiles covering the frame
+    ROI_RECT,     // a rectangle in frame pixels
+} roi_kind_t;
+
+typedef struct _roi_item_t
+{
+    roi_kind_t kind;
+    int x, y, w, h; // ROI_TILES: cols and rows in w and h
+} roi_item_t;
+
+typedef struct _roi_spec_t
+{
+    int n;
+    roi_item_t items[ROI_MAX];
+} roi_spec_t;
+
+/*
+ * spec: ';' separated regions, each one of
+ *   full        the whole frame
+ *   grid        tiles of the model input size at full resolution
+ *   CxR         C columns x R rows of tiles covering the frame
+ *   x,y,w,h     a rectangle in frame pixels
+ * e.g. "grid;full" or "0,0,1920,1080;1920,0,1920,1080". -1 if malformed.
+ */
+int roi_parse(const char *spec, roi_spec_t *out);
+
+/*
+ * Tiled / region of interest inference for one stream (-roi).
+ *
+ * The frame is cut into regions (roi_parse()) that are letterboxed into
+ * the model input one by one, so small objects in a large frame keep
+ * their pixels instead of being scaled down with the rest. Every region
+ * has its own detections, in frame pixels; merge() puts them together
+ * with one NMS pass across regions, which removes the duplicates found
+ * twice where tiles overlap.
+ *
+ * A region none of whose motion blocks (motion.h) moved keeps its
+ * detections instead of going to the NPU again, for the gate's refresh
+ * interval at most.
+ *
+ * Used by the inference thread only.
+ */
+class RoiScheduler
+{
+public:
+    RoiScheduler();
+
+    void init(const roi_spec_t *spec, int model_w, int model_h);
+
+    /*
+     * Picks the regions of the w x h frame seq to infer, those motion saw
+     * move (all of them without a gate or with it off), laid out again when
+     * the size changes. Returns how many, see todo().
+     */
+    int begin(int w, int h, int64_t seq, const MotionGate *motion);
+    int n_todo() const { return n_todo_; }
+    int todo(int i) const { return todo_[i]; }
+
+    int regions() const { return n_; }
+    const SDL_Rect *rect(int region) const { return &rects_[region]; }
+    /* where post_process() writes the region's detections */
+    detect_result_group_t *result(int region) { return &results_[region]; }
+
+    /* every region's latest detections in one group, overlaps suppressed */
+    void merge(float nms_threshold, detect_result_group_t *out);
+
+    /* ms_per_run: NPU time per inference, for the time saved */
+    void report(double ms_per_run) const;
+
+private:
+    void layout(int w, int h);
+    void add(int x, int y, int w, int h);
+
+    roi_spec_t spec_;
+    int model_w_, model_h_;
+    int frame_w_, frame_h_;
+
+    int n_;
+    SDL_Rect rects_[ROI_MAX];
+    detect_result_group_t results_[ROI_MAX];
+    int64_t inferred_seq_[ROI_MAX]; // -1 before the first time
+
+    int n_todo_;
+    int todo_[ROI_MAX];
+
+    /* merge() scratch */
+    NmsEngine nms_;
+    float boxes_[ROI_CANDIDATES * 4];
+    float scores_[ROI_CANDIDATES];
+    int classes_[ROI_CANDIDATES];
+    int keep_[ROI_CANDIDATES];
+    const detect_result_t *cands_[ROI_CANDIDATES];
+
+    uint64_t frames_;
+    uint64_t inferred_;
+    uint64_t still_;
+    uint64_t refreshed_;
+    uint64_t merged_in_;
+    uint64_t merged_out_;
+};
+
+#endif //_FFRKNN_ROI_H_
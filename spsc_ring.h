@@ -0,0 +1,231 @@
+#ifndef _FFRKNN_SPSC_RING_H_
+#define _FFRKNN_SPSC_RING_H_
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#define RING_SPIN 128 // failed attempts spun and yielded before a waiter parks on its futex
+
+/*
+ * Lock-free single-producer/single-consumer ring of preallocated handles
+ * (AVPacket *, frame_slot_t *, ...). The ring never owns what it carries:
+ * items come from a pool and go back to it once consumed.
+ *
+ * RING_BLOCK makes push() wait for room (files, nothing may be lost).
+ * RING_DROP_OLDEST makes push() evict the oldest queued item instead and
+ * hand it back to the producer, which recycles it as its next buffer, so a
+ * live source never stalls behind a slow consumer.
+ *
+ * Only head is ever written by both sides (consumer pop, producer evict),
+ * always through a CAS, and slots are atomics so a consumer racing with an
+ * eviction simply retries.
+ *
+ * A side that has to wait spins and yields RING_SPIN times, then parks on
+ * a futex: an idle stage costs no CPU. The other side only makes the wake
+ * system call when a waiter has said it is parking.
+ */
+enum ring_policy_t {
+    RING_BLOCK = 0,
+    RING_DROP_OLDEST,
+};
+
+template <typename T>
+class SpscRing
+{
+public:
+    /* capacity is rounded up to a power of two */
+    explicit SpscRing(unsigned capacity = 8, ring_policy_t policy = RING_BLOCK)
+        : policy_(policy), abort_(false), head_(0), tail_(0), pushed_(0), dropped_(0)
+    {
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word");
+        filled_.seq.store(0, std::memory_order_relaxed);
+        filled_.parked.store(0, std::memory_order_relaxed);
+        emptied_.seq.store(0, std::memory_order_relaxed);
+        emptied_.parked.store(0, std::memory_order_relaxed);
+        unsigned cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+        mask_ = cap - 1;
+        slots_ = new std::atomic<T>[cap];
+        for (unsigned i = 0; i < cap; i++)
+            slots_[i].store(T(), std::memory_order_relaxed);
+    }
+
+    ~SpscRing() { delete[] slots_; }
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    void set_policy(ring_policy_t policy) { policy_ = policy; }
+
+    /*
+     * Producer side. Returns 0 once queued, -1 if the ring was aborted.
+     * With RING_DROP_OLDEST an evicted item is returned in *evicted (it is
+     * left untouched otherwise), the caller owns it again.
+     */
+    int push(T item, T *evicted = nullptr)
+    {
+        for (unsigned spin = 0;; spin++) {
+            if (abort_.load(std::memory_order_acquire))
+                return -1;
+            uint64_t t = tail_.load(std::memory_order_relaxed);
+            uint64_t h = head_.load(std::memory_order_acquire);
+            if (t - h <= mask_) {
+                slots_[t & mask_].store(item, std::memory_order_relaxed);
+                tail_.store(t + 1, std::memory_order_release);
+                pushed_.fetch_add(1, std::memory_order_relaxed);
+                wake(&filled_);
+                return 0;
+            }
+            if (policy_ == RING_DROP_OLDEST && evicted) {
+                T old = slots_[h & mask_].load(std::memory_order_relaxed);
+                if (head_.compare_exchange_strong(h, h + 1, std::memory_order_acq_rel)) {
+                    *evicted = old;
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                }
+                continue;
+            }
+            if (spin < RING_SPIN) {
+                backoff(spin);
+                continue;
+            }
+            park(&emptied_, 0, [this] {
+                return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire) <= mask_;
+            });
+        }
+    }
+
+    /* Consumer side. Returns 0 with an item, 1 when empty, -1 once aborted and drained. */
+    int try_pop(T *item)
+    {
+        for (;;) {
+            uint64_t h = head_.load(std::memory_order_acquire);
+            uint64_t t = tail_.load(std::memory_order_acquire);
+            if (h == t)
+                return abort_.load(std::memory_order_acquire) ? -1 : 1;
+            T v = slots_[h & mask_].load(std::memory_order_relaxed);
+            if (head_.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel)) {
+                *item = v;
+                wake(&emptied_);
+                return 0;
+            }
+        }
+    }
+
+    /* Blocking pop, gives up after timeout_ms (< 0 waits forever). Same return codes as try_pop(). */
+    int pop(T *item, int timeout_ms = -1)
+    {
+        uint64_t deadline = timeout_ms < 0 ? 0 : now_us() + (uint64_t)timeout_ms * 1000;
+
+        for (unsigned spin = 0;; spin++) {
+            int ret = try_pop(item);
+            if (ret <= 0)
+                return ret;
+            if (abort_.load(std::memory_order_acquire))
+                return -1;
+            if (deadline && now_us() >= deadline)
+                return 1;
+            if (spin < RING_SPIN) {
+                backoff(spin);
+                continue;
+            }
+            park(&filled_, deadline, [this] {
+                return head_.load(std::memory_order_acquire) != tail_.load(std::memory_order_acquire);
+            });
+        }
+    }
+
+    /* Wakes both sides; queued items stay poppable until the ring is empty */
+    void abort()
+    {
+        abort_.store(true, std::memory_order_release);
+        wake(&filled_);
+        wake(&emptied_);
+    }
+
+    unsigned capacity() const { return mask_ + 1; }
+    unsigned size() const
+    {
+        return (unsigned)(tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire));
+    }
+    uint64_t pushed() const { return pushed_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    static uint64_t now_us()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    /* Spin briefly, then yield: the other side is usually a few instructions away */
+    static void backoff(unsigned spin)
+    {
+        if (spin >= RING_SPIN / 2)
+            sched_yield();
+    }
+
+    /* One side's sleepers: seq moves on every wake, a futex word */
+    struct waitq_t
+    {
+        std::atomic<uint32_t> seq;
+        std::atomic<uint32_t> parked;
+    };
+
+    /*
+     * Sleeps on q until woken, the deadline (0: none) or ready(). parked is
+     * raised before ready() is looked at again and the waker changes the
+     * ring before it looks at parked, with a full fence on both sides: one
+     * of the two sees the other, so no wake is lost.
+     */
+    template <typename Ready>
+    void park(waitq_t *q, uint64_t deadline, Ready ready)
+    {
+        uint32_t seq = q->seq.load(std::memory_order_acquire);
+        struct timespec ts, *timeout = NULL;
+
+        q->parked.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!ready() && !abort_.load(std::memory_order_acquire)) {
+            if (deadline) {
+                uint64_t now = now_us(), left = deadline > now ? deadline - now : 0;
+                ts.tv_sec = left / 1000000;
+                ts.tv_nsec = left % 1000000 * 1000;
+                timeout = &ts;
+            }
+            /* returns at once if a wake already moved seq */
+            syscall(SYS_futex, (uint32_t *)&q->seq, FUTEX_WAIT_PRIVATE, seq, timeout, NULL, 0);
+        }
+        q->parked.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    static void wake(waitq_t *q)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!q->parked.load(std::memory_order_relaxed))
+            return;
+        q->seq.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, (uint32_t *)&q->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+
+    ring_policy_t policy_;
+    unsigned mask_;
+    std::atomic<T> *slots_;
+    std::atomic<bool> abort_;
+    alignas(64) std::atomic<uint64_t> head_;
+    alignas(64) std::atomic<uint64_t> tail_;
+    alignas(64) std::atomic<uint64_t> pushed_;
+    std::atomic<uint64_t> dropped_;
+    alignas(64) waitq_t filled_; // consumers waiting for an item
+    alignas(64) waitq_t emptied_; // producers waiting for room
+};
+
+#endif //_FFRKNN_SPSC_RING_H_
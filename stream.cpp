@@ -0,0 +1,134 @@
+/*
+ * Per-input pipeline state, NPU scheduling between inputs and the mosaic.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "stream.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int stream_sched_init(stream_sched_t *s, int n, const char *spec)
+{
+    const char *p = spec;
+    char *end;
+
+    memset(s, 0, sizeof(stream_sched_t));
+    s->n = n;
+    for (int i = 0; i < STREAM_MAX; i++)
+        s->weight[i] = 1.0f;
+    if (!spec || !strcmp(spec, "fair"))
+        return 0;
+    if (!strncmp(spec, "prio", 4)) {
+        s->policy = SCHED_PRIORITY;
+        return 0;
+    }
+    for (int i = 0; i < STREAM_MAX && *p; i++) {
+        s->weight[i] = strtof(p, &end);
+        if (end == p || s->weight[i] <= 0.0f) {
+            fprintf(stderr, "sched: bad weight list '%s', expected fair, prio or w0,w1,...\n", spec);
+            return -1;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+void stream_sched_order(const stream_sched_t *s, int *order)
+{
+    for (int i = 0; i < s->n; i++) {
+        int j = i;
+
+        /* insertion sort on virtual time, ties stay in -i order */
+        while (s->policy == SCHED_FAIR && j > 0 && s->vtime[order[j - 1]] > s->vtime[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+}
+
+void stream_sched_charge(stream_sched_t *s, int stream)
+{
+    double start = s->vtime[stream] > s->vclock ? s->vtime[stream] : s->vclock;
+
+    s->submitted[stream]++;
+    s->vtime[stream] = start + 1.0 / s->weight[stream];
+    s->vclock = start;
+}
+
+void stream_init(stream_t *s, int index, const char *url, int frame_width, int frame_height)
+{
+    /* s comes zeroed (new stream_t()), only what is not 0 is set */
+    s->index = index;
+    s->url = url;
+    s->frame_width = frame_width;
+    s->frame_height = frame_height;
+    s->last_inferred_seq = -1;
+    detect_history_init(&s->history);
+    stage_init(&s->stats_read, "read");
+    stage_init(&s->stats_decode, "decode");
+    stage_init(&s->stats_display, "display");
+    path_init(&s->paths_decode, "decode");
+    path_init(&s->paths_display, "display");
+}
+
+void stream_mosaic(int n, int width, int height, SDL_Rect *tiles)
+{
+    int cols = (int)ceil(sqrt((double)n));
+    int rows = (n + cols - 1) / cols;
+
+    for (int i = 0; i < n; i++) {
+        int c = i % cols, r = i / cols;
+
+        tiles[i].x = c * width / cols;
+        tiles[i].y = r * height / rows;
+        tiles[i].w = (c + 1) * width / cols - tiles[i].x;
+        tiles[i].h = (r + 1) * height / rows - tiles[i].y;
+    }
+}
+
+uint64_t stream_memory(const stream_t *s, int model_input_size)
+{
+    return sizeof(stream_t) + (uint64_t)PIPELINE_SLOTS * model_input_size +
+           (uint64_t)s->frame_pool.high_water * s->frame_pool.size;
+}
+
+void stream_report(const stream_t *s, const stream_sched_t *sched, double npu_ms)
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < sched->n; i++)
+        total += sched->submitted[i];
+    fprintf(stderr, "stream %-3d: %s\n", s->index, s->synthetic ? "synthetic" : s->url);
+    stage_report(&s->stats_read);
+    stage_report(&s->stats_decode);
+    stage_report(&s->stats_display);
+    path_report(&s->paths_decode);
+    path_report(&s->paths_display);
+    s->converter.report();
+    s->preproc.report();
+    if (s->motion.enabled())
+        s->motion.report(npu_ms);
+    if (s->roi.regions())
+        s->roi.report(npu_ms);
+    frame_pool_report(&s->frame_pool);
+    fprintf(stderr, "%-10s: %6llu inferred (%.1f%% of the NPU)  %6llu reused  %6llu of %llu dropped\n", "frames",
+            (unsigned long long)sched->submitted[s->index], total ? 100.0 * sched->submitted[s->index] / total : 0.0,
+            (unsigned long long)s->frames_reused, (unsigned long long)s->infer_ring.dropped(),
+            (unsigned long long)s->infer_ring.pushed());
+}
@@ -0,0 +1,161 @@
+#ifndef _FFRKNN_STREAM_H_
+#define _FFRKNN_STREAM_H_
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+
+#include <convert.h>
+#include <extrapolate.h>
+#include <infer_backend.h>
+#include <motion.h>
+#include <overlay.h>
+#include <pipeline.h>
+#include <preprocess.h>
+#include <record.h>
+#include <roi.h>
+#include <tracker.h>
+
+extern "C" {
+#include <libavutil/rational.h>
+}
+
+struct AVCodec;
+struct AVCodecContext;
+struct AVFormatContext;
+
+#define STREAM_MAX 16 // inputs in one process, shown as a mosaic of up to 4 x 4 tiles
+
+/* Frame waiting in the inference thread for its turn to be displayed */
+typedef struct _stream_pending_t
+{
+    frame_slot_t *slot;
+    infer_job_t *job; // result once collected, NULL while on the NPU
+    int inferred;     // submitted to the backend
+    int held;         // -mg: not inferred as nothing moved, shows the last detections as they were
+} stream_pending_t;
+
+/* -roi: a region of a frame on the NPU, in one of the model inputs kept for them */
+typedef struct _roi_job_t
+{
+    struct _stream_t *s;
+    int region;
+    uint8_t *input;
+    letterbox_t letterbox; // where the region is in input
+    xform_t to_source;     // input -> frame pixels
+} roi_job_t;
+
+/*
+ * One input (-i) with its own demux -> decode -> display chain. Streams
+ * only share the inference backend: the inference thread takes frames from
+ * every infer_ring in the order stream_sched_t gives it.
+ *
+ * Ownership follows the threads: read and decode own the input, the
+ * decoder and the pool; the inference thread owns pending, history,
+ * tracker, motion and roi; the display owns the texture and its counters.
+ */
+typedef struct _stream_t
+{
+    int index;
+    const char *url;
+    int synthetic; // generated test pattern, no demux/decode
+    int synthetic_idle; // synth:idle, the pattern holds still but for a burst of motion now and then
+    int live;
+
+    /* read + decode */
+    struct AVFormatContext *input_ctx;
+    struct AVCodecContext *codec_ctx;
+    struct AVCodec *codec;
+    int video_stream;
+    struct AVFrame *frame;
+    struct AVFrame *sw_frame; // DRM_PRIME frame downloaded to memory, CPU fallback only
+    int frame_width;
+    int frame_height;
+    AVRational time_base; // of slot->pts
+    FrameConverter converter;
+    Preprocessor preproc; // frame -> letterboxed model input
+    frame_pool_t frame_pool;
+    int64_t frame_seq;
+    frame_slot_t *spare_slot; // slot evicted from infer_ring, reused by its producer
+
+    packet_ring_t pkt_free_ring{PIPELINE_PKTS};  // decode -> read: empty packets
+    packet_ring_t pkt_ring{PIPELINE_PKTS};       // read -> decode: demuxed packets
+    slot_ring_t slot_free_ring{PIPELINE_SLOTS};  // display -> decode: recycled frame slots
+    slot_ring_t infer_ring{PIPELINE_DEPTH};      // decode -> inference, drops oldest on live sources
+    slot_ring_t display_ring{PIPELINE_DEPTH};    // inference -> display
+    struct AVPacket *pkts[PIPELINE_PKTS];
+    frame_slot_t slots[PIPELINE_SLOTS];
+
+    /* inference */
+    stream_pending_t pending[PIPELINE_SLOTS]; // in seq order from head
+    int head;
+    int n_pending;
+    int eos;
+    int64_t last_inferred_seq;
+    detect_history_t history;
+    Tracker tracker;
+    uint64_t frames_reused;
+    MotionGate motion;           // -mg / -roi: the blocks that moved, every frame taken goes through it
+    RoiScheduler roi;            // -roi: regions inferred one by one and merged
+    stream_pending_t *roi_frame; // the frame whose regions are going to the NPU, NULL when none
+    int roi_next;                // its next region to submit, in roi.todo() order
+    int roi_left;                // its regions on the NPU
+
+    /* display */
+    SDL_Rect tile;
+    SDL_Texture *texture;
+    Uint32 texture_format;
+    int texture_width;
+    int texture_height;
+    xform_t to_tile;             // frame pixels -> tile, for the picture in the texture
+    detect_result_group_t shown; // its detections, mapped into the tile
+    int has_picture;
+    int ended; // end of stream reached the display
+    float frmrate;
+    Uint32 frmrate_mark;
+    int frmrate_frames;
+    overlay_text_t hud[OVERLAY_HUD_LINES]; // FPS / inference time, rasterized when they change
+    FrameRecorder *recorder; // -e, fed with every shown frame
+
+    stage_stats_t stats_read;
+    stage_stats_t stats_decode;
+    stage_stats_t stats_display;
+    path_stats_t paths_decode;
+    path_stats_t paths_display;
+} stream_t;
+
+typedef enum _sched_policy_t
+{
+    SCHED_FAIR = 0, // NPU shared by weight (1 each unless given), idle streams do not bank credit
+    SCHED_PRIORITY, // -i order: a stream only gets the NPU when every earlier one has nothing ready
+} sched_policy_t;
+
+/*
+ * Picks which stream's frame goes to the NPU next. Fair sharing is start
+ * time fair queuing: every inference advances the stream's virtual time by
+ * 1 / weight and the stream furthest behind goes first.
+ */
+typedef struct _stream_sched_t
+{
+    sched_policy_t policy;
+    int n;
+    float weight[STREAM_MAX];
+    double vtime[STREAM_MAX];
+    double vclock;
+    uint64_t submitted[STREAM_MAX];
+} stream_sched_t;
+
+/* spec: "fair", "prio" or comma separated weights in -i order ("3,1,1") */
+int stream_sched_init(stream_sched_t *s, int n, const char *spec);
+/* fills order[] with the stream indices, most entitled first */
+void stream_sched_order(const stream_sched_t *s, int *order);
+void stream_sched_charge(stream_sched_t *s, int stream);
+
+void stream_init(stream_t *s, int index, const char *url, int frame_width, int frame_height);
+/* n tiles as close to square as possible, filling the window row by row */
+void stream_mosaic(int n, int width, int height, SDL_Rect *tiles);
+/* bytes the stream holds on its own: slots, model inputs, pooled pictures */
+uint64_t stream_memory(const stream_t *s, int model_input_size);
+/* npu_ms: mean NPU time per inference, for what motion gating saved */
+void stream_report(const stream_t *s, const stream_sched_t *sched, double npu_ms);
+
+#endif //_FFRKNN_STREAM_H_
@@ -0,0 +1,190 @@
+/*
+ * MotionGate over generated static, noisy and moving scenes; block SAD against the plain C formula.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include <motion.h>
+
+#define SCENE_W      640
+#define SCENE_H      360
+#define SCENE_FRAMES 300
+#define SCENE_NOISE  6  // +- luma noise of the noisy scene, under what a block needs to move
+#define SCENE_OBJECT 64 // side of the square crossing the moving scene, 8 pixels a frame
+#define SAD_ROUNDS   200
+
+typedef enum _scene_t
+{
+    SCENE_STATIC = 0,
+    SCENE_NOISY,
+    SCENE_MOVING,
+} scene_t;
+
+static const char *scene_names[] = {"static", "noisy", "moving"};
+
+/* Frame n of a scene: a fixed ramp, noise on top or a bright square along the top */
+static void make_frame(scene_t scene, int n, unsigned *seed, std::vector<uint8_t> *buf, AVFrame *f)
+{
+    uint8_t *y = buf->data();
+
+    for (int r = 0; r < SCENE_H; r++) {
+        for (int x = 0; x < SCENE_W; x++) {
+            int v = 40 + (r + x) / 8;
+
+            if (scene == SCENE_NOISY) {
+                *seed = *seed * 1103515245 + 12345;
+                v += (int)((*seed >> 16) % (2 * SCENE_NOISE + 1)) - SCENE_NOISE;
+            }
+            y[r * SCENE_W + x] = (uint8_t)v;
+        }
+    }
+    if (scene == SCENE_MOVING) {
+        int x0 = n * 8 % (SCENE_W - SCENE_OBJECT);
+
+        for (int r = 40; r < 40 + SCENE_OBJECT; r++)
+            memset(y + r * SCENE_W + x0, 230, SCENE_OBJECT);
+    }
+
+    memset(f, 0, sizeof(AVFrame));
+    f->width = SCENE_W;
+    f->height = SCENE_H;
+    f->format = AV_PIX_FMT_YUV420P;
+    f->data[0] = y;
+    f->linesize[0] = SCENE_W;
+    f->data[1] = y + SCENE_W * SCENE_H;
+    f->data[2] = f->data[1] + SCENE_W / 2 * SCENE_H / 2;
+    f->linesize[1] = f->linesize[2] = SCENE_W / 2;
+}
+
+/* Runs a scene through a gate with the default parameters, counting what wants() lets through */
+static int run_scene(scene_t scene, int expect_passed, int expect_refreshes)
+{
+    std::vector<uint8_t> buf(SCENE_W * SCENE_H * 3 / 2, 128);
+    SDL_Rect object = {0, 40, SCENE_W, SCENE_OBJECT}, below = {0, 200, SCENE_W, SCENE_H - 200};
+    motion_params_t params;
+    MotionGate gate;
+    unsigned seed = 1;
+    int passed = 0, refreshes = 0, since = 0, stray = 0, failures = 0;
+
+    motion_params_init(&params);
+    gate.init(&params);
+    for (int n = 0; n < SCENE_FRAMES; n++) {
+        AVFrame f;
+        int moved;
+
+        make_frame(scene, n, &seed, &buf, &f);
+        moved = gate.update(&f);
+        if (gate.wants(n)) {
+            passed++;
+            /* let through without enough moved blocks: the refresh */
+            refreshes += n > 0 && moved < params.min_blocks;
+            if (since && since + 1 != params.refresh && moved < params.min_blocks)
+                failures++;
+            since = 0;
+        } else {
+            since++;
+        }
+        /* the square only ever crosses its band */
+        if (n > 0)
+            stray += gate.moved(&below);
+        if (scene == SCENE_MOVING && n > 0 && !gate.moved(&object))
+            failures++;
+    }
+
+    fprintf(stderr, "%-8s: %d frames, %d inferred, %d skipped, %d refreshes\n", scene_names[scene], SCENE_FRAMES,
+            passed, SCENE_FRAMES - passed, refreshes);
+    if (passed != expect_passed || refreshes != expect_refreshes) {
+        fprintf(stderr, "motion_test: %s: %d inferred and %d refreshes, %d and %d expected\n", scene_names[scene],
+                passed, refreshes, expect_passed, expect_refreshes);
+        failures++;
+    }
+    if (stray) {
+        fprintf(stderr, "motion_test: %s: %d frames with motion where nothing moves\n", scene_names[scene], stray);
+        failures++;
+    }
+    return failures;
+}
+
+/* What motion_block_sad() has to give, one pixel at a time */
+static void reference_sad(const uint8_t *thumb, uint8_t *background, int w, int h, uint32_t *sad)
+{
+    int bw = w / MOTION_BLOCK;
+
+    memset(sad, 0, sizeof(uint32_t) * bw * (h / MOTION_BLOCK));
+    for (int y = 0; y < h / MOTION_BLOCK * MOTION_BLOCK; y++) {
+        for (int x = 0; x < w; x++) {
+            int c = thumb[y * w + x], b = background[y * w + x];
+
+            sad[y / MOTION_BLOCK * bw + x / MOTION_BLOCK] += abs(c - b);
+            background[y * w + x] = (uint8_t)((b + ((b + c + 1) >> 1) + 1) >> 1);
+        }
+    }
+}
+
+static int check_block_sad()
+{
+    static const int sizes[][2] = {{MOTION_THUMB_W, MOTION_THUMB_MAX}, {MOTION_THUMB_W, 88}, {2 * MOTION_BLOCK, 8}};
+    unsigned seed = 7;
+
+    for (const auto &size : sizes) {
+        int w = size[0], h = size[1], blocks = w / MOTION_BLOCK * (h / MOTION_BLOCK);
+        std::vector<uint8_t> thumb(w * h), bg(w * h), ref_bg(w * h);
+        std::vector<uint32_t> sad(blocks), ref_sad(blocks);
+
+        for (int round = 0; round < SAD_ROUNDS; round++) {
+            for (int i = 0; i < w * h; i++) {
+                seed = seed * 1103515245 + 12345;
+                /* every few rounds the extremes, for the widest sums */
+                thumb[i] = round % 4 == 0 ? (uint8_t)((seed >> 24) & 1 ? 255 : 0) : (uint8_t)(seed >> 24);
+                if (round == 0)
+                    bg[i] = ref_bg[i] = (uint8_t)(255 - thumb[i]);
+            }
+            motion_block_sad(thumb.data(), bg.data(), w, h, sad.data());
+            reference_sad(thumb.data(), ref_bg.data(), w, h, ref_sad.data());
+            if (sad != ref_sad || bg != ref_bg) {
+                fprintf(stderr, "motion_test: %dx%d round %d: motion_block_sad() gives another %s\n", w, h, round,
+                        sad != ref_sad ? "SAD" : "background");
+                return 1;
+            }
+        }
+    }
+    fprintf(stderr, "block SAD: %d rounds per size, same as the plain C formula\n", SAD_ROUNDS);
+    return 0;
+}
+
+int main()
+{
+    int failures = check_block_sad();
+
+    /*
+     * Defaults: the first frame and then a refresh every MOTION_REFRESH
+     * frames get through a still scene, noise included; every frame of a
+     * moving one.
+     */
+    failures += run_scene(SCENE_STATIC, SCENE_FRAMES / MOTION_REFRESH, SCENE_FRAMES / MOTION_REFRESH - 1);
+    failures += run_scene(SCENE_NOISY, SCENE_FRAMES / MOTION_REFRESH, SCENE_FRAMES / MOTION_REFRESH - 1);
+    failures += run_scene(SCENE_MOVING, SCENE_FRAMES, 0);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Steady-state post_process() must not touch the heap: counted malloc / new.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <vector>
+
+#include <infer_backend.h>
+#include <postprocess.h>
+
+#define ALLOC_FRAMES 8   // fixed output tensors, cycled
+#define ALLOC_RUNS   1000 // post_process() calls counted per NMS method
+
+/* --- counting allocator (glibc): every path to the heap goes through these --- */
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void *__libc_memalign(size_t align, size_t size);
+extern "C" void __libc_free(void *p);
+
+static int counting;
+static uint64_t allocations;
+
+extern "C" void *malloc(size_t size)
+{
+    allocations += counting;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    allocations += counting;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+    allocations += counting;
+    return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p) { __libc_free(p); }
+
+void *operator new(size_t size)
+{
+    void *p;
+
+    allocations += counting;
+    if (!(p = __libc_malloc(size ? size : 1)))
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, std::align_val_t align)
+{
+    void *p;
+
+    allocations += counting;
+    if (!(p = __libc_memalign((size_t)align, size ? size : 1)))
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+void operator delete(void *p) noexcept { __libc_free(p); }
+void operator delete[](void *p) noexcept { __libc_free(p); }
+void operator delete(void *p, size_t) noexcept { __libc_free(p); }
+void operator delete[](void *p, size_t) noexcept { __libc_free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { __libc_free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { __libc_free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { __libc_free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { __libc_free(p); }
+
+/*
+ * YOLOv5 heads of the reference backend: the synthetic objects on
+ * frames 0-3, crowded random tensors (thousands of candidates) on 4-7.
+ */
+static int make_frames(int *n_outputs, infer_tensor_attr_t *attrs, std::vector<int8_t> *tensors)
+{
+    InferBackend *backend = create_replay_backend("synth", 0);
+    infer_tensor_attr_t input;
+    int n_inputs;
+    unsigned seed = 1;
+
+    if (backend->init(NULL, 0, 1) < 0 || backend->query_attrs(&n_inputs, &input, n_outputs, attrs) < 0 ||
+        backend->start() < 0)
+        return -1;
+    for (int f = 0; f < ALLOC_FRAMES; f++) {
+        infer_job_t *job;
+
+        if (backend->submit(f * 7, NULL, NULL) < 0 || !(job = backend->collect()))
+            return -1;
+        for (int t = 0; t < *n_outputs; t++) {
+            std::vector<int8_t> *out = &tensors[f * INFER_MAX_TENSORS + t];
+
+            out->assign(job->outputs[t], job->outputs[t] + attrs[t].n_elems);
+            for (size_t i = 0; f >= ALLOC_FRAMES / 2 && i < out->size(); i++) {
+                seed = seed * 1103515245 + 12345;
+                (*out)[i] = (int8_t)(seed >> 24);
+            }
+        }
+        backend->release(job);
+    }
+    backend->stop();
+    delete backend;
+    return 0;
+}
+
+int main()
+{
+    static const nms_method_t methods[] = {NMS_HARD, NMS_LINEAR, NMS_GAUSSIAN};
+    static const char *names[] = {"hard", "linear", "gaussian"};
+    std::vector<int8_t> tensors[ALLOC_FRAMES * INFER_MAX_TENSORS];
+    infer_tensor_attr_t attrs[INFER_MAX_TENSORS];
+    int8_t *outputs[ALLOC_FRAMES][INFER_MAX_TENSORS];
+    detect_result_group_t group;
+    PostProcessWorkspace ws;
+    int n_outputs, failures = 0;
+    uint64_t detections;
+    void *volatile probe; // kept, so the compiler cannot leave the allocations out
+
+    if (make_frames(&n_outputs, attrs, tensors) < 0 || ws.init(n_outputs, attrs, 640, 640, NULL) < 0) {
+        fprintf(stderr, "postprocess_alloc_test: no model outputs\n");
+        return 1;
+    }
+    for (int f = 0; f < ALLOC_FRAMES; f++)
+        for (int t = 0; t < n_outputs; t++)
+            outputs[f][t] = tensors[f * INFER_MAX_TENSORS + t].data();
+
+    /* the counter has to see both ways to the heap, or zero proves nothing */
+    allocations = 0;
+    counting = 1;
+    probe = malloc(16);
+    free(probe);
+    probe = new std::vector<int>(16);
+    delete (std::vector<int> *)probe;
+    counting = 0;
+    if (allocations != 3) {
+        fprintf(stderr, "postprocess_alloc_test: the counting allocator saw %llu of 3 allocations\n",
+                (unsigned long long)allocations);
+        return 1;
+    }
+
+    for (int m = 0; m < 3; m++) {
+        setNmsMethod(methods[m], 0.5f);
+        /* warm up: the first calls may still size what init() could not know */
+        for (int f = 0; f < ALLOC_FRAMES; f++)
+            post_process(outputs[f], 640, 640, BOX_THRESH, NMS_THRESH, NULL, NULL, &ws, &group);
+
+        detections = 0;
+        allocations = 0;
+        counting = 1;
+        for (int i = 0; i < ALLOC_RUNS; i++) {
+            post_process(outputs[i % ALLOC_FRAMES], 640, 640, BOX_THRESH, NMS_THRESH, NULL, NULL, &ws, &group);
+            detections += group.count;
+        }
+        counting = 0;
+
+        fprintf(stderr, "%-8s: %d frames, %llu detections, %llu allocations\n", names[m], ALLOC_RUNS,
+                (unsigned long long)detections, (unsigned long long)allocations);
+        if (allocations || !detections) {
+            fprintf(stderr, "postprocess_alloc_test: %s NMS: %llu heap allocations in steady state\n", names[m],
+                    (unsigned long long)allocations);
+            failures++;
+        }
+    }
+    deinitPostProcess();
+    return failures ? 1 : 0;
+}
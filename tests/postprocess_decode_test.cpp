@@ -0,0 +1,209 @@
+/*
+ * YOLOv5 head decode (tables, vector scan) against the per-candidate process() it replaced, bit for bit.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <infer_backend.h>
+#include <postprocess.h>
+
+/* --- what post_process() ran per level before the tables, as it was, the class count a parameter --- */
+
+static float sigmoid(float x) { return 1.0 / (1.0 + expf(-x)); }
+
+static float unsigmoid(float y) { return -1.0 * logf((1.0 / y) - 1.0); }
+
+inline static int32_t __clip(float val, float min, float max)
+{
+    float f = val <= min ? min : (val >= max ? max : val);
+    return f;
+}
+
+static int8_t qnt_f32_to_affine(float f32, int32_t zp, float scale)
+{
+    float dst_val = (f32 / scale) + zp;
+    int8_t res = (int8_t)__clip(dst_val, -128, 127);
+    return res;
+}
+
+static float deqnt_affine_to_f32(int8_t qnt, int32_t zp, float scale) { return ((float)qnt - (float)zp) * scale; }
+
+static int process(int8_t *input, const int *anchor, int grid_h, int grid_w, int stride, int n_classes,
+                   std::vector<float> &boxes, std::vector<float> &objProbs, std::vector<int> &classId, float threshold,
+                   int32_t zp, float scale)
+{
+    const int PROP_BOX_SIZE = 5 + n_classes;
+    int validCount = 0;
+    int grid_len = grid_h * grid_w;
+    float thres = unsigmoid(threshold);
+    int8_t thres_i8 = qnt_f32_to_affine(thres, zp, scale);
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < grid_h; i++) {
+            for (int j = 0; j < grid_w; j++) {
+                int8_t box_confidence = input[(PROP_BOX_SIZE * a + 4) * grid_len + i * grid_w + j];
+                if (box_confidence >= thres_i8) {
+                    int offset = (PROP_BOX_SIZE * a) * grid_len + i * grid_w + j;
+                    int8_t *in_ptr = input + offset;
+                    float box_x = sigmoid(deqnt_affine_to_f32(*in_ptr, zp, scale)) * 2.0 - 0.5;
+                    float box_y = sigmoid(deqnt_affine_to_f32(in_ptr[grid_len], zp, scale)) * 2.0 - 0.5;
+                    float box_w = sigmoid(deqnt_affine_to_f32(in_ptr[2 * grid_len], zp, scale)) * 2.0;
+                    float box_h = sigmoid(deqnt_affine_to_f32(in_ptr[3 * grid_len], zp, scale)) * 2.0;
+                    box_x = (box_x + j) * (float)stride;
+                    box_y = (box_y + i) * (float)stride;
+                    box_w = box_w * box_w * (float)anchor[a * 2];
+                    box_h = box_h * box_h * (float)anchor[a * 2 + 1];
+                    box_x -= (box_w / 2.0);
+                    box_y -= (box_h / 2.0);
+
+                    int8_t maxClassProbs = in_ptr[5 * grid_len];
+                    int maxClassId = 0;
+                    for (int k = 1; k < n_classes; ++k) {
+                        int8_t prob = in_ptr[(5 + k) * grid_len];
+                        if (prob > maxClassProbs) {
+                            maxClassId = k;
+                            maxClassProbs = prob;
+                        }
+                    }
+                    if (maxClassProbs > thres_i8) {
+                        objProbs.push_back(sigmoid(deqnt_affine_to_f32(maxClassProbs, zp, scale)) *
+                                           sigmoid(deqnt_affine_to_f32(box_confidence, zp, scale)));
+                        classId.push_back(maxClassId);
+                        validCount++;
+                        boxes.push_back(box_x);
+                        boxes.push_back(box_y);
+                        boxes.push_back(box_w);
+                        boxes.push_back(box_h);
+                    }
+                }
+            }
+        }
+    }
+    return validCount;
+}
+
+/* --- the cases --- */
+
+typedef struct _quant_t
+{
+    int32_t zp;
+    float scale;
+} quant_t;
+
+/* 80 and 3 classes have their own kernel, 25 takes the generic one; 608 leaves partial blocks */
+static const int class_counts[] = {80, 3, 25};
+static const int input_sizes[] = {640, 608};
+static const quant_t quants[] = {{-17, 0.0837f}, {12, 0.05f}, {-90, 0.12f}};
+static const float thresholds[] = {BOX_THRESH, 0.6f};
+
+/*
+ * Random int8 heads: spread over the whole range, or packed around zp so
+ * most cells are candidates and class scores tie.
+ */
+static void fill(std::vector<int8_t> *t, int32_t zp, int narrow, unsigned *seed)
+{
+    for (size_t i = 0; i < t->size(); i++) {
+        int v;
+
+        *seed = *seed * 1103515245 + 12345;
+        v = narrow ? zp + (int)((*seed >> 16) % 9) - 4 : (int)(*seed >> 24) - 128;
+        (*t)[i] = (int8_t)(v < -128 ? -128 : v > 127 ? 127 : v);
+    }
+}
+
+int main()
+{
+    infer_tensor_attr_t input, synth[INFER_MAX_TENSORS];
+    InferBackend *backend;
+    int n_inputs, n_outputs, cases = 0, failures = 0;
+    uint64_t candidates = 0;
+    unsigned seed = 1;
+
+    /* the YOLOv5 heads of the reference backend, reshaped per case */
+    backend = create_replay_backend(NULL, 0);
+    if (backend->init(NULL, 0, 1) < 0 || backend->query_attrs(&n_inputs, &input, &n_outputs, synth) < 0 ||
+        n_outputs != HEAD_LEVELS) {
+        fprintf(stderr, "postprocess_decode_test: no YOLOv5 heads\n");
+        return 1;
+    }
+    delete backend;
+
+    for (int nc : class_counts) {
+        for (int size : input_sizes) {
+            for (const quant_t &q : quants) {
+                for (int narrow = 0; narrow < 2; narrow++) {
+                    infer_tensor_attr_t attrs[HEAD_LEVELS];
+                    std::vector<int8_t> tensors[HEAD_LEVELS];
+                    int8_t *outputs[HEAD_LEVELS];
+                    PostProcessWorkspace ws;
+
+                    for (int l = 0; l < HEAD_LEVELS; l++) {
+                        attrs[l] = synth[l];
+                        attrs[l].dims[1] = 3 * (5 + nc);
+                        attrs[l].dims[2] = attrs[l].dims[3] = size / (8 << l);
+                        attrs[l].n_elems = attrs[l].dims[1] * attrs[l].dims[2] * attrs[l].dims[3];
+                        attrs[l].zp = q.zp;
+                        attrs[l].scale = q.scale;
+                        tensors[l].resize(attrs[l].n_elems);
+                        fill(&tensors[l], q.zp, narrow, &seed);
+                        outputs[l] = tensors[l].data();
+                    }
+                    if (ws.init(HEAD_LEVELS, attrs, size, size, NULL) < 0) {
+                        fprintf(stderr, "postprocess_decode_test: %d classes at %d not taken\n", nc, size);
+                        failures++;
+                        continue;
+                    }
+
+                    for (float threshold : thresholds) {
+                        for (int l = 0; l < HEAD_LEVELS; l++) {
+                            const head_layout_t *layout = &ws.layout;
+                            std::vector<float> boxes, probs;
+                            std::vector<int> ids;
+                            int t = layout->tensor[l][0], n, expected;
+
+                            ws.filterBoxes.clear();
+                            ws.objProbs.clear();
+                            ws.classId.clear();
+                            n = layout->decode(&ws, l, outputs, threshold);
+                            expected = process(outputs[t], layout->anchors[l], layout->grid_h[l], layout->grid_w[l],
+                                               layout->stride[l], nc, boxes, probs, ids, threshold, q.zp, q.scale);
+                            cases++;
+                            candidates += n;
+                            if (n != expected || ws.classId != ids ||
+                                memcmp(ws.objProbs.data(), probs.data(), sizeof(float) * probs.size()) ||
+                                memcmp(ws.filterBoxes.data(), boxes.data(), sizeof(float) * boxes.size())) {
+                                fprintf(stderr, "postprocess_decode_test: %d classes, %dx%d level %d, zp %d "
+                                        "scale %g%s, threshold %g: %d candidates, process() gives %d%s\n", nc, size,
+                                        size, l, q.zp, q.scale, narrow ? " narrow" : "", threshold, n, expected,
+                                        n == expected ? ", not the same bits" : "");
+                                failures++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    deinitPostProcess();
+    fprintf(stderr, "postprocess_decode_test: %d levels, %llu candidates, %d differ from process()\n", cases,
+            (unsigned long long)candidates, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * Preprocessor CPU kernel on odd frame sizes: letterbox, bars and bands, bytes against the plain C build.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include <preprocess.h>
+
+#define PP_WIDTH   640
+#define PP_HEIGHT  640
+#define PP_THREADS 4 // bands of the second kernel, what a 1080p frame gets split into
+#define PP_RGA_OVER 0.01 // RGA: share of the bytes allowed further than PREPROCESS_TOLERANCE from the CPU
+
+/* odd widths leave the vector loops a tail, 1920x1080 is cut into bands */
+static const int sizes[][2] = {{1920, 1080}, {1279, 719}, {641, 479}, {479, 853}, {65, 37}, {33, 17}};
+static const int formats[] = {AV_PIX_FMT_NV12, AV_PIX_FMT_NV21, AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUVJ420P};
+
+static const char *format_name(int format)
+{
+    switch (format) {
+    case AV_PIX_FMT_NV12:
+        return "NV12";
+    case AV_PIX_FMT_NV21:
+        return "NV21";
+    case AV_PIX_FMT_YUV420P:
+        return "YUV420P";
+    default:
+        return "YUVJ420P";
+    }
+}
+
+/* The planes one after the other in one buffer, the layout convert_rga_layout() accepts */
+static void make_frame(int w, int h, int format, unsigned seed, std::vector<uint8_t> *buf, AVFrame *f)
+{
+    int ls = (w + 15) & ~15, hs = (h + 1) & ~1;
+    uint8_t *y, *c;
+
+    buf->assign((size_t)ls * hs * 3 / 2, 0);
+    y = buf->data();
+    c = y + (size_t)ls * hs;
+    /* a ramp with noise in luma, chroma anywhere: the conversion has to clamp */
+    for (int r = 0; r < h; r++) {
+        for (int x = 0; x < w; x++) {
+            seed = seed * 1103515245 + 12345;
+            y[(size_t)r * ls + x] = (uint8_t)((r * 3 + x * 5) / 4 + (seed >> 28));
+        }
+    }
+    for (size_t i = 0; i < (size_t)ls * hs / 2; i++) {
+        seed = seed * 1103515245 + 12345;
+        c[i] = (uint8_t)(seed >> 24);
+    }
+
+    memset(f, 0, sizeof(AVFrame));
+    f->width = w;
+    f->height = h;
+    f->format = format;
+    f->data[0] = y;
+    f->linesize[0] = ls;
+    f->data[1] = c;
+    if (format == AV_PIX_FMT_NV12 || format == AV_PIX_FMT_NV21) {
+        f->linesize[1] = ls;
+    } else {
+        f->linesize[1] = f->linesize[2] = ls / 2;
+        f->data[2] = c + (size_t)(ls / 2) * (hs / 2);
+    }
+}
+
+static uint64_t row_hash(const uint8_t *p, int n)
+{
+    uint64_t h = 14695981039346656037ull;
+
+    for (int i = 0; i < n; i++)
+        h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+/* Everything outside lb must still be the grey of the bars */
+static int bars_painted(const uint8_t *dst, const letterbox_t *lb)
+{
+    for (int r = 0; r < PP_HEIGHT; r++) {
+        for (int x = 0; x < PP_WIDTH; x++) {
+            const uint8_t *px = dst + ((size_t)r * PP_WIDTH + x) * 3;
+
+            if (r >= lb->y && r < lb->y + lb->h && x >= lb->x && x < lb->x + lb->w)
+                continue;
+            if (px[0] != PREPROCESS_PAD || px[1] != PREPROCESS_PAD || px[2] != PREPROCESS_PAD)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint8_t> single(PP_WIDTH * PP_HEIGHT * 3), banded(single.size()), frame;
+    uint64_t hashes[PP_HEIGHT], ref_hashes[PP_HEIGHT];
+    FILE *ref = NULL;
+    int writing = 0, cases = 0, failures = 0, rga_cases = 0;
+
+    /* -w file: keep what this build makes, -c file: hold it against what another build kept */
+    if (argc == 3 && (!strcmp(argv[1], "-w") || !strcmp(argv[1], "-c"))) {
+        writing = argv[1][1] == 'w';
+        if (!(ref = fopen(argv[2], writing ? "wb" : "rb"))) {
+            fprintf(stderr, "preprocess_test: cannot open %s\n", argv[2]);
+            return 1;
+        }
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: preprocess_test [-w | -c reference]\n");
+        return 1;
+    }
+
+    for (int rgb = 0; rgb < 2; rgb++) {
+        Preprocessor one, bands;
+        letterbox_t lb_one, lb_bands;
+#ifdef HAVE_RGA
+        Preprocessor rga;
+        std::vector<uint8_t> by_rga(single.size());
+        letterbox_t lb_rga;
+
+        memset(&lb_rga, 0, sizeof(letterbox_t));
+        if (rga.init(PP_WIDTH, PP_HEIGHT, rgb, PREPROCESS_RGA, 1) < 0)
+            return 1;
+#endif
+
+        if (one.init(PP_WIDTH, PP_HEIGHT, rgb, PREPROCESS_CPU, 1) < 0 ||
+            bands.init(PP_WIDTH, PP_HEIGHT, rgb, PREPROCESS_CPU, PP_THREADS) < 0)
+            return 1;
+        memset(&lb_one, 0, sizeof(letterbox_t));
+        memset(&lb_bands, 0, sizeof(letterbox_t));
+
+        for (const auto &size : sizes) {
+            for (int format : formats) {
+                for (int cropped = 0; cropped < 2; cropped++) {
+                    int w = size[0], h = size[1];
+                    SDL_Rect crop = {(w / 5) & ~1, (h / 7) & ~1, (w / 2) & ~1, (h / 2) & ~1};
+                    const SDL_Rect *c = cropped ? &crop : NULL;
+                    letterbox_t fit;
+                    AVFrame f;
+                    char name[64];
+
+                    snprintf(name, sizeof(name), "%dx%d %s%s %s", w, h, format_name(format),
+                             cropped ? " crop" : "", rgb ? "RGB" : "BGR");
+                    make_frame(w, h, format, (unsigned)(w * 31 + h * 7 + format), &frame, &f);
+                    letterbox_fit(c ? c->w : w, c ? c->h : h, PP_WIDTH, PP_HEIGHT, &fit);
+                    cases++;
+
+                    if (one.run(&f, c, single.data(), &lb_one) != PREPROCESS_PATH_CPU ||
+                        bands.run(&f, c, banded.data(), &lb_bands) != PREPROCESS_PATH_CPU) {
+                        fprintf(stderr, "preprocess_test: %s: the CPU kernel failed\n", name);
+                        failures++;
+                        continue;
+                    }
+                    if (memcmp(&lb_one, &fit, sizeof(letterbox_t)) || memcmp(&lb_bands, &fit, sizeof(letterbox_t))) {
+                        fprintf(stderr, "preprocess_test: %s: letterbox %d,%d %dx%d, letterbox_fit() gives "
+                                "%d,%d %dx%d\n", name, lb_one.x, lb_one.y, lb_one.w, lb_one.h, fit.x, fit.y, fit.w,
+                                fit.h);
+                        failures++;
+                    }
+                    if (!bars_painted(single.data(), &fit)) {
+                        fprintf(stderr, "preprocess_test: %s: the picture runs into the bars\n", name);
+                        failures++;
+                    }
+                    if (single != banded) {
+                        fprintf(stderr, "preprocess_test: %s: %d bands give other bytes than one\n", name,
+                                PP_THREADS);
+                        failures++;
+                    }
+
+                    for (int r = 0; r < PP_HEIGHT; r++)
+                        hashes[r] = row_hash(&single[(size_t)r * PP_WIDTH * 3], PP_WIDTH * 3);
+                    if (ref && writing) {
+                        fwrite(&fit, sizeof(letterbox_t), 1, ref);
+                        fwrite(hashes, sizeof(hashes), 1, ref);
+                    } else if (ref) {
+                        letterbox_t ref_lb;
+                        int row = -1;
+
+                        if (fread(&ref_lb, sizeof(letterbox_t), 1, ref) != 1 ||
+                            fread(ref_hashes, sizeof(ref_hashes), 1, ref) != 1) {
+                            fprintf(stderr, "preprocess_test: the reference ends before %s\n", name);
+                            return 1;
+                        }
+                        for (int r = 0; r < PP_HEIGHT && row < 0; r++)
+                            if (hashes[r] != ref_hashes[r])
+                                row = r;
+                        if (memcmp(&ref_lb, &fit, sizeof(letterbox_t)) || row >= 0) {
+                            fprintf(stderr, "preprocess_test: %s: row %d differs from the reference build\n", name,
+                                    row);
+                            failures++;
+                        }
+                    }
+
+#ifdef HAVE_RGA
+                    /* RGA rounds its own way: close to the CPU kernel, not equal; sizes it refuses are left out */
+                    if (rga.run(&f, c, by_rga.data(), &lb_rga) == PREPROCESS_PATH_RGA) {
+                        uint64_t over = 0;
+
+                        for (int r = fit.y; r < fit.y + fit.h; r++) {
+                            size_t offset = ((size_t)r * PP_WIDTH + fit.x) * 3;
+
+                            for (int i = 0; i < fit.w * 3; i++)
+                                over += abs(by_rga[offset + i] - single[offset + i]) > PREPROCESS_TOLERANCE;
+                        }
+                        if (over > PP_RGA_OVER * fit.w * fit.h * 3 || !bars_painted(by_rga.data(), &fit)) {
+                            fprintf(stderr, "preprocess_test: %s: RGA and the CPU kernel differ by more than %d in "
+                                    "%llu bytes\n", name, PREPROCESS_TOLERANCE, (unsigned long long)over);
+                            failures++;
+                        }
+                        rga_cases++;
+                    }
+#endif
+                }
+            }
+        }
+        bands.report();
+    }
+
+    if (ref)
+        fclose(ref);
+    fprintf(stderr, "preprocess_test: %d cases%s, %d against RGA, %d failures\n", cases,
+            !ref ? "" : writing ? ", reference written" : ", checked against the reference", rga_cases, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * SpscRing across two threads: order, drop counts and the end of stream.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include <spsc_ring.h>
+
+#define RING_ITEMS 200000 // items per run
+#define RING_DEPTH 4      // like PIPELINE_DEPTH
+#define RING_POOL  (RING_DEPTH + 2)
+#define RING_IDLE_MS  300 // an idle wait measured
+#define RING_IDLE_CPU 5   // ms of CPU it may burn, a parked waiter burns none
+
+/* What the stages hand over: a slot from a pool, stamped by the producer */
+typedef struct _item_t
+{
+    int64_t seq;
+} item_t;
+
+static int failures;
+
+#define CHECK(cond, ...)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "ring_test: " __VA_ARGS__);                                                                \
+            fprintf(stderr, "\n");                                                                                     \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+/*
+ * Producer and consumer the way decodeThread() and the inference thread
+ * run them: slots come from a pool, go through ring, come back through
+ * free_ring; a slot evicted by RING_DROP_OLDEST is the producer's next one.
+ * NULL ends the stream. slow: the consumer stalls now and then, otherwise
+ * the producer yields every few items.
+ */
+static void run(ring_policy_t policy, int slow)
+{
+    const char *name = policy == RING_BLOCK ? "block" : "drop oldest";
+    SpscRing<item_t *> ring(RING_DEPTH, policy);
+    SpscRing<item_t *> free_ring(RING_POOL);
+    item_t pool[RING_POOL];
+    uint64_t evicted = 0, received = 0, out_of_order = 0;
+    int64_t last = -1;
+    int ended = 0;
+
+    for (int i = 0; i < RING_POOL; i++)
+        free_ring.push(&pool[i]);
+
+    std::thread producer([&] {
+        item_t *spare = NULL, *item;
+
+        for (int64_t seq = 0; seq < RING_ITEMS; seq++) {
+            if (spare) {
+                item = spare;
+                spare = NULL;
+            } else if (free_ring.pop(&item) != 0) {
+                return;
+            }
+            item->seq = seq;
+            if (ring.push(item, &spare) < 0)
+                return;
+            evicted += spare != NULL;
+            /* otherwise the consumer hardly gets a turn and nearly everything is dropped */
+            if (!slow && (seq & 7) == 0)
+                sched_yield();
+        }
+        item = NULL;
+        ring.push(NULL, &item);
+        evicted += item != NULL;
+    });
+
+    for (;;) {
+        item_t *item;
+
+        if (ring.pop(&item, 5000) != 0) {
+            CHECK(0, "%s: nothing for 5 s after %llu items", name, (unsigned long long)received);
+            break;
+        }
+        if (!item) {
+            ended = 1;
+            break;
+        }
+        out_of_order += item->seq <= last;
+        last = item->seq;
+        received++;
+        if (slow && (received & 255) == 0)
+            usleep(100);
+        free_ring.push(item);
+    }
+    ring.abort();
+    free_ring.abort();
+    producer.join();
+
+    CHECK(ended, "%s: no end of stream", name);
+    CHECK(!out_of_order, "%s: %llu items out of order", name, (unsigned long long)out_of_order);
+    CHECK(last == RING_ITEMS - 1, "%s: last item %lld, not %d", name, (long long)last, RING_ITEMS - 1);
+    CHECK(ring.pushed() == RING_ITEMS + 1, "%s: %llu pushed, not %d", name, (unsigned long long)ring.pushed(),
+          RING_ITEMS + 1);
+    CHECK(ring.dropped() == evicted, "%s: ring dropped %llu, producer got %llu back", name,
+          (unsigned long long)ring.dropped(), (unsigned long long)evicted);
+    CHECK(received + ring.dropped() == RING_ITEMS, "%s: %llu received + %llu dropped != %d", name,
+          (unsigned long long)received, (unsigned long long)ring.dropped(), RING_ITEMS);
+    if (policy == RING_BLOCK)
+        CHECK(!ring.dropped(), "%s: dropped %llu", name, (unsigned long long)ring.dropped());
+    fprintf(stderr, "%-12s%s: %llu received, %llu dropped\n", name, slow ? ", slow" : "", (unsigned long long)received,
+            (unsigned long long)ring.dropped());
+}
+
+/* abort() lets the consumer drain what is queued, then both sides get -1 */
+static void run_abort()
+{
+    SpscRing<item_t *> ring(RING_DEPTH, RING_BLOCK);
+    item_t items[RING_DEPTH], *item = NULL;
+    int ret;
+
+    for (int i = 0; i < RING_DEPTH; i++) {
+        items[i].seq = i;
+        ring.push(&items[i]);
+    }
+    /* a producer blocked on the full ring is woken by abort() */
+    std::thread producer([&] { ret = ring.push(&items[0]); });
+    usleep(10000);
+    ring.abort();
+    producer.join();
+    CHECK(ret == -1, "abort: blocked push returned %d", ret);
+
+    for (int i = 0; i < RING_DEPTH; i++) {
+        CHECK(ring.pop(&item) == 0 && item == &items[i], "abort: queued item %d lost", i);
+    }
+    CHECK(ring.pop(&item) == -1, "abort: drained ring does not report the end");
+    CHECK(ring.try_pop(&item) == -1, "abort: drained ring does not report the end");
+    CHECK(ring.push(&items[0]) == -1, "abort: push after abort accepted");
+}
+
+static uint64_t thread_cpu_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Waiting on an empty or a full ring parks the thread: no CPU, and woken as soon as the other side moves */
+static void run_idle()
+{
+    SpscRing<item_t *> ring(RING_DEPTH, RING_BLOCK);
+    item_t items[RING_DEPTH + 1], *item = NULL;
+    uint64_t cpu_us = 0, t0;
+    int ret = 0;
+
+    t0 = thread_cpu_us();
+    ret = ring.pop(&item, RING_IDLE_MS);
+    cpu_us = thread_cpu_us() - t0;
+    CHECK(ret == 1, "idle: pop on an empty ring returned %d", ret);
+    CHECK(cpu_us < RING_IDLE_CPU * 1000, "idle: a %d ms pop took %.1f ms of CPU", RING_IDLE_MS, cpu_us / 1000.0);
+
+    /* a consumer parked with no timeout sees the item pushed later */
+    std::thread consumer([&] {
+        uint64_t c0 = thread_cpu_us();
+
+        ret = ring.pop(&item);
+        cpu_us = thread_cpu_us() - c0;
+    });
+    usleep(RING_IDLE_MS * 1000);
+    ring.push(&items[0]);
+    consumer.join();
+    CHECK(ret == 0 && item == &items[0], "idle: parked pop returned %d", ret);
+    CHECK(cpu_us < RING_IDLE_CPU * 1000, "idle: a parked pop took %.1f ms of CPU", cpu_us / 1000.0);
+
+    /* and a producer parked on a full ring sees the room made later */
+    for (int i = 0; i < RING_DEPTH; i++)
+        ring.push(&items[i]);
+    std::thread producer([&] {
+        uint64_t p0 = thread_cpu_us();
+
+        ret = ring.push(&items[RING_DEPTH]);
+        cpu_us = thread_cpu_us() - p0;
+    });
+    usleep(RING_IDLE_MS * 1000);
+    ring.pop(&item);
+    producer.join();
+    CHECK(ret == 0 && ring.size() == RING_DEPTH, "idle: parked push returned %d", ret);
+    CHECK(cpu_us < RING_IDLE_CPU * 1000, "idle: a parked push took %.1f ms of CPU", cpu_us / 1000.0);
+    fprintf(stderr, "idle: waits parked\n");
+}
+
+int main()
+{
+    run(RING_BLOCK, 0);
+    run(RING_BLOCK, 1);
+    run(RING_DROP_OLDEST, 0);
+    run(RING_DROP_OLDEST, 1);
+    run_abort();
+    run_idle();
+    if (failures)
+        fprintf(stderr, "ring_test: %d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,412 @@
+/*
+ * SORT-style tracker: constant-velocity Kalman filters, IoU + Hungarian
+ * assignment.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "tracker.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <pipeline.h>
+
+/* noise model, in frame pixels and frames */
+#define KF_Q     1.0f   // acceleration variance
+#define KF_R     16.0f  // measurement variance (4 px)
+#define KF_P_VEL 100.0f // initial velocity variance
+
+static inline float iou_xyxy(float ax1, float ay1, float ax2, float ay2, float bx1, float by1, float bx2, float by2)
+{
+    float w = std::min(ax2, bx2) - std::max(ax1, bx1);
+    float h = std::min(ay2, by2) - std::max(ay1, by1);
+    float inter, uni;
+
+    if (w <= 0.f || h <= 0.f)
+        return 0.f;
+    inter = w * h;
+    uni = (ax2 - ax1) * (ay2 - ay1) + (bx2 - bx1) * (by2 - by1) - inter;
+    return uni > 0.f ? inter / uni : 0.f;
+}
+
+Tracker::Tracker() : n_(0), next_id_(0), seq_(-1), updates_(0), busy_us_(0), max_us_(0)
+{
+    pair_det_.reserve(TRACK_MAX * TRACK_MAX);
+    pair_trk_.reserve(TRACK_MAX * TRACK_MAX);
+    pair_iou_.reserve(TRACK_MAX * TRACK_MAX);
+    rows_.resize(TRACK_MAX);
+    cols_.resize(TRACK_MAX);
+    cost_.resize(TRACK_MAX * TRACK_MAX);
+    u_.resize(TRACK_MAX + 1);
+    v_.resize(TRACK_MAX + 1);
+    minv_.resize(TRACK_MAX + 1);
+    p_.resize(TRACK_MAX + 1);
+    way_.resize(TRACK_MAX + 1);
+    used_.resize(TRACK_MAX + 1);
+}
+
+void Tracker::predict(int dt)
+{
+    float q00 = KF_Q * dt * dt * dt / 3.f, q01 = KF_Q * dt * dt / 2.f, q11 = KF_Q * dt;
+
+    for (int t = 0; t < n_; t++) {
+        cx_[t] += vx_[t] * dt;
+        cy_[t] += vy_[t] * dt;
+        w_[t] += vw_[t] * dt;
+        h_[t] += vh_[t] * dt;
+    }
+    /* P = F P F' + Q, F = [1 dt; 0 1] */
+    for (int t = 0; t < n_; t++) {
+        float p00 = p00_[t], p01 = p01_[t], p11 = p11_[t];
+
+        p00_[t] = p00 + 2.f * dt * p01 + dt * dt * p11 + q00;
+        p01_[t] = p01 + dt * p11 + q01;
+        p11_[t] = p11 + q11;
+    }
+}
+
+void Tracker::correct(int t, const detect_result_t *det)
+{
+    float zx = (det->box.left + det->box.right) * 0.5f;
+    float zy = (det->box.top + det->box.bottom) * 0.5f;
+    float zw = (float)(det->box.right - det->box.left);
+    float zh = (float)(det->box.bottom - det->box.top);
+    float s = p00_[t] + KF_R;
+    float k0 = p00_[t] / s, k1 = p01_[t] / s;
+    float y;
+
+    y = zx - cx_[t];
+    cx_[t] += k0 * y;
+    vx_[t] += k1 * y;
+    y = zy - cy_[t];
+    cy_[t] += k0 * y;
+    vy_[t] += k1 * y;
+    y = zw - w_[t];
+    w_[t] += k0 * y;
+    vw_[t] += k1 * y;
+    y = zh - h_[t];
+    h_[t] += k0 * y;
+    vh_[t] += k1 * y;
+
+    p11_[t] -= k1 * p01_[t];
+    p01_[t] *= 1.f - k0;
+    p00_[t] *= 1.f - k0;
+
+    score_[t] = det->prop;
+    hits_[t]++;
+    last_hit_[t] = seq_;
+}
+
+void Tracker::spawn(const detect_result_t *det)
+{
+    int t = n_;
+
+    if (n_ == TRACK_MAX)
+        return;
+    cx_[t] = (det->box.left + det->box.right) * 0.5f;
+    cy_[t] = (det->box.top + det->box.bottom) * 0.5f;
+    w_[t] = (float)(det->box.right - det->box.left);
+    h_[t] = (float)(det->box.bottom - det->box.top);
+    vx_[t] = vy_[t] = vw_[t] = vh_[t] = 0.f;
+    p00_[t] = KF_R;
+    p01_[t] = 0.f;
+    p11_[t] = KF_P_VEL;
+    score_[t] = det->prop;
+    id_[t] = ++next_id_;
+    hits_[t] = 1;
+    last_hit_[t] = seq_;
+    class_id_[t] = det->class_id;
+    n_++;
+}
+
+/* swap-remove: the last track takes the slot */
+void Tracker::remove(int t)
+{
+    int l = --n_;
+
+    if (t == l)
+        return;
+    cx_[t] = cx_[l];
+    cy_[t] = cy_[l];
+    w_[t] = w_[l];
+    h_[t] = h_[l];
+    vx_[t] = vx_[l];
+    vy_[t] = vy_[l];
+    vw_[t] = vw_[l];
+    vh_[t] = vh_[l];
+    p00_[t] = p00_[l];
+    p01_[t] = p01_[l];
+    p11_[t] = p11_[l];
+    score_[t] = score_[l];
+    id_[t] = id_[l];
+    hits_[t] = hits_[l];
+    last_hit_[t] = last_hit_[l];
+    class_id_[t] = class_id_[l];
+}
+
+int Tracker::find(int i)
+{
+    while (parent_[i] != i) {
+        parent_[i] = parent_[parent_[i]];
+        i = parent_[i];
+    }
+    return i;
+}
+
+/*
+ * Optimal assignment of the detections and tracks sharing a root. Costs
+ * are 1 - IoU, pairs below TRACK_IOU cost 1 and are rejected afterwards.
+ */
+void Tracker::solve_group(int root, int n_dets)
+{
+    int n_rows = 0, n_cols = 0;
+    int transpose, n, m;
+    float *a = cost_.data();
+
+    for (int i = 0; i < n_dets; i++) {
+        if (root_[i] == root) {
+            local_[i] = n_rows;
+            rows_[n_rows++] = i;
+        }
+    }
+    for (int t = 0; t < n_; t++) {
+        if (root_[n_dets + t] == root) {
+            local_[n_dets + t] = n_cols;
+            cols_[n_cols++] = t;
+        }
+    }
+
+    /* the Hungarian method below wants no more rows than columns */
+    transpose = n_rows > n_cols;
+    n = transpose ? n_cols : n_rows;
+    m = transpose ? n_rows : n_cols;
+    std::fill(a, a + n * m, 1.f);
+    for (size_t k = 0; k < pair_det_.size(); k++) {
+        int r, c;
+
+        if (root_[pair_det_[k]] != root)
+            continue;
+        r = local_[pair_det_[k]];
+        c = local_[n_dets + pair_trk_[k]];
+        if (transpose)
+            a[c * m + r] = 1.f - pair_iou_[k];
+        else
+            a[r * m + c] = 1.f - pair_iou_[k];
+    }
+
+    /* shortest augmenting paths with potentials, 1-based: p_[j] is the row given column j */
+    std::fill(u_.begin(), u_.begin() + n + 1, 0.f);
+    std::fill(v_.begin(), v_.begin() + m + 1, 0.f);
+    std::fill(p_.begin(), p_.begin() + m + 1, 0);
+    std::fill(way_.begin(), way_.begin() + m + 1, 0);
+    for (int i = 1; i <= n; i++) {
+        int j0 = 0;
+
+        p_[0] = i;
+        std::fill(minv_.begin(), minv_.begin() + m + 1, FLT_MAX);
+        std::fill(used_.begin(), used_.begin() + m + 1, 0);
+        do {
+            int i0 = p_[j0], j1 = 0;
+            float delta = FLT_MAX;
+
+            used_[j0] = 1;
+            for (int j = 1; j <= m; j++) {
+                if (used_[j])
+                    continue;
+                float cur = a[(i0 - 1) * m + (j - 1)] - u_[i0] - v_[j];
+                if (cur < minv_[j]) {
+                    minv_[j] = cur;
+                    way_[j] = j0;
+                }
+                if (minv_[j] < delta) {
+                    delta = minv_[j];
+                    j1 = j;
+                }
+            }
+            for (int j = 0; j <= m; j++) {
+                if (used_[j]) {
+                    u_[p_[j]] += delta;
+                    v_[j] -= delta;
+                } else {
+                    minv_[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while (p_[j0] != 0);
+        do {
+            int j1 = way_[j0];
+            p_[j0] = p_[j1];
+            j0 = j1;
+        } while (j0);
+    }
+
+    for (int j = 1; j <= m; j++) {
+        int i = p_[j];
+        int r, c;
+
+        if (!i || a[(i - 1) * m + (j - 1)] > 1.f - TRACK_IOU)
+            continue;
+        r = transpose ? j - 1 : i - 1;
+        c = transpose ? i - 1 : j - 1;
+        det_track_[rows_[r]] = cols_[c];
+    }
+}
+
+int Tracker::match(const detect_result_t *dets, int n_dets)
+{
+    int n_nodes = n_dets + n_;
+    int matched = 0;
+
+    pair_det_.clear();
+    pair_trk_.clear();
+    pair_iou_.clear();
+    for (int i = 0; i < n_nodes; i++) {
+        parent_[i] = i;
+        group_dets_[i] = 0;
+        group_trks_[i] = 0;
+    }
+
+    /* predicted boxes, corners side by side for the gating loop */
+    for (int t = 0; t < n_; t++) {
+        float hw = w_[t] * 0.5f, hh = h_[t] * 0.5f;
+
+        x1_[t] = cx_[t] - hw;
+        y1_[t] = cy_[t] - hh;
+        x2_[t] = cx_[t] + hw;
+        y2_[t] = cy_[t] + hh;
+    }
+
+    for (int i = 0; i < n_dets; i++) {
+        const detect_result_t *d = &dets[i];
+        float dx1 = d->box.left, dy1 = d->box.top, dx2 = d->box.right, dy2 = d->box.bottom;
+
+        det_track_[i] = -1;
+        for (int t = 0; t < n_; t++) {
+            float iou;
+            int a, b;
+
+            if (x1_[t] >= dx2 || x2_[t] <= dx1 || y1_[t] >= dy2 || y2_[t] <= dy1)
+                continue;
+            iou = iou_xyxy(dx1, dy1, dx2, dy2, x1_[t], y1_[t], x2_[t], y2_[t]);
+            if (iou < TRACK_IOU || d->class_id != class_id_[t])
+                continue;
+            pair_det_.push_back(i);
+            pair_trk_.push_back(t);
+            pair_iou_.push_back(iou);
+            a = find(i);
+            b = find(n_dets + t);
+            if (a != b)
+                parent_[a] = b;
+        }
+    }
+
+    /* each connected group of candidate pairs is an independent assignment problem */
+    for (int i = 0; i < n_nodes; i++) {
+        root_[i] = find(i);
+        if (i < n_dets)
+            group_dets_[root_[i]]++;
+        else
+            group_trks_[root_[i]]++;
+    }
+    for (size_t k = 0; k < pair_det_.size(); k++) {
+        int d = pair_det_[k];
+        int root = root_[d];
+
+        if (det_track_[d] >= 0 || group_dets_[root] < 0)
+            continue;
+        if (group_dets_[root] == 1 && group_trks_[root] == 1)
+            det_track_[d] = pair_trk_[k]; // the common case: one detection, one track
+        else
+            solve_group(root, n_dets);
+        group_dets_[root] = -1; // solved
+    }
+    for (int i = 0; i < n_dets; i++)
+        matched += det_track_[i] >= 0;
+    return matched;
+}
+
+void Tracker::update(int64_t seq, const detect_result_t *dets, int n_dets)
+{
+    uint64_t t0 = stage_now_us(), us;
+    int dt = seq_ < 0 || seq <= seq_ ? 1 : (int)(seq - seq_);
+    int n_old;
+
+    if (n_dets > TRACK_MAX)
+        n_dets = TRACK_MAX;
+    seq_ = seq;
+    predict(dt);
+    match(dets, n_dets);
+
+    n_old = n_;
+    for (int i = 0; i < n_dets; i++) {
+        if (det_track_[i] >= 0)
+            correct(det_track_[i], &dets[i]);
+        else
+            spawn(&dets[i]);
+    }
+    for (int t = n_old - 1; t >= 0; t--) {
+        if (seq - last_hit_[t] > TRACK_MAX_AGE)
+            remove(t);
+    }
+
+    us = stage_now_us() - t0;
+    updates_++;
+    busy_us_ += us;
+    if (us > max_us_)
+        max_us_ = us;
+}
+
+void Tracker::output(int64_t seq, detect_result_group_t *group) const
+{
+    int shown[TRACK_MAX];
+    int n = 0;
+    float ahead = seq > seq_ ? (float)(seq - seq_) : 0.f;
+
+    for (int t = 0; t < n_; t++) {
+        if (hits_[t] >= TRACK_MIN_HITS && seq - last_hit_[t] <= TRACK_MAX_AGE)
+            shown[n++] = t;
+    }
+    std::sort(shown, shown + n, [this](int a, int b) { return score_[a] > score_[b]; });
+    if (n > OBJ_NUMB_MAX_SIZE)
+        n = OBJ_NUMB_MAX_SIZE;
+
+    group->count = n;
+    for (int k = 0; k < n; k++) {
+        int t = shown[k];
+        detect_result_t *r = &group->results[k];
+        float cx = cx_[t] + vx_[t] * ahead, cy = cy_[t] + vy_[t] * ahead;
+        float hw = std::max(w_[t] + vw_[t] * ahead, 1.f) * 0.5f;
+        float hh = std::max(h_[t] + vh_[t] * ahead, 1.f) * 0.5f;
+
+        r->class_id = class_id_[t];
+        r->box.left = std::max((int)lroundf(cx - hw), 0);
+        r->box.top = std::max((int)lroundf(cy - hh), 0);
+        r->box.right = std::max((int)lroundf(cx + hw), r->box.left);
+        r->box.bottom = std::max((int)lroundf(cy + hh), r->box.top);
+        r->prop = score_[t];
+        r->track_id = id_[t];
+    }
+}
+
+void Tracker::report() const
+{
+    fprintf(stderr, "tracker   : %6llu updates  avg %6.3f ms  max %6.3f ms  %d tracks, %d ids\n",
+            (unsigned long long)updates_, updates_ ? busy_us_ / 1000.0 / updates_ : 0.0, max_us_ / 1000.0, n_,
+            next_id_);
+}
@@ -0,0 +1,96 @@
+#ifndef _FFRKNN_TRACKER_H_
+#define _FFRKNN_TRACKER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <postprocess.h>
+
+#define TRACK_MAX      256  // live tracks, also the most detections taken per update
+#define TRACK_IOU      0.3f // least overlap between a prediction and a detection to pair them
+#define TRACK_MIN_HITS 3    // detections before a track is shown
+#define TRACK_MAX_AGE  10   // frames a track is carried on its prediction without a detection
+
+/*
+ * SORT-style multi-object tracker.
+ *
+ * Every track runs a constant-velocity Kalman filter on its box centre and
+ * size. The four coordinates use the same noise model and are always
+ * updated together, so they share one 2x2 covariance and one gain: a track
+ * costs 11 floats, kept in parallel arrays so prediction and gating stream
+ * through memory.
+ *
+ * Detections are paired with the predicted tracks of the same class by
+ * IoU: pairs above TRACK_IOU split the problem into connected groups,
+ * single pairs are matched directly and the rest is solved with the
+ * Hungarian method per group. Unmatched detections start new tracks.
+ *
+ * All buffers are sized for TRACK_MAX in the constructor, updates never
+ * allocate.
+ *
+ * In the player the detections come from post_process(), at most
+ * OBJ_NUMB_MAX_SIZE (64) a frame, and output() shows as many: the room
+ * above that is for the tracks coasting on their prediction and for callers
+ * with their own detections (bench/track_bench.cpp runs 250 objects).
+ */
+class Tracker
+{
+public:
+    Tracker();
+
+    /* folds the detections of frame seq in (frames must come in increasing order) */
+    void update(int64_t seq, const detect_result_t *dets, int n_dets);
+
+    /*
+     * Confirmed tracks at frame seq (the last update or any frame after it,
+     * extrapolated) with their ids, at most OBJ_NUMB_MAX_SIZE by score.
+     */
+    void output(int64_t seq, detect_result_group_t *group) const;
+
+    int tracks() const { return n_; }
+    void report() const;
+
+private:
+    void predict(int dt);
+    int match(const detect_result_t *dets, int n_dets);
+    void solve_group(int root, int n_dets);
+    int find(int i);
+    void correct(int t, const detect_result_t *det);
+    void spawn(const detect_result_t *det);
+    void remove(int t);
+
+    /* track state, structure of arrays */
+    float cx_[TRACK_MAX], cy_[TRACK_MAX], w_[TRACK_MAX], h_[TRACK_MAX];
+    float vx_[TRACK_MAX], vy_[TRACK_MAX], vw_[TRACK_MAX], vh_[TRACK_MAX];
+    float p00_[TRACK_MAX], p01_[TRACK_MAX], p11_[TRACK_MAX];
+    float score_[TRACK_MAX];
+    int id_[TRACK_MAX];
+    int hits_[TRACK_MAX];
+    int64_t last_hit_[TRACK_MAX];
+    int class_id_[TRACK_MAX];
+    int n_;
+    int next_id_;
+    int64_t seq_;
+
+    /* per update scratch */
+    int det_track_[TRACK_MAX]; // matched track of each detection, -1 if none
+    float x1_[TRACK_MAX], y1_[TRACK_MAX], x2_[TRACK_MAX], y2_[TRACK_MAX]; // predicted boxes
+    int parent_[2 * TRACK_MAX]; // union-find over detections then tracks
+    int root_[2 * TRACK_MAX];
+    int local_[2 * TRACK_MAX];      // row / column of a node within its group
+    int group_dets_[2 * TRACK_MAX]; // per root, -1 once solved
+    int group_trks_[2 * TRACK_MAX];
+    std::vector<int> pair_det_, pair_trk_;
+    std::vector<float> pair_iou_;
+    std::vector<int> rows_, cols_;
+    std::vector<float> cost_, u_, v_, minv_;
+    std::vector<int> p_, way_;
+    std::vector<char> used_;
+
+    uint64_t updates_;
+    uint64_t busy_us_;
+    uint64_t max_us_;
+};
+
+#endif //_FFRKNN_TRACKER_H_
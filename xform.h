@@ -0,0 +1,37 @@
+#ifndef _FFRKNN_XFORM_H_
+#define _FFRKNN_XFORM_H_
+
+/*
+ * Mapping between the coordinate spaces a box goes through: model input,
+ * source frame, display tile. They only ever differ by a scale and an
+ * offset per axis, x' = x * sx + tx, y' = y * sy + ty: a mapping is four
+ * floats, applied with a multiply-add per coordinate.
+ */
+typedef struct _xform_t
+{
+    float sx, sy;
+    float tx, ty;
+} xform_t;
+
+static inline xform_t xform_identity(void)
+{
+    xform_t t = {1.0f, 1.0f, 0.0f, 0.0f};
+    return t;
+}
+
+/* the rectangle (x, y, w, h) onto (dx, dy, dw, dh) */
+static inline xform_t xform_rect(float x, float y, float w, float h, float dx, float dy, float dw, float dh)
+{
+    xform_t t;
+
+    t.sx = dw / w;
+    t.sy = dh / h;
+    t.tx = dx - x * t.sx;
+    t.ty = dy - y * t.sy;
+    return t;
+}
+
+static inline float xform_x(const xform_t *t, float x) { return x * t->sx + t->tx; }
+static inline float xform_y(const xform_t *t, float y) { return y * t->sy + t->ty; }
+
+#endif //_FFRKNN_XFORM_H_